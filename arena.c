@@ -0,0 +1,354 @@
+#include "./arena.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "./comm.h"
+
+#define ARENA_MAGIC 0x6462617265616e31ULL  // "dbarean1"
+// where every arena is mapped, far away from the heap, stacks and libraries
+#define ARENA_BASE ((void *)0x600000000000UL)
+#define ARENA_ALIGN 16
+// blocks up to ARENA_SMALL_MAX bytes come in ARENA_ALIGN steps, larger ones
+// in powers of two
+#define ARENA_SMALL_MAX 4096
+#define ARENA_SMALL_CLASSES (ARENA_SMALL_MAX / ARENA_ALIGN)
+#define ARENA_CLASSES (ARENA_SMALL_CLASSES + 48)
+#define ARENA_HUGEPAGE (2UL << 20)
+// each thread keeps up to this many bytes of freed blocks per class (and at
+// least one block, at most ARENA_CACHE_MAX), so most allocations and frees
+// never touch arena_mutex
+#define ARENA_CACHE_BYTES 16384
+#define ARENA_CACHE_MAX 64
+
+typedef struct arena_hdr {
+    uint64_t magic;
+    uint64_t tag;
+    uint64_t size;
+    uint64_t top;    // offset of the first byte never handed out
+    uint64_t clean;  // set by arena_close(1), cleared while in use
+    void *roots[2];
+    void *free[ARENA_CLASSES];  // singly linked through the first word
+} arena_hdr_t;
+
+// precedes every block; 16 bytes so that payloads stay aligned
+typedef struct arena_block {
+    uint64_t cls;
+    uint64_t pad;
+} arena_block_t;
+
+/*
+ * A thread's cache of free blocks, in front of the free lists in the header.
+ * It is refilled and emptied half a limit at a time under arena_mutex, and
+ * every cache is on a list so arena_close() can return their blocks to the
+ * header before it is saved.
+ */
+typedef struct arena_cache {
+    void *free[ARENA_CLASSES];
+    uint32_t count[ARENA_CLASSES];
+    struct arena_cache *prev, *next;
+} arena_cache_t;
+
+static arena_hdr_t *arena = NULL;
+static int arena_fd = -1;
+// guards the header's free lists and top, and the list of caches
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static arena_cache_t *arena_caches = NULL;
+static pthread_key_t arena_cache_key;
+static pthread_once_t arena_cache_once = PTHREAD_ONCE_INIT;
+static __thread arena_cache_t *my_cache = NULL;
+
+static inline int arena_class(size_t size) {
+    if (size == 0) size = 1;
+    if (size <= ARENA_SMALL_MAX) {
+        return (int)((size + ARENA_ALIGN - 1) / ARENA_ALIGN) - 1;
+    }
+    int bits = 64 - __builtin_clzll((unsigned long long)(size - 1));
+    return ARENA_SMALL_CLASSES + bits - 13;
+}
+
+static inline size_t arena_class_size(int cls) {
+    if (cls < ARENA_SMALL_CLASSES) {
+        return (size_t)(cls + 1) * ARENA_ALIGN;
+    }
+    return (size_t)1 << (cls - ARENA_SMALL_CLASSES + 13);
+}
+
+static void arena_lock(void) {
+    int err;
+    if ((err = pthread_mutex_lock(&arena_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void arena_unlock(void) {
+    int err;
+    if ((err = pthread_mutex_unlock(&arena_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+/* How many blocks of class cls a thread keeps before giving half back. */
+static inline uint32_t arena_cache_limit(int cls) {
+    size_t limit = ARENA_CACHE_BYTES / arena_class_size(cls);
+    if (limit < 1) return 1;
+    return limit > ARENA_CACHE_MAX ? ARENA_CACHE_MAX : limit;
+}
+
+/*
+ * Moves n blocks of class cls from the cache to the header's free list; the
+ * mutex must be held.
+ */
+static void arena_cache_drain(arena_cache_t *cache, int cls, uint32_t n) {
+    while (n-- > 0 && cache->free[cls] != NULL) {
+        void *ptr = cache->free[cls];
+        cache->free[cls] = *(void **)ptr;
+        cache->count[cls]--;
+        *(void **)ptr = arena->free[cls];
+        arena->free[cls] = ptr;
+    }
+}
+
+/* Gives an exiting thread's blocks back and forgets its cache. */
+static void arena_cache_destroy(void *arg) {
+    arena_cache_t *cache = arg;
+    arena_lock();
+    for (int cls = 0; cls < ARENA_CLASSES; cls++) {
+        arena_cache_drain(cache, cls, cache->count[cls]);
+    }
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        arena_caches = cache->next;
+    }
+    if (cache->next != NULL) cache->next->prev = cache->prev;
+    arena_unlock();
+    free(cache);
+}
+
+static void arena_cache_key_create(void) {
+    int err;
+    if ((err = pthread_key_create(&arena_cache_key, arena_cache_destroy)) !=
+        0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+/* The calling thread's cache, set up on first use; NULL if out of memory. */
+static arena_cache_t *arena_cache(void) {
+    int err;
+    if (my_cache != NULL) return my_cache;
+    pthread_once(&arena_cache_once, arena_cache_key_create);
+    if ((my_cache = calloc(1, sizeof(arena_cache_t))) == NULL) return NULL;
+    if ((err = pthread_setspecific(arena_cache_key, my_cache)) != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    arena_lock();
+    my_cache->next = arena_caches;
+    if (arena_caches != NULL) arena_caches->prev = my_cache;
+    arena_caches = my_cache;
+    arena_unlock();
+    return my_cache;
+}
+
+int arena_open(const char *path, size_t size, unsigned long tag) {
+    arena_hdr_t hdr;
+    struct stat st;
+    int reattach = 0;
+
+    if ((arena_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        perror("arena open");
+        return -1;
+    }
+    if (fstat(arena_fd, &st) < 0) {
+        perror("arena fstat");
+        close(arena_fd);
+        return -1;
+    }
+
+    // an arena closed cleanly with the same layout can be used as is
+    if (st.st_size >= (off_t)sizeof(hdr) &&
+        pread(arena_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic == ARENA_MAGIC && hdr.tag == tag && hdr.clean &&
+        hdr.size == (uint64_t)st.st_size) {
+        reattach = 1;
+        size = hdr.size;
+    } else if (st.st_size > 0) {
+        fprintf(stderr, "arena %s is stale or incompatible, starting empty\n",
+                path);
+    }
+
+    if (!reattach) {
+        // throw the old contents away; the file is sparse until touched
+        if (ftruncate(arena_fd, 0) < 0 || ftruncate(arena_fd, size) < 0) {
+            perror("arena ftruncate");
+            close(arena_fd);
+            return -1;
+        }
+    }
+
+    void *addr = mmap(ARENA_BASE, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED_NOREPLACE, arena_fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("arena mmap");
+        close(arena_fd);
+        return -1;
+    }
+    if (addr != ARENA_BASE) {
+        // older kernels treat MAP_FIXED_NOREPLACE as a hint
+        fprintf(stderr, "arena could not be mapped at %p\n", ARENA_BASE);
+        munmap(addr, size);
+        close(arena_fd);
+        return -1;
+    }
+    arena = (arena_hdr_t *)addr;
+
+    if (!reattach) {
+        arena->magic = ARENA_MAGIC;
+        arena->tag = tag;
+        arena->size = size;
+        arena->top = (sizeof(arena_hdr_t) + ARENA_ALIGN - 1) &
+                     ~(uint64_t)(ARENA_ALIGN - 1);
+    }
+    // until arena_close(1), a crash leaves the arena inconsistent
+    arena->clean = 0;
+    return reattach;
+}
+
+int arena_open_huge(size_t size) {
+    int huge = 1;
+    size = (size + ARENA_HUGEPAGE - 1) & ~(ARENA_HUGEPAGE - 1);
+
+    // no MAP_NORESERVE here: without a reservation a hugetlb mapping would
+    // succeed and then SIGBUS on first touch when the pool is exhausted
+    void *addr = mmap(
+        ARENA_BASE, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED_NOREPLACE, -1, 0);
+    if (addr == MAP_FAILED) {
+        // no reserved hugetlb pages: ask for transparent huge pages instead
+        huge = 0;
+        addr = mmap(
+            ARENA_BASE, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+            -1, 0);
+        if (addr == MAP_FAILED) {
+            perror("arena mmap");
+            return -1;
+        }
+        if (madvise(addr, size, MADV_HUGEPAGE) < 0) perror("arena madvise");
+    }
+    if (addr != ARENA_BASE) {
+        fprintf(stderr, "arena could not be mapped at %p\n", ARENA_BASE);
+        munmap(addr, size);
+        return -1;
+    }
+    arena = (arena_hdr_t *)addr;
+    arena->magic = ARENA_MAGIC;
+    arena->size = size;
+    arena->top =
+        (sizeof(arena_hdr_t) + ARENA_ALIGN - 1) & ~(uint64_t)(ARENA_ALIGN - 1);
+    return huge;
+}
+
+int arena_enabled(void) { return arena != NULL; }
+
+int arena_persistent(void) { return arena_fd >= 0; }
+
+void *arena_alloc(size_t size) {
+    int cls = arena_class(size);
+    arena_cache_t *cache;
+    void *ptr;
+
+    if (cls >= ARENA_CLASSES || (cache = arena_cache()) == NULL) return NULL;
+
+    if (cache->free[cls] == NULL) {
+        // refill half the cache at once: freed blocks of the same class
+        // first, then fresh ones off the top
+        uint32_t want = (arena_cache_limit(cls) + 1) / 2;
+        uint64_t need = sizeof(arena_block_t) + arena_class_size(cls);
+        arena_lock();
+        for (; want > 0; want--) {
+            if ((ptr = arena->free[cls]) != NULL) {
+                arena->free[cls] = *(void **)ptr;
+            } else if (arena->top + need <= arena->size) {
+                arena_block_t *block =
+                    (arena_block_t *)((char *)arena + arena->top);
+                block->cls = cls;
+                arena->top += need;
+                ptr = block + 1;
+            } else {
+                break;
+            }
+            *(void **)ptr = cache->free[cls];
+            cache->free[cls] = ptr;
+            cache->count[cls]++;
+        }
+        arena_unlock();
+        if (cache->free[cls] == NULL) return NULL;
+    }
+    ptr = cache->free[cls];
+    cache->free[cls] = *(void **)ptr;
+    cache->count[cls]--;
+    return ptr;
+}
+
+void arena_free(void *ptr) {
+    arena_block_t *block = (arena_block_t *)ptr - 1;
+    int cls = block->cls;
+    arena_cache_t *cache = arena_cache();
+
+    if (cache == NULL) {
+        // no cache to put it in, straight back to the header
+        arena_lock();
+        *(void **)ptr = arena->free[cls];
+        arena->free[cls] = ptr;
+        arena_unlock();
+        return;
+    }
+    *(void **)ptr = cache->free[cls];
+    cache->free[cls] = ptr;
+    if (++cache->count[cls] > arena_cache_limit(cls)) {
+        arena_lock();
+        arena_cache_drain(cache, cls, cache->count[cls] / 2);
+        arena_unlock();
+    }
+}
+
+void **arena_roots(void) { return arena->roots; }
+
+void arena_close(int clean) {
+    size_t size = arena->size;
+
+    // blocks sitting in threads' caches belong in the header, or a reattached
+    // arena would never hand them out again; the caches themselves stay
+    // until their threads exit
+    arena_lock();
+    for (arena_cache_t *cache = arena_caches; cache != NULL;
+         cache = cache->next) {
+        for (int cls = 0; cls < ARENA_CLASSES; cls++) {
+            arena_cache_drain(cache, cls, cache->count[cls]);
+        }
+    }
+    arena_unlock();
+    if (arena_fd < 0) {
+        // anonymous arenas just go away
+        if (munmap(arena, size) < 0) perror("arena munmap");
+        arena = NULL;
+        return;
+    }
+    if (clean) {
+        arena->clean = 1;
+        if (msync(arena, size, MS_SYNC) < 0) perror("arena msync");
+    }
+    if (munmap(arena, size) < 0) perror("arena munmap");
+    if (close(arena_fd) < 0) perror("arena close");
+    arena = NULL;
+    arena_fd = -1;
+}
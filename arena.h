@@ -0,0 +1,66 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * A thread-safe allocator for tree nodes and their strings that carves memory
+ * out of one large mapping. When the mapping is backed by a file (for example
+ * in /dev/shm) it outlives the server process, so a restarted server can
+ * reattach to the tree left there instead of rebuilding it.
+ *
+ * The mapping is always placed at the same address, recorded in its header,
+ * so the node_t pointers stored inside it stay valid across processes and do
+ * not need to be translated.
+ *
+ * Blocks come in size classes. Each thread keeps a few free blocks of every
+ * class to itself and only takes the arena's lock to fetch or return them
+ * in batches, so client threads rarely wait on each other to allocate.
+ */
+
+/*
+ * Maps the file at path (created if missing and sized to size bytes) and
+ * makes it the source of arena_alloc(). tag describes the layout of the data
+ * the caller keeps in the arena; an existing arena is only reattached if it
+ * was written with the same tag. Returns 1 if the file held an arena that was
+ * closed cleanly and has been reattached, 0 if a new empty arena was set up,
+ * and -1 on error.
+ */
+int arena_open(const char *path, size_t size, unsigned long tag);
+
+/*
+ * Sets up an anonymous arena of size bytes (rounded up to a 2MB multiple)
+ * backed by 2MB huge pages, so that walking a large tree touches far fewer
+ * TLB entries than it would with malloc'ed nodes scattered over 4KB pages.
+ * Falls back to transparent huge pages if no hugetlb pages are reserved.
+ * Returns 1 if hugetlb pages were used, 0 for the fallback, -1 on error.
+ * Such an arena is never reattached; arena_close() simply unmaps it.
+ */
+int arena_open_huge(size_t size);
+
+/* Nonzero once arena_open() or arena_open_huge() has succeeded. */
+int arena_enabled(void);
+
+/* Nonzero if the arena is backed by a file and outlives the process. */
+int arena_persistent(void);
+
+/* Allocates size bytes from the arena, or returns NULL if it is full. */
+void *arena_alloc(size_t size);
+
+/* Returns a block obtained from arena_alloc() to the arena. */
+void arena_free(void *ptr);
+
+/*
+ * Two pointer-sized slots kept in the arena header for the caller's roots.
+ * They are only meaningful after a clean arena_close().
+ */
+void **arena_roots(void);
+
+/*
+ * Unmaps the arena. If clean is nonzero the arena is marked as consistent so
+ * that the next arena_open() of the same file reattaches to it; otherwise its
+ * contents will be discarded on the next open.
+ */
+void arena_close(int clean);
+
+#endif  // ARENA_H_
@@ -0,0 +1,258 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./arena.h"
+#include "./db.h"
+#include "./intern.h"
+#include "./perfctr.h"
+
+/*
+ * In-process benchmark for the database tree. It inserts random keys with
+ * db_add(), then looks random ones up with db_query(), and reports the time
+ * per operation together with the cycles, instructions, LLC, branch and dTLB
+ * misses per operation where the kernel exposes hardware counters (see
+ * perfctr.h). Run it with and without -H to see what the huge page arena
+ * saves on deep traversals. With -t the keys are split between that many
+ * threads, which add and then query at the same time; the counters then only
+ * cover the main thread's share. With -H it finally times the arena alone,
+ * allocating and freeing node-sized blocks in batches on every thread.
+ */
+
+#define KEYLEN 12
+#define NKEYS 1000000
+#define NQUERIES 1000000
+#define ARENA_SIZE_MB 1024
+#define INTERN_BUCKETS (1 << 16)
+
+/* Prints each counter's increase since start, per operation. */
+static void counter_report(perfctr_t *pc, uint64_t *start, long ops) {
+    uint64_t now[PERFCTR_EVENTS];
+    int ok = perfctr_read(pc, now) == 0;
+    for (int e = 0; e < PERFCTR_EVENTS; e++) {
+        if (!ok || !perfctr_counting(pc, e)) {
+            printf("  %-18s n/a\n", perfctr_name(e));
+        } else {
+            printf("  %-18s %.3f/op\n", perfctr_name(e),
+                   (double)(now[e] - start[e]) / ops);
+        }
+    }
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 +
+           (end->tv_nsec - start->tv_nsec);
+}
+
+/* One thread's share of a phase: keys [from, to), or as many queries. */
+typedef struct worker {
+    pthread_t thread;
+    char *keys;
+    long nkeys;
+    long from, to;
+    unsigned int seed;
+    long done;  // keys added or found
+} worker_t;
+
+static void *add_keys(void *arg) {
+    worker_t *w = arg;
+    for (long i = w->from; i < w->to; i++) {
+        char *key = &w->keys[i * (KEYLEN + 1)];
+        if (db_add(key, key) > 0) w->done++;
+    }
+    return NULL;
+}
+
+static void *query_keys(void *arg) {
+    worker_t *w = arg;
+    char result[BUFSIZ];
+    for (long i = w->from; i < w->to; i++) {
+        char *key = &w->keys[(rand_r(&w->seed) % w->nkeys) * (KEYLEN + 1)];
+        db_query(key, result, sizeof(result));
+        if (strcmp(result, key) == 0) w->done++;
+    }
+    return NULL;
+}
+
+// blocks each thread holds at once in the arena phase
+#define ARENA_BATCH 64
+
+static void *churn_arena(void *arg) {
+    worker_t *w = arg;
+    void *blocks[ARENA_BATCH];
+    for (long i = w->from; i < w->to; i += ARENA_BATCH) {
+        int n = 0;
+        for (; n < ARENA_BATCH && i + n < w->to; n++) {
+            // a node, its key or its value
+            if ((blocks[n] = arena_alloc(16 + rand_r(&w->seed) % 96)) == NULL) {
+                break;
+            }
+        }
+        w->done += n;
+        while (n > 0) arena_free(blocks[--n]);
+    }
+    return NULL;
+}
+
+/*
+ * Runs fn over [0, n) split between nworkers threads, the first share on the
+ * calling thread; returns the sum of what they did.
+ */
+static long run_workers(worker_t *workers, int nworkers, long n,
+                        void *(*fn)(void *)) {
+    long done = 0;
+    int err;
+    for (int t = 0; t < nworkers; t++) {
+        workers[t].from = n * t / nworkers;
+        workers[t].to = n * (t + 1) / nworkers;
+        workers[t].done = 0;
+        if (t > 0 && (err = pthread_create(&workers[t].thread, NULL, fn,
+                                           &workers[t])) != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    fn(&workers[0]);
+    for (int t = 0; t < nworkers; t++) {
+        if (t > 0) pthread_join(workers[t].thread, NULL);
+        done += workers[t].done;
+    }
+    return done;
+}
+
+static void random_key(char *buf, unsigned int *seed) {
+    for (int i = 0; i < KEYLEN; i++) {
+        buf[i] = 'a' + rand_r(seed) % 26;
+    }
+    buf[KEYLEN] = '\0';
+}
+
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-n <keys>] [-q <queries>] [-H] [-a <arena MB>] "
+            "[-i] [-r <seed>] [-t <threads>]\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    long nkeys = NKEYS;
+    long nqueries = NQUERIES;
+    int hugepages = 0;
+    int interning = 0;
+    size_t arena_mb = ARENA_SIZE_MB;
+    unsigned int seed = 330;
+    int nworkers = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:q:Ha:ir:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                nkeys = atol(optarg);
+                break;
+            case 'q':
+                nqueries = atol(optarg);
+                break;
+            case 'H':
+                hugepages = 1;
+                break;
+            case 'i':
+                interning = 1;
+                break;
+            case 'a':
+                arena_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                nworkers = atoi(optarg);
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+    if (nkeys <= 0 || nworkers < 1) {
+        usage_error(argv[0]);
+        return 1;
+    }
+
+    if (hugepages) {
+        int ret;
+        if ((ret = db_use_hugepages(arena_mb << 20)) < 0) {
+            fprintf(stderr, "could not set up the huge page arena\n");
+            return 1;
+        }
+        printf("arena: %zu MB of %s\n", arena_mb,
+               ret ? "hugetlb pages" : "transparent huge pages");
+    } else {
+        printf("arena: none (malloc)\n");
+    }
+
+    if (interning && db_use_interning(INTERN_BUCKETS) < 0) {
+        fprintf(stderr, "could not enable string interning\n");
+        return 1;
+    }
+
+    // keys are generated up front so that only the tree is measured
+    char *keys = malloc(nkeys * (KEYLEN + 1));
+    worker_t *workers = calloc(nworkers, sizeof(worker_t));
+    if (keys == NULL || workers == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (long i = 0; i < nkeys; i++) {
+        random_key(&keys[i * (KEYLEN + 1)], &seed);
+    }
+    for (int t = 0; t < nworkers; t++) {
+        workers[t].keys = keys;
+        workers[t].nkeys = nkeys;
+        workers[t].seed = seed + t;
+    }
+    if (nworkers > 1) printf("threads: %d\n", nworkers);
+
+    perfctr_t pc;
+    uint64_t counts[PERFCTR_EVENTS];
+    perfctr_open(&pc);
+
+    struct timespec start, end;
+    perfctr_read(&pc, counts);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long added = run_workers(workers, nworkers, nkeys, add_keys);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("insert: %ld keys, %.1f ns/op\n", added,
+           elapsed_ns(&start, &end) / nkeys);
+    counter_report(&pc, counts, workers[0].to);
+    if (interning) {
+        // every key is stored as its own value, so half the copies go away
+        size_t strings, refs;
+        intern_stats(&strings, &refs);
+        printf("interned: %zu strings for %zu references\n", strings, refs);
+    }
+
+    perfctr_read(&pc, counts);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long found = run_workers(workers, nworkers, nqueries, query_keys);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("query: %ld found, %.1f ns/op\n", found,
+           elapsed_ns(&start, &end) / nqueries);
+    counter_report(&pc, counts, workers[0].to);
+    if (hugepages) {
+        perfctr_read(&pc, counts);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long churned = run_workers(workers, nworkers, nqueries, churn_arena);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("arena: %ld allocs and frees, %.1f ns/op\n", churned,
+               elapsed_ns(&start, &end) / nqueries);
+        counter_report(&pc, counts, workers[0].to);
+    }
+    perfctr_close(&pc);
+
+    db_cleanup();
+    free(workers);
+    free(keys);
+    return 0;
+}
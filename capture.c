@@ -0,0 +1,149 @@
+#include "./capture.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+
+/* The capture file, appended to under a mutex */
+
+// records are buffered this much before they are written out
+#define CAPTURE_BUFFER (1 << 20)
+
+static struct {
+    pthread_mutex_t mutex;
+    FILE *file;  // 0 when not capturing
+    char *buffer;
+    int on;            // read without the mutex, to skip it when not capturing
+    int generation;    // of the file, so connections are numbered per file
+    uint64_t next;     // the number of the next new connection
+    uint64_t last_us;  // when the previous record was written
+    uint64_t records;
+    uint64_t bytes;
+} capture = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// the calling thread's connection in the file of its generation, if any
+static __thread uint64_t my_connection = 0;
+static __thread int my_generation = 0;
+
+static void capture_lock(void) {
+    int err;
+    if ((err = pthread_mutex_lock(&capture.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void capture_unlock(void) {
+    int err;
+    if ((err = pthread_mutex_unlock(&capture.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/* Writes v as an unsigned LEB128 varint. */
+static void put_varint(uint64_t v) {
+    unsigned char bytes[10];
+    int n = 0;
+    do {
+        bytes[n++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        v >>= 7;
+    } while (v > 0);
+    fwrite(bytes, 1, n, capture.file);
+    capture.bytes += n;
+}
+
+/* Writes a record's header; the mutex must be held and the file open. */
+static void put_header(uint64_t connection, size_t len) {
+    uint64_t now = now_us();
+    put_varint(connection);
+    put_varint(now - capture.last_us);
+    put_varint(len);
+    capture.last_us = now;
+    capture.records++;
+}
+
+int capture_open(const char *path) {
+    FILE *file;
+    char *buffer;
+
+    if ((file = fopen(path, "w")) == NULL) return -1;
+    if ((buffer = malloc(CAPTURE_BUFFER)) != NULL) {
+        setvbuf(file, buffer, _IOFBF, CAPTURE_BUFFER);
+    }
+    fputs(CAPTURE_MAGIC, file);
+    capture_close(NULL);
+    capture_lock();
+    capture.file = file;
+    capture.buffer = buffer;
+    capture.generation++;
+    capture.next = 1;
+    capture.last_us = now_us();
+    capture.records = 0;
+    capture.bytes = strlen(CAPTURE_MAGIC);
+    __atomic_store_n(&capture.on, 1, __ATOMIC_RELAXED);
+    capture_unlock();
+    return 0;
+}
+
+int capture_enabled(void) {
+    return __atomic_load_n(&capture.on, __ATOMIC_RELAXED);
+}
+
+void capture_command(const char *line, const char *payload, size_t len) {
+    size_t line_len = strlen(line);
+    capture_lock();
+    if (capture.file != NULL) {
+        // a connection that was open before the file was gets a number now
+        if (my_generation != capture.generation) {
+            my_generation = capture.generation;
+            my_connection = capture.next++;
+        }
+        put_header(my_connection, line_len + (payload ? len + 1 : 0));
+        fwrite(line, 1, line_len, capture.file);
+        if (payload != NULL) {
+            fwrite(payload, 1, len, capture.file);
+            fputc('\n', capture.file);
+        }
+        capture.bytes += line_len + (payload ? len + 1 : 0);
+    }
+    capture_unlock();
+}
+
+void capture_disconnect(void) {
+    capture_lock();
+    // only connections that sent something while capturing are in the file
+    if (capture.file != NULL && my_generation == capture.generation) {
+        put_header(my_connection, 0);
+    }
+    my_generation = 0;
+    capture_unlock();
+}
+
+void capture_close(FILE *out) {
+    capture_lock();
+    if (capture.file != NULL) {
+        if (fclose(capture.file) != 0) perror("capture");
+        free(capture.buffer);
+        capture.file = NULL;
+        capture.buffer = NULL;
+        __atomic_store_n(&capture.on, 0, __ATOMIC_RELAXED);
+        if (out != NULL) {
+            fprintf(out,
+                    "captured %llu records of %llu connections in %llu "
+                    "bytes\n",
+                    (unsigned long long)capture.records,
+                    (unsigned long long)capture.next - 1,
+                    (unsigned long long)capture.bytes);
+        }
+    } else if (out != NULL) {
+        fprintf(out, "not capturing\n");
+    }
+    capture_unlock();
+}
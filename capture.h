@@ -0,0 +1,49 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Traffic capture: every client command, as the client sent it, is appended
+ * to a file together with its connection and when it arrived, so the load
+ * can be replayed later with the replay tool. The file starts with
+ * CAPTURE_MAGIC, followed by records of three unsigned LEB128 varints and
+ * some bytes:
+ *
+ *   connection   numbered from 1 in the order of their first command
+ *   delay        microseconds since the previous record in the file
+ *   length       of the bytes that follow; 0 when the connection closed
+ *   bytes        the command line with its newline, and for an 'A' command
+ *                its value and the newline after it
+ *
+ * so a command such as "q key\n" costs about ten bytes.
+ */
+
+#define CAPTURE_MAGIC "dbcapture 1\n"
+
+/*
+ * Captures the commands of every connection from now on to a new file at
+ * path, closing the previous one. Returns -1 if it cannot be created.
+ */
+int capture_open(const char *path);
+
+/* Nonzero while capturing. */
+int capture_enabled(void);
+
+/*
+ * Records a command arriving on the calling client thread's connection:
+ * line as read, then len bytes of payload and a newline if payload is not
+ * NULL.
+ */
+void capture_command(const char *line, const char *payload, size_t len);
+
+/* Records that the calling client thread's connection closed. */
+void capture_disconnect(void);
+
+/*
+ * Stops capturing and closes the file, printing how much it holds to out.
+ */
+void capture_close(FILE *out);
+
+#endif  // CAPTURE_H_
@@ -0,0 +1,256 @@
+#include "./cdc.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+#include "./db.h"
+
+/* The ring of recent changes and the subscribers reading from it */
+
+// changes copied out of the ring per write to a subscriber
+#define CDC_BATCH 64
+// the longest change line: "<seq> a <name> <value>\n"
+#define CDC_LINE_MAX (2 * BUFLEN + 32)
+// how long a waiting subscriber sleeps before checking its connection
+#define CDC_POLL_MS 200
+
+typedef struct cdc_entry {
+    char *line;  // the change as sent to subscribers
+    size_t len;
+    blob_t *payload;  // a reference to the value of an 'A' line, or NULL
+} cdc_entry_t;
+
+static struct cdc {
+    // guards everything below
+    pthread_mutex_t mutex;
+    // broadcast whenever a change is recorded
+    pthread_cond_t cond;
+    cdc_entry_t *ring;  // change seq lives at ring[(seq - 1) % capacity]
+    size_t capacity;
+    uint64_t oldest;  // the oldest change still held
+    uint64_t next;    // the sequence number of the next change
+} cdc = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 1, 1};
+
+static int cdc_on = 0;
+
+int cdc_enabled(void) { return cdc_on; }
+
+static void cdc_entry_clear(cdc_entry_t *entry) {
+    free(entry->line);
+    if (entry->payload != 0) db_blob_put(entry->payload);
+    entry->line = 0;
+    entry->payload = 0;
+}
+
+/*
+ * The observer registered with db_observe(). It runs under the changed key's
+ * parent lock, so changes to one key get increasing sequence numbers in the
+ * order they were made. Large values are not copied: the entry keeps a
+ * reference to the blob the node holds.
+ */
+static void cdc_record(const db_change_t *change, void *arg) {
+    char line[CDC_LINE_MAX];
+    int err;
+    int len;
+    (void)arg;
+
+    if ((err = pthread_mutex_lock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (cdc.ring != 0) {
+        uint64_t seq = cdc.next++;
+        cdc_entry_t *entry = &cdc.ring[(seq - 1) % cdc.capacity];
+        cdc_entry_clear(entry);
+        if (seq - cdc.oldest >= cdc.capacity)
+            cdc.oldest = seq - cdc.capacity + 1;
+
+        if (change->op == db_op_remove) {
+            len = snprintf(line, sizeof(line), "%" PRIu64 " d %s\n", seq,
+                           change->name);
+        } else if (change->op == db_op_remove_range) {
+            len = snprintf(line, sizeof(line), "%" PRIu64 " D %s %s\n", seq,
+                           change->name, change->value);
+        } else if (change->large) {
+            len = snprintf(line, sizeof(line), "%" PRIu64 " A %s %zu\n", seq,
+                           change->name, change->len);
+        } else {
+            len = snprintf(line, sizeof(line), "%" PRIu64 " a %s %s\n", seq,
+                           change->name, change->value);
+        }
+        if ((entry->line = malloc(len)) == 0) {
+            // subscribers that still need this change must start over
+            cdc.oldest = seq + 1;
+        } else {
+            memcpy(entry->line, line, len);
+            entry->len = len;
+            if (change->large) {
+                entry->payload = change->blob;
+                __atomic_add_fetch(&entry->payload->refs, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if ((err = pthread_cond_broadcast(&cdc.cond)) != 0) {
+            handle_error_en(err, "pthread_cond_broadcast");
+        }
+    }
+    if ((err = pthread_mutex_unlock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+int cdc_open(size_t capacity) {
+    if (capacity == 0) return -1;
+    if ((cdc.ring = calloc(capacity, sizeof(cdc_entry_t))) == 0) {
+        perror("calloc");
+        return -1;
+    }
+    cdc.capacity = capacity;
+    if (db_observe(cdc_record, 0) < 0) {
+        fprintf(stderr, "cdc: too many observers\n");
+        free(cdc.ring);
+        cdc.ring = 0;
+        return -1;
+    }
+    cdc_on = 1;
+    return 0;
+}
+
+size_t cdc_capacity(void) { return cdc.capacity; }
+
+uint64_t cdc_next(void) {
+    int err;
+    uint64_t next;
+    if ((err = pthread_mutex_lock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    next = cdc.next;
+    if ((err = pthread_mutex_unlock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return next;
+}
+
+/* Writes a "subscribed" or "gap" line. */
+static int cdc_status(FILE *cxstr, const char *what, uint64_t seq) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%s %" PRIu64 "\n", what, seq);
+    struct iovec iov = {line, len};
+    return comm_writev(cxstr, &iov, 1);
+}
+
+int cdc_stream(FILE *cxstr, uint64_t from, int heartbeat) {
+    // the lines of a batch are copied out of the ring so the write happens
+    // without the mutex; payloads are sent from their blobs
+    static const char newline = '\n';
+    char *lines;
+    blob_t *payloads[CDC_BATCH];
+    struct iovec iov[3 * CDC_BATCH + 1];
+    uint64_t oldest;
+    int err;
+    int ret = 0;
+
+    // with room for a heartbeat after the batch
+    if ((lines = malloc((CDC_BATCH + 1) * CDC_LINE_MAX)) == 0) {
+        perror("malloc");
+        return -1;
+    }
+    if ((err = pthread_mutex_lock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (from == 0) from = cdc.next;
+    oldest = cdc.oldest;
+    int held = from >= cdc.oldest && from <= cdc.next;
+    if ((err = pthread_mutex_unlock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if (cdc_status(cxstr, held ? "subscribed" : "gap", held ? from : oldest) <
+        0) {
+        free(lines);
+        return -1;
+    }
+
+    while (held && !comm_peer_gone(cxstr)) {
+        struct timespec deadline;
+        int count = 0;
+        int nvec = 0;
+        size_t used = 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CDC_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if ((err = pthread_mutex_lock(&cdc.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        err = 0;
+        while (from == cdc.next && err != ETIMEDOUT) {
+            err = pthread_cond_timedwait(&cdc.cond, &cdc.mutex, &deadline);
+            if (err != 0 && err != ETIMEDOUT) {
+                handle_error_en(err, "pthread_cond_timedwait");
+            }
+        }
+        if (from < cdc.oldest) {
+            // the ring overtook us
+            held = 0;
+            oldest = cdc.oldest;
+        }
+        for (; held && from < cdc.next && count < CDC_BATCH; from++, count++) {
+            cdc_entry_t *entry = &cdc.ring[(from - 1) % cdc.capacity];
+            memcpy(lines + used, entry->line, entry->len);
+            iov[nvec].iov_base = lines + used;
+            iov[nvec++].iov_len = entry->len;
+            used += entry->len;
+            if ((payloads[count] = entry->payload) != 0) {
+                __atomic_add_fetch(&entry->payload->refs, 1, __ATOMIC_RELAXED);
+                iov[nvec].iov_base = entry->payload->data;
+                iov[nvec++].iov_len = entry->payload->len;
+                iov[nvec].iov_base = (void *)&newline;
+                iov[nvec++].iov_len = 1;
+            }
+        }
+        if (heartbeat && held) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            int len = snprintf(
+                lines + used, CDC_LINE_MAX, "h %" PRIu64 " %lld\n", cdc.next,
+                (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+            iov[nvec].iov_base = lines + used;
+            iov[nvec++].iov_len = len;
+        }
+        if ((err = pthread_mutex_unlock(&cdc.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+
+        if (nvec > 0 && comm_writev(cxstr, iov, nvec) < 0) ret = -1;
+        for (int i = 0; i < count; i++) {
+            if (payloads[i] != 0) db_blob_put(payloads[i]);
+        }
+        if (ret < 0) break;
+        if (!held) ret = cdc_status(cxstr, "gap", oldest);
+    }
+    free(lines);
+    return ret;
+}
+
+void cdc_close(void) {
+    int err;
+    if ((err = pthread_mutex_lock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (cdc.ring != 0) {
+        for (size_t i = 0; i < cdc.capacity; i++) {
+            cdc_entry_clear(&cdc.ring[i]);
+        }
+        free(cdc.ring);
+        cdc.ring = 0;
+    }
+    cdc_on = 0;
+    if ((err = pthread_mutex_unlock(&cdc.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
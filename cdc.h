@@ -0,0 +1,51 @@
+#ifndef CDC_H_
+#define CDC_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Change data capture. Every successful add and remove is given the next
+ * sequence number (starting at 1 in each server process) and kept in a ring
+ * of the most recent changes, from which subscribed connections are sent the
+ * changes they have not seen yet. A subscriber that falls so far behind that
+ * the ring overwrote changes it still needs is told so and dropped, and must
+ * start again from a full dump.
+ */
+
+/*
+ * Keeps the last capacity changes and registers the observer that records
+ * them. Keys loaded before the call (from checkpoints, the write-ahead log or
+ * a handoff) are not streamed. Must be called before clients are served.
+ * Returns 0 on success and -1 on failure.
+ */
+int cdc_open(size_t capacity);
+
+/* Nonzero once cdc_open() has succeeded. */
+int cdc_enabled(void);
+
+/*
+ * Streams the changes from sequence number from onwards to the connection
+ * until it is closed or shut down for reading, or the ring overtakes it.
+ * from 0 means the changes made after the call. The first line is
+ * "subscribed <seq>", or "gap <oldest>" (and nothing else) if the changes
+ * starting at from are no longer, or not yet, held in the ring. Each change
+ * follows as "<seq> a <name> <value>", "<seq> d <name>", or, for a large
+ * value, "<seq> A <name> <length>" followed by the bytes and a newline.
+ * With heartbeat set, every write (at least one per 200 ms) ends with an
+ * "h <next seq> <leader time in ms>" line, from which a follower measures
+ * how far behind it is. Returns 0 when the subscriber went away and -1 if the
+ * connection failed.
+ */
+int cdc_stream(FILE *cxstr, uint64_t from, int heartbeat);
+
+/* The sequence number the next change will get. */
+uint64_t cdc_next(void);
+
+/* The number of changes the ring holds. */
+size_t cdc_capacity(void);
+
+/* Drops the ring. No subscriber may be streaming. */
+void cdc_close(void);
+
+#endif  // CDC_H_
@@ -0,0 +1,810 @@
+// for syncfs()
+#define _GNU_SOURCE
+#include "./ckpt.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+#include "./wal.h"
+
+/* Dirty key range tracking and incremental checkpoint files */
+
+// a region is split once it holds twice this many keys, and one left with
+// under a quarter of it takes its neighbour along the next time it is written
+#define CKPT_REGION_KEYS 4096
+#define CKPT_MAXLEN 256
+// the write buffer of a region file
+#define CKPT_BUFFER (1 << 20)
+
+/* A range of keys, from lo up to the next region's lo, and its file. */
+typedef struct region {
+    char *lo;             // "" for the first region
+    uint32_t gen;         // the checkpoint that wrote its file, 0 if none
+    uint32_t num;         // which of that checkpoint's files it is
+    uint32_t keys;        // in the file
+    unsigned char dirty;  // set by every change to a key in the range
+} region_t;
+
+/* Consecutive regions that a checkpoint rewrites as one walk over the keys. */
+typedef struct span {
+    size_t first, end;              // its old regions
+    size_t first_piece, end_piece;  // the new regions it was written to
+} span_t;
+
+static struct ckpt {
+    char dir[BUFSIZ / 2];  // leaves room for file names in BUFSIZ paths
+    // readers: marking regions dirty; writer: replacing them
+    pthread_rwlock_t lock;
+    region_t *regions;  // in key order, covering every key
+    size_t nregions;
+    unsigned long generation;  // of the last checkpoint
+    // scratch for ckpt_take() and the walks of write_span()
+    unsigned char *writing;
+    span_t *spans;
+    size_t nspans, spans_cap;
+    region_t *pieces;
+    size_t npieces, pieces_cap;
+    FILE *out;  // the file of the last piece, once it has a key
+    char *buffer;
+    uint32_t writing_gen;
+    uint32_t next_num;
+    size_t planned;     // pieces the span is split into
+    size_t piece_keys;  // for each but the last
+    int failed;
+    // one checkpoint at a time
+    pthread_mutex_t mutex;
+    int suspended;  // while another server owns the directory
+    // the periodic checkpoint thread
+    long interval_ms;
+    pthread_cond_t cond;
+    int stopping;
+    int running;
+    pthread_t thread;
+} ckpt = {.lock = PTHREAD_RWLOCK_INITIALIZER,
+          .mutex = PTHREAD_MUTEX_INITIALIZER,
+          .cond = PTHREAD_COND_INITIALIZER};
+
+static int ckpt_on = 0;
+
+/* A record of a region file, pointing into its mapping. */
+typedef struct ckpt_record {
+    const char *name;
+    size_t nlen;
+    const char *value;
+    size_t vlen;
+    int large;
+} ckpt_record_t;
+
+/* The region holding name: the last one whose lo is not above it. */
+static size_t ckpt_region(const char *name) {
+    size_t lo = 0, hi = ckpt.nregions;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(ckpt.regions[mid].lo, name) <= 0) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void ckpt_mark(const db_change_t *change, void *arg) {
+    int err;
+    if ((err = pthread_rwlock_rdlock(&ckpt.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    // a range delete dirties every region its range overlaps
+    size_t first = ckpt_region(change->name);
+    size_t last =
+        change->op == db_op_remove_range ? ckpt_region(change->value) : first;
+    for (size_t r = first; r <= last; r++) {
+        __atomic_store_n(&ckpt.regions[r].dirty, 1, __ATOMIC_RELEASE);
+    }
+    if ((err = pthread_rwlock_unlock(&ckpt.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+int ckpt_enabled(void) { return ckpt_on; }
+
+static void region_path(uint32_t gen, uint32_t num, char *path, size_t len) {
+    snprintf(path, len, "%s/c%u.%u", ckpt.dir, gen, num);
+}
+
+/* Writes a MANIFEST listing regions and makes it durable. */
+static int write_manifest(region_t *regions, size_t n, unsigned long gen,
+                          off_t wal_from) {
+    char path[BUFSIZ];
+    char tmp[BUFSIZ];
+    snprintf(path, sizeof(path), "%s/MANIFEST", ckpt.dir);
+    snprintf(tmp, sizeof(tmp), "%s/MANIFEST.tmp", ckpt.dir);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror(tmp);
+        return -1;
+    }
+    fprintf(out, "checkpoint %lu\nwal %lld\n", gen, (long long)wal_from);
+    for (size_t r = 0; r < n; r++) {
+        fprintf(out, "region %u %u %u%s%s\n", regions[r].gen, regions[r].num,
+                regions[r].keys, r > 0 ? " " : "", regions[r].lo);
+    }
+    if (fflush(out) == EOF || fsync(fileno(out)) < 0) {
+        perror(tmp);
+        fclose(out);
+        return -1;
+    }
+    fclose(out);
+    if (rename(tmp, path) < 0) {
+        perror("rename");
+        return -1;
+    }
+    // and the rename itself
+    int dfd = open(ckpt.dir, O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return 0;
+}
+
+/* Adds a new region starting at lo, without a file until it gets a key. */
+static int piece_start(const char *lo) {
+    if (ckpt.npieces == ckpt.pieces_cap) {
+        size_t cap = ckpt.pieces_cap ? 2 * ckpt.pieces_cap : 64;
+        region_t *bigger = realloc(ckpt.pieces, cap * sizeof(region_t));
+        if (bigger == NULL) return -1;
+        ckpt.pieces = bigger;
+        ckpt.pieces_cap = cap;
+    }
+    region_t *piece = &ckpt.pieces[ckpt.npieces];
+    memset(piece, 0, sizeof(*piece));
+    if ((piece->lo = strdup(lo)) == NULL) return -1;
+    ckpt.npieces++;
+    return 0;
+}
+
+/* Completes the last region's file, if it has one. */
+static void piece_finish(void) {
+    if (ckpt.out == NULL) return;
+    if (fclose(ckpt.out) == EOF) {
+        perror("checkpoint");
+        ckpt.failed = 1;
+    }
+    ckpt.out = NULL;
+}
+
+/*
+ * db_dump_range()'s pick: the file of the last new region, after starting
+ * another one at name if that one is full.
+ */
+static FILE *ckpt_pick(const char *name, void *arg) {
+    size_t *span_pieces = arg;
+    region_t *piece = &ckpt.pieces[ckpt.npieces - 1];
+
+    if (ckpt.failed) return NULL;
+    if (piece->keys > 0 &&
+        ((*span_pieces < ckpt.planned && piece->keys >= ckpt.piece_keys) ||
+         piece->keys >= 2 * CKPT_REGION_KEYS)) {
+        piece_finish();
+        if (piece_start(name) < 0) {
+            perror("checkpoint");
+            ckpt.failed = 1;
+            return NULL;
+        }
+        (*span_pieces)++;
+        piece = &ckpt.pieces[ckpt.npieces - 1];
+    }
+    if (ckpt.out == NULL) {
+        char path[BUFSIZ];
+        piece->gen = ckpt.writing_gen;
+        piece->num = ckpt.next_num++;
+        region_path(piece->gen, piece->num, path, sizeof(path));
+        if ((ckpt.out = fopen(path, "w")) == NULL) {
+            perror(path);
+            ckpt.failed = 1;
+            return NULL;
+        }
+        if (ckpt.buffer != NULL) {
+            setvbuf(ckpt.out, ckpt.buffer, _IOFBF, CKPT_BUFFER);
+        }
+    }
+    piece->keys++;
+    return ckpt.out;
+}
+
+/*
+ * Writes the keys of the old regions first to end, walking only their range,
+ * to new regions of about CKPT_REGION_KEYS keys each (at most twice that),
+ * split at the keys where the walk gets there.
+ */
+static void write_span(size_t first, size_t end) {
+    size_t keys = 0;
+    size_t span_pieces = 1;
+    for (size_t r = first; r < end; r++) keys += ckpt.regions[r].keys;
+    ckpt.planned = keys / CKPT_REGION_KEYS > 0 ? keys / CKPT_REGION_KEYS : 1;
+    ckpt.piece_keys = keys / ckpt.planned;
+
+    if (ckpt.nspans == ckpt.spans_cap) {
+        size_t cap = ckpt.spans_cap ? 2 * ckpt.spans_cap : 64;
+        span_t *bigger = realloc(ckpt.spans, cap * sizeof(span_t));
+        if (bigger == NULL) {
+            ckpt.failed = 1;
+            return;
+        }
+        ckpt.spans = bigger;
+        ckpt.spans_cap = cap;
+    }
+    span_t *span = &ckpt.spans[ckpt.nspans++];
+    span->first = first;
+    span->end = end;
+    span->first_piece = ckpt.npieces;
+    // the first new region starts where the old ones did, so that the
+    // regions keep covering every key
+    if (piece_start(ckpt.regions[first].lo) < 0) {
+        ckpt.nspans--;
+        ckpt.failed = 1;
+        return;
+    }
+    const char *hi = end < ckpt.nregions ? ckpt.regions[end].lo : NULL;
+    if (db_dump_range(ckpt.regions[first].lo, hi, ckpt_pick, &span_pieces) <
+        0) {
+        ckpt.failed = 1;
+    }
+    piece_finish();
+    span->end_piece = ckpt.npieces;
+}
+
+/*
+ * Copies the new regions' dirty marks from the old ones, which changes went
+ * on marking during the checkpoint: a new region is dirty if any of the old
+ * regions it was written from is, since the walk may have missed the change.
+ * Holds ckpt.lock for writing.
+ */
+static void carry_marks(region_t *regions) {
+    size_t n = 0, s = 0;
+    for (size_t r = 0; r < ckpt.nregions;) {
+        if (s < ckpt.nspans && ckpt.spans[s].first == r) {
+            unsigned char dirty = 0;
+            for (; r < ckpt.spans[s].end; r++) {
+                dirty |= ckpt.regions[r].dirty;
+            }
+            for (size_t p = ckpt.spans[s].first_piece;
+                 p < ckpt.spans[s].end_piece; p++) {
+                regions[n++].dirty = dirty;
+            }
+            s++;
+        } else {
+            regions[n++].dirty = ckpt.regions[r++].dirty;
+        }
+    }
+}
+
+int ckpt_take(void) {
+    struct timespec start, finish;
+    size_t dirty = 0, keys = 0;
+    region_t *regions = NULL;
+    size_t n = 0;
+    int ret = 0;
+    int err;
+
+    if ((err = pthread_mutex_lock(&ckpt.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (ckpt.suspended) {
+        if ((err = pthread_mutex_unlock(&ckpt.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // everything logged before this point is in the regions written below
+    off_t wal_from = wal_offset();
+    unsigned char *writing = realloc(ckpt.writing, ckpt.nregions);
+    if (writing == NULL) {
+        if ((err = pthread_mutex_unlock(&ckpt.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        return -1;
+    }
+    ckpt.writing = writing;
+    // a change after this is picked up now or by the next checkpoint
+    for (size_t r = 0; r < ckpt.nregions; r++) {
+        writing[r] =
+            __atomic_exchange_n(&ckpt.regions[r].dirty, 0, __ATOMIC_ACQ_REL);
+        dirty += writing[r];
+    }
+    if (dirty == 0) {
+        // nothing changed since the last checkpoint
+        if ((err = pthread_mutex_unlock(&ckpt.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        return 0;
+    }
+
+    // walk each run of dirty regions, and only those
+    ckpt.writing_gen = ckpt.generation + 1;
+    ckpt.next_num = 1;
+    ckpt.nspans = ckpt.npieces = 0;
+    ckpt.failed = 0;
+    for (size_t first = 0; first < ckpt.nregions && !ckpt.failed;) {
+        if (!writing[first]) {
+            first++;
+            continue;
+        }
+        size_t end = first, span_keys = 0;
+        while (1) {
+            while (end < ckpt.nregions && writing[end]) {
+                span_keys += ckpt.regions[end++].keys;
+            }
+            // a small region takes its neighbour along, so that regions do
+            // not dwindle into many tiny files
+            if (end == ckpt.nregions ||
+                ckpt.regions[end - 1].keys >= CKPT_REGION_KEYS / 4 ||
+                span_keys + ckpt.regions[end].keys >= CKPT_REGION_KEYS) {
+                break;
+            }
+            writing[end] = 1;
+        }
+        write_span(first, end);
+        first = end;
+    }
+    // a file per region can be thousands of files, so they are made durable
+    // with one syncfs() instead of an fsync() each
+    int dfd = open(ckpt.dir, O_RDONLY | O_DIRECTORY);
+    if (!ckpt.failed && (dfd < 0 || syncfs(dfd) < 0)) {
+        perror(ckpt.dir);
+        ckpt.failed = 1;
+    }
+    if (dfd >= 0) close(dfd);
+
+    // the new list of regions: the old ones with each span replaced
+    if (!ckpt.failed) {
+        size_t replaced = 0;
+        for (size_t s = 0; s < ckpt.nspans; s++) {
+            replaced += ckpt.spans[s].end - ckpt.spans[s].first;
+        }
+        n = ckpt.nregions - replaced + ckpt.npieces;
+        if ((regions = malloc(n * sizeof(region_t))) == NULL) ckpt.failed = 1;
+    }
+    if (!ckpt.failed) {
+        size_t i = 0, s = 0;
+        for (size_t r = 0; r < ckpt.nregions;) {
+            if (s < ckpt.nspans && ckpt.spans[s].first == r) {
+                for (size_t p = ckpt.spans[s].first_piece;
+                     p < ckpt.spans[s].end_piece; p++) {
+                    regions[i++] = ckpt.pieces[p];
+                    keys += ckpt.pieces[p].keys;
+                }
+                r = ckpt.spans[s++].end;
+            } else {
+                regions[i++] = ckpt.regions[r++];
+            }
+        }
+        if (write_manifest(regions, n, ckpt.writing_gen, wal_from) < 0) {
+            ckpt.failed = 1;
+        }
+    }
+    if (ckpt.failed) {
+        // the old manifest still stands, and its wal offset only holds with
+        // every region: drop the new files and write the spans again next time
+        for (size_t p = 0; p < ckpt.npieces; p++) {
+            if (ckpt.pieces[p].gen != 0) {
+                char path[BUFSIZ];
+                region_path(ckpt.pieces[p].gen, ckpt.pieces[p].num, path,
+                            sizeof(path));
+                unlink(path);
+            }
+            free(ckpt.pieces[p].lo);
+        }
+        for (size_t r = 0; r < ckpt.nregions; r++) {
+            if (writing[r]) {
+                __atomic_store_n(&ckpt.regions[r].dirty, 1, __ATOMIC_RELEASE);
+            }
+        }
+        free(regions);
+        fprintf(stderr, "checkpoint failed\n");
+        ret = -1;
+    } else {
+        if ((err = pthread_rwlock_wrlock(&ckpt.lock)) != 0) {
+            handle_error_en(err, "pthread_rwlock_wrlock");
+        }
+        carry_marks(regions);
+        region_t *old = ckpt.regions;
+        size_t old_n = ckpt.nregions;
+        ckpt.regions = regions;
+        ckpt.nregions = n;
+        if ((err = pthread_rwlock_unlock(&ckpt.lock)) != 0) {
+            handle_error_en(err, "pthread_rwlock_unlock");
+        }
+        // the replaced regions' files are superseded now
+        for (size_t r = 0; r < old_n; r++) {
+            if (!writing[r]) continue;
+            if (old[r].gen != 0) {
+                char path[BUFSIZ];
+                region_path(old[r].gen, old[r].num, path, sizeof(path));
+                unlink(path);
+            }
+            free(old[r].lo);
+        }
+        free(old);
+        ckpt.generation = ckpt.writing_gen;
+        // replay starts here from now on
+        wal_release(wal_from);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        printf(
+            "checkpoint %lu: rewrote %zu dirty of %zu regions into %zu "
+            "(%zu keys) in %.1f ms\n",
+            ckpt.generation, dirty, old_n, ckpt.npieces, keys,
+            (finish.tv_sec - start.tv_sec) * 1e3 +
+                (finish.tv_nsec - start.tv_nsec) / 1e6);
+        fflush(stdout);
+    }
+    if ((err = pthread_mutex_unlock(&ckpt.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return ret;
+}
+
+/* Parses a mapped region file, appending its records to *recs. */
+static int parse_region(const char *data, size_t size, ckpt_record_t **recs,
+                        size_t *nrecs, size_t *cap) {
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *sp = nl != NULL ? memchr(p, ' ', nl - p) : NULL;
+        if (sp == NULL || sp == p) return -1;
+        if (*nrecs == *cap) {
+            *cap = *cap ? *cap * 2 : 1024;
+            ckpt_record_t *bigger = realloc(*recs, *cap * sizeof(**recs));
+            if (bigger == NULL) return -1;
+            *recs = bigger;
+        }
+        ckpt_record_t *rec = &(*recs)[(*nrecs)++];
+        const char *sp2 = memchr(sp + 1, ' ', nl - sp - 1);
+        if (sp - p == 1 && p[0] == 'A' && sp2 != NULL) {
+            // "A name length", then the bytes
+            rec->name = sp + 1;
+            rec->nlen = sp2 - sp - 1;
+            rec->vlen = strtoul(sp2 + 1, NULL, 10);
+            rec->value = nl + 1;
+            rec->large = 1;
+            if ((size_t)(end - nl - 1) < rec->vlen + 1 ||
+                nl[1 + rec->vlen] != '\n') {
+                return -1;
+            }
+            nl += rec->vlen + 1;
+        } else {
+            rec->name = p;
+            rec->nlen = sp - p;
+            rec->value = sp + 1;
+            rec->vlen = nl - sp - 1;
+            rec->large = 0;
+        }
+        if (rec->nlen >= CKPT_MAXLEN ||
+            (!rec->large && rec->vlen >= CKPT_MAXLEN)) {
+            return -1;
+        }
+        p = nl + 1;
+    }
+    return 0;
+}
+
+static int add_record(ckpt_record_t *rec) {
+    char name[CKPT_MAXLEN];
+    char value[CKPT_MAXLEN];
+    int ret;
+    memcpy(name, rec->name, rec->nlen);
+    name[rec->nlen] = '\0';
+    if (!rec->large) {
+        memcpy(value, rec->value, rec->vlen);
+        value[rec->vlen] = '\0';
+        return db_add(name, value);
+    }
+    blob_t *blob = db_blob_alloc(rec->vlen);
+    if (blob == NULL) return -1;
+    memcpy(blob->data, rec->value, rec->vlen);
+    if ((ret = db_add_blob(name, blob)) <= 0) db_blob_put(blob);
+    return ret;
+}
+
+/*
+ * Adds the records, which are in key order, middle first: inserting them in
+ * order would build a linked list.
+ */
+static int add_balanced(ckpt_record_t *recs, size_t n) {
+    size_t cap = 64, depth = 0;
+    size_t(*stack)[2] = malloc(cap * sizeof(*stack));
+    int ret = 0;
+    if (stack == NULL) return -1;
+    if (n > 0) {
+        stack[depth][0] = 0;
+        stack[depth++][1] = n;
+    }
+    while (ret == 0 && depth > 0) {
+        size_t lo = stack[--depth][0];
+        size_t hi = stack[depth][1];
+        size_t mid = lo + (hi - lo) / 2;
+        if (add_record(&recs[mid]) < 0) ret = -1;
+        if (depth + 2 > cap) {
+            cap *= 2;
+            size_t(*bigger)[2] = realloc(stack, cap * sizeof(*stack));
+            if (bigger == NULL) {
+                ret = -1;
+                break;
+            }
+            stack = bigger;
+        }
+        if (mid + 1 < hi) {
+            stack[depth][0] = mid + 1;
+            stack[depth++][1] = hi;
+        }
+        if (lo < mid) {
+            stack[depth][0] = lo;
+            stack[depth++][1] = mid;
+        }
+    }
+    free(stack);
+    return ret;
+}
+
+/* Rebuilds the database from the region files in the manifest. */
+static int load_regions(void) {
+    struct timespec start, finish;
+    ckpt_record_t *recs = NULL;
+    size_t nrecs = 0, cap = 0;
+    void **maps = malloc(ckpt.nregions * sizeof(void *));
+    size_t *sizes = malloc(ckpt.nregions * sizeof(size_t));
+    size_t nmaps = 0;
+    int ret = maps != NULL && sizes != NULL ? 0 : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t r = 0; r < ckpt.nregions && ret == 0; r++) {
+        char path[BUFSIZ];
+        struct stat st;
+        region_t *region = &ckpt.regions[r];
+        if (region->gen == 0) continue;
+        region_path(region->gen, region->num, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(path);
+            ret = -1;
+        } else if (st.st_size > 0) {
+            void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                perror("mmap");
+                ret = -1;
+            } else {
+                maps[nmaps] = map;
+                sizes[nmaps++] = st.st_size;
+                size_t before = nrecs;
+                if (parse_region(map, st.st_size, &recs, &nrecs, &cap) < 0) {
+                    fprintf(stderr, "%s: malformed checkpoint\n", path);
+                    ret = -1;
+                }
+                region->keys = nrecs - before;
+            }
+        }
+        if (fd >= 0) close(fd);
+    }
+    // the regions are ranges of keys in order, so the records already are
+    if (ret == 0) ret = add_balanced(recs, nrecs);
+    for (size_t i = 0; i < nmaps; i++) munmap(maps[i], sizes[i]);
+    free(maps);
+    free(sizes);
+    free(recs);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (ret == 0) {
+        printf("loaded %zu keys from checkpoint %lu in %.1f ms\n", nrecs,
+               ckpt.generation,
+               (finish.tv_sec - start.tv_sec) * 1e3 +
+                   (finish.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    return ret;
+}
+
+/* Reads the regions listed in the manifest at path, if there is one. */
+static int read_manifest(const char *path, off_t *wal_from) {
+    char line[BUFSIZ];
+    char lo[CKPT_MAXLEN];
+    long long from = 0;
+    size_t cap = 0;
+    region_t region;
+
+    FILE *in = fopen(path, "r");
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+        if (sscanf(line, "checkpoint %lu", &ckpt.generation) == 1 ||
+            sscanf(line, "wal %lld", &from) == 1) {
+            continue;
+        }
+        // only the first region, which starts at the first key, has no lo
+        lo[0] = '\0';
+        int fields = sscanf(line, "region %u %u %u %255s", &region.gen,
+                            &region.num, &region.keys, lo);
+        if (fields != (ckpt.nregions == 0 ? 3 : 4) ||
+            (ckpt.nregions > 0 &&
+             strcmp(ckpt.regions[ckpt.nregions - 1].lo, lo) >= 0)) {
+            fprintf(stderr, "%s: malformed manifest\n", path);
+            fclose(in);
+            return -1;
+        }
+        if (ckpt.nregions == cap) {
+            cap = cap ? 2 * cap : 64;
+            region_t *bigger = realloc(ckpt.regions, cap * sizeof(region_t));
+            if (bigger == NULL) {
+                fclose(in);
+                return -1;
+            }
+            ckpt.regions = bigger;
+        }
+        region.lo = strdup(lo);
+        region.dirty = 0;
+        if (region.lo == NULL) {
+            fclose(in);
+            return -1;
+        }
+        ckpt.regions[ckpt.nregions++] = region;
+    }
+    if (in != NULL) fclose(in);
+    *wal_from = from;
+    return 0;
+}
+
+/* Orders region files by checkpoint and number. */
+static int compare_files(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Removes the region files not in the manifest. */
+static void remove_stale(const char *dir) {
+    char path[BUFSIZ];
+    uint32_t gen, num;
+    uint64_t *files = malloc((ckpt.nregions + 1) * sizeof(uint64_t));
+    if (files == NULL) return;
+    for (size_t r = 0; r < ckpt.nregions; r++) {
+        files[r] = (uint64_t)ckpt.regions[r].gen << 32 | ckpt.regions[r].num;
+    }
+    qsort(files, ckpt.nregions, sizeof(uint64_t), compare_files);
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    while (d != NULL && (ent = readdir(d)) != NULL) {
+        if (sscanf(ent->d_name, "c%u.%u", &gen, &num) != 2) continue;
+        uint64_t file = (uint64_t)gen << 32 | num;
+        if (bsearch(&file, files, ckpt.nregions, sizeof(uint64_t),
+                    compare_files) != NULL) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        unlink(path);
+    }
+    if (d != NULL) closedir(d);
+    free(files);
+}
+
+static void *ckpt_thread(void *arg) {
+    int err;
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ckpt.interval_ms / 1000;
+        deadline.tv_nsec += (ckpt.interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if ((err = pthread_mutex_lock(&ckpt.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        err = 0;
+        while (!ckpt.stopping && err != ETIMEDOUT) {
+            err = pthread_cond_timedwait(&ckpt.cond, &ckpt.mutex, &deadline);
+            if (err != 0 && err != ETIMEDOUT) {
+                handle_error_en(err, "pthread_cond_timedwait");
+            }
+        }
+        int stopping = ckpt.stopping;
+        if ((err = pthread_mutex_unlock(&ckpt.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (stopping) break;
+        ckpt_take();
+    }
+    return NULL;
+}
+
+int ckpt_open(const char *dir, int load, long interval_ms, off_t *wal_from) {
+    char path[BUFSIZ];
+    off_t from;
+    int err;
+
+    if (strlen(dir) >= sizeof(ckpt.dir)) {
+        fprintf(stderr, "%s: name too long\n", dir);
+        return -1;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    snprintf(ckpt.dir, sizeof(ckpt.dir), "%s", dir);
+
+    snprintf(path, sizeof(path), "%s/MANIFEST", dir);
+    if (read_manifest(path, &from) < 0) return -1;
+    // region files not in the manifest are from an interrupted checkpoint
+    remove_stale(dir);
+    if (ckpt.nregions == 0) {
+        // one region for every key until the first checkpoint splits it
+        ckpt.regions = malloc(sizeof(region_t));
+        if (ckpt.regions == NULL || (ckpt.regions[0].lo = strdup("")) == NULL) {
+            return -1;
+        }
+        ckpt.regions[0].gen = ckpt.regions[0].num = ckpt.regions[0].keys = 0;
+        ckpt.nregions = 1;
+    }
+    // a region file is written in one go, so one buffer serves them all
+    ckpt.buffer = malloc(CKPT_BUFFER);
+
+    if (load) {
+        if (load_regions() < 0) return -1;
+        *wal_from = from;
+    } else {
+        for (size_t r = 0; r < ckpt.nregions; r++) ckpt.regions[r].dirty = 1;
+        *wal_from = 0;
+    }
+    if (db_observe(ckpt_mark, NULL) < 0) return -1;
+
+    if (interval_ms > 0) {
+        ckpt.interval_ms = interval_ms;
+        if ((err = pthread_create(&ckpt.thread, 0, ckpt_thread, 0)) != 0) {
+            handle_error_en(err, "pthread_create");
+        }
+        ckpt.running = 1;
+    }
+    ckpt_on = 1;
+    return 0;
+}
+
+void ckpt_suspend(int suspend) {
+    int err;
+    // waits for a checkpoint in progress
+    if ((err = pthread_mutex_lock(&ckpt.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    ckpt.suspended = suspend;
+    if ((err = pthread_mutex_unlock(&ckpt.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+void ckpt_close(int final) {
+    int err;
+    if (ckpt.running) {
+        if ((err = pthread_mutex_lock(&ckpt.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        ckpt.stopping = 1;
+        if ((err = pthread_cond_signal(&ckpt.cond)) != 0) {
+            handle_error_en(err, "pthread_cond_signal");
+        }
+        if ((err = pthread_mutex_unlock(&ckpt.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if ((err = pthread_join(ckpt.thread, NULL)) != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+        ckpt.running = 0;
+    }
+    if (final) ckpt_take();
+    ckpt_on = 0;
+}
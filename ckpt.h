@@ -0,0 +1,49 @@
+#ifndef CKPT_H_
+#define CKPT_H_
+
+#include <sys/types.h>
+
+/*
+ * Incremental checkpoints. The keys are split into ranges (regions) of a few
+ * thousand keys each, and every add and remove marks its key's region dirty.
+ * A checkpoint walks only the dirty ranges of the tree and writes each to new
+ * region files, splitting the ranges that grew and joining the ones that
+ * shrank, then atomically replaces the MANIFEST that lists every region and
+ * its file, so the reading and writing a checkpoint does follows the ranges
+ * that changed rather than the size of the database.
+ */
+
+/*
+ * Opens (or creates) the checkpoint directory dir. If load is set the
+ * database is rebuilt from the files in its MANIFEST; otherwise (after a
+ * handoff) every region is marked dirty so that the next checkpoint rewrites
+ * it. Stores the write-ahead log offset the checkpoint covers in *wal_from
+ * (see wal.h), and starts a thread that checkpoints every interval_ms if
+ * that is positive. Must be called before any keys are added. Returns 0 on
+ * success and -1 on failure.
+ */
+int ckpt_open(const char *dir, int load, long interval_ms, off_t *wal_from);
+
+/* Nonzero once ckpt_open() has succeeded. */
+int ckpt_enabled(void);
+
+/*
+ * Takes a checkpoint now. Returns 0 on success and -1 on failure or while
+ * checkpoints are suspended.
+ */
+int ckpt_take(void);
+
+/*
+ * Suspends (or resumes) checkpoints, waiting for one in progress. A server
+ * handing off suspends them, since the new server writes to the same
+ * directory.
+ */
+void ckpt_suspend(int suspend);
+
+/*
+ * Stops the checkpoint thread, first taking a last checkpoint if final is
+ * set. Must be called before db_cleanup().
+ */
+void ckpt_close(int final);
+
+#endif  // CKPT_H_
@@ -57,6 +57,31 @@ int get_socket(const char *server, const char *port) {
     return sock;
 }
 
+/*
+ * Copies the payload announced by a length-prefixed line (an 'A' command, or
+ * the reply to a 'Q' command) from in to out, including the newline that
+ * ends it. The length is the first number on the line for a reply, and
+ * the third word of an 'A' command. Returns 0 on success, -1 on a bad line or
+ * a short read.
+ */
+int copy_payload(const char *line, FILE *in, FILE *out, int is_command) {
+    char buf[BUFSIZE];
+    size_t len;
+
+    if (sscanf(line, is_command ? "%*s %*s %zu" : "%zu", &len) != 1) {
+        return -1;
+    }
+    // the newline after the payload comes along
+    len++;
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (fread(buf, 1, n, in) != n) return -1;
+        if (fwrite(buf, 1, n, out) != n) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
 /*
  * Forks off a process that attempts to connect to the server, and then run the
  * script in the file provided.
@@ -106,6 +131,12 @@ pid_t create_occurence(const char *server, const char *port,
                     fprintf(stderr, "No connection!\n");
                     exit(1);
                 }
+                // an 'A' command is followed by its value in the script
+                if (qbuf[0] == 'A' &&
+                    copy_payload(qbuf, infile, cxn, 1) == -1) {
+                    fprintf(stderr, "Bad or truncated 'A' command!\n");
+                    exit(1);
+                }
                 fflush(cxn);
             }
 
@@ -115,6 +146,39 @@ pid_t create_occurence(const char *server, const char *port,
                 exit(1);
             }
             printf("%s", rbuf);
+            // a 'Q' reply is a length line followed by the value
+            if (qbuf[0] == 'Q' && rbuf[0] >= '0' && rbuf[0] <= '9' &&
+                copy_payload(rbuf, cxn, stdout, 0) == -1) {
+                fprintf(stderr, "Connection terminated.\n");
+                exit(1);
+            }
+            // a 'V' or 'K' reply is a count line followed by that many keys
+            if ((qbuf[0] == 'V' || qbuf[0] == 'K') && rbuf[0] >= '0' &&
+                rbuf[0] <= '9') {
+                for (long n = atol(rbuf); n > 0; n--) {
+                    if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
+                        fprintf(stderr, "Connection terminated.\n");
+                        exit(1);
+                    }
+                    printf("%s", rbuf);
+                }
+            }
+            // after 'S' or 'W' the server streams changes until we hang up
+            if ((qbuf[0] == 'S' && strncmp(rbuf, "subscribed", 10) == 0) ||
+                (qbuf[0] == 'W' && strncmp(rbuf, "watching", 8) == 0)) {
+                while (fgets(rbuf, BUFSIZE, cxn) != NULL) {
+                    printf("%s", rbuf);
+                    // "<seq> A <key> <length>" is followed by the value
+                    char *change = strchr(rbuf, ' ');
+                    if (change != NULL && change[1] == 'A' &&
+                        copy_payload(change + 1, cxn, stdout, 1) == -1) {
+                        break;
+                    }
+                    fflush(stdout);
+                }
+                fprintf(stderr, "Subscription ended.\n");
+                exit(0);
+            }
         }
     }
 
@@ -1,6 +1,8 @@
 #include "./comm.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include "./trace.h"
 
 /* Serverside I/O functions */
 
@@ -18,19 +21,31 @@ static void *listener(void (*server)(FILE *));
 
 static int comm_port;
 
+// set when the listening socket was handed to us instead of created here
+static int comm_inherited = 0;
+
+pthread_t start_listener_fd(int fd, void (*server)(FILE *)) {
+    lsock = fd;
+    comm_inherited = 1;
+    return start_listener(0, server);
+}
+
+int comm_listen_fd(void) { return lsock; }
+
 pthread_t start_listener(int port, void (*server)(FILE *)) {
-    comm_port = port;
+    if (!comm_inherited) comm_port = port;
     pthread_t tid;
     int err;
 
     if ((err = pthread_create(&tid, 0, (void *(*)(void *))listener,
                               (void *)server)))
         handle_error_en(err, "pthread_create");
- 
+
     return tid;
 }
 
-void *listener(void (*server)(FILE *)) {
+/* Creates, binds and listens on the server socket for comm_port. */
+static void open_listener(void) {
     if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(1);
@@ -55,6 +70,22 @@ void *listener(void (*server)(FILE *)) {
     }
 
     fprintf(stderr, "listening on port %d\n", comm_port);
+}
+
+void *listener(void (*server)(FILE *)) {
+    if (comm_inherited) {
+        // the socket is already bound and listening, just learn its port
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        if (getsockname(lsock, (struct sockaddr *)&addr, &addr_len) < 0) {
+            perror("getsockname");
+            exit(1);
+        }
+        comm_port = ntohs(addr.sin_port);
+        fprintf(stderr, "listening on inherited socket, port %d\n", comm_port);
+    } else {
+        open_listener();
+    }
 
     while (1) {
         int csock;
@@ -66,6 +97,10 @@ void *listener(void (*server)(FILE *)) {
             perror("accept");
             continue;
         }
+        // the listener is stopped with pthread_cancel(); only allow that
+        // while blocked in accept() so a connection is never half set up
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        TRACE1(connection__accept, csock);
 
         fprintf(stderr, "received connection from %s#%hu\n",
                 inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
@@ -74,26 +109,55 @@ void *listener(void (*server)(FILE *)) {
         if (!(cxstr = fdopen(csock, "w+"))) {
             perror("fdopen");
             if (close(csock) < 0) perror("close");
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
             continue;
         }
 
         server(cxstr);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     }
 
     return NULL;
 }
 
 void comm_shutdown(FILE *cxstr) {
+    TRACE1(connection__close, fileno(cxstr));
     if (fclose(cxstr) < 0) perror("fclose");
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
+/*
+ * Responses bypass the stdio buffer: a stream that still holds read-ahead
+ * input (pipelined commands, or the rest of a payload) cannot be switched to
+ * writing on a socket.
+ */
+int comm_writev(FILE *cxstr, struct iovec *vec, int count) {
+    while (count > 0) {
+        ssize_t sent = writev(fileno(cxstr), vec, count);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
             fprintf(stderr, "client connection terminated\n");
             return -1;
         }
+        while (count > 0 && (size_t)sent >= vec->iov_len) {
+            sent -= vec->iov_len;
+            vec++;
+            count--;
+        }
+        if (count > 0) {
+            vec->iov_base = (char *)vec->iov_base + sent;
+            vec->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+int comm_serve(FILE *cxstr, char *response, char *command) {
+    size_t len = strlen(response);
+    if (len > 0) {
+        struct iovec iov[2] = {{response, len}, {"\n", 1}};
+        if (comm_writev(cxstr, iov, 2) < 0) {
+            return -1;
+        }
     }
 
     if (fgets(command, BUFLEN, cxstr) == NULL) {
@@ -103,3 +167,30 @@ int comm_serve(FILE *cxstr, char *response, char *command) {
 
     return 0;
 }
+
+int comm_recv_payload(FILE *cxstr, char *data, size_t len) {
+    // the bytes may already sit in the stream's buffer, so read through it
+    if (fread(data, 1, len, cxstr) != len || fgetc(cxstr) != '\n') {
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
+    }
+    return 0;
+}
+
+int comm_send_payload(FILE *cxstr, const char *data, size_t len) {
+    char header[32];
+    int hlen = snprintf(header, sizeof(header), "%zu\n", len);
+    // the value is written straight from where it is stored
+    struct iovec iov[3] = {{header, hlen}, {(void *)data, len}, {"\n", 1}};
+    return comm_writev(cxstr, iov, 3);
+}
+
+int comm_peer_gone(FILE *cxstr) {
+    struct pollfd pfd = {fileno(cxstr), POLLIN, 0};
+    char scratch[BUFLEN];
+    if (poll(&pfd, 1, 0) <= 0) return 0;
+    if (pfd.revents & (POLLHUP | POLLERR)) return 1;
+    // a shut down read side reads as end of file
+    ssize_t got = recv(pfd.fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+    return got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR);
+}
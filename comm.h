@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 #define BUFLEN 256
 #define handle_error_en(en, msg) \
@@ -14,7 +15,26 @@
     } while (0)
 
 pthread_t start_listener(int port, void (*serve_func)(FILE *));
+/* Like start_listener(), but accepts on an already listening socket, e.g. one
+ * received from another server process during a handoff. */
+pthread_t start_listener_fd(int fd, void (*serve_func)(FILE *));
+/* The listening socket, valid once the listener thread has set it up. */
+int comm_listen_fd(void);
 void comm_shutdown(FILE *cxstr);
 int comm_serve(FILE *cxstr, char *resp, char *cmd);
+/* Reads the len byte payload of a length-prefixed command and the newline
+ * that ends it. Returns 0 on success and -1 if the connection failed. */
+int comm_recv_payload(FILE *cxstr, char *data, size_t len);
+/* Sends a "length" line, len bytes of data and a newline with one writev(),
+ * without copying data. Returns 0 on success and -1 if the connection failed.
+ */
+int comm_send_payload(FILE *cxstr, const char *data, size_t len);
+/* Writes all of the count iovecs to the connection, retrying partial writes;
+ * vec is modified. Returns 0 on success and -1 if the connection failed. */
+int comm_writev(FILE *cxstr, struct iovec *vec, int count);
+/* For connections the server only writes to, such as subscriptions: returns
+ * nonzero once the peer closed the connection, or the server shut down its
+ * read side to drain it. Anything the peer sent is discarded. */
+int comm_peer_gone(FILE *cxstr);
 
 #endif  // COMM_H_
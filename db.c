@@ -1,3 +1,5 @@
+// for PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+#define _GNU_SOURCE
 #include "./db.h"
 #include <assert.h>
 #include <ctype.h>
@@ -5,21 +7,146 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "./arena.h"
 #include "./comm.h"
+#include "./hot.h"
+#include "./intern.h"
+#include "./lsm.h"
+#include "./stats.h"
+#include "./tier.h"
+#include "./trace.h"
 
 #define MAXLEN 256
+// identifies the node_t layout stored in a shared arena; bump the version
+// whenever node_t or the way strings hang off it changes
+#define DB_ARENA_TAG ((4UL << 16) | sizeof(node_t))
+// the tiering sweep takes subtrees of up to this many keys in one go
+#define TIER_SUBTREE 64
 
 // The root node of the binary tree, unlike all
 // other nodes in the tree, this one is never
 // freed (it's allocated in the data region).
 node_t head = {"", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER};
 
+/*
+ * A named database. Each has its own root node, so clients of different
+ * databases never contend on a lock, and its own per-thread counters (see
+ * stats.h), so they do not contend on those either.
+ */
+typedef struct db_namespace {
+    char name[MAXLEN];
+    node_t *root;
+    // counter ids, -1 if the registry ran out of room
+    int queries;
+    int adds;
+    int removes;
+    // held for reading by every add and remove and for writing by a range
+    // delete, so that no writer is inside a subtree when it is cut out;
+    // writers are preferred, or a steady stream of adds would starve it
+    pthread_rwlock_t writers;
+    struct db_namespace *next;
+} db_namespace_t;
+
+// head is the root of the default database, which is the only one that is
+// logged, checkpointed, replicated, watched or kept in run files
+static db_namespace_t default_ns = {
+    .name = "default",
+    .root = &head,
+    .queries = STATS_QUERIES,
+    .adds = STATS_ADDS,
+    .removes = STATS_REMOVES,
+    .writers = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP};
+// the list of databases, only ever added to while serving
+static db_namespace_t *namespaces = &default_ns;
+static pthread_mutex_t namespaces_mutex = PTHREAD_MUTEX_INITIALIZER;
+// how many there are besides the default one, guarded by namespaces_mutex
+static int named_count = 0;
+// set by db_default_only() before serving
+static int default_only = 0;
+// subtree sizes are kept, set by db_use_sampling() or db_use_tiering()
+static int keep_sizes = 0;
+// the database the calling client thread has selected
+static __thread db_namespace_t *cur_ns = &default_ns;
+
+// Polled between the lines of an 'f' command so that a draining server can
+// stop a long-running file load without cancelling the thread.
+static int (*interrupt_check)(void) = 0;
+
+void db_set_interrupt(int (*check)(void)) { interrupt_check = check; }
+
+// Called for every change, see db_observe(). Only written before serving.
+static struct {
+    void (*fn)(const db_change_t *change, void *arg);
+    void *arg;
+} observers[DB_MAX_OBSERVERS];
+static int nobservers = 0;
+
+int db_observe(void (*fn)(const db_change_t *change, void *arg), void *arg) {
+    if (nobservers == DB_MAX_OBSERVERS) return -1;
+    observers[nobservers].fn = fn;
+    observers[nobservers].arg = arg;
+    nobservers++;
+    return 0;
+}
+
+/* Reports a change to the observers. The caller holds the parent's lock. */
+static void db_notify(enum db_op op, const char *name, const char *value,
+                      blob_t *blob) {
+    db_change_t change = {op, name, value, 0, blob != 0, blob};
+    // called for every successful change, so this is where they are counted;
+    // the keys of a range are counted as the reclaim thread frees them
+    if (op != db_op_remove_range) {
+        stats_add(op == db_op_add ? cur_ns->adds : cur_ns->removes, 1);
+    }
+    if (nobservers == 0 || cur_ns != &default_ns) return;
+    if (blob != 0) {
+        change.value = blob->data;
+        change.len = blob->len;
+    } else if (value != 0) {
+        change.len = strlen(value);
+    }
+    for (int i = 0; i < nobservers; i++) {
+        observers[i].fn(&change, observers[i].arg);
+    }
+}
+
+// Per-thread lock accounting for the slow command log, see db_lock_stats()
+static __thread size_t locks_taken = 0;
+static __thread size_t depth_reached = 0;
+static __thread uint64_t lock_wait_ns = 0;
+
+void db_lock_stats(size_t *locks, size_t *depth, uint64_t *wait_ns) {
+    *locks = locks_taken;
+    *depth = depth_reached;
+    *wait_ns = lock_wait_ns;
+    locks_taken = 0;
+    depth_reached = 0;
+    lock_wait_ns = 0;
+}
+
+/* Notes that a search locked a node depth levels below the root. */
+static inline void note_depth(size_t depth) {
+    if (depth > depth_reached) depth_reached = depth;
+}
+
 /*
 This helper method locks the rwlock of a node using the specified
-locktype
+locktype. A lock that is not free at once is waited for with the clock
+running, so the uncontended path never reads it.
 */
 static inline void lock(enum locktype lt, pthread_rwlock_t *lk) {
+    struct timespec start, end;
     int err;
+    locks_taken++;
+    TRACE2(lock__acquire, lk, lt == l_write);
+    if (lt == l_read) {
+        if ((err = pthread_rwlock_tryrdlock(lk)) == 0) return;
+    } else {
+        if ((err = pthread_rwlock_trywrlock(lk)) == 0) return;
+    }
+    if (err != EBUSY) handle_error_en(err, "pthread_rwlock_trylock");
+    clock_gettime(CLOCK_MONOTONIC, &start);
     if (lt == l_read) {
         if ((err = pthread_rwlock_rdlock(lk)) != 0) {
             handle_error_en(err, "pthread_rwlock_rdlock");
@@ -29,138 +156,480 @@ static inline void lock(enum locktype lt, pthread_rwlock_t *lk) {
             handle_error_en(err, "pthread_rwlock_wrlock");
         }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t waited = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                      end.tv_nsec - start.tv_nsec;
+    lock_wait_ns += waited;
+    TRACE3(lock__wait, lk, lt == l_write, waited);
 }
 
-node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left,
-                         node_t *arg_right) {
+static inline void unlock(pthread_rwlock_t *lk) {
+    int err;
+    TRACE1(lock__release, lk);
+    if ((err = pthread_rwlock_unlock(lk)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+/*
+ * Tree memory comes from the shared arena when one has been attached with
+ * db_attach(), and from malloc otherwise.
+ */
+static inline void *db_alloc(size_t size) {
+    return arena_enabled() ? arena_alloc(size) : malloc(size);
+}
+
+static inline void db_free(void *ptr) {
+    if (arena_enabled()) {
+        arena_free(ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+/* Copies a key or value for a node, sharing the copy if interning is on. */
+static char *db_strdup(char *str, size_t len) {
+    char *copy;
+    if (intern_enabled()) return intern_get(str, len);
+    if ((copy = (char *)db_alloc(len + 1)) == 0) return 0;
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+static inline void db_strfree(char *str) {
+    if (intern_enabled()) {
+        intern_put(str);
+    } else {
+        db_free(str);
+    }
+}
+
+blob_t *db_blob_alloc(size_t len) {
+    blob_t *blob;
+    if (len > MAXVALUE) return 0;
+    if ((blob = (blob_t *)db_alloc(sizeof(blob_t) + len + 1)) == 0) return 0;
+    blob->refs = 1;
+    blob->len = len;
+    blob->data[len] = '\0';
+    return blob;
+}
+
+void db_blob_put(blob_t *blob) {
+    if (__atomic_sub_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        db_free(blob);
+    }
+}
+
+/*
+ * Creates a node holding either the string arg_value or, if arg_value is 0,
+ * the blob arg_blob, whose reference passes to the node. With neither the
+ * node is a tombstone.
+ */
+node_t *node_constructor(char *arg_name, char *arg_value, blob_t *arg_blob,
+                         node_t *arg_left, node_t *arg_right) {
     size_t name_len = strlen(arg_name);
-    size_t val_len = strlen(arg_value);
+    size_t val_len = arg_value != 0 ? strlen(arg_value) : 0;
 
     if (name_len > MAXLEN || val_len > MAXLEN) return 0;
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
+    node_t *new_node = (node_t *)db_alloc(sizeof(node_t));
 
     if (new_node == 0) return 0;
 
-    if ((new_node->name = (char *)malloc(name_len + 1)) == 0) {
-        free(new_node);
-        return 0;
-    }
-
-    if ((new_node->value = (char *)malloc(val_len + 1)) == 0) {
-        free(new_node->name);
-        free(new_node);
+    if ((new_node->name = db_strdup(arg_name, name_len)) == 0) {
+        db_free(new_node);
         return 0;
     }
 
-    if ((snprintf(new_node->name, MAXLEN, "%s", arg_name)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
-    } else if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
+    if (arg_value == 0 && arg_blob == 0) {
+        new_node->blob = 0;
+        new_node->value = 0;
+    } else if (arg_value == 0) {
+        // large values stay in their blob
+        new_node->blob = arg_blob;
+        new_node->value = arg_blob->data;
+    } else if ((new_node->value = db_strdup(arg_value, val_len)) == 0) {
+        db_strfree(new_node->name);
+        db_free(new_node);
         return 0;
+    } else {
+        new_node->blob = 0;
     }
 
     pthread_rwlock_init(&new_node->rwl, 0);
 
+    new_node->spill = 0;
+    new_node->spill_len = 0;
+    new_node->spill_blob = 0;
+    // a new value survives at least one tiering sweep in memory
+    new_node->hot = 1;
     new_node->lchild = arg_left;
     new_node->rchild = arg_right;
+    new_node->size = 1;
+    TRACE2(node__alloc, new_node, new_node->name);
     return new_node;
 }
 
 void node_destructor(node_t *node) {
-    if (node->name != 0) free(node->name);
-    if (node->value != 0) free(node->value);
+    TRACE1(node__free, node);
+    if (node->name != 0) db_strfree(node->name);
+    if (node->blob != 0) {
+        db_blob_put(node->blob);
+    } else if (node->value != 0) {
+        db_strfree(node->value);
+    } else if (node->spill != 0) {
+        tier_release(node->spill - 1, node->spill_len);
+    }
     pthread_rwlock_destroy(&node->rwl);
-    free(node);
+    db_free(node);
 }
 
-void db_query(char *name, char *result, int len) {
+/* Gives a tombstone a value again, taking arg_blob as node_constructor()
+ * would. Returns 1, or -1 if the value could not be copied. */
+static int node_revive(node_t *node, char *arg_value, blob_t *arg_blob) {
+    if (arg_value == 0) {
+        node->blob = arg_blob;
+        node->value = arg_blob->data;
+    } else if ((node->value = db_strdup(arg_value, strlen(arg_value))) == 0) {
+        return -1;
+    }
+    return 1;
+}
+
+/* Reads a node's evicted value back from the log into a new blob. */
+static blob_t *node_load_spilled(node_t *node) {
+    blob_t *blob = db_blob_alloc(node->spill_len);
+    if (blob != 0 && tier_load(node->spill - 1, blob->data, blob->len) < 0) {
+        db_blob_put(blob);
+        blob = 0;
+    }
+    return blob;
+}
+
+/*
+ * Whether 'q' can answer with the len bytes of an 'A' value: they must fit
+ * in a reply line, like any value 'a' could have stored, and hold no line
+ * break or NUL to cut it short. The tree, the tier log and the run files all
+ * answer the same way.
+ */
+static int value_fits_line(const char *data, size_t len) {
+    return len <= MAXLEN && memchr(data, '\n', len) == 0 &&
+           memchr(data, '\0', len) == 0;
+}
+
+/*
+ * Enters the database as an add or remove. A range delete takes the writer
+ * lock for writing, so it waits for these to finish (see db_remove_range()).
+ */
+static inline void db_writer_enter(db_namespace_t *ns) {
     int err;
-    node_t *target;
-    // lock the head
-    if ((err = pthread_rwlock_rdlock(&head.rwl)) != 0) {
+    if ((err = pthread_rwlock_rdlock(&ns->writers)) != 0) {
         handle_error_en(err, "pthread_rwlock_rdlock");
     }
-    target = search(name, &head, 0, l_read);
+}
 
-    if (target == 0) {
-        snprintf(result, len, "not found");
+/* Leaves the database after db_writer_enter(). */
+static inline void db_writer_leave(db_namespace_t *ns) {
+    int err;
+    if ((err = pthread_rwlock_unlock(&ns->writers)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
 
-        return;
+/* Records a read of the node for the tiering sweep. */
+static inline void node_touch(node_t *node) {
+    // several readers may store this at once under the read lock
+    if (tier_enabled()) __atomic_store_n(&node->hot, 1, __ATOMIC_RELAXED);
+}
+
+/* Turns a node into a tombstone, freeing its value. */
+static void node_bury(node_t *node) {
+    if (node->blob != 0) {
+        db_blob_put(node->blob);
     } else {
-        snprintf(result, len, "%s", target->value);
-        // unlock the target
-        if ((err = pthread_rwlock_unlock(&target->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
+        db_strfree(node->value);
+    }
+    node->blob = 0;
+    node->value = 0;
+}
+
+static inline size_t node_size(node_t *node) {
+    return node != 0 ? __atomic_load_n(&node->size, __ATOMIC_RELAXED) : 0;
+}
+
+static inline void node_resize(node_t *node, long delta) {
+    __atomic_add_fetch(&node->size, delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * search() with write locks, for a change of delta keys under the target's
+ * parent: adds delta to the size of every node it locks, the root and the
+ * target included, since a sampler may be reading them. If the change does
+ * not happen after all, db_unresize() takes it back. delta is 0 when sizes
+ * are not kept, and then no size is touched.
+ */
+static node_t *search_resize(char *name, node_t *parent, node_t **parentpp,
+                             long delta) {
+    node_t *next;
+    size_t depth = 0;
+    if (delta != 0) node_resize(parent, delta);
+    while (1) {
+        next = strcmp(name, parent->name) < 0 ? parent->lchild : parent->rchild;
+        if (next == 0) break;
+        lock(l_write, &next->rwl);
+        depth++;
+        if (delta != 0) node_resize(next, delta);
+        if (strcmp(name, next->name) == 0) break;
+        unlock(&parent->rwl);
+        parent = next;
+    }
+    *parentpp = parent;
+    note_depth(depth);
+    return next;
+}
+
+/*
+ * Undoes search_resize() along the path to name once the caller has let go
+ * of its locks. Read locks do, since sizes only change with atomics. If the
+ * path changed in between, a few sizes stay off by delta, which only skews
+ * sampling slightly.
+ */
+static void db_unresize(char *name, node_t *root, long delta) {
+    node_t *node = root;
+    node_t *next;
+    lock(l_read, &root->rwl);
+    node_resize(root, -delta);
+    while ((next = strcmp(name, node->name) < 0 ? node->lchild
+                                                : node->rchild) != 0) {
+        lock(l_read, &next->rwl);
+        node_resize(next, -delta);
+        unlock(&node->rwl);
+        node = next;
+        if (strcmp(name, node->name) == 0) break;
+    }
+    unlock(&node->rwl);
+}
+
+void db_query(char *name, char *result, int len) {
+    node_t *target;
+    blob_t *blob;
+    node_t *root = cur_ns->root;
+    if (hot_enabled()) hot_record(name);
+    stats_add(cur_ns->queries, 1);
+    if (lsm_enabled()) lsm_enter();
+    // lock the head
+    lock(l_read, &root->rwl);
+    target = search(name, root, 0, l_read);
+
+    if (target == 0) {
+        // not in the memtable, but it may be in a run file
+        if (lsm_enabled() && lsm_get(name, &blob) > 0) {
+            if (!value_fits_line(blob->data, blob->len)) {
+                snprintf(result, len, "value too large, use Q");
+            } else {
+                snprintf(result, len, "%s", blob->data);
+            }
+            db_blob_put(blob);
+        } else {
+            snprintf(result, len, "not found");
         }
+    } else {
+        node_touch(target);
+        if (target->blob != 0 &&
+            value_fits_line(target->blob->data, target->blob->len)) {
+            // a short 'A' value answers like an 'a' one
+            snprintf(result, len, "%s", target->blob->data);
+        } else if (target->blob != 0 ||
+                   (target->spill != 0 && target->spill_len > MAXLEN)) {
+            // large values only fit through the 'Q' command
+            snprintf(result, len, "value too large, use Q");
+        } else if (target->spill != 0) {
+            // read the evicted value straight into the response
+            char buf[MAXLEN + 1];
+            size_t vlen = target->spill_len;
+            if (tier_load(target->spill - 1, buf, vlen) < 0) {
+                snprintf(result, len, "read error");
+            } else if (target->spill_blob && !value_fits_line(buf, vlen)) {
+                snprintf(result, len, "value too large, use Q");
+            } else {
+                buf[vlen] = '\0';
+                snprintf(result, len, "%s", buf);
+            }
+        } else if (NODE_IS_TOMBSTONE(target)) {
+            snprintf(result, len, "not found");
+        } else {
+            snprintf(result, len, "%s", target->value);
+        }
+        // unlock the target
+        unlock(&target->rwl);
+    }
+    if (lsm_enabled()) lsm_leave();
+}
 
-        return;
+blob_t *db_query_blob(char *name) {
+    node_t *target;
+    blob_t *blob = 0;
+    node_t *root = cur_ns->root;
+    if (hot_enabled()) hot_record(name);
+    stats_add(cur_ns->queries, 1);
+    if (lsm_enabled()) lsm_enter();
+    // lock the head
+    lock(l_read, &root->rwl);
+    if ((target = search(name, root, 0, l_read)) == 0) {
+        if (lsm_enabled() && lsm_get(name, &blob) <= 0) blob = 0;
+        if (lsm_enabled()) lsm_leave();
+        return blob;
+    }
+    node_touch(target);
+    if (NODE_IS_TOMBSTONE(target)) {
+        blob = 0;
+    } else if (target->spill != 0) {
+        blob = node_load_spilled(target);
+    } else if (target->blob != 0) {
+        // take a reference so the caller can send it without the lock
+        blob = target->blob;
+        __atomic_add_fetch(&blob->refs, 1, __ATOMIC_RELAXED);
+    } else if ((blob = db_blob_alloc(strlen(target->value))) != 0) {
+        memcpy(blob->data, target->value, blob->len);
     }
+    // unlock the target
+    unlock(&target->rwl);
+    if (lsm_enabled()) lsm_leave();
+    return blob;
 }
 
-int db_add(char *name, char *value) {
-    // TODO: Make this thread-safe!
+/*
+ * Whether the key has a live version below the memtable. Writers ask before
+ * taking any node lock, so a run file read never stalls the tree behind the
+ * root; the answer holds until lsm_leave(), since only a flush moves keys
+ * below the memtable and it waits for every thread inside. Another insert of
+ * the same key in the meantime lands in the memtable, where search sees it.
+ */
+static int db_in_runs(char *name) {
+    blob_t *old;
+    if (lsm_get(name, &old) <= 0) return 0;
+    db_blob_put(old);
+    return 1;
+}
+
+/* Shared by db_add() and db_add_blob(): value is 0 for a blob value. */
+static int db_insert(char *name, char *value, blob_t *blob) {
     node_t *parent;
     node_t *target;
     node_t *newnode;
-    int err;
+    int ret = 1;
+    int in_runs = 0;
+    db_namespace_t *ns = cur_ns;
+    node_t *root = ns->root;
+    // the memtable's sizes are not kept, since it is never sampled
+    long delta = keep_sizes && !lsm_enabled() ? 1 : 0;
+    if (hot_enabled()) hot_record(name);
+    if (lsm_enabled()) {
+        lsm_enter();
+        in_runs = db_in_runs(name);
+    }
+    db_writer_enter(ns);
     // lock the head before search
-    if ((err = pthread_rwlock_wrlock(&head.rwl)) != 0) {
-        handle_error_en(err, "pthread_rwlock_wrlock");
+    lock(l_write, &root->rwl);
+
+    if ((target = search_resize(name, root, &parent, delta)) != 0) {
+        // a key deleted since the last flush can be added again
+        ret = NODE_IS_TOMBSTONE(target) ? node_revive(target, value, blob) : 0;
+        if (ret > 0) db_notify(db_op_add, name, value, blob);
+        // unlock the target
+        unlock(&target->rwl);
+    } else if (in_runs) {
+        // already in a run file
+        ret = 0;
+    } else if ((newnode = node_constructor(name, value, blob, 0, 0)) == 0) {
+        // out of memory, or out of arena space
+        ret = -1;
+    } else {
+        if (strcmp(name, parent->name) < 0)
+            parent->lchild = newnode;
+        else
+            parent->rchild = newnode;
+        if (lsm_enabled()) lsm_note_insert();
+        db_notify(db_op_add, name, value, blob);
     }
+    // unlock the parent
+    unlock(&parent->rwl);
+    if (ret <= 0 && delta != 0) db_unresize(name, root, delta);
+    db_writer_leave(ns);
+    if (lsm_enabled()) lsm_leave();
 
-    if ((target = search(name, &head, &parent, l_write)) != 0) {
-        // unlock the target is not found
-        if ((err = pthread_rwlock_unlock(&target->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
-        // unlock the parent
-        if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+    return (ret);
+}
 
-        return (0);
-    }
+int db_add(char *name, char *value) { return db_insert(name, value, 0); }
 
-    newnode = node_constructor(name, value, 0, 0);
+int db_add_blob(char *name, blob_t *blob) { return db_insert(name, 0, blob); }
 
-    if (strcmp(name, parent->name) < 0)
-        parent->lchild = newnode;
-    else
-        parent->rchild = newnode;
-    // unlock the parent
-    if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-        handle_error_en(err, "pthread_rwlock_unlock");
+/*
+ * db_remove() in LSM mode: the key is buried in the memtable rather than
+ * unlinked, since older versions of it may be in the run files.
+ */
+static int db_remove_lsm(char *name) {
+    node_t *parent;
+    node_t *dnode;
+    int ret = 1;
+
+    lsm_enter();
+    int in_runs = db_in_runs(name);
+    lock(l_write, &head.rwl);
+    if ((dnode = search(name, &head, &parent, l_write)) != 0) {
+        if (NODE_IS_TOMBSTONE(dnode)) {
+            ret = 0;
+        } else {
+            node_bury(dnode);
+            db_notify(db_op_remove, name, 0, 0);
+        }
+        unlock(&dnode->rwl);
+    } else if (in_runs) {
+        if ((dnode = node_constructor(name, 0, 0, 0, 0)) == 0) {
+            ret = -1;
+        } else {
+            if (strcmp(name, parent->name) < 0)
+                parent->lchild = dnode;
+            else
+                parent->rchild = dnode;
+            lsm_note_insert();
+            db_notify(db_op_remove, name, 0, 0);
+        }
+    } else {
+        ret = 0;
     }
-
-    return (1);
+    unlock(&parent->rwl);
+    lsm_leave();
+    return ret;
 }
 
 int db_remove(char *name) {
     node_t *parent;
     node_t *dnode;
     node_t *next;
-    int err;
+    db_namespace_t *ns = cur_ns;
+    node_t *root = ns->root;
 
-    if ((err = pthread_rwlock_wrlock(&head.rwl)) != 0) {
-        handle_error_en(err, "pthread_rwlock_wrlock");
-    }
+    if (hot_enabled()) hot_record(name);
+    // only the default database is kept in run files
+    if (lsm_enabled()) return db_remove_lsm(name);
+
+    long delta = keep_sizes ? -1 : 0;
+    db_writer_enter(ns);
+    lock(l_write, &root->rwl);
 
     // first, find the node to be removed
-    if ((dnode = search(name, &head, &parent, l_write)) == 0) {
+    if ((dnode = search_resize(name, root, &parent, delta)) == 0) {
         // it's not there
         // unlock the parent
-        if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&parent->rwl);
+        if (delta != 0) db_unresize(name, root, delta);
+        db_writer_leave(ns);
 
         return (0);
     }
+    db_notify(db_op_remove, name, 0, 0);
 
     // We found it, if the node has no
     // right child, then we can merely replace its parent's pointer to
@@ -172,13 +641,9 @@ int db_remove(char *name) {
         else
             parent->rchild = dnode->lchild;
         // unlock the parent
-        if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&parent->rwl);
         // unlock the node to be deleted
-        if ((err = pthread_rwlock_unlock(&dnode->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&dnode->rwl);
         // done with dnode
         node_destructor(dnode);
     } else if (dnode->lchild == 0) {
@@ -191,13 +656,9 @@ int db_remove(char *name) {
             parent->rchild = dnode->rchild;
 
         // unlock the parent
-        if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&parent->rwl);
         // unlock the node to be deleted
-        if ((err = pthread_rwlock_unlock(&dnode->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&dnode->rwl);
         // done with dnode
         node_destructor(dnode);
     } else {
@@ -209,64 +670,348 @@ int db_remove(char *name) {
         next = dnode->rchild;
         node_t **pnext = &dnode->rchild;
         // lock the right child of the node to be deleted
-        if ((err = pthread_rwlock_wrlock(&next->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_wrlock");
-        }
+        lock(l_write, &next->rwl);
+        // every node down to the one that goes loses a key below it
+        node_resize(next, -1);
         while (next->lchild != 0) {
             // work our way down the lchild chain, finding the smallest node
             // in the subtree.
             // lock the left child
-            if ((err = pthread_rwlock_wrlock(&next->lchild->rwl)) != 0) {
-                handle_error_en(err, "pthread_rwlock_wrlock");
-            }
+            lock(l_write, &next->lchild->rwl);
             node_t *nextl = next->lchild;
+            node_resize(nextl, -1);
             pnext = &next->lchild;
             // unlock the next before moving to the next iteration
-            if ((err = pthread_rwlock_unlock(&next->rwl)) != 0) {
-                handle_error_en(err, "pthread_rwlock_unlock");
-            }
+            unlock(&next->rwl);
             next = nextl;
         }
 
-        dnode->name = realloc(dnode->name, strlen(next->name) + 1);
-        dnode->value = realloc(dnode->value, strlen(next->value) + 1);
-
-        snprintf(dnode->name, MAXLEN, "%s", next->name);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
+        // move next's strings into dnode; next takes dnode's old strings
+        // with it when it is destroyed
+        char *old_name = dnode->name;
+        char *old_value = dnode->value;
+        blob_t *old_blob = dnode->blob;
+        uint64_t old_spill = dnode->spill;
+        uint32_t old_spill_len = dnode->spill_len;
+        dnode->name = next->name;
+        dnode->value = next->value;
+        dnode->blob = next->blob;
+        dnode->spill = next->spill;
+        dnode->spill_len = next->spill_len;
+        dnode->spill_blob = next->spill_blob;
+        dnode->hot = next->hot;
+        next->name = old_name;
+        next->value = old_value;
+        next->blob = old_blob;
+        next->spill = old_spill;
+        next->spill_len = old_spill_len;
         *pnext = next->rchild;
         // unlock the next
-        if ((err = pthread_rwlock_unlock(&next->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&next->rwl);
         // unlock the node to be deleted
-        if ((err = pthread_rwlock_unlock(&dnode->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&dnode->rwl);
         // unlock the parent
-        if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&parent->rwl);
 
         node_destructor(next);
     }
+    db_writer_leave(ns);
 
     return (1);
 }
 
-node_t *search(char *name, node_t *parent, node_t **parentpp,
-               enum locktype lt) {
-    // Search the tree, starting at parent, for a node containing
-    // name (the "target node").  Return a pointer to the node,
-    // if found, otherwise return 0.  If parentpp is not 0, then it points
-    // to a location at which the address of the parent of the target node
-    // is stored.  If the target node is not found, the location pointed to
-    // by parentpp is set to what would be the the address of the parent of
-    // the target node, if it were there.
-    //
+/*
+ * Subtrees cut out by db_remove_range(), waiting for the reclaim thread to
+ * free them, so that a range delete only holds locks while relinking.
+ */
+typedef struct db_reclaim {
+    node_t *root;
+    db_namespace_t *ns;  // whose removes the freed keys are counted in
+    struct db_reclaim *next;
+} db_reclaim_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    db_reclaim_t *queue;
+    int started;
+    int stop;
+    pthread_t thread;
+} reclaim = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+             .cond = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Frees a tree that is no longer reachable from any root, returning how many
+ * nodes it had. Threads that were already inside it when it was cut out may
+ * still be walking down, so each node is write locked before its children
+ * are read; nobody can reach a node but through its parent, so once we hold
+ * it, nobody waits for it and everyone who passed it is further down. Rotates
+ * left children up rather than keeping a stack, since a tree built from
+ * sorted keys can be as deep as it is large.
+ */
+static size_t db_reclaim_tree(node_t *node) {
+    size_t count = 0;
+    node_t *left;
+    if (node != 0) lock(l_write, &node->rwl);
+    while (node != 0) {
+        if ((left = node->lchild) != 0) {
+            lock(l_write, &left->rwl);
+            node->lchild = left->rchild;
+            left->rchild = node;
+            unlock(&node->rwl);
+            node = left;
+        } else {
+            node_t *right = node->rchild;
+            unlock(&node->rwl);
+            node_destructor(node);
+            count++;
+            if ((node = right) != 0) lock(l_write, &node->rwl);
+        }
+    }
+    return count;
+}
+
+static void *db_reclaim_thread(void *arg) {
+    db_reclaim_t *item;
+    int err;
+    (void)arg;
+    if ((err = pthread_mutex_lock(&reclaim.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    while (1) {
+        while (reclaim.queue == 0 && !reclaim.stop) {
+            if ((err = pthread_cond_wait(&reclaim.cond, &reclaim.mutex)) != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+        }
+        // the queue is emptied before stopping
+        if ((item = reclaim.queue) == 0) break;
+        reclaim.queue = item->next;
+        if ((err = pthread_mutex_unlock(&reclaim.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        stats_add(item->ns->removes, db_reclaim_tree(item->root));
+        free(item);
+        if ((err = pthread_mutex_lock(&reclaim.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+    }
+    if ((err = pthread_mutex_unlock(&reclaim.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return 0;
+}
+
+/*
+ * Hands a cut out tree to the reclaim thread, starting it the first time. If
+ * that fails the tree is freed by the calling thread instead.
+ */
+static void db_reclaim_queue(node_t *root) {
+    db_reclaim_t *item;
+    int err;
+    if ((item = malloc(sizeof(db_reclaim_t))) != 0) {
+        item->root = root;
+        item->ns = cur_ns;
+        if ((err = pthread_mutex_lock(&reclaim.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        if (!reclaim.started &&
+            pthread_create(&reclaim.thread, 0, db_reclaim_thread, 0) == 0) {
+            reclaim.started = 1;
+        }
+        if (reclaim.started) {
+            item->next = reclaim.queue;
+            reclaim.queue = item;
+            if ((err = pthread_cond_signal(&reclaim.cond)) != 0) {
+                handle_error_en(err, "pthread_cond_signal");
+            }
+        }
+        if ((err = pthread_mutex_unlock(&reclaim.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (reclaim.started) return;
+        free(item);
+    }
+    stats_add(cur_ns->removes, db_reclaim_tree(root));
+}
+
+/* Frees everything queued for reclaiming and stops the reclaim thread. */
+static void db_reclaim_stop(void) {
+    int err;
+    if (!reclaim.started) return;
+    if ((err = pthread_mutex_lock(&reclaim.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    reclaim.stop = 1;
+    if ((err = pthread_cond_signal(&reclaim.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    if ((err = pthread_mutex_unlock(&reclaim.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_join(reclaim.thread, 0)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    reclaim.started = reclaim.stop = 0;
+}
+
+/*
+ * Cuts the keys of a range out of the subtree hanging from *slot, keeping
+ * those below bound if below is set and those above it otherwise. The
+ * subtree hangs from the range's side of the bound, so whichever node on
+ * the path is in the range, so is all of its subtree on that side: it is cut
+ * out whole and replaced by its other subtree, which takes O(depth) link
+ * changes. The nodes cut out are chained into *garbage through the child
+ * pointer that freed up. The nodes kept are left write locked, for
+ * db_spine_unlock(); they form the spine of what is left, from *slot down to
+ * the node returned (0 if none).
+ */
+static node_t *db_trim(node_t **slot, const char *bound, int below,
+                       node_t **garbage) {
+    node_t *last = 0;
+    node_t *node;
+    while ((node = *slot) != 0) {
+        lock(l_write, &node->rwl);
+        int cmp = strcmp(node->name, bound);
+        if (below ? cmp < 0 : cmp > 0) {
+            // it stays, with its subtree away from the range
+            last = node;
+            slot = below ? &node->rchild : &node->lchild;
+        } else {
+            node_t **other = below ? &node->lchild : &node->rchild;
+            *slot = *other;
+            *other = *garbage;
+            *garbage = node;
+            unlock(&node->rwl);
+        }
+    }
+    return last;
+}
 
+/*
+ * Returns how many keys are left in a spine kept by db_trim(), from node
+ * down to last, with extra keys to be hung below last.
+ */
+static size_t db_spine_size(node_t *node, node_t *last, int below,
+                            size_t extra) {
+    size_t size = extra;
+    while (1) {
+        // each node on the spine, and its subtree away from the range
+        size += 1 + node_size(below ? node->lchild : node->rchild);
+        if (node == last) return size;
+        node = below ? node->rchild : node->lchild;
+    }
+}
+
+/* Stores the new sizes along a spine kept by db_trim() and unlocks it. */
+static void db_spine_unlock(node_t *node, node_t *last, int below,
+                            size_t size) {
+    while (1) {
+        node_t *next = below ? node->rchild : node->lchild;
+        node_t *away = below ? node->lchild : node->rchild;
+        __atomic_store_n(&node->size, size, __ATOMIC_RELAXED);
+        size -= 1 + node_size(away);
+        unlock(&node->rwl);
+        if (node == last) return;
+        node = next;
+    }
+}
+
+int db_remove_range(const char *lo, const char *hi) {
+    db_namespace_t *ns = cur_ns;
+    node_t *root = ns->root;
+    node_t *parent = root;
+    node_t *node;
+    node_t *garbage = 0;
+    int err;
+
+    // older versions of the keys may be in the run files
+    if (lsm_enabled()) return -1;
+    if (strcmp(lo, hi) > 0) return 0;
+
+    // wait for the adds and removes under way and hold off new ones: none
+    // is left inside a subtree that is cut out, to change keys nobody can
+    // reach and report them after the range, and none is reported between
+    // the cut and the change below. Readers carry on.
+    if ((err = pthread_rwlock_wrlock(&ns->writers)) != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+    // find the highest node in the range; all the others are below it
+    lock(l_write, &root->rwl);
+    while (1) {
+        node = strcmp(lo, parent->name) < 0 ? parent->lchild : parent->rchild;
+        if (node == 0) break;
+        lock(l_write, &node->rwl);
+        if (strcmp(node->name, lo) >= 0 && strcmp(node->name, hi) <= 0) break;
+        unlock(&parent->rwl);
+        parent = node;
+    }
+
+    size_t removed = 0;
+    if (node != 0) {
+        node_t *left_end = db_trim(&node->lchild, lo, 1, &garbage);
+        node_t *right_end = db_trim(&node->rchild, hi, 0, &garbage);
+        size_t right = 0;
+        size_t left;
+        if (right_end != 0) {
+            right = db_spine_size(node->rchild, right_end, 0, 0);
+            db_spine_unlock(node->rchild, right_end, 0, right);
+        }
+        // what is left below node is outside the range; join the two sides
+        // by hanging the right one off the largest key of the left one,
+        // which ends its spine
+        node_t *joined = node->lchild != 0 ? node->lchild : node->rchild;
+        if (left_end != 0) {
+            left_end->rchild = node->rchild;
+            left = db_spine_size(node->lchild, left_end, 1, right);
+            db_spine_unlock(node->lchild, left_end, 1, left);
+        } else {
+            left = right;
+        }
+        if (strcmp(node->name, parent->name) < 0)
+            parent->lchild = joined;
+        else
+            parent->rchild = joined;
+        removed = node_size(node) - left;
+        node->lchild = garbage;
+        node->rchild = 0;
+        unlock(&node->rwl);
+        // under the parent's lock like every change, so no query sees the
+        // keys gone before the observers (the value index) have heard
+        db_notify(db_op_remove_range, lo, hi, 0);
+        unlock(&parent->rwl);
+    } else {
+        unlock(&parent->rwl);
+    }
+
+    // the sizes on the path down to parent counted the keys removed. Nobody
+    // else moves that path meanwhile, and sizes are atomic, so read locks do.
+    if (keep_sizes && removed > 0) {
+        node_t *up = root;
+        lock(l_read, &up->rwl);
+        while (1) {
+            node_resize(up, -(long)removed);
+            if (up == parent) break;
+            node_t *next = strcmp(lo, up->name) < 0 ? up->lchild : up->rchild;
+            lock(l_read, &next->rwl);
+            unlock(&up->rwl);
+            up = next;
+        }
+        unlock(&up->rwl);
+    }
+    if ((err = pthread_rwlock_unlock(&ns->writers)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    if (node == 0) return 0;
+    db_reclaim_queue(node);
+    return 1;
+}
+
+/* search(), depth levels below where it started. */
+static node_t *search_from(char *name, node_t *parent, node_t **parentpp,
+                           enum locktype lt, size_t depth) {
     node_t *next;
     node_t *result;
-    int err;
 
     if (strcmp(name, parent->name) < 0) {
         next = parent->lchild;
@@ -279,28 +1024,39 @@ node_t *search(char *name, node_t *parent, node_t **parentpp,
     } else {
         // lock the next node
         lock(lt, &next->rwl);
+        depth++;
         if (strcmp(name, next->name) == 0) {
             result = next;
         } else {
             // unlock the parent
-            if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-                handle_error_en(err, "pthread_rwlock_unlock");
-            }
-            return search(name, next, parentpp, lt);
+            unlock(&parent->rwl);
+            return search_from(name, next, parentpp, lt, depth);
         }
     }
+    note_depth(depth);
 
     if (parentpp != NULL) {
         *parentpp = parent;
     } else {
         // unlock the parent
-        if ((err = pthread_rwlock_unlock(&parent->rwl)) != 0) {
-            handle_error_en(err, "pthread_rwlock_unlock");
-        }
+        unlock(&parent->rwl);
     }
     return result;
 }
 
+node_t *search(char *name, node_t *parent, node_t **parentpp,
+               enum locktype lt) {
+    // Search the tree, starting at parent, for a node containing
+    // name (the "target node").  Return a pointer to the node,
+    // if found, otherwise return 0.  If parentpp is not 0, then it points
+    // to a location at which the address of the parent of the target node
+    // is stored.  If the target node is not found, the location pointed to
+    // by parentpp is set to what would be the the address of the parent of
+    // the target node, if it were there.
+    //
+    return search_from(name, parent, parentpp, lt, 0);
+}
+
 static inline void print_spaces(int lvl, FILE *out) {
     for (int i = 0; i < lvl; i++) {
         fprintf(out, " ");
@@ -311,7 +1067,6 @@ static inline void print_spaces(int lvl, FILE *out) {
 void db_print_recurs(node_t *node, int lvl, FILE *out) {
     // print spaces to differentiate levels
     print_spaces(lvl, out);
-    int err;
     // print out the current node
 
     if (node == NULL) {
@@ -319,26 +1074,37 @@ void db_print_recurs(node_t *node, int lvl, FILE *out) {
         return;
     }
 
-    if ((err = pthread_rwlock_rdlock(&node->rwl)) != 0) {
-        handle_error_en(err, "pthread_rwlock_rdlock");
-    }
+    lock(l_read, &node->rwl);
     if (node == &head) {
         fprintf(out, "(root)\n");
 
     } else {
-        fprintf(out, "%s %s\n", node->name, node->value);
+        const char *shown = node->value;
+        if (node->blob != 0) {
+            shown = "(large value)";
+        } else if (node->spill != 0) {
+            shown = "(on disk)";
+        } else if (NODE_IS_TOMBSTONE(node)) {
+            shown = "(deleted)";
+        }
+        fprintf(out, "%s %s\n", node->name, shown);
     }
     db_print_recurs(node->lchild, lvl + 1, out);
     db_print_recurs(node->rchild, lvl + 1, out);
-    if ((err = pthread_rwlock_unlock(&node->rwl)) != 0) {
-        handle_error_en(err, "pthread_rwlock_unlock");
-    }
+    unlock(&node->rwl);
+}
+
+/* Prints the tree, keeping the memtable from being flushed meanwhile. */
+static void db_print_tree(FILE *out) {
+    if (lsm_enabled()) lsm_enter();
+    db_print_recurs(&head, 0, out);
+    if (lsm_enabled()) lsm_leave();
 }
 
 int db_print(char *filename) {
     FILE *out;
     if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
+        db_print_tree(stdout);
 
         return 0;
     }
@@ -348,7 +1114,7 @@ int db_print(char *filename) {
     }
 
     if (*filename == '\0') {
-        db_print_recurs(&head, 0, stdout);
+        db_print_tree(stdout);
         pthread_rwlock_unlock(&head.rwl);
         return 0;
     }
@@ -358,13 +1124,310 @@ int db_print(char *filename) {
         return -1;
     }
 
-    db_print_recurs(&head, 0, out);
+    db_print_tree(out);
     fclose(out);
     pthread_rwlock_unlock(&head.rwl);
 
     return 0;
 }
 
+/*
+ * Copies the smallest key greater than last (or equal to it, if inclusive is
+ * set) into next, descending hand over hand with read locks. Returns 0 if
+ * there is no such key.
+ */
+static int db_next_key(const char *last, char *next, int inclusive) {
+    node_t *node = &head;
+    node_t *child;
+    int found = 0;
+    lock(l_read, &head.rwl);
+    while (1) {
+        int cmp = node != &head ? strcmp(node->name, last) : -1;
+        if (cmp > 0 || (inclusive && cmp == 0)) {
+            strcpy(next, node->name);
+            found = 1;
+            child = node->lchild;
+        } else {
+            child = node->rchild;
+        }
+        if (child == 0) break;
+        lock(l_read, &child->rwl);
+        unlock(&node->rwl);
+        node = child;
+    }
+    unlock(&node->rwl);
+    return found;
+}
+
+/*
+ * Writes the node's key and value to out as a db_dump() record. Deleted keys
+ * are skipped. The caller holds the node's lock.
+ */
+static int db_write_record(node_t *node, FILE *out) {
+    int ret = 0;
+    if (NODE_IS_TOMBSTONE(node)) {
+        // nothing to write for a deleted key
+    } else if (node->blob != 0 || node->spill != 0) {
+        // evicted values are read back from the log for the dump
+        blob_t *blob = node->blob;
+        if (blob == 0) {
+            blob = node_load_spilled(node);
+        } else {
+            __atomic_add_fetch(&blob->refs, 1, __ATOMIC_RELAXED);
+        }
+        if (blob == 0) {
+            ret = -1;
+        } else if (node->blob == 0 && !node->spill_blob) {
+            if (fprintf(out, "%s %s\n", node->name, blob->data) < 0) ret = -1;
+        } else if (fprintf(out, "A %s %zu\n", node->name, blob->len) < 0 ||
+                   fwrite(blob->data, 1, blob->len, out) != blob->len ||
+                   fputc('\n', out) == EOF) {
+            ret = -1;
+        }
+        if (blob != 0) db_blob_put(blob);
+    } else if (fprintf(out, "%s %s\n", node->name, node->value) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* helper function for db_dump, a pre-order walk like db_print_recurs */
+int db_dump_recurs(node_t *node, FILE *out) {
+    int ret = 0;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    lock(l_read, &node->rwl);
+    if (node != &head) ret = db_write_record(node, out);
+    if (ret == 0) ret = db_dump_recurs(node->lchild, out);
+    if (ret == 0) ret = db_dump_recurs(node->rchild, out);
+    unlock(&node->rwl);
+    return ret;
+}
+
+int db_dump(FILE *out) {
+    int ret;
+    if (lsm_enabled()) lsm_enter();
+    ret = db_dump_recurs(&head, out);
+    if (lsm_enabled()) lsm_leave();
+    if (ret < 0 || fflush(out) == EOF) {
+        return -1;
+    }
+    return 0;
+}
+
+int db_dump_range(const char *lo, const char *hi,
+                  FILE *(*pick)(const char *name, void *arg), void *arg) {
+    char last[MAXLEN + 1];
+    char next[MAXLEN + 1];
+    node_t *node;
+    FILE *out;
+    int stop = 0;
+    int ret = 0;
+
+    snprintf(last, sizeof(last), "%s", lo);
+    // one key at a time, like the tiering sweep
+    for (int first = 1; ret == 0 && !stop && db_next_key(last, next, first) &&
+                        (hi == 0 || strcmp(next, hi) < 0);
+         first = 0) {
+        lock(l_read, &head.rwl);
+        if ((node = search(next, &head, 0, l_read)) != 0) {
+            if (!NODE_IS_TOMBSTONE(node)) {
+                if ((out = pick(next, arg)) != 0) {
+                    ret = db_write_record(node, out);
+                } else {
+                    stop = 1;
+                }
+            }
+            unlock(&node->rwl);
+        }
+        strcpy(last, next);
+    }
+    return ret;
+}
+
+int db_clear(void) {
+    char last[MAXLEN + 1] = "";
+    char next[MAXLEN + 1];
+    int count = 0;
+    int ret;
+    // one key at a time, so readers are never locked out for long
+    for (int first = 1; db_next_key(last, next, first); first = 0) {
+        if ((ret = db_remove(next)) < 0) return -1;
+        count += ret;
+        strcpy(last, next);
+    }
+    return count;
+}
+
+int db_remove_each(const char *lo, const char *hi,
+                   int (*match)(const char *name, void *arg), void *arg) {
+    char last[MAXLEN + 1];
+    char next[MAXLEN + 1];
+    int count = 0;
+    int ret;
+    snprintf(last, sizeof(last), "%s", lo);
+    for (int first = 1; db_next_key(last, next, first) && strcmp(next, hi) <= 0;
+         first = 0) {
+        if (match(next, arg)) {
+            if ((ret = db_remove(next)) < 0) return -1;
+            count += ret;
+        }
+        strcpy(last, next);
+    }
+    return count;
+}
+
+/* A per-thread xorshift generator for db_sample(), seeded on first use. */
+static uint64_t db_random(void) {
+    static __thread uint64_t state = 0;
+    if (state == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        // the address of state tells threads that start together apart
+        state =
+            ((now.tv_sec * 1000000000ULL + now.tv_nsec) ^ (uintptr_t)&state) |
+            1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/*
+ * Writes the key of the given rank below root to out, descending hand over
+ * hand with read locks and steering by the subtree sizes. Returns 1, or 0
+ * if the tree changed so that there is no such key any more.
+ */
+static int db_sample_one(node_t *root, size_t rank, FILE *out) {
+    node_t *node = root;
+    node_t *next;
+    int found = 0;
+    while (1) {
+        size_t left = node_size(node->lchild);
+        // the root holds no key
+        size_t here = node != root;
+        if (rank < left) {
+            next = node->lchild;
+        } else if (rank < left + here) {
+            found = fprintf(out, "%s\n", node->name) > 0;
+            break;
+        } else {
+            rank -= left + here;
+            next = node->rchild;
+        }
+        if (next == 0) {
+            // sizes changed under us; the last key passed will do
+            if (here) found = fprintf(out, "%s\n", node->name) > 0;
+            break;
+        }
+        lock(l_read, &next->rwl);
+        unlock(&node->rwl);
+        node = next;
+    }
+    unlock(&node->rwl);
+    return found;
+}
+
+long db_sample(size_t k, char **keys, size_t *len) {
+    node_t *root = cur_ns->root;
+    long count = 0;
+    FILE *out;
+
+    if ((out = open_memstream(keys, len)) == 0) return -1;
+    for (size_t i = 0; i < k; i++) {
+        lock(l_read, &root->rwl);
+        size_t total = node_size(root);
+        if (total == 0) {
+            unlock(&root->rwl);
+            break;
+        }
+        count += db_sample_one(root, db_random() % total, out);
+    }
+    if (fclose(out) != 0) {
+        free(*keys);
+        *keys = 0;
+        return -1;
+    }
+    return count;
+}
+
+long db_count(void) {
+    return keep_sizes && !lsm_enabled() ? (long)node_size(&head) : -1;
+}
+
+int db_use_sampling(void) {
+    size_t n = 0, cap = 1024;
+    node_t **nodes;
+    if (keep_sizes) return 0;
+    // a reattached tree (db_attach()) may have been changed without sizes:
+    // count every subtree, children before parents, by walking the nodes in
+    // reverse breadth first order
+    if ((nodes = malloc(cap * sizeof(node_t *))) == 0) return -1;
+    nodes[n++] = &head;
+    for (size_t i = 0; i < n; i++) {
+        if (n + 2 > cap) {
+            node_t **bigger = realloc(nodes, 2 * cap * sizeof(node_t *));
+            if (bigger == 0) {
+                free(nodes);
+                return -1;
+            }
+            nodes = bigger;
+            cap *= 2;
+        }
+        if (nodes[i]->lchild != 0) nodes[n++] = nodes[i]->lchild;
+        if (nodes[i]->rchild != 0) nodes[n++] = nodes[i]->rchild;
+    }
+    while (n-- > 0) {
+        // the root holds no key
+        nodes[n]->size = (nodes[n] != &head) + node_size(nodes[n]->lchild) +
+                         node_size(nodes[n]->rchild);
+    }
+    free(nodes);
+    keep_sizes = 1;
+    return 0;
+}
+
+int db_sampling(void) { return keep_sizes; }
+
+int db_load(FILE *in) {
+    char line[3 * MAXLEN + 3];
+    char name[MAXLEN];
+    char value[MAXLEN];
+    char length[MAXLEN];
+    int count = 0;
+    int ret;
+
+    while (fgets(line, sizeof(line), in) != 0) {
+        ret = sscanf(line, "%255s %255s %255s", name, value, length);
+        if (ret == 3 && strcmp(name, "A") == 0) {
+            // a large value: "A name length", then the bytes
+            blob_t *blob = db_blob_alloc(strtoul(length, 0, 10));
+            if (blob == 0 || fread(blob->data, 1, blob->len, in) != blob->len ||
+                fgetc(in) != '\n') {
+                if (blob != 0) db_blob_put(blob);
+                return -1;
+            }
+            if ((ret = db_add_blob(value, blob)) <= 0) db_blob_put(blob);
+        } else if (ret == 2) {
+            ret = db_add(name, value);
+        } else {
+            return -1;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        count += ret;
+    }
+    if (ferror(in)) {
+        return -1;
+    }
+    return count;
+}
+
 /* Recursively destroys node and all its children. */
 void db_cleanup_recurs(node_t *node) {
     if (node == NULL) {
@@ -377,15 +1440,294 @@ void db_cleanup_recurs(node_t *node) {
     node_destructor(node);
 }
 
+/* Registers the named database's counter of what. */
+static int db_namespace_counter(const char *name, const char *what) {
+    char counter[MAXLEN + 32];
+    snprintf(counter, sizeof(counter), "db.%s.%s", name, what);
+    return stats_register(counter, 1);
+}
+
+/*
+ * Returns the database called name, creating it if there is none yet, or 0
+ * if out of memory.
+ */
+static db_namespace_t *db_namespace(const char *name) {
+    db_namespace_t *ns;
+    int err;
+    if ((err = pthread_mutex_lock(&namespaces_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    for (ns = namespaces; ns != 0; ns = ns->next) {
+        if (strcmp(ns->name, name) == 0) break;
+    }
+    if (ns == 0 && (ns = calloc(1, sizeof(db_namespace_t))) != 0) {
+        if ((ns->root = calloc(1, sizeof(node_t))) == 0) {
+            free(ns);
+            ns = 0;
+        } else {
+            // a root like head, which is never freed with the tree
+            ns->root->name = ns->root->value = "";
+            if ((err = pthread_rwlock_init(&ns->root->rwl, 0)) != 0) {
+                handle_error_en(err, "pthread_rwlock_init");
+            }
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(
+                &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            if ((err = pthread_rwlock_init(&ns->writers, &attr)) != 0) {
+                handle_error_en(err, "pthread_rwlock_init");
+            }
+            pthread_rwlockattr_destroy(&attr);
+            snprintf(ns->name, sizeof(ns->name), "%s", name);
+            ns->queries = db_namespace_counter(name, "queries");
+            ns->adds = db_namespace_counter(name, "adds");
+            ns->removes = db_namespace_counter(name, "removes");
+            ns->next = default_ns.next;
+            default_ns.next = ns;
+            named_count++;
+        }
+    }
+    if ((err = pthread_mutex_unlock(&namespaces_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return ns;
+}
+
+/* Frees the named databases; their nodes too unless free_nodes is 0. */
+static void db_cleanup_namespaces(int free_nodes) {
+    db_namespace_t *ns;
+    while ((ns = default_ns.next) != 0) {
+        default_ns.next = ns->next;
+        named_count--;
+        if (free_nodes) {
+            db_cleanup_recurs(ns->root->lchild);
+            db_cleanup_recurs(ns->root->rchild);
+        }
+        pthread_rwlock_destroy(&ns->root->rwl);
+        pthread_rwlock_destroy(&ns->writers);
+        free(ns->root);
+        free(ns);
+    }
+}
+
+void db_default_only(void) { default_only = 1; }
+
+int db_named_count(void) {
+    int count;
+    int err;
+    if ((err = pthread_mutex_lock(&namespaces_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    count = named_count;
+    if ((err = pthread_mutex_unlock(&namespaces_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return count;
+}
+
 void db_cleanup() {
+    // finish freeing what range deletes cut out, while the allocators are up
+    db_reclaim_stop();
+    // flush the memtable to a last run; that also frees it
+    if (lsm_enabled()) lsm_close();
+    // the sweep must not touch nodes that are being freed
+    if (tier_enabled()) tier_close();
+    if (arena_enabled() && !arena_persistent()) {
+        // unmapping the arena frees every node and string at once
+        head.lchild = head.rchild = 0;
+        db_cleanup_namespaces(0);
+        if (intern_enabled()) intern_destroy(0);
+        arena_close(0);
+        return;
+    }
+    if (arena_enabled()) {
+        // leave the tree in the arena for the next server to reattach
+        void **roots = arena_roots();
+        roots[0] = head.lchild;
+        roots[1] = head.rchild;
+        head.lchild = head.rchild = 0;
+        arena_close(1);
+        return;
+    }
     db_cleanup_recurs(head.lchild);
     db_cleanup_recurs(head.rchild);
+    head.lchild = head.rchild = 0;
+    db_cleanup_namespaces(1);
+    if (intern_enabled()) intern_destroy(1);
+}
+
+int db_attach(const char *path, size_t size) {
+    int ret;
+    if ((ret = arena_open(path, size, DB_ARENA_TAG)) == 1) {
+        void **roots = arena_roots();
+        head.lchild = (node_t *)roots[0];
+        head.rchild = (node_t *)roots[1];
+        head.size = node_size(head.lchild) + node_size(head.rchild);
+    }
+    return ret;
+}
+
+int db_use_lsm(const char *dir, size_t memtable_keys) {
+    if (tier_enabled()) {
+        // flushes write values from memory only
+        fprintf(stderr, "LSM mode does not work with tiering\n");
+        return -1;
+    }
+    if (arena_persistent()) {
+        // the runs would go stale against a reattached memtable
+        fprintf(stderr, "LSM mode does not work with a shared database\n");
+        return -1;
+    }
+    return lsm_open(dir, memtable_keys);
+}
+
+node_t *db_detach_memtable(void) {
+    // every key sorts after the root's empty name, so lchild is always empty
+    node_t *root = head.rchild;
+    head.rchild = 0;
+    head.size = 0;
+    return root;
+}
+
+void db_free_detached(node_t *root) { db_cleanup_recurs(root); }
+
+int db_use_tiering(const char *path, long interval_ms) {
+    if (arena_persistent() || lsm_enabled()) {
+        // the log is rebuilt on every start, so it cannot back a stored tree
+        fprintf(stderr, "tiering does not work with -s or -l\n");
+        return -1;
+    }
+    // the sweep steers by subtree sizes
+    keep_sizes = 1;
+    return tier_open(path, interval_ms);
+}
+
+/* Evicts or loads back the value of one node. Holds its write lock. */
+static void db_tier_node(node_t *node, size_t *evicted, size_t *loaded) {
+    if (node->hot) {
+        node->hot = 0;
+        if (node->spill == 0) return;
+        // read since the last sweep: bring it back into memory
+        blob_t *blob = node_load_spilled(node);
+        if (blob == 0) return;
+        if (node->spill_blob) {
+            node->blob = blob;
+            node->value = blob->data;
+        } else {
+            node->value = db_strdup(blob->data, blob->len);
+            db_blob_put(blob);
+            if (node->value == 0) return;
+        }
+        tier_release(node->spill - 1, node->spill_len);
+        node->spill = 0;
+        (*loaded)++;
+    } else if (node->spill == 0 && !NODE_IS_TOMBSTONE(node)) {
+        // cold: move the value to the log
+        const char *data = node->blob != 0 ? node->blob->data : node->value;
+        size_t len = node->blob != 0 ? node->blob->len : strlen(node->value);
+        int64_t off = tier_spill(data, len);
+        if (off < 0) return;
+        node->spill = off + 1;
+        node->spill_len = len;
+        node->spill_blob = node->blob != 0;
+        if (node->blob != 0) {
+            db_blob_put(node->blob);
+        } else {
+            db_strfree(node->value);
+        }
+        node->blob = 0;
+        node->value = 0;
+        (*evicted)++;
+    }
+}
+
+/*
+ * Sweeps the keys above last in the subtree under node, whose write lock is
+ * held, in order, locking children before their parents are let go of.
+ */
+static void db_tier_subtree(node_t *node, const char *last, size_t *evicted,
+                            size_t *loaded) {
+    node_t *child;
+    int above = strcmp(node->name, last) > 0;
+    if (above && (child = node->lchild) != 0) {
+        lock(l_write, &child->rwl);
+        db_tier_subtree(child, last, evicted, loaded);
+        unlock(&child->rwl);
+    }
+    if (above) db_tier_node(node, evicted, loaded);
+    if ((child = node->rchild) != 0) {
+        lock(l_write, &child->rwl);
+        db_tier_subtree(child, last, evicted, loaded);
+        unlock(&child->rwl);
+    }
+}
+
+void db_tier_sweep(size_t *evicted, size_t *loaded) {
+    char last[MAXLEN + 1] = "";
+    char next[MAXLEN + 1];
+    node_t *node;
+    node_t *child;
+    *evicted = *loaded = 0;
+    while (1) {
+        // descend towards the key after last with read locks, like
+        // db_next_key(), and sweep the first subtree of at most
+        // TIER_SUBTREE keys on the way under its own write lock, so clients
+        // only wait for that subtree and the root is not locked per key
+        int found = 0;
+        node = &head;
+        lock(l_read, &head.rwl);
+        while (1) {
+            if (node != &head && strcmp(node->name, last) > 0) {
+                strcpy(next, node->name);
+                found = 1;
+                child = node->lchild;
+            } else {
+                child = node->rchild;
+            }
+            if (child == 0) {
+                unlock(&node->rwl);
+                break;
+            }
+            if (__atomic_load_n(&child->size, __ATOMIC_RELAXED) <=
+                TIER_SUBTREE) {
+                lock(l_write, &child->rwl);
+                unlock(&node->rwl);
+                db_tier_subtree(child, last, evicted, loaded);
+                unlock(&child->rwl);
+                break;
+            }
+            lock(l_read, &child->rwl);
+            unlock(&node->rwl);
+            node = child;
+        }
+        if (!found) break;
+        // everything between last and next has been swept, and next heads a
+        // larger subtree, so it is swept on its own
+        lock(l_write, &head.rwl);
+        if ((node = search(next, &head, 0, l_write)) != 0) {
+            db_tier_node(node, evicted, loaded);
+            unlock(&node->rwl);
+        }
+        strcpy(last, next);
+    }
+}
+
+int db_use_hugepages(size_t size) { return arena_open_huge(size); }
+
+int db_use_interning(size_t nbuckets) {
+    if (arena_persistent()) {
+        // the table itself lives on the heap and would not be reattached
+        fprintf(stderr, "interning does not work with a shared database\n");
+        return -1;
+    }
+    return intern_init(nbuckets, db_alloc, db_free);
 }
 
 void interpret_command(char *command, char *response, int len) {
     char value[MAXLEN];
     char ibuf[MAXLEN];
     char name[MAXLEN];
+    db_namespace_t *ns;
     int sscanf_ret;
 
     if (strlen(command) <= 1) {
@@ -416,8 +1758,10 @@ void interpret_command(char *command, char *response, int len) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            if (db_add(name, value)) {
+            if ((sscanf_ret = db_add(name, value)) > 0) {
                 snprintf(response, len, "added");
+            } else if (sscanf_ret < 0) {
+                snprintf(response, len, "out of memory");
             } else {
                 snprintf(response, len, "already in database");
             }
@@ -431,14 +1775,59 @@ void interpret_command(char *command, char *response, int len) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            if (db_remove(name)) {
+            if ((sscanf_ret = db_remove(name)) > 0) {
                 snprintf(response, len, "removed");
+            } else if (sscanf_ret < 0) {
+                snprintf(response, len, "out of memory");
             } else {
                 snprintf(response, len, "not in database");
             }
 
             return;
 
+        case 'D':
+            // Delete every key from the first name to the second
+            if (sscanf(&command[1], "%255s %255s", name, value) < 2) {
+                snprintf(response, len, "ill-formed command");
+                return;
+            }
+            if ((sscanf_ret = db_remove_range(name, value)) > 0) {
+                snprintf(response, len, "range removed");
+            } else if (sscanf_ret < 0) {
+                snprintf(response, len, "not supported in LSM mode");
+            } else {
+                snprintf(response, len, "none in range");
+            }
+
+            return;
+
+        case 'n':
+            // Select a named database for this connection
+            if (sscanf(&command[1], "%255s", name) < 1) {
+                strcpy(name, default_ns.name);
+            }
+            if (strcmp(name, cur_ns->name) == 0) {
+                // already selected
+            } else if (lsm_enabled() || arena_persistent() || default_only) {
+                // run files, reattached arenas, logs, checkpoints, followers
+                // and the value index only know about head
+                snprintf(response, len, "only the default database");
+                return;
+            } else if ((ns = db_namespace(name)) == 0) {
+                snprintf(response, len, "out of memory");
+                return;
+            } else {
+                cur_ns = ns;
+            }
+            snprintf(response, len,
+                     "using %s: %llu queries, %llu adds, %llu removes",
+                     cur_ns->name,
+                     (unsigned long long)stats_sum(cur_ns->queries),
+                     (unsigned long long)stats_sum(cur_ns->adds),
+                     (unsigned long long)stats_sum(cur_ns->removes));
+
+            return;
+
         case 'f':
             // process the commands in a file (silently)
             sscanf_ret = sscanf(&command[1], "%255s", name);
@@ -453,7 +1842,12 @@ void interpret_command(char *command, char *response, int len) {
                 return;
             }
             while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-                pthread_testcancel();  // fgets is not a cancellation point
+                // stop between commands if the server is shutting down
+                if (interrupt_check != 0 && interrupt_check()) {
+                    fclose(finput);
+                    snprintf(response, len, "file interrupted");
+                    return;
+                }
                 interpret_command(ibuf, response, len);
             }
             fclose(finput);
@@ -2,15 +2,46 @@
 #define DB_H_
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// the largest value accepted by the length-prefixed 'A' command
+#define MAXVALUE (64 << 20)
+
+/*
+ * A value too large for a command line, stored out of line. Blobs are
+ * reference counted so that a response can be written straight from the
+ * stored bytes after the node lock has been dropped.
+ */
+typedef struct blob {
+    size_t refs;
+    size_t len;
+    char data[];  // len bytes followed by a '\0'
+} blob_t;
 
 typedef struct node {
     char *name;
-    char *value;
+    char *value;  // points into blob->data for large values
     struct node *lchild;
     struct node *rchild;
     pthread_rwlock_t rwl;
+    blob_t *blob;  // the value's blob, or NULL for ordinary values
+    // with tiering, an evicted value has neither value nor blob (see tier.h)
+    uint64_t spill;      // offset + 1 of the value in the log, 0 if in memory
+    uint32_t spill_len;  // its length
+    uint8_t spill_blob;  // it was a blob before it was evicted
+    uint8_t hot;         // read since the last tiering sweep
+    // keys in this subtree, for db_sample() and the tiering sweep; with
+    // db_use_sampling(), updated with atomics by every writer that passes the
+    // node, and exact whenever no change is under way
+    size_t size;
 } node_t;
 
+// In LSM mode a deleted key stays in the memtable as a node with neither a
+// value nor a blob, shadowing older versions in the run files (see lsm.h).
+#define NODE_IS_TOMBSTONE(node) \
+    ((node)->value == 0 && (node)->blob == 0 && (node)->spill == 0)
+
 extern node_t head;
 enum locktype { l_read, l_write };
 node_t *search(char *name, node_t *parent, node_t **parentp, enum locktype lt);
@@ -22,12 +53,35 @@ node_t *search(char *name, node_t *parent, node_t **parentp, enum locktype lt);
  */
 void db_query(char *name, char *result, int len);
 
+/**
+ * db_blob_alloc() returns a blob with room for len bytes and one reference,
+ * or NULL if it could not be allocated or len exceeds MAXVALUE.
+ * db_blob_put() drops a reference, freeing the blob on the last one.
+ */
+blob_t *db_blob_alloc(size_t len);
+void db_blob_put(blob_t *blob);
+
+/**
+ * db_query_blob() looks the key up like db_query() and returns its value as
+ * a blob with a reference the caller must drop with db_blob_put(), or NULL
+ * if the key is not present. Large values are returned without copying.
+ */
+blob_t *db_query_blob(char *name);
+
+/**
+ * db_add_blob() adds the key with a value held in a blob, like db_add(). On
+ * success the node takes over the caller's reference to the blob; otherwise
+ * the caller keeps it. Returns 1 on success, 0 if the key is present and -1
+ * if the node could not be allocated.
+ */
+int db_add_blob(char *name, blob_t *blob);
+
 /**
  * db_add() uses search() to determine if the given key is already in the
  * database. If the key is not in the database, the function creates a new node
  * with the given key and value and inserts this node into the database as a
- * child of the parent node returned by search(). Returns 1 on success and 0 on
- * failure
+ * child of the parent node returned by search(). Returns 1 on success, 0 if
+ * the key is already present and -1 if the node could not be allocated.
  */
 int db_add(char *name, char *value);
 
@@ -49,12 +103,49 @@ int db_add(char *name, char *value);
  */
 int db_remove(char *name);
 
+/**
+ * db_remove_range() removes every key from lo to hi inclusive. The subtrees
+ * lying entirely in the range are cut out whole, so the tree is relinked in
+ * O(depth) steps, and a background thread frees their nodes afterwards.
+ * Observers hear of it as a single db_op_remove_range change. It waits for
+ * the adds and removes under way and holds off new ones while it cuts, so no
+ * change lands in a cut out subtree or reaches the observers out of order;
+ * queries carry on, and one already inside a cut out subtree finishes there.
+ * Returns 1 if any keys were in the range, 0 if none were, and -1 under
+ * db_use_lsm(), where removed keys must be buried rather than unlinked.
+ */
+int db_remove_range(const char *lo, const char *hi);
+
+/**
+ * db_remove_each() removes the keys from lo to hi inclusive for which match
+ * returns nonzero, one at a time with db_remove(). It is how the replay
+ * threads of the write-ahead log apply a range delete to the keys they own.
+ * Returns the number of keys removed, or -1 if out of memory.
+ */
+int db_remove_each(const char *lo, const char *hi,
+                   int (*match)(const char *name, void *arg), void *arg);
+
 /**
  * The interpret_command() function gets called by the server to interpret a
  * command from a client, call database functions, and store the response.
+ * "n <name>" selects (creating it if need be) the named database that the
+ * calling thread's later commands and db_query(), db_add() and db_remove()
+ * calls use; "n" alone goes back to the default database. Only the default
+ * database is seen by observers, dumps, checkpoints and the tiering sweep.
+ * "D <lo> <hi>" removes every key from lo to hi with db_remove_range().
  */
 void interpret_command(char *command, char *response, int resp_capacity);
 
+/**
+ * db_default_only() makes "n" refuse to create named databases, for a server
+ * whose write-ahead log, checkpoints, change stream, followers or value
+ * index only cover the default one, so that no key is accepted that a
+ * restart or failover would lose. It must be called before serving.
+ * db_named_count() returns how many named databases there are.
+ */
+void db_default_only(void);
+int db_named_count(void);
+
 /**
   * The db_print() function performs a pre-order traversal of the tree, printing
   each  node's representation and then recursively printing its left and right
@@ -64,6 +155,73 @@ void interpret_command(char *command, char *response, int resp_capacity);
   */
 int db_print(char *filename);
 
+/**
+ * db_dump() writes every key and value in the database to out, one
+ * "name value" line per node, in the same pre-order as db_print(). Large
+ * values are written as an "A name length" line followed by the value's
+ * bytes and a newline, the same as the 'A' command. Loading
+ * the lines back in order with db_load() rebuilds a tree of the same shape.
+ * Returns 0 on success or -1 if writing failed.
+ */
+int db_dump(FILE *out);
+
+/**
+ * db_dump_range() walks the keys from lo up to but not including hi (or to
+ * the last key, if hi is NULL) in order, and writes each, as a db_dump()
+ * record, to the stream pick() returns for its name, stopping at the first
+ * key for which that is NULL. Nodes are locked one at a time, so each key is
+ * written as it was at some point during the call, and pick() runs under that
+ * key's lock. The streams are not flushed. Returns 0 on success or -1 if
+ * writing failed.
+ */
+int db_dump_range(const char *lo, const char *hi,
+                  FILE *(*pick)(const char *name, void *arg), void *arg);
+
+/**
+ * db_clear() removes every key, one at a time, while other threads keep using
+ * the database. It only sees the tree, so it does not clear run files under
+ * db_use_lsm(). Returns the number of keys removed, or -1 if out of memory.
+ */
+int db_clear(void);
+
+/**
+ * db_sample() picks k keys of the calling thread's database uniformly at
+ * random, with replacement. Each descends from the root to a random rank,
+ * steering by the subtree sizes, so the whole call costs O(k depth) rather
+ * than a walk of the tree. The keys are stored one per line in a malloc()ed
+ * buffer in *keys, with its length in *len. Returns how many there are,
+ * fewer than k only if the database is empty or shrinks meanwhile, or -1 if
+ * out of memory. It needs db_use_sampling(), and sizes are not kept under
+ * db_use_lsm().
+ */
+long db_sample(size_t k, char **keys, size_t *len);
+
+/**
+ * db_use_sampling() keeps the subtree sizes db_sample() steers by, counting
+ * them once for a tree that was reattached with db_attach(). Without it, and
+ * without db_use_tiering(), which keeps them too, adds and removes leave the
+ * sizes alone: they cost an atomic on every node on the way down, and a
+ * second walk to take them back when the key turns out to be present (or
+ * absent). It must be called before serving. Returns 0 on success and -1 if
+ * out of memory. db_sampling() returns nonzero if sizes are kept.
+ */
+int db_use_sampling(void);
+int db_sampling(void);
+
+/**
+ * db_count() returns the number of keys in the default database, read from
+ * the root's subtree size without taking a lock, or -1 if sizes are not kept
+ * (see db_use_sampling()) or under db_use_lsm().
+ */
+long db_count(void);
+
+/**
+ * db_load() reads the records written by db_dump() from in until EOF
+ * and adds each of them to the database. Returns the number of keys added, or
+ * -1 on a malformed line or read error.
+ */
+int db_load(FILE *in);
+
 /**
  * The db_cleanup() function frees all dynamically-allocated nodes in the
  * database. This function should be used in server.c to clean up the database
@@ -75,4 +233,110 @@ int db_print(char *filename);
  */
 void db_cleanup(void);
 
+/**
+ * db_attach() moves the database into a shared arena backed by the file at
+ * path (see arena.h), which must be called before any keys are added. If the
+ * file holds a tree left there by a server that exited cleanly, that tree is
+ * reattached in place and the function returns 1; otherwise the arena starts
+ * empty and 0 is returned. Returns -1 on error. Once attached, db_cleanup()
+ * leaves the tree in the arena instead of freeing it.
+ */
+int db_attach(const char *path, size_t size);
+
+/**
+ * db_use_hugepages() allocates nodes and strings from an anonymous arena of
+ * size bytes backed by 2MB huge pages (see arena_open_huge()), which must be
+ * called before any keys are added. Returns 1 if hugetlb pages are used, 0 if
+ * it fell back to transparent huge pages, and -1 on error.
+ */
+int db_use_hugepages(size_t size);
+
+/**
+ * db_use_interning() makes nodes share a single reference counted copy of
+ * equal keys and values (see intern.h), starting with a table of nbuckets
+ * buckets. It must be called before any keys are added, after
+ * db_use_hugepages() if both are used, and cannot be combined with
+ * db_attach(). Returns 0 on success and -1 on failure.
+ */
+int db_use_interning(size_t nbuckets);
+
+/**
+ * db_use_lsm() turns the tree into the memtable of a log-structured store
+ * kept in the directory dir (see lsm.h), flushing it to a sorted run file
+ * every memtable_keys keys. It must be called before any keys are added and
+ * cannot be combined with db_attach(). Keys in the runs are answered by
+ * db_query() and db_query_blob() as usual, but db_print() and db_dump() only
+ * see the memtable. Returns 0 on success and -1 on failure.
+ */
+int db_use_lsm(const char *dir, size_t memtable_keys);
+
+/**
+ * db_detach_memtable() unhooks the whole tree from head and returns its root
+ * (NULL if the tree is empty); db_free_detached() frees such a tree. Only
+ * lsm.c calls these, with every other memtable user locked out.
+ */
+node_t *db_detach_memtable(void);
+void db_free_detached(node_t *root);
+
+/**
+ * db_use_tiering() evicts cold values to a value log at path (see tier.h),
+ * sweeping the tree every interval_ms. It must be called before any keys are
+ * added and cannot be combined with db_attach() or db_use_lsm(). Returns 0 on
+ * success and -1 on failure.
+ */
+int db_use_tiering(const char *path, long interval_ms);
+
+/**
+ * db_tier_sweep() visits every key once, a subtree of a few dozen keys at a
+ * time under its top node's write lock, reaching each with read locks. Values
+ * read since the last sweep that are on disk are loaded back; values not read
+ * since the last sweep are evicted to the log. Reports how many of each.
+ */
+void db_tier_sweep(size_t *evicted, size_t *loaded);
+
+/**
+ * A change to the database, as passed to observers: a key was added with a
+ * value (given as value and len; large is set if the value is a blob), a
+ * key was removed (value is NULL), or every key from name to value was
+ * removed (see db_remove_range()). An observer that keeps a large value past
+ * the call takes a reference to blob instead of copying it.
+ */
+enum db_op { db_op_add, db_op_remove, db_op_remove_range };
+typedef struct db_change {
+    enum db_op op;
+    const char *name;
+    const char *value;
+    size_t len;
+    int large;
+    blob_t *blob;  // the value's blob if large, else NULL
+} db_change_t;
+
+/**
+ * db_observe() registers fn to be called with arg for every successful add
+ * and remove. It is called while the changed node's parent is still write
+ * locked, so the calls for any one key happen in the order the changes were
+ * made. Observers must be registered before clients are served and must not
+ * call back into the database. Returns 0, or -1 if there are already
+ * DB_MAX_OBSERVERS.
+ */
+#define DB_MAX_OBSERVERS 8
+int db_observe(void (*fn)(const db_change_t *change, void *arg), void *arg);
+
+/**
+ * db_lock_stats() reports how many node locks the calling thread has taken,
+ * how many levels below the root its deepest search went, and how long it
+ * spent waiting for locks that other threads held, since its last call, and
+ * starts counting again. Only a lock that is not free at once is timed, so
+ * uncontended locking never reads the clock.
+ */
+void db_lock_stats(size_t *locks, size_t *depth, uint64_t *wait_ns);
+
+/**
+ * db_set_interrupt() registers a function that interpret_command() polls
+ * between the lines of an 'f' command. When it returns nonzero the file is
+ * abandoned and "file interrupted" is reported, which lets the server drain
+ * client threads without cancelling them while they hold node locks.
+ */
+void db_set_interrupt(int (*check)(void));
+
 #endif  // DB_H_
@@ -0,0 +1,230 @@
+#include "./handoff.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Zero-downtime upgrades: passing the listening socket between servers */
+
+// sent along with the descriptor so the receiver can tell it got the right one
+#define HANDOFF_MAGIC 'H'
+// the receiver's reply once the database is loaded
+#define HANDOFF_LOADED 'L'
+// the sender's answer to that: it is shutting down, the receiver may serve
+#define HANDOFF_GO 'G'
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "handoff: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_send(const char *path, int lfd, int (*dump)(FILE *),
+                 int timeout_ms) {
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    struct timeval timeout = {timeout_ms / 1000, timeout_ms % 1000 * 1000};
+    int usock, csock, ready;
+
+    if (handoff_addr(path, &addr) < 0) return -1;
+
+    if ((usock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    // a socket file left behind by an earlier handoff would make bind fail
+    unlink(path);
+    if (bind(usock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(usock, 1) < 0) {
+        perror("handoff bind");
+        close(usock);
+        return -1;
+    }
+
+    fprintf(stderr, "waiting %d ms for new server on %s\n", timeout_ms, path);
+    // nobody may ever come, so only wait as long as allowed (an interrupted
+    // wait starts over, which a signal storm could stretch; that is fine)
+    pfd.fd = usock;
+    pfd.events = POLLIN;
+    while ((ready = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {
+    }
+    if (ready <= 0) {
+        if (ready == 0) {
+            fprintf(stderr, "handoff: no new server came\n");
+        } else {
+            perror("poll");
+        }
+        close(usock);
+        unlink(path);
+        return -1;
+    }
+    while ((csock = accept(usock, 0, 0)) < 0) {
+        if (errno != EINTR) {
+            perror("accept");
+            close(usock);
+            unlink(path);
+            return -1;
+        }
+    }
+    close(usock);
+    unlink(path);
+    // a new server that stops reading must not hold this one up forever
+    if (setsockopt(csock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) <
+        0) {
+        perror("setsockopt");
+        close(csock);
+        return -1;
+    }
+
+    // the database ends with the stream, so the receiver confirms loading it
+    // over a socket pair of its own
+    int fds[2], ctl[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) < 0) {
+        perror("socketpair");
+        close(csock);
+        return -1;
+    }
+    if (setsockopt(ctl[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) <
+        0) {
+        perror("setsockopt");
+        close(ctl[0]);
+        close(ctl[1]);
+        close(csock);
+        return -1;
+    }
+    fds[0] = lfd;
+    fds[1] = ctl[1];
+
+    // the listening socket and the receiver's end of the pair travel as
+    // ancillary data on a one byte message
+    char magic = HANDOFF_MAGIC;
+    struct iovec iov = {&magic, 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int sent = sendmsg(csock, &msg, 0);
+    close(ctl[1]);
+    if (sent != 1) {
+        perror("sendmsg");
+        close(ctl[0]);
+        close(csock);
+        return -1;
+    }
+
+    // then the database itself
+    FILE *out;
+    if (!(out = fdopen(csock, "w"))) {
+        perror("fdopen");
+        close(ctl[0]);
+        close(csock);
+        return -1;
+    }
+    int ret = dump(out);
+    if (fclose(out) == EOF) ret = -1;
+    // this server only goes once the receiver says it loaded all of it
+    char reply = 0;
+    if (ret >= 0 && (read(ctl[0], &reply, 1) != 1 || reply != HANDOFF_LOADED)) {
+        fprintf(stderr, "handoff: new server did not load the database\n");
+        ret = -1;
+    }
+    // without the go ahead the receiver exits, so only one server serves
+    reply = HANDOFF_GO;
+    if (ret >= 0 && send(ctl[0], &reply, 1, MSG_NOSIGNAL) != 1) {
+        perror("handoff send");
+        ret = -1;
+    }
+    close(ctl[0]);
+    return ret < 0 ? -1 : 0;
+}
+
+int handoff_recv(const char *path, int *lfd, int (*load)(FILE *)) {
+    struct sockaddr_un addr;
+    int usock;
+
+    if (handoff_addr(path, &addr) < 0) return -1;
+
+    if ((usock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(usock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("handoff connect");
+        close(usock);
+        return -1;
+    }
+
+    int fds[2];
+    char magic = 0;
+    struct iovec iov = {&magic, 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(usock, &msg, 0) != 1) {
+        perror("recvmsg");
+        close(usock);
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (magic != HANDOFF_MAGIC || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "handoff: no listening socket received\n");
+        close(usock);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *lfd = fds[0];
+
+    FILE *in;
+    if (!(in = fdopen(usock, "r"))) {
+        perror("fdopen");
+        close(fds[1]);
+        close(usock);
+        return -1;
+    }
+    int ret = load(in);
+    fclose(in);
+    // report the load and wait for the sender to give way: if it gave up on
+    // us in the meantime, it is still serving and we must not
+    char reply = HANDOFF_LOADED;
+    if (ret >= 0 && (send(fds[1], &reply, 1, MSG_NOSIGNAL) != 1 ||
+                     read(fds[1], &reply, 1) != 1 || reply != HANDOFF_GO)) {
+        fprintf(stderr, "handoff: old server did not give way\n");
+        ret = -1;
+    }
+    close(fds[1]);
+    return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <stdio.h>
+
+// how long handoff_send() waits for the new server unless told otherwise
+#define HANDOFF_TIMEOUT_MS 30000
+
+/*
+ * Hands this server's listening socket and database to a replacement server
+ * process. Binds a Unix domain socket at path, waits up to timeout_ms for the
+ * new process to connect, passes lfd to it with SCM_RIGHTS and then streams
+ * the database over the same connection using dump, giving up on a receiver
+ * that stops reading for as long. It then waits as long again for the
+ * receiver to report that it loaded the database, and only then tells it to
+ * start serving. The caller must make sure nothing modifies the database
+ * while this runs. Returns 0 on success, -1 on failure or timeout, after
+ * which the caller still owns lfd and can keep serving; the receiver then
+ * never serves.
+ */
+int handoff_send(const char *path, int lfd, int (*dump)(FILE *),
+                 int timeout_ms);
+
+/*
+ * The other half of handoff_send(): connects to the Unix domain socket at
+ * path, stores the received listening socket in *lfd and loads the database
+ * stream with load. If that worked it reports so and waits for the sender
+ * to give way. Returns the value returned by load, or -1 on failure, when
+ * the sender keeps serving and *lfd must not be used.
+ */
+int handoff_recv(const char *path, int *lfd, int (*load)(FILE *));
+
+#endif  // HANDOFF_H_
@@ -0,0 +1,242 @@
+#include "./hot.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+
+/* Per-thread count-min sketches with top-k heaps, merged for reports */
+
+#define HOT_ROWS 4
+#define HOT_WIDTH 4096  // a power of two
+
+typedef struct hot_entry {
+    uint64_t hash;
+    uint64_t count;  // the sketch's estimate when last counted
+    char key[BUFLEN];
+} hot_entry_t;
+
+typedef struct sketch {
+    // guards everything below; only contended while a report reads it
+    pthread_mutex_t mutex;
+    uint32_t counts[HOT_ROWS][HOT_WIDTH];
+    hot_entry_t heap[HOT_TOP];  // a min-heap on count
+    int nheap;
+    int owned;  // a thread is counting in it; guarded by hot.mutex
+    struct sketch *next;
+} sketch_t;
+
+static struct {
+    // guards the list and who owns which sketch
+    pthread_mutex_t mutex;
+    sketch_t *sketches;
+    pthread_key_t key;  // releases a thread's sketch when it exits
+    int on;
+} hot = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread sketch_t *mine = 0;
+
+static void hot_lock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_lock(mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void hot_unlock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_unlock(mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+/*
+ * Leaves an exiting thread's sketch, with its counts, to the next thread
+ * that starts counting, so that connections coming and going neither lose
+ * counts nor pile up sketches.
+ */
+static void hot_release(void *sketch) {
+    hot_lock(&hot.mutex);
+    ((sketch_t *)sketch)->owned = 0;
+    hot_unlock(&hot.mutex);
+}
+
+void hot_open(void) {
+    int err;
+    if ((err = pthread_key_create(&hot.key, hot_release)) != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+    hot.on = 1;
+}
+
+int hot_enabled(void) { return hot.on; }
+
+/* Returns the calling thread's sketch, or 0 if out of memory. */
+static sketch_t *hot_mine(void) {
+    sketch_t *s;
+    int err;
+    if (mine != 0) return mine;
+    hot_lock(&hot.mutex);
+    s = hot.sketches;
+    while (s != 0 && s->owned) s = s->next;
+    if (s == 0 && (s = calloc(1, sizeof(sketch_t))) != 0) {
+        if ((err = pthread_mutex_init(&s->mutex, 0)) != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+        s->next = hot.sketches;
+        hot.sketches = s;
+    }
+    if (s != 0) s->owned = 1;
+    hot_unlock(&hot.mutex);
+    if (s != 0 && (err = pthread_setspecific(hot.key, s)) != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    return mine = s;
+}
+
+static uint64_t hot_hash(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* The counter of key in a row, from two halves of one hash. */
+static inline unsigned hot_slot(uint64_t hash, int row) {
+    return ((uint32_t)hash + row * (uint32_t)(hash >> 32)) & (HOT_WIDTH - 1);
+}
+
+/* Restores the heap order below slot i after its count grew. */
+static void hot_sift_down(sketch_t *s, int i) {
+    while (1) {
+        int least = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < s->nheap && s->heap[l].count < s->heap[least].count) least = l;
+        if (r < s->nheap && s->heap[r].count < s->heap[least].count) least = r;
+        if (least == i) return;
+        hot_entry_t tmp = s->heap[i];
+        s->heap[i] = s->heap[least];
+        s->heap[least] = tmp;
+        i = least;
+    }
+}
+
+/* Restores the heap order above slot i after it was added. */
+static void hot_sift_up(sketch_t *s, int i) {
+    while (i > 0 && s->heap[(i - 1) / 2].count > s->heap[i].count) {
+        hot_entry_t tmp = s->heap[i];
+        s->heap[i] = s->heap[(i - 1) / 2];
+        s->heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+void hot_record(const char *key) {
+    sketch_t *s;
+    uint64_t hash = hot_hash(key);
+    uint64_t estimate = UINT32_MAX;
+    int i;
+
+    if ((s = hot_mine()) == 0) return;
+    hot_lock(&s->mutex);
+    for (int row = 0; row < HOT_ROWS; row++) {
+        uint32_t *counter = &s->counts[row][hot_slot(hash, row)];
+        if (*counter < UINT32_MAX) (*counter)++;
+        if (*counter < estimate) estimate = *counter;
+    }
+    for (i = 0; i < s->nheap; i++) {
+        if (s->heap[i].hash == hash && strcmp(s->heap[i].key, key) == 0) break;
+    }
+    if (i < s->nheap) {
+        s->heap[i].count = estimate;
+        hot_sift_down(s, i);
+    } else if (s->nheap < HOT_TOP || estimate > s->heap[0].count) {
+        // a new candidate takes the place of the coldest one
+        if (s->nheap < HOT_TOP) {
+            i = s->nheap++;
+        } else {
+            i = 0;
+        }
+        s->heap[i].hash = hash;
+        s->heap[i].count = estimate;
+        snprintf(s->heap[i].key, BUFLEN, "%s", key);
+        if (i == 0) {
+            hot_sift_down(s, 0);
+        } else {
+            hot_sift_up(s, i);
+        }
+    }
+    hot_unlock(&s->mutex);
+}
+
+static int hot_by_count(const void *a, const void *b) {
+    const hot_entry_t *x = a;
+    const hot_entry_t *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+void hot_report(FILE *out, int n) {
+    static uint32_t merged[HOT_ROWS][HOT_WIDTH];
+    static hot_entry_t candidates[HOT_TOP * 64];
+    int ncandidates = 0;
+    uint64_t total = 0;
+
+    if (!hot.on) {
+        fprintf(out, "hot key tracking not enabled\n");
+        return;
+    }
+    if (n < 1 || n > HOT_TOP) n = HOT_TOP;
+    // reports come from the console thread only, so the statics are free
+    memset(merged, 0, sizeof(merged));
+    hot_lock(&hot.mutex);
+    for (sketch_t *s = hot.sketches; s != 0; s = s->next) {
+        hot_lock(&s->mutex);
+        for (int row = 0; row < HOT_ROWS; row++) {
+            for (int col = 0; col < HOT_WIDTH; col++) {
+                uint64_t sum = (uint64_t)merged[row][col] + s->counts[row][col];
+                merged[row][col] = sum < UINT32_MAX ? sum : UINT32_MAX;
+            }
+        }
+        for (int i = 0; i < s->nheap; i++) {
+            int j;
+            for (j = 0; j < ncandidates; j++) {
+                if (candidates[j].hash == s->heap[i].hash &&
+                    strcmp(candidates[j].key, s->heap[i].key) == 0) {
+                    break;
+                }
+            }
+            if (j == ncandidates &&
+                ncandidates < (int)(sizeof(candidates) / sizeof(*candidates))) {
+                candidates[ncandidates++] = s->heap[i];
+            }
+        }
+        // start a new window
+        memset(s->counts, 0, sizeof(s->counts));
+        s->nheap = 0;
+        hot_unlock(&s->mutex);
+    }
+    hot_unlock(&hot.mutex);
+
+    // every access was counted once in each row
+    for (int col = 0; col < HOT_WIDTH; col++) total += merged[0][col];
+    for (int j = 0; j < ncandidates; j++) {
+        uint64_t estimate = UINT32_MAX;
+        for (int row = 0; row < HOT_ROWS; row++) {
+            uint32_t count = merged[row][hot_slot(candidates[j].hash, row)];
+            if (count < estimate) estimate = count;
+        }
+        candidates[j].count = estimate;
+    }
+    qsort(candidates, ncandidates, sizeof(*candidates), hot_by_count);
+    fprintf(out, "%llu accesses since the last report\n",
+            (unsigned long long)total);
+    for (int j = 0; j < ncandidates && j < n; j++) {
+        fprintf(out, "%2d %s %llu (%.1f%%)\n", j + 1, candidates[j].key,
+                (unsigned long long)candidates[j].count,
+                total > 0 ? 100.0 * candidates[j].count / total : 0.0);
+    }
+}
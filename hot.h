@@ -0,0 +1,34 @@
+#ifndef HOT_H_
+#define HOT_H_
+
+#include <stdio.h>
+
+/*
+ * Hot key tracking. Every thread that queries or changes a key counts it in
+ * its own count-min sketch, which overestimates a key's count only by the
+ * keys that collide with it in every row, and keeps the keys with the
+ * highest estimates in a small min-heap. Nothing is shared between threads
+ * while counting; a report adds the sketches together and ranks the union of
+ * their heaps by the merged estimates.
+ */
+
+// the keys each thread keeps as candidates for the heaviest hitters
+#define HOT_TOP 32
+
+/* Starts counting. Must be called before clients are served. */
+void hot_open(void);
+
+/* Nonzero once hot_open() has been called. */
+int hot_enabled(void);
+
+/* Counts one query or change of key by the calling thread. */
+void hot_record(const char *key);
+
+/*
+ * Writes the n (at most HOT_TOP) most accessed keys since the last report
+ * to out, with their estimated counts and the total number of accesses, and
+ * starts counting afresh.
+ */
+void hot_report(FILE *out, int n);
+
+#endif  // HOT_H_
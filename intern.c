@@ -0,0 +1,214 @@
+#include "./intern.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+
+// bucket i is guarded by stripe i % INTERN_STRIPES
+#define INTERN_STRIPES 256
+// the table doubles once it holds this many entries per bucket
+#define INTERN_LOAD 2
+
+typedef struct intern_entry {
+    struct intern_entry *next;
+    uint64_t hash;
+    size_t refs;
+    size_t len;
+    char str[];
+} intern_entry_t;
+
+typedef struct intern_table {
+    intern_entry_t **buckets;
+    size_t mask;
+    // lookups hold resize_lock for reading, a resize holds it for writing
+    pthread_rwlock_t resize_lock;
+    pthread_mutex_t stripes[INTERN_STRIPES];
+    size_t strings;  // updated atomically, outside the stripe locks
+    size_t refs;
+    void *(*alloc)(size_t);
+    void (*dealloc)(void *);
+} intern_table_t;
+
+static intern_table_t *table = NULL;
+
+static inline uint64_t intern_hash(const char *str, size_t len) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline intern_entry_t *intern_entry(char *str) {
+    return (intern_entry_t *)(str - offsetof(intern_entry_t, str));
+}
+
+int intern_init(size_t nbuckets, void *(*alloc)(size_t),
+                void (*dealloc)(void *)) {
+    size_t size = INTERN_STRIPES;
+    while (size < nbuckets) size <<= 1;
+
+    if ((table = (intern_table_t *)malloc(sizeof(intern_table_t))) == NULL) {
+        return -1;
+    }
+    if ((table->buckets = calloc(size, sizeof(intern_entry_t *))) == NULL) {
+        free(table);
+        table = NULL;
+        return -1;
+    }
+    table->mask = size - 1;
+    pthread_rwlock_init(&table->resize_lock, 0);
+    for (int i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_init(&table->stripes[i], 0);
+    }
+    table->strings = 0;
+    table->refs = 0;
+    table->alloc = alloc;
+    table->dealloc = dealloc;
+    return 0;
+}
+
+int intern_enabled(void) { return table != NULL; }
+
+/* Doubles the bucket array; called without any locks held. */
+static void intern_grow(size_t seen_mask) {
+    int err;
+    if ((err = pthread_rwlock_wrlock(&table->resize_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+    // somebody else may have grown the table while we waited
+    if (table->mask == seen_mask) {
+        size_t size = (table->mask + 1) * 2;
+        intern_entry_t **buckets = calloc(size, sizeof(intern_entry_t *));
+        if (buckets != NULL) {
+            for (size_t i = 0; i <= table->mask; i++) {
+                intern_entry_t *entry = table->buckets[i];
+                while (entry != NULL) {
+                    intern_entry_t *next = entry->next;
+                    entry->next = buckets[entry->hash & (size - 1)];
+                    buckets[entry->hash & (size - 1)] = entry;
+                    entry = next;
+                }
+            }
+            free(table->buckets);
+            table->buckets = buckets;
+            table->mask = size - 1;
+        }
+    }
+    if ((err = pthread_rwlock_unlock(&table->resize_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+char *intern_get(const char *str, size_t len) {
+    int err;
+    uint64_t hash = intern_hash(str, len);
+    intern_entry_t *entry;
+    int created = 0;
+    size_t mask;
+
+    if ((err = pthread_rwlock_rdlock(&table->resize_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    mask = table->mask;
+    size_t bucket = hash & mask;
+    pthread_mutex_t *stripe = &table->stripes[bucket % INTERN_STRIPES];
+    if ((err = pthread_mutex_lock(stripe)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    for (entry = table->buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->len == len &&
+            memcmp(entry->str, str, len) == 0) {
+            break;
+        }
+    }
+    if (entry != NULL) {
+        entry->refs++;
+    } else if ((entry = table->alloc(sizeof(intern_entry_t) + len + 1)) !=
+               NULL) {
+        entry->hash = hash;
+        entry->refs = 1;
+        entry->len = len;
+        memcpy(entry->str, str, len);
+        entry->str[len] = '\0';
+        entry->next = table->buckets[bucket];
+        table->buckets[bucket] = entry;
+        created = 1;
+    }
+    if ((err = pthread_mutex_unlock(stripe)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_rwlock_unlock(&table->resize_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    if (entry == NULL) return NULL;
+
+    __atomic_fetch_add(&table->refs, 1, __ATOMIC_RELAXED);
+    if (created && __atomic_add_fetch(&table->strings, 1, __ATOMIC_RELAXED) >
+                       (mask + 1) * INTERN_LOAD) {
+        intern_grow(mask);
+    }
+    return entry->str;
+}
+
+void intern_put(char *str) {
+    int err;
+    intern_entry_t *entry = intern_entry(str);
+    int freed = 0;
+
+    if ((err = pthread_rwlock_rdlock(&table->resize_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    size_t bucket = entry->hash & table->mask;
+    pthread_mutex_t *stripe = &table->stripes[bucket % INTERN_STRIPES];
+    if ((err = pthread_mutex_lock(stripe)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (--entry->refs == 0) {
+        // unlink it from its chain
+        intern_entry_t **link = &table->buckets[bucket];
+        while (*link != entry) link = &(*link)->next;
+        *link = entry->next;
+        freed = 1;
+    }
+    if ((err = pthread_mutex_unlock(stripe)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_rwlock_unlock(&table->resize_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    __atomic_fetch_sub(&table->refs, 1, __ATOMIC_RELAXED);
+    if (freed) {
+        __atomic_fetch_sub(&table->strings, 1, __ATOMIC_RELAXED);
+        table->dealloc(entry);
+    }
+}
+
+void intern_stats(size_t *strings, size_t *refs) {
+    *strings = __atomic_load_n(&table->strings, __ATOMIC_RELAXED);
+    *refs = __atomic_load_n(&table->refs, __ATOMIC_RELAXED);
+}
+
+void intern_destroy(int free_entries) {
+    if (free_entries) {
+        for (size_t i = 0; i <= table->mask; i++) {
+            intern_entry_t *entry = table->buckets[i];
+            while (entry != NULL) {
+                intern_entry_t *next = entry->next;
+                table->dealloc(entry);
+                entry = next;
+            }
+        }
+    }
+    pthread_rwlock_destroy(&table->resize_lock);
+    for (int i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_destroy(&table->stripes[i]);
+    }
+    free(table->buckets);
+    free(table);
+    table = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef INTERN_H_
+#define INTERN_H_
+
+#include <stddef.h>
+
+/*
+ * A concurrent, reference counted set of strings. Interning a string returns
+ * the single shared copy of it, so keys and values that repeat across the
+ * tree (value == key is common) are only stored once.
+ */
+
+/*
+ * Enables interning with an initial table of nbuckets buckets (rounded up to
+ * a power of two). Entries are allocated with alloc and released with
+ * dealloc, so they can live in the same arena as the tree. Returns 0 on
+ * success and -1 on failure.
+ */
+int intern_init(size_t nbuckets, void *(*alloc)(size_t),
+                void (*dealloc)(void *));
+
+/* Nonzero once intern_init() has succeeded. */
+int intern_enabled(void);
+
+/*
+ * Returns the shared copy of the len byte string str, creating it if needed,
+ * and takes a reference on it. Returns NULL if allocation failed.
+ */
+char *intern_get(const char *str, size_t len);
+
+/* Drops a reference taken by intern_get(), freeing the copy on the last. */
+void intern_put(char *str);
+
+/*
+ * Reports the number of distinct strings held and the number of references
+ * to them; refs - strings copies are saved.
+ */
+void intern_stats(size_t *strings, size_t *refs);
+
+/*
+ * Frees the table. Entries are only freed if free_entries is set; pass 0 when
+ * the memory they live in is about to be released wholesale.
+ */
+void intern_destroy(int free_entries);
+
+#endif  // INTERN_H_
@@ -0,0 +1,905 @@
+#include "./lsm.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "./comm.h"
+
+/* Sorted run files, their Bloom filters and background compaction */
+
+#define LSM_MAGIC "DBRUN001"
+#define LSM_HEADER 16  // magic and a 64 bit record count
+#define LSM_RECORD 7   // 16 bit key length, 8 bit flags, 32 bit value length
+#define LSM_TOMB 1
+#define LSM_MAXKEY 256
+// one sparse index entry per this many records
+#define LSM_INDEX_EVERY 16
+#define LSM_BLOOM_BITS 10  // per key, about 1% false positives
+#define LSM_BLOOM_HASHES 7
+// runs are merged this many neighbours at a time, once that many are of a
+// size, so a key is rewritten about once per factor of this in size
+#define LSM_FANOUT 4
+// and past this many runs the smallest neighbours are merged whatever their
+// sizes, to bound the runs a lookup may have to check
+#define LSM_MAX_RUNS 16
+#define LSM_MERGE_BUF 65536
+
+typedef struct run {
+    unsigned long seq;
+    int fd;
+    size_t count;
+    uint64_t *bloom;
+    size_t bloom_bits;
+    // every LSM_INDEX_EVERY-th key and the offset of its record
+    char **index_keys;
+    off_t *index_offs;
+    size_t nindex;
+} run_t;
+
+/* A buffered sequential reader over a run file. */
+typedef struct cursor {
+    run_t *run;
+    off_t off;  // file offset of buf[0]
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+} cursor_t;
+
+typedef struct record {
+    char key[LSM_MAXKEY + 1];
+    size_t klen;
+    int flags;
+    size_t vlen;
+} record_t;
+
+/* Builds a run file record by record. */
+typedef struct run_writer {
+    FILE *out;
+    char path[BUFSIZ];
+    off_t off;
+    run_t *run;
+    size_t cap_index;
+} run_writer_t;
+
+static struct lsm {
+    char dir[BUFSIZ / 2];  // leaves room for file names in BUFSIZ paths
+    size_t limit;
+    size_t memtable_keys;  // updated atomically
+    // readers: every memtable operation; writer: detaching the memtable
+    pthread_rwlock_t memtable_lock;
+    // guards frozen and the run list
+    pthread_rwlock_t lock;
+    node_t *frozen;  // detached memtable being written, or NULL
+    size_t frozen_keys;
+    run_t **runs;  // oldest first
+    int nruns;
+    unsigned long next_seq;
+    // wakes the background thread
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int flush_wanted;
+    int stopping;
+    pthread_t thread;
+} lsm;
+
+static int lsm_on = 0;
+
+static uint64_t lsm_hash(const char *key, size_t len, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void bloom_add(run_t *run, const char *key, size_t len) {
+    uint64_t h1 = lsm_hash(key, len, 0);
+    uint64_t h2 = lsm_hash(key, len, 0x9e3779b97f4a7c15ULL) | 1;
+    for (int i = 0; i < LSM_BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % run->bloom_bits;
+        run->bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static int bloom_check(run_t *run, const char *key, size_t len) {
+    uint64_t h1 = lsm_hash(key, len, 0);
+    uint64_t h2 = lsm_hash(key, len, 0x9e3779b97f4a7c15ULL) | 1;
+    for (int i = 0; i < LSM_BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % run->bloom_bits;
+        if (!(run->bloom[bit / 64] & (1ULL << (bit % 64)))) return 0;
+    }
+    return 1;
+}
+
+static run_t *run_alloc(unsigned long seq, size_t expected) {
+    run_t *run = calloc(1, sizeof(run_t));
+    if (run == NULL) return NULL;
+    run->seq = seq;
+    run->fd = -1;
+    run->bloom_bits = (expected > 0 ? expected : 1) * LSM_BLOOM_BITS;
+    if ((run->bloom = calloc((run->bloom_bits + 63) / 64, 8)) == NULL) {
+        free(run);
+        return NULL;
+    }
+    return run;
+}
+
+static void run_free(run_t *run) {
+    if (run->fd >= 0) close(run->fd);
+    for (size_t i = 0; i < run->nindex; i++) free(run->index_keys[i]);
+    free(run->index_keys);
+    free(run->index_offs);
+    free(run->bloom);
+    free(run);
+}
+
+static void run_path(unsigned long seq, char *path, size_t len) {
+    snprintf(path, len, "%s/run-%08lu.sst", lsm.dir, seq);
+}
+
+/* Records the key at off in the sparse index. */
+static int run_index(run_t *run, size_t *cap, const char *key, off_t off) {
+    if (run->nindex == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 64;
+        char **keys = realloc(run->index_keys, ncap * sizeof(char *));
+        if (keys == NULL) return -1;
+        run->index_keys = keys;
+        off_t *offs = realloc(run->index_offs, ncap * sizeof(off_t));
+        if (offs == NULL) return -1;
+        run->index_offs = offs;
+        *cap = ncap;
+    }
+    if ((run->index_keys[run->nindex] = strdup(key)) == NULL) return -1;
+    run->index_offs[run->nindex++] = off;
+    return 0;
+}
+
+static void cursor_init(cursor_t *cur, run_t *run, off_t off, char *buf,
+                        size_t cap) {
+    cur->run = run;
+    cur->off = off;
+    cur->buf = buf;
+    cur->cap = cap;
+    cur->len = 0;
+    cur->pos = 0;
+}
+
+static off_t cursor_tell(cursor_t *cur) { return cur->off + cur->pos; }
+
+/* Copies the next n bytes to dst (or skips them if dst is NULL). */
+static int cursor_read(cursor_t *cur, void *dst, size_t n) {
+    while (n > 0) {
+        if (cur->pos == cur->len) {
+            cur->off += cur->len;
+            cur->pos = cur->len = 0;
+            ssize_t got = pread(cur->run->fd, cur->buf, cur->cap, cur->off);
+            if (got <= 0) return -1;
+            cur->len = got;
+        }
+        size_t take = cur->len - cur->pos < n ? cur->len - cur->pos : n;
+        if (dst != NULL) {
+            memcpy(dst, cur->buf + cur->pos, take);
+            dst = (char *)dst + take;
+        }
+        cur->pos += take;
+        n -= take;
+    }
+    return 0;
+}
+
+/* Reads the next record's header and key; its value is left unread. */
+static int cursor_next(cursor_t *cur, record_t *rec) {
+    unsigned char hdr[LSM_RECORD];
+    uint16_t klen;
+    uint32_t vlen;
+    if (cursor_read(cur, hdr, LSM_RECORD) < 0) return -1;
+    memcpy(&klen, hdr, 2);
+    memcpy(&vlen, hdr + 3, 4);
+    if (klen > LSM_MAXKEY || cursor_read(cur, rec->key, klen) < 0) return -1;
+    rec->key[klen] = '\0';
+    rec->klen = klen;
+    rec->flags = hdr[2];
+    rec->vlen = vlen;
+    return 0;
+}
+
+static blob_t *cursor_value(cursor_t *cur, record_t *rec) {
+    blob_t *blob = db_blob_alloc(rec->vlen);
+    if (blob == NULL) return NULL;
+    if (cursor_read(cur, blob->data, rec->vlen) < 0) {
+        db_blob_put(blob);
+        return NULL;
+    }
+    return blob;
+}
+
+/* Opens an existing run file and rebuilds its Bloom filter and index. */
+static run_t *run_open(unsigned long seq) {
+    char path[BUFSIZ];
+    char header[LSM_HEADER];
+    uint64_t count;
+    size_t cap = 0;
+    run_t *run;
+    int fd;
+
+    run_path(seq, path, sizeof(path));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (pread(fd, header, LSM_HEADER, 0) != LSM_HEADER ||
+        memcmp(header, LSM_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a run file\n", path);
+        close(fd);
+        return NULL;
+    }
+    memcpy(&count, header + 8, 8);
+    if ((run = run_alloc(seq, count)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    run->fd = fd;
+    run->count = count;
+
+    char *buf = malloc(LSM_MERGE_BUF);
+    cursor_t cur;
+    record_t rec;
+    cursor_init(&cur, run, LSM_HEADER, buf, LSM_MERGE_BUF);
+    for (size_t i = 0; buf != NULL && i < count; i++) {
+        off_t off = cursor_tell(&cur);
+        if (cursor_next(&cur, &rec) < 0 ||
+            cursor_read(&cur, NULL, rec.vlen) < 0 ||
+            (i % LSM_INDEX_EVERY == 0 &&
+             run_index(run, &cap, rec.key, off) < 0)) {
+            fprintf(stderr, "%s: truncated run file\n", path);
+            free(buf);
+            run_free(run);
+            return NULL;
+        }
+        bloom_add(run, rec.key, rec.klen);
+    }
+    free(buf);
+    return run;
+}
+
+static run_writer_t *writer_open(size_t expected) {
+    run_writer_t *w = calloc(1, sizeof(run_writer_t));
+    if (w == NULL) return NULL;
+    if ((w->run = run_alloc(lsm.next_seq++, expected)) == NULL) {
+        free(w);
+        return NULL;
+    }
+    run_path(w->run->seq, w->path, sizeof(w->path));
+    if ((w->out = fopen(w->path, "w")) == NULL) {
+        perror(w->path);
+        run_free(w->run);
+        free(w);
+        return NULL;
+    }
+    // the count is filled in by writer_finish()
+    char header[LSM_HEADER] = LSM_MAGIC;
+    fwrite(header, 1, LSM_HEADER, w->out);
+    w->off = LSM_HEADER;
+    return w;
+}
+
+static int writer_add(run_writer_t *w, const char *key, int flags,
+                      const char *value, size_t vlen) {
+    unsigned char hdr[LSM_RECORD];
+    uint16_t klen = strlen(key);
+    uint32_t len = vlen;
+    memcpy(hdr, &klen, 2);
+    hdr[2] = flags;
+    memcpy(hdr + 3, &len, 4);
+    if (w->run->count % LSM_INDEX_EVERY == 0 &&
+        run_index(w->run, &w->cap_index, key, w->off) < 0) {
+        return -1;
+    }
+    if (fwrite(hdr, 1, LSM_RECORD, w->out) != LSM_RECORD ||
+        fwrite(key, 1, klen, w->out) != klen ||
+        fwrite(value, 1, vlen, w->out) != vlen) {
+        return -1;
+    }
+    bloom_add(w->run, key, klen);
+    w->off += LSM_RECORD + klen + vlen;
+    w->run->count++;
+    return 0;
+}
+
+/* Completes the file and returns the run, or NULL (removing the file). */
+static run_t *writer_finish(run_writer_t *w, int ok) {
+    run_t *run = w->run;
+    uint64_t count = run->count;
+    if (ok &&
+        (fseek(w->out, 8, SEEK_SET) < 0 || fwrite(&count, 8, 1, w->out) != 1 ||
+         fflush(w->out) == EOF || fsync(fileno(w->out)) < 0)) {
+        perror(w->path);
+        ok = 0;
+    }
+    if (fclose(w->out) == EOF) ok = 0;
+    if (ok && (run->fd = open(w->path, O_RDONLY)) < 0) {
+        perror(w->path);
+        ok = 0;
+    }
+    if (!ok) {
+        unlink(w->path);
+        run_free(run);
+        run = NULL;
+    }
+    free(w);
+    return run;
+}
+
+/*
+ * Rewrites MANIFEST, the list of live runs, atomically and durably, together
+ * with the names of the run files it lists. Holds lsm.lock.
+ */
+static int write_manifest(void) {
+    char path[BUFSIZ];
+    char tmp[BUFSIZ];
+    snprintf(path, sizeof(path), "%s/MANIFEST", lsm.dir);
+    snprintf(tmp, sizeof(tmp), "%s/MANIFEST.tmp", lsm.dir);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror(tmp);
+        return -1;
+    }
+    for (int i = 0; i < lsm.nruns; i++) {
+        fprintf(out, "%lu\n", lsm.runs[i]->seq);
+    }
+    if (fflush(out) == EOF || fsync(fileno(out)) < 0) {
+        perror(tmp);
+        fclose(out);
+        return -1;
+    }
+    fclose(out);
+    if (rename(tmp, path) < 0) {
+        perror("rename");
+        return -1;
+    }
+    // and the rename, and the entries of new run files
+    int dfd = open(lsm.dir, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0 || fsync(dfd) < 0) {
+        perror(lsm.dir);
+        if (dfd >= 0) close(dfd);
+        return -1;
+    }
+    close(dfd);
+    return 0;
+}
+
+/*
+ * Drops a run that is not listed after all: its file is only removed once a
+ * manifest without it is durable, so whichever manifest a crash leaves
+ * behind names files that still exist. Holds lsm.lock.
+ */
+static void run_discard(run_t *run) {
+    char path[BUFSIZ];
+    run_path(run->seq, path, sizeof(path));
+    if (write_manifest() == 0) unlink(path);
+    run_free(run);
+}
+
+static int run_get(run_t *run, const char *name, blob_t **value) {
+    size_t len = strlen(name);
+    if (run->nindex == 0 || !bloom_check(run, name, len)) return 0;
+
+    // find the last index key <= name
+    size_t lo = 0, hi = run->nindex;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(run->index_keys[mid], name) <= 0) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (strcmp(run->index_keys[lo], name) > 0) return 0;
+
+    char buf[4096];
+    cursor_t cur;
+    record_t rec;
+    cursor_init(&cur, run, run->index_offs[lo], buf, sizeof(buf));
+    for (int i = 0; i < LSM_INDEX_EVERY; i++) {
+        if (cursor_next(&cur, &rec) < 0) return 0;
+        int cmp = strcmp(rec.key, name);
+        if (cmp > 0) return 0;
+        if (cmp == 0) {
+            if (rec.flags & LSM_TOMB) return -1;
+            return (*value = cursor_value(&cur, &rec)) != NULL ? 1 : 0;
+        }
+        if (cursor_read(&cur, NULL, rec.vlen) < 0) return 0;
+    }
+    return 0;
+}
+
+int lsm_get(const char *name, blob_t **value) {
+    int err;
+    int ret = 0;
+
+    if ((err = pthread_rwlock_rdlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    // the detached memtable is immutable, so it is searched without locks
+    node_t *node = lsm.frozen;
+    while (node != NULL) {
+        int cmp = strcmp(name, node->name);
+        if (cmp == 0) break;
+        node = cmp < 0 ? node->lchild : node->rchild;
+    }
+    if (node != NULL) {
+        if (node->blob != NULL) {
+            *value = node->blob;
+            __atomic_add_fetch(&node->blob->refs, 1, __ATOMIC_RELAXED);
+            ret = 1;
+        } else if (node->value == NULL) {
+            ret = -1;
+        } else if ((*value = db_blob_alloc(strlen(node->value))) != NULL) {
+            memcpy((*value)->data, node->value, (*value)->len);
+            ret = 1;
+        }
+    } else {
+        for (int i = lsm.nruns - 1; i >= 0 && ret == 0; i--) {
+            ret = run_get(lsm.runs[i], name, value);
+        }
+    }
+    if ((err = pthread_rwlock_unlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    return ret;
+}
+
+/* Writes the detached memtable rooted at root to a new run, in key order. */
+static run_t *flush_tree(node_t *root, size_t expected) {
+    run_writer_t *w = writer_open(expected);
+    if (w == NULL) return NULL;
+
+    // an explicit stack: sorted inserts make the tree arbitrarily deep
+    size_t cap = 1024, depth = 0;
+    node_t **stack = malloc(cap * sizeof(node_t *));
+    node_t *node = root;
+    int ok = stack != NULL;
+    while (ok && (node != NULL || depth > 0)) {
+        if (node != NULL) {
+            if (depth == cap) {
+                node_t **bigger = realloc(stack, 2 * cap * sizeof(node_t *));
+                if (bigger == NULL) {
+                    ok = 0;
+                    break;
+                }
+                stack = bigger;
+                cap *= 2;
+            }
+            stack[depth++] = node;
+            node = node->lchild;
+            continue;
+        }
+        node = stack[--depth];
+        if (node->blob != NULL) {
+            ok = writer_add(w, node->name, 0, node->blob->data,
+                            node->blob->len) == 0;
+        } else if (node->value == NULL) {
+            ok = writer_add(w, node->name, LSM_TOMB, "", 0) == 0;
+        } else {
+            ok = writer_add(w, node->name, 0, node->value,
+                            strlen(node->value)) == 0;
+        }
+        node = node->rchild;
+    }
+    free(stack);
+    return writer_finish(w, ok);
+}
+
+/* Writes the detached memtable to a new run, and frees it once the run is
+ * listed. Returns -1, keeping it in memory for lookups, if that fails. */
+static int lsm_flush_frozen(void) {
+    int err;
+    node_t *root = lsm.frozen;
+    run_t *run = flush_tree(root, lsm.frozen_keys);
+
+    if ((err = pthread_rwlock_wrlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+    if (run != NULL) {
+        run_t **runs = realloc(lsm.runs, (lsm.nruns + 1) * sizeof(run_t *));
+        if (runs != NULL) {
+            lsm.runs = runs;
+            lsm.runs[lsm.nruns++] = run;
+            if (write_manifest() < 0) {
+                lsm.nruns--;
+                run_discard(run);
+                run = NULL;
+            }
+        } else {
+            run_discard(run);
+            run = NULL;
+        }
+    }
+    if (run != NULL) {
+        lsm.frozen = NULL;
+    }
+    if ((err = pthread_rwlock_unlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    if (run == NULL) {
+        // keep serving the keys from the detached tree rather than lose them
+        fprintf(stderr, "lsm: flush failed, keeping the memtable in memory\n");
+        return -1;
+    }
+    db_free_detached(root);
+    return 0;
+}
+
+/* Moves the memtable to a new run. Only the background thread and
+ * lsm_close() call this, so flushes never overlap. */
+static void lsm_flush(void) {
+    int err;
+    size_t keys;
+
+    // there is room for one detached tree: one whose flush failed is written
+    // first, and while it cannot be the memtable just keeps growing
+    if (lsm.frozen != NULL && lsm_flush_frozen() < 0) return;
+
+    if ((err = pthread_rwlock_wrlock(&lsm.memtable_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+    keys = __atomic_exchange_n(&lsm.memtable_keys, 0, __ATOMIC_RELAXED);
+    node_t *root = keys > 0 ? db_detach_memtable() : NULL;
+    if (root != NULL) {
+        if ((err = pthread_rwlock_wrlock(&lsm.lock)) != 0) {
+            handle_error_en(err, "pthread_rwlock_wrlock");
+        }
+        lsm.frozen = root;
+        lsm.frozen_keys = keys;
+        if ((err = pthread_rwlock_unlock(&lsm.lock)) != 0) {
+            handle_error_en(err, "pthread_rwlock_unlock");
+        }
+    }
+    if ((err = pthread_rwlock_unlock(&lsm.memtable_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    if (root != NULL) lsm_flush_frozen();
+}
+
+/* The size class of a run: 0 up to twice a memtable, and a factor of
+ * LSM_FANOUT more for each class above that. */
+static int run_tier(run_t *run) {
+    int tier = 0;
+    for (size_t size = 2 * lsm.limit; run->count > size; size *= LSM_FANOUT) {
+        tier++;
+    }
+    return tier;
+}
+
+/*
+ * Picks LSM_FANOUT neighbouring runs to merge, storing the oldest in *first:
+ * the newest such group whose runs are all of one size class, or, once there
+ * are more than LSM_MAX_RUNS runs, the group with the fewest keys. Only
+ * neighbours are merged, so the runs stay ordered by age and a newer version
+ * of a key still shadows an older one. Returns 0 if nothing is to be merged.
+ */
+static int lsm_pick(int *first) {
+    int err;
+    int found = 0;
+    size_t least = 0;
+
+    if ((err = pthread_rwlock_rdlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    for (int i = lsm.nruns - LSM_FANOUT; i >= 0 && !found; i--) {
+        int tier = run_tier(lsm.runs[i]);
+        found = 1;
+        for (int k = 1; k < LSM_FANOUT; k++) {
+            found &= run_tier(lsm.runs[i + k]) == tier;
+        }
+        if (found) *first = i;
+    }
+    for (int i = 0;
+         !found && lsm.nruns > LSM_MAX_RUNS && i <= lsm.nruns - LSM_FANOUT;
+         i++) {
+        size_t keys = 0;
+        for (int k = 0; k < LSM_FANOUT; k++) keys += lsm.runs[i + k]->count;
+        if (i == 0 || keys < least) {
+            least = keys;
+            *first = i;
+        }
+    }
+    found |= lsm.nruns > LSM_MAX_RUNS;
+    if ((err = pthread_rwlock_unlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    return found;
+}
+
+/*
+ * Merges the n runs from the first-th oldest into one, dropping versions that
+ * newer runs among them shadow, and tombstones too if there is no older run
+ * for them to shadow. Only the background thread merges or flushes, and a
+ * flush only appends a run, so those runs keep their places meanwhile.
+ * Returns -1, leaving the runs as they were, if it fails.
+ */
+static int lsm_compact(int first, int n) {
+    int err;
+    size_t expected = 0;
+
+    if ((err = pthread_rwlock_rdlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    run_t *inputs[n];
+    memcpy(inputs, lsm.runs + first, n * sizeof(run_t *));
+    if ((err = pthread_rwlock_unlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    for (int i = 0; i < n; i++) expected += inputs[i]->count;
+
+    cursor_t curs[n];
+    record_t recs[n];
+    int live[n];
+    char *bufs = malloc((size_t)n * LSM_MERGE_BUF);
+    run_writer_t *w = bufs != NULL ? writer_open(expected) : NULL;
+    if (w == NULL) {
+        free(bufs);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        cursor_init(&curs[i], inputs[i], LSM_HEADER, bufs + i * LSM_MERGE_BUF,
+                    LSM_MERGE_BUF);
+        live[i] = inputs[i]->count > 0 && cursor_next(&curs[i], &recs[i]) == 0;
+    }
+
+    int ok = 1;
+    size_t done[n];
+    memset(done, 0, sizeof(done));
+    while (ok) {
+        // the smallest key; on ties the newest run, which is the last one
+        int pick = -1;
+        for (int i = 0; i < n; i++) {
+            if (live[i] &&
+                (pick < 0 || strcmp(recs[i].key, recs[pick].key) <= 0)) {
+                pick = i;
+            }
+        }
+        if (pick < 0) break;
+        if (!(recs[pick].flags & LSM_TOMB)) {
+            blob_t *value = cursor_value(&curs[pick], &recs[pick]);
+            ok = value != NULL &&
+                 writer_add(w, recs[pick].key, 0, value->data, value->len) == 0;
+            if (value != NULL) db_blob_put(value);
+        } else {
+            ok = cursor_read(&curs[pick], NULL, recs[pick].vlen) == 0;
+            // a tombstone still hides the key in the runs older than these
+            if (ok && first > 0) {
+                ok = writer_add(w, recs[pick].key, LSM_TOMB, "", 0) == 0;
+            }
+        }
+        // step every run past this key
+        char key[LSM_MAXKEY + 1];
+        strcpy(key, recs[pick].key);
+        for (int i = 0; ok && i < n; i++) {
+            if (!live[i] || strcmp(recs[i].key, key) != 0) continue;
+            if (i != pick && cursor_read(&curs[i], NULL, recs[i].vlen) < 0) {
+                ok = 0;
+                break;
+            }
+            done[i]++;
+            live[i] = done[i] < inputs[i]->count &&
+                      cursor_next(&curs[i], &recs[i]) == 0;
+            ok = live[i] || done[i] == inputs[i]->count;
+        }
+    }
+    free(bufs);
+    run_t *merged = writer_finish(w, ok);
+    if (merged == NULL) {
+        fprintf(stderr, "lsm: compaction failed\n");
+        return -1;
+    }
+
+    // replace the inputs with the merged run, unless that cannot be recorded
+    if ((err = pthread_rwlock_wrlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+    lsm.runs[first] = merged;
+    memmove(&lsm.runs[first + 1], &lsm.runs[first + n],
+            (lsm.nruns - first - n) * sizeof(run_t *));
+    lsm.nruns -= n - 1;
+    if (write_manifest() < 0) {
+        memmove(&lsm.runs[first + n], &lsm.runs[first + 1],
+                (lsm.nruns - first - 1) * sizeof(run_t *));
+        memcpy(&lsm.runs[first], inputs, n * sizeof(run_t *));
+        lsm.nruns += n - 1;
+        run_discard(merged);
+        merged = NULL;
+    }
+    if ((err = pthread_rwlock_unlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+    if (merged == NULL) {
+        fprintf(stderr, "lsm: compaction not recorded, keeping its inputs\n");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        char path[BUFSIZ];
+        run_path(inputs[i]->seq, path, sizeof(path));
+        unlink(path);
+        run_free(inputs[i]);
+    }
+    return 0;
+}
+
+static void *lsm_thread(void *arg) {
+    int err;
+    while (1) {
+        if ((err = pthread_mutex_lock(&lsm.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        while (!lsm.flush_wanted && !lsm.stopping) {
+            if ((err = pthread_cond_wait(&lsm.cond, &lsm.mutex)) != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+        }
+        int flush = lsm.flush_wanted;
+        int stopping = lsm.stopping;
+        lsm.flush_wanted = 0;
+        if ((err = pthread_mutex_unlock(&lsm.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (stopping) break;
+        if (flush) lsm_flush();
+        // a merge can complete a group of the next size class in turn
+        int first;
+        while (lsm_pick(&first) && lsm_compact(first, LSM_FANOUT) == 0) {
+        }
+    }
+    return NULL;
+}
+
+void lsm_note_insert(void) {
+    int err;
+    // every limit keys, so a flush that could not run is asked for again
+    size_t keys = __atomic_add_fetch(&lsm.memtable_keys, 1, __ATOMIC_RELAXED);
+    if (keys % lsm.limit != 0) return;
+    if ((err = pthread_mutex_lock(&lsm.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    lsm.flush_wanted = 1;
+    if ((err = pthread_cond_signal(&lsm.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    if ((err = pthread_mutex_unlock(&lsm.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+void lsm_enter(void) {
+    int err;
+    if ((err = pthread_rwlock_rdlock(&lsm.memtable_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+}
+
+void lsm_leave(void) {
+    int err;
+    if ((err = pthread_rwlock_unlock(&lsm.memtable_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+int lsm_enabled(void) { return lsm_on; }
+
+void lsm_stats(int *runs, size_t *keys) {
+    int err;
+    if ((err = pthread_rwlock_rdlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    *runs = lsm.nruns;
+    *keys = 0;
+    for (int i = 0; i < lsm.nruns; i++) *keys += lsm.runs[i]->count;
+    if ((err = pthread_rwlock_unlock(&lsm.lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+int lsm_open(const char *dir, size_t memtable_keys) {
+    char path[BUFSIZ];
+    unsigned long seq;
+    int err;
+
+    if (strlen(dir) >= sizeof(lsm.dir)) {
+        fprintf(stderr, "%s: name too long\n", dir);
+        return -1;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    snprintf(lsm.dir, sizeof(lsm.dir), "%s", dir);
+    lsm.limit = memtable_keys > 0 ? memtable_keys : 1;
+    lsm.next_seq = 1;
+
+    // writers first, or a steady stream of operations would starve flushes
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lsm.memtable_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_rwlock_init(&lsm.lock, 0);
+    pthread_mutex_init(&lsm.mutex, 0);
+    pthread_cond_init(&lsm.cond, 0);
+
+    // reopen the runs listed in the manifest, oldest first
+    snprintf(path, sizeof(path), "%s/MANIFEST", dir);
+    FILE *in = fopen(path, "r");
+    while (in != NULL && fscanf(in, "%lu", &seq) == 1) {
+        run_t *run = run_open(seq);
+        run_t **runs = realloc(lsm.runs, (lsm.nruns + 1) * sizeof(run_t *));
+        if (run == NULL || runs == NULL) {
+            fclose(in);
+            return -1;
+        }
+        lsm.runs = runs;
+        lsm.runs[lsm.nruns++] = run;
+        if (seq >= lsm.next_seq) lsm.next_seq = seq + 1;
+    }
+    if (in != NULL) fclose(in);
+
+    // run files not in the manifest are from an interrupted flush or merge
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    while (d != NULL && (ent = readdir(d)) != NULL) {
+        if (sscanf(ent->d_name, "run-%lu.sst", &seq) != 1) continue;
+        int listed = 0;
+        for (int i = 0; i < lsm.nruns; i++) listed |= lsm.runs[i]->seq == seq;
+        if (!listed) {
+            snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+            unlink(path);
+        }
+        if (seq >= lsm.next_seq) lsm.next_seq = seq + 1;
+    }
+    if (d != NULL) closedir(d);
+
+    if ((err = pthread_create(&lsm.thread, 0, lsm_thread, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    lsm_on = 1;
+    return 0;
+}
+
+void lsm_close(void) {
+    int err;
+    if ((err = pthread_mutex_lock(&lsm.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    lsm.stopping = 1;
+    if ((err = pthread_cond_signal(&lsm.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    if ((err = pthread_mutex_unlock(&lsm.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_join(lsm.thread, NULL)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    // whatever is still in memory goes to one last run
+    lsm_flush();
+    if (lsm.frozen != NULL) {
+        fprintf(stderr, "lsm: lost %zu keys that could not be written\n",
+                lsm.frozen_keys);
+        db_free_detached(lsm.frozen);
+        lsm.frozen = NULL;
+    }
+    for (int i = 0; i < lsm.nruns; i++) run_free(lsm.runs[i]);
+    free(lsm.runs);
+    lsm.runs = NULL;
+    lsm.nruns = 0;
+    lsm_on = 0;
+}
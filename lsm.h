@@ -0,0 +1,59 @@
+#ifndef LSM_H_
+#define LSM_H_
+
+#include <stddef.h>
+#include "./db.h"
+
+/*
+ * Log-structured storage under the tree. In this mode the tree is only the
+ * memtable: once it holds lsm_open()'s limit of keys, a background thread
+ * detaches it, writes it out as an immutable sorted run file, and frees it.
+ * Lookups that miss the memtable check the detached tree (while it is being
+ * written) and then the runs from newest to oldest, skipping runs whose Bloom
+ * filter rules the key out. The same thread merges neighbouring runs of about
+ * the same size, a few at a time (size-tiered compaction), so a key is only
+ * rewritten once each time the runs around it grow by that factor; deleted
+ * keys are dropped once a merge reaches the oldest run.
+ *
+ * Deletes are recorded as tombstones: nodes with neither a value nor a blob,
+ * which shadow older versions of the key in the runs.
+ */
+
+/*
+ * Opens (or creates) the run directory dir, loads the runs listed in its
+ * MANIFEST and starts the background thread. memtable_keys is the number of
+ * memtable nodes, tombstones included, that triggers a flush. Must be called
+ * before any keys are added. Returns 0 on success and -1 on failure.
+ */
+int lsm_open(const char *dir, size_t memtable_keys);
+
+/* Nonzero once lsm_open() has succeeded. */
+int lsm_enabled(void);
+
+/*
+ * Every memtable operation runs between lsm_enter() and lsm_leave(), so that
+ * the memtable is never detached while a thread is inside it.
+ */
+void lsm_enter(void);
+void lsm_leave(void);
+
+/* Called after a node was added to the memtable; may schedule a flush. */
+void lsm_note_insert(void);
+
+/*
+ * Looks name up below the memtable. Returns 1 and stores a referenced blob
+ * holding the value in *value if the key is present, 0 if it is not, and -1
+ * if its newest version is a tombstone. Must be called inside lsm_enter().
+ */
+int lsm_get(const char *name, blob_t **value);
+
+/* Reports the number of runs and the keys stored in them. */
+void lsm_stats(int *runs, size_t *keys);
+
+/*
+ * Stops the background thread and writes what is left in the memtable to a
+ * final run, so that the next lsm_open() of the same directory sees every key.
+ */
+void lsm_close(void);
+
+#endif  // LSM_H_
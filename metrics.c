@@ -0,0 +1,274 @@
+#include "./metrics.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+#include "./stats.h"
+
+/* Per-thread counters (see stats.h), summed by an HTTP thread when scraped */
+
+// the commands counted under their own label; the rest count as "other",
+// in the slot of the terminating '\0'
+static const char metrics_commands[] = "qadfnAQDVK";
+#define METRICS_COMMANDS (sizeof(metrics_commands))
+
+// upper bounds of the latency buckets; the last bucket has none (+Inf)
+static const uint64_t metrics_bounds_ns[] = {
+    10000,   50000,    100000,   250000,    500000,    1000000,   2500000,
+    5000000, 10000000, 50000000, 100000000, 500000000, 1000000000};
+#define METRICS_BUCKETS \
+    (sizeof(metrics_bounds_ns) / sizeof(metrics_bounds_ns[0]) + 1)
+
+// the largest request read; anything past it is ignored
+#define METRICS_REQUEST 1024
+
+static struct {
+    // the first ids of the counters (see stats.h)
+    int buckets;  // METRICS_BUCKETS per command
+    int sum_ns;   // one per command
+    int locks;
+    int lock_wait_ns;
+    int on;
+    int sock;  // -1 while not serving
+    pthread_t thread;
+} metrics = {.sock = -1};
+
+void metrics_command(char command, uint64_t total_ns, size_t locks,
+                     uint64_t wait_ns) {
+    size_t i, b;
+    for (i = 0; i < METRICS_COMMANDS - 1; i++) {
+        if (metrics_commands[i] == command) break;
+    }
+    for (b = 0; b < METRICS_BUCKETS - 1; b++) {
+        if (total_ns <= metrics_bounds_ns[b]) break;
+    }
+    stats_add(metrics.buckets + i * METRICS_BUCKETS + b, 1);
+    stats_add(metrics.sum_ns + i, total_ns);
+    stats_add(metrics.locks, locks);
+    stats_add(metrics.lock_wait_ns, wait_ns);
+}
+
+/* The resident set size of the process, or 0 if it cannot be read. */
+static uint64_t metrics_resident(void) {
+    unsigned long long pages = 0;
+    FILE *statm;
+    if ((statm = fopen("/proc/self/statm", "r")) == 0) return 0;
+    if (fscanf(statm, "%*u %llu", &pages) != 1) pages = 0;
+    fclose(statm);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Writes the sum of every thread's counters to out in the text format. */
+static void metrics_write(FILE *out) {
+    uint64_t buckets[METRICS_COMMANDS][METRICS_BUCKETS];
+    uint64_t sum_ns[METRICS_COMMANDS];
+    uint64_t opened = stats_sum(STATS_CONNECTIONS_OPENED);
+    uint64_t closed = stats_sum(STATS_CONNECTIONS_CLOSED);
+
+    stats_sums(metrics.buckets, METRICS_COMMANDS * METRICS_BUCKETS,
+               &buckets[0][0]);
+    stats_sums(metrics.sum_ns, METRICS_COMMANDS, sum_ns);
+
+    fprintf(out,
+            "# HELP db_command_duration_seconds Time taken by client "
+            "commands.\n"
+            "# TYPE db_command_duration_seconds histogram\n");
+    for (size_t i = 0; i < METRICS_COMMANDS; i++) {
+        char label[8];
+        uint64_t count = 0;
+        if (i < METRICS_COMMANDS - 1) {
+            snprintf(label, sizeof(label), "%c", metrics_commands[i]);
+        } else {
+            snprintf(label, sizeof(label), "other");
+        }
+        // the buckets are cumulative
+        for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+            count += buckets[i][b];
+            if (b < METRICS_BUCKETS - 1) {
+                fprintf(out,
+                        "db_command_duration_seconds_bucket{command=\"%s\","
+                        "le=\"%g\"} %llu\n",
+                        label, metrics_bounds_ns[b] / 1e9,
+                        (unsigned long long)count);
+            } else {
+                fprintf(out,
+                        "db_command_duration_seconds_bucket{command=\"%s\","
+                        "le=\"+Inf\"} %llu\n",
+                        label, (unsigned long long)count);
+            }
+        }
+        fprintf(out, "db_command_duration_seconds_sum{command=\"%s\"} %.9f\n",
+                label, sum_ns[i] / 1e9);
+        fprintf(out, "db_command_duration_seconds_count{command=\"%s\"} %llu\n",
+                label, (unsigned long long)count);
+    }
+    fprintf(out,
+            "# HELP db_connections_opened_total Client connections accepted.\n"
+            "# TYPE db_connections_opened_total counter\n"
+            "db_connections_opened_total %llu\n"
+            "# HELP db_connections Client connections open.\n"
+            "# TYPE db_connections gauge\n"
+            "db_connections %lld\n",
+            (unsigned long long)opened, (long long)(opened - closed));
+    fprintf(out,
+            "# HELP db_lock_acquisitions_total Node locks taken by client "
+            "commands.\n"
+            "# TYPE db_lock_acquisitions_total counter\n"
+            "db_lock_acquisitions_total %llu\n"
+            "# HELP db_lock_wait_seconds_total Time client commands waited "
+            "for node locks held by other threads.\n"
+            "# TYPE db_lock_wait_seconds_total counter\n"
+            "db_lock_wait_seconds_total %.9f\n",
+            (unsigned long long)stats_sum(metrics.locks),
+            stats_sum(metrics.lock_wait_ns) / 1e9);
+    long keys = db_count();
+    if (keys >= 0) {
+        fprintf(out,
+                "# HELP db_keys Keys in the default database.\n"
+                "# TYPE db_keys gauge\n"
+                "db_keys %ld\n",
+                keys);
+    }
+    fprintf(out,
+            "# HELP db_resident_memory_bytes Resident memory of the server.\n"
+            "# TYPE db_resident_memory_bytes gauge\n"
+            "db_resident_memory_bytes %llu\n",
+            (unsigned long long)metrics_resident());
+}
+
+/* Writes all of len bytes of data to fd. Returns -1 if that failed. */
+static int metrics_send(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Answers one HTTP request on fd, which it closes. */
+static void metrics_answer(int fd) {
+    char request[METRICS_REQUEST + 1];
+    char header[128];
+    size_t have = 0;
+    char *body = 0;
+    size_t len = 0;
+    FILE *out;
+    const char *status = "404 Not Found";
+
+    // a scraper that stops talking must not hold up the next one
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (have < METRICS_REQUEST) {
+        ssize_t n = read(fd, request + have, METRICS_REQUEST - have);
+        if (n <= 0) break;
+        have += n;
+        request[have] = '\0';
+        if (strstr(request, "\r\n\r\n") != 0) break;
+    }
+    request[have] = '\0';
+    if ((out = open_memstream(&body, &len)) == 0) {
+        close(fd);
+        return;
+    }
+    if (strncmp(request, "GET /metrics ", 13) == 0) {
+        status = "200 OK";
+        metrics_write(out);
+    } else {
+        fprintf(out, "try GET /metrics\n");
+    }
+    if (fclose(out) == 0) {
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n",
+                 status, len);
+        if (metrics_send(fd, header, strlen(header)) == 0) {
+            metrics_send(fd, body, len);
+        }
+    }
+    free(body);
+    close(fd);
+}
+
+static void *metrics_serve(void *arg) {
+    (void)arg;
+    while (1) {
+        int fd;
+        if ((fd = accept(metrics.sock, 0, 0)) < 0) {
+            perror("metrics: accept");
+            continue;
+        }
+        // metrics_close() cancels the thread; only while it waits in accept()
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        metrics_answer(fd);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    return 0;
+}
+
+int metrics_open(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int err;
+
+    if (!metrics.on) {
+        if ((metrics.buckets =
+                 stats_register("command.duration_buckets",
+                                METRICS_COMMANDS * METRICS_BUCKETS)) < 0 ||
+            (metrics.sum_ns =
+                 stats_register("command.duration_ns", METRICS_COMMANDS)) < 0 ||
+            (metrics.locks = stats_register("command.locks", 1)) < 0 ||
+            (metrics.lock_wait_ns = stats_register("command.lock_wait_ns", 1)) <
+                0) {
+            fprintf(stderr, "metrics: too many counters\n");
+            return -1;
+        }
+        metrics.on = 1;
+    }
+    if ((metrics.sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("metrics: socket");
+        return -1;
+    }
+    setsockopt(metrics.sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    // only scrapers on this host, the metrics are not access controlled
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(metrics.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(metrics.sock, 16) < 0) {
+        perror("metrics: bind");
+        close(metrics.sock);
+        metrics.sock = -1;
+        return -1;
+    }
+    if ((err = pthread_create(&metrics.thread, 0, metrics_serve, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    return 0;
+}
+
+int metrics_enabled(void) { return metrics.on; }
+
+void metrics_close(void) {
+    int err;
+    if (metrics.sock < 0) return;
+    if ((err = pthread_cancel(metrics.thread)) != 0) {
+        handle_error_en(err, "pthread_cancel");
+    }
+    if ((err = pthread_join(metrics.thread, 0)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    close(metrics.sock);
+    metrics.sock = -1;
+}
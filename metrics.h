@@ -0,0 +1,37 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Server metrics in the Prometheus text format, served over HTTP on a local
+ * port. The counters are kept per thread in the statistics registry (see
+ * stats.h), so counting takes no lock and shares no cache line with other
+ * threads, and a scrape never makes a client thread wait.
+ */
+
+/*
+ * Starts a thread serving GET /metrics on 127.0.0.1:port, and starts
+ * counting. Must first be called before clients are served. Returns 0 on
+ * success and -1 if the port could not be bound.
+ */
+int metrics_open(int port);
+
+/* Nonzero once metrics_open() has succeeded. */
+int metrics_enabled(void);
+
+/*
+ * Counts one client command, by its first letter, that took total_ns, and
+ * the locks it took and how long it waited for them (see db_lock_stats()).
+ */
+void metrics_command(char command, uint64_t total_ns, size_t locks,
+                     uint64_t wait_ns);
+
+/*
+ * Stops serving metrics, for instance while the port is handed to a new
+ * server. Counting goes on, and metrics_open() can serve them again.
+ */
+void metrics_close(void);
+
+#endif  // METRICS_H_
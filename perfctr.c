@@ -0,0 +1,248 @@
+#include "./perfctr.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./stats.h"
+
+/* perf_event_open() groups, and the server's per command sums of them */
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[PERFCTR_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"dTLB-load-misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+int perfctr_open(perfctr_t *pc) {
+    struct perf_event_attr attr;
+    pc->leader = -1;
+    pc->nopen = 0;
+    for (int e = 0; e < PERFCTR_EVENTS; e++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        // the first event that opens leads the group, the rest join it
+        pc->fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, pc->leader, 0);
+        if (pc->fd[e] < 0) continue;
+        if (pc->leader < 0) pc->leader = pc->fd[e];
+        pc->nopen++;
+    }
+    return pc->nopen;
+}
+
+const char *perfctr_name(int event) { return events[event].name; }
+
+int perfctr_counting(const perfctr_t *pc, int event) {
+    return pc->fd[event] >= 0;
+}
+
+int perfctr_read(const perfctr_t *pc, uint64_t values[PERFCTR_EVENTS]) {
+    // the number of events, then their counts in the order they were opened
+    uint64_t group[1 + PERFCTR_EVENTS];
+    ssize_t want = (1 + pc->nopen) * sizeof(uint64_t);
+    int i = 1;
+
+    if (pc->leader < 0 || read(pc->leader, group, want) != want) return -1;
+    for (int e = 0; e < PERFCTR_EVENTS; e++) {
+        values[e] = pc->fd[e] >= 0 ? group[i++] : 0;
+    }
+    return 0;
+}
+
+void perfctr_close(perfctr_t *pc) {
+    // the leader last, so the group stays whole until it goes
+    for (int e = PERFCTR_EVENTS - 1; e >= 0; e--) {
+        if (pc->fd[e] >= 0 && pc->fd[e] != pc->leader) close(pc->fd[e]);
+        pc->fd[e] = -1;
+    }
+    if (pc->leader >= 0) close(pc->leader);
+    pc->leader = -1;
+    pc->nopen = 0;
+}
+
+// the commands summed under their own letter; the rest count as "other", in
+// the slot of the terminating '\0'
+static const char perfctr_commands[] = "qadfnAQDVK";
+#define PERFCTR_COMMANDS (sizeof(perfctr_commands))
+
+/* What a client thread needs to measure its own commands */
+typedef struct sampler_thread {
+    perfctr_t pc;
+    uint32_t random;  // xorshift state, never 0
+    int measuring;
+    uint64_t start[PERFCTR_EVENTS];
+} sampler_thread_t;
+
+static struct {
+    // guards the totals reported
+    pthread_mutex_t mutex;
+    pthread_key_t key;  // closes a thread's counters when it exits
+    int every;
+    int on;
+    int counting[PERFCTR_EVENTS];  // as found by perfctr_sample_open()
+    // the first ids of the sums (see stats.h)
+    int measured;  // one per command
+    int counts;    // PERFCTR_EVENTS per command
+    uint64_t reported[PERFCTR_COMMANDS];
+    uint64_t reported_counts[PERFCTR_COMMANDS][PERFCTR_EVENTS];
+} sampler = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// 0 until the thread runs its first command
+static __thread sampler_thread_t *mine = 0;
+
+/* Closes an exiting thread's counters, which count only that thread. */
+static void sampler_release(void *self) {
+    perfctr_close(&((sampler_thread_t *)self)->pc);
+    free(self);
+}
+
+int perfctr_sample_open(int every) {
+    perfctr_t probe;
+    int err;
+
+    if (every < 1) every = 1;
+    if (perfctr_open(&probe) == 0) return -1;
+    for (int e = 0; e < PERFCTR_EVENTS; e++) {
+        sampler.counting[e] = perfctr_counting(&probe, e);
+    }
+    perfctr_close(&probe);
+    if ((sampler.measured =
+             stats_register("perfctr.measured", PERFCTR_COMMANDS)) < 0 ||
+        (sampler.counts = stats_register(
+             "perfctr.counts", PERFCTR_COMMANDS * PERFCTR_EVENTS)) < 0) {
+        return -1;
+    }
+    if ((err = pthread_key_create(&sampler.key, sampler_release)) != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+    sampler.every = every;
+    sampler.on = 1;
+    return 0;
+}
+
+int perfctr_sampling(void) { return sampler.on; }
+
+/* Returns the calling thread's state, or 0 if out of memory. */
+static sampler_thread_t *sampler_mine(void) {
+    sampler_thread_t *self;
+    int err;
+    if (mine != 0) return mine;
+    if ((self = calloc(1, sizeof(sampler_thread_t))) == 0) return 0;
+    if ((err = pthread_setspecific(sampler.key, self)) != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    // counters count the thread that opens them
+    perfctr_open(&self->pc);
+    self->random = (uint32_t)(uintptr_t)self | 1;
+    return mine = self;
+}
+
+void perfctr_command_start(void) {
+    sampler_thread_t *self;
+    if ((self = sampler_mine()) == 0 || self->pc.nopen == 0) return;
+    // at random rather than every so many, which would alias with clients
+    // that repeat a pattern of commands
+    self->random ^= self->random << 13;
+    self->random ^= self->random >> 17;
+    self->random ^= self->random << 5;
+    self->measuring = self->random % sampler.every == 0 &&
+                      perfctr_read(&self->pc, self->start) == 0;
+}
+
+void perfctr_command_done(char command) {
+    sampler_thread_t *self = mine;
+    uint64_t now[PERFCTR_EVENTS];
+    size_t i;
+
+    if (self == 0 || !self->measuring) return;
+    self->measuring = 0;
+    if (perfctr_read(&self->pc, now) < 0) return;
+    for (i = 0; i < PERFCTR_COMMANDS - 1; i++) {
+        if (perfctr_commands[i] == command) break;
+    }
+    stats_add(sampler.measured + i, 1);
+    for (int e = 0; e < PERFCTR_EVENTS; e++) {
+        stats_add(sampler.counts + i * PERFCTR_EVENTS + e,
+                  now[e] - self->start[e]);
+    }
+}
+
+void perfctr_report(FILE *out) {
+    uint64_t measured[PERFCTR_COMMANDS];
+    uint64_t counts[PERFCTR_COMMANDS][PERFCTR_EVENTS];
+    int err;
+
+    if (!sampler.on) {
+        fprintf(out, "performance counters not enabled\n");
+        return;
+    }
+    if ((err = pthread_mutex_lock(&sampler.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    stats_sums(sampler.measured, PERFCTR_COMMANDS, measured);
+    stats_sums(sampler.counts, PERFCTR_COMMANDS * PERFCTR_EVENTS,
+               &counts[0][0]);
+    // report what was added since the last report, and remember the totals
+    for (size_t i = 0; i < PERFCTR_COMMANDS; i++) {
+        uint64_t total = measured[i];
+        measured[i] -= sampler.reported[i];
+        sampler.reported[i] = total;
+        for (int e = 0; e < PERFCTR_EVENTS; e++) {
+            total = counts[i][e];
+            counts[i][e] -= sampler.reported_counts[i][e];
+            sampler.reported_counts[i][e] = total;
+        }
+    }
+    if ((err = pthread_mutex_unlock(&sampler.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+
+    fprintf(out, "per command, measuring 1 in %d:\n%-8s %10s", sampler.every,
+            "command", "measured");
+    for (int e = 0; e < PERFCTR_EVENTS; e++) {
+        if (sampler.counting[e]) fprintf(out, " %17s", events[e].name);
+    }
+    if (sampler.counting[PERFCTR_CYCLES] &&
+        sampler.counting[PERFCTR_INSTRUCTIONS]) {
+        fprintf(out, " %6s", "IPC");
+    }
+    fprintf(out, "\n");
+    for (size_t i = 0; i < PERFCTR_COMMANDS; i++) {
+        if (measured[i] == 0) continue;
+        if (i < PERFCTR_COMMANDS - 1) {
+            fprintf(out, "%-8c %10llu", perfctr_commands[i],
+                    (unsigned long long)measured[i]);
+        } else {
+            fprintf(out, "%-8s %10llu", "other",
+                    (unsigned long long)measured[i]);
+        }
+        for (int e = 0; e < PERFCTR_EVENTS; e++) {
+            if (sampler.counting[e]) {
+                fprintf(out, " %17.1f", (double)counts[i][e] / measured[i]);
+            }
+        }
+        if (sampler.counting[PERFCTR_CYCLES] &&
+            sampler.counting[PERFCTR_INSTRUCTIONS]) {
+            uint64_t cycles = counts[i][PERFCTR_CYCLES];
+            fprintf(out, " %6.2f",
+                    cycles ? (double)counts[i][PERFCTR_INSTRUCTIONS] / cycles
+                           : 0.0);
+        }
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef PERFCTR_H_
+#define PERFCTR_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Hardware performance counters from perf_event_open(), counting the user
+ * space work of the calling thread. The events are opened as one group, so
+ * a single read() returns all of them as of the same instant. Events the
+ * CPU or the kernel does not expose (as in most VMs) are left out; with
+ * perf_event_paranoid above 2 there are none.
+ */
+
+enum perfctr_event {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_LLC_MISSES,
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_DTLB_MISSES,
+    PERFCTR_EVENTS
+};
+
+typedef struct perfctr {
+    int fd[PERFCTR_EVENTS];  // -1 for an event that could not be opened
+    int leader;              // the fd the group is read through, or -1
+    int nopen;
+} perfctr_t;
+
+/*
+ * Opens and starts the counters for the calling thread. Returns how many of
+ * the events could be opened; with none, perfctr_read() always fails.
+ */
+int perfctr_open(perfctr_t *pc);
+
+/* The event's name, e.g. "LLC-misses". */
+const char *perfctr_name(int event);
+
+/* Nonzero if the event is being counted. */
+int perfctr_counting(const perfctr_t *pc, int event);
+
+/*
+ * Stores the counts so far in values, leaving 0 for the events not being
+ * counted. Returns 0 on success and -1 on failure.
+ */
+int perfctr_read(const perfctr_t *pc, uint64_t values[PERFCTR_EVENTS]);
+
+/* Stops and closes the counters. */
+void perfctr_close(perfctr_t *pc);
+
+/*
+ * Per command type accounting for the server: each client thread measures
+ * a random sample of the commands it runs with its own counters, and the
+ * differences are added up by the command's first letter in per-thread
+ * counters (see stats.h).
+ */
+
+/*
+ * Starts measuring one command in every, on average; the counters of each
+ * thread are opened when it first runs a command. Returns -1, without starting,
+ * if no event can be counted on this machine.
+ */
+int perfctr_sample_open(int every);
+
+/* Nonzero once perfctr_sample_open() has succeeded. */
+int perfctr_sampling(void);
+
+/* Called before and after each client command, by the thread running it. */
+void perfctr_command_start(void);
+void perfctr_command_done(char command);
+
+/*
+ * Writes the counts per measured command, by command, since the previous
+ * report to out.
+ */
+void perfctr_report(FILE *out);
+
+#endif  // PERFCTR_H_
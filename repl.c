@@ -0,0 +1,456 @@
+#include "./repl.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "./cdc.h"
+#include "./comm.h"
+#include "./db.h"
+#include "./lsm.h"
+
+/* Sending the database to followers, and following a leader */
+
+// how long a follower waits before reconnecting to its leader
+#define REPL_RETRY_MS 1000
+// keys per chunk of a snapshot, the most the leader holds in memory for one
+#define REPL_CHUNK_KEYS 4096
+
+static struct repl {
+    char host[BUFLEN];
+    char port[32];
+    pthread_t thread;
+    // guards everything below
+    pthread_mutex_t mutex;
+    // wakes the thread early from its retry delay when stopping
+    pthread_cond_t cond;
+    int stopping;
+    int fd;            // the connection to the leader, or -1
+    int streaming;     // the snapshot is loaded and changes are being applied
+    int ready;         // a whole snapshot is loaded; read without the mutex
+    uint64_t applied;  // the sequence number of the last change applied
+    uint64_t changes;  // changes applied since the last snapshot
+    uint64_t leader_next;  // the leader's next sequence number, as of
+    long long heard_ms;    // this time, the last heartbeat
+    long long delay_ms;    // how long that heartbeat took to arrive
+    int snapshots;         // snapshots loaded
+} repl = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+          .cond = PTHREAD_COND_INITIALIZER,
+          .fd = -1};
+
+static int repl_on = 0;
+
+int repl_following(void) { return repl_on; }
+
+int repl_ready(void) { return __atomic_load_n(&repl.ready, __ATOMIC_ACQUIRE); }
+
+static long long repl_now_ms(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* A chunk of a snapshot, filled by db_dump_range() through repl_pick(). */
+typedef struct repl_chunk {
+    FILE *out;
+    size_t keys;
+    int full;
+    char next[BUFLEN];  // the key the next chunk starts at, once full
+} repl_chunk_t;
+
+static FILE *repl_pick(const char *name, void *arg) {
+    repl_chunk_t *chunk = arg;
+    if (chunk->keys == REPL_CHUNK_KEYS) {
+        // stops the walk
+        snprintf(chunk->next, sizeof(chunk->next), "%s", name);
+        chunk->full = 1;
+        return 0;
+    }
+    chunk->keys++;
+    return chunk->out;
+}
+
+int repl_serve(FILE *cxstr) {
+    char header[64];
+    char lo[BUFLEN] = "";
+    repl_chunk_t chunk = {.full = 1};
+    char *data = 0;
+    size_t size = 0;
+    size_t total = 0;
+    uint64_t from;
+    long long start;
+    int ret;
+
+    if (!cdc_enabled() || lsm_enabled()) {
+        // the snapshot would miss keys in run files
+        const char *why = lsm_enabled() ? "cannot replicate in LSM mode\n"
+                                        : "change capture not enabled\n";
+        struct iovec iov = {(void *)why, strlen(why)};
+        return comm_writev(cxstr, &iov, 1);
+    }
+    // every change from here on is streamed after the snapshot
+    from = cdc_next();
+    start = repl_now_ms(CLOCK_MONOTONIC);
+    int hlen = snprintf(header, sizeof(header), "snapshot %" PRIu64 "\n", from);
+    struct iovec iov = {header, hlen};
+    if (comm_writev(cxstr, &iov, 1) < 0) return -1;
+    // a chunk at a time, dumped to memory first so that the tree is not
+    // locked while the follower reads, and only one chunk is held at once
+    while (chunk.full) {
+        chunk.keys = 0;
+        chunk.full = 0;
+        if ((chunk.out = open_memstream(&data, &size)) == 0) {
+            perror("open_memstream");
+            return -1;
+        }
+        ret = db_dump_range(lo, 0, repl_pick, &chunk);
+        if (fclose(chunk.out) == EOF || ret < 0) {
+            fprintf(stderr, "replication: could not take a snapshot\n");
+            free(data);
+            return -1;
+        }
+        hlen = snprintf(header, sizeof(header), "%zu\n", size);
+        struct iovec iov[3] = {{header, hlen}, {data, size}, {"\n", 1}};
+        ret = size > 0 ? comm_writev(cxstr, iov, 3) : 0;
+        free(data);
+        data = 0;
+        if (ret < 0) return -1;
+        total += size;
+        strcpy(lo, chunk.next);
+    }
+    // an empty chunk ends the snapshot
+    iov.iov_base = "0\n";
+    iov.iov_len = 2;
+    if (comm_writev(cxstr, &iov, 1) < 0) return -1;
+
+    // the changes made meanwhile are only in the ring, which must still
+    // hold them, with room to spare for the next follower
+    uint64_t made = cdc_next() - from;
+    long long took = repl_now_ms(CLOCK_MONOTONIC) - start;
+    fprintf(stderr,
+            "replication: sent a %zu byte snapshot in %lld ms, streaming "
+            "from %" PRIu64 "\n",
+            total, took, from);
+    if (made > cdc_capacity() / 2) {
+        fprintf(stderr,
+                "replication: %" PRIu64
+                " changes were made during the snapshot and the ring holds "
+                "%zu; -R should be at least %" PRIu64 " at this rate\n",
+                made, cdc_capacity(), 2 * made);
+    }
+    return cdc_stream(cxstr, from, 1);
+}
+
+static int repl_connect(void) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+    struct addrinfo *res;
+    int sock = -1;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(repl.host, repl.port, &hints, &result)) != 0) {
+        fprintf(stderr, "replication: %s\n", gai_strerror(err));
+        return -1;
+    }
+    for (res = result; res != 0; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) break;
+        if (close(sock) < 0) perror("close");
+        sock = -1;
+    }
+    freeaddrinfo(result);
+    return sock;
+}
+
+/* Loads the chunks of a snapshot from in, up to the empty one that ends it. */
+static int repl_load(FILE *in) {
+    char line[64];
+    char *data;
+    FILE *mem;
+    size_t len;
+    int keys = 0;
+    int ret;
+
+    while (fgets(line, sizeof(line), in) != 0 &&
+           sscanf(line, "%zu", &len) == 1) {
+        if (len == 0) return keys;
+        if ((data = malloc(len)) == 0) {
+            perror("malloc");
+            return -1;
+        }
+        if (fread(data, 1, len, in) != len || fgetc(in) != '\n') {
+            free(data);
+            return -1;
+        }
+        if ((mem = fmemopen(data, len, "r")) == 0) {
+            perror("fmemopen");
+            free(data);
+            return -1;
+        }
+        ret = db_load(mem);
+        fclose(mem);
+        free(data);
+        if (ret < 0) return -1;
+        keys += ret;
+    }
+    return -1;
+}
+
+/* Applies one change line from the leader's stream. Returns -1 on error. */
+static int repl_apply(FILE *in, const char *line) {
+    unsigned long long seq;
+    char op;
+    char name[BUFLEN];
+    char value[BUFLEN];
+    int err;
+    int ret;
+
+    if (line[0] == 'h') {
+        unsigned long long next;
+        long long sent_ms;
+        if (sscanf(line, "h %llu %lld", &next, &sent_ms) != 2) return -1;
+        if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        repl.leader_next = next;
+        repl.heard_ms = repl_now_ms(CLOCK_MONOTONIC);
+        repl.delay_ms = repl_now_ms(CLOCK_REALTIME) - sent_ms;
+        if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        return 0;
+    }
+    ret = sscanf(line, "%llu %c %255s %255s", &seq, &op, name, value);
+    if (ret == 4 && op == 'a') {
+        ret = db_add(name, value);
+    } else if (ret == 3 && op == 'd') {
+        ret = db_remove(name);
+    } else if (ret == 4 && op == 'D') {
+        ret = db_remove_range(name, value);
+    } else if (ret == 4 && op == 'A') {
+        blob_t *blob = db_blob_alloc(strtoul(value, 0, 10));
+        if (blob == 0 || fread(blob->data, 1, blob->len, in) != blob->len ||
+            fgetc(in) != '\n') {
+            if (blob != 0) db_blob_put(blob);
+            return -1;
+        }
+        if ((ret = db_add_blob(name, blob)) <= 0) db_blob_put(blob);
+    } else {
+        return -1;
+    }
+    // a change the snapshot already had fails harmlessly
+    if (ret < 0) return -1;
+    if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    repl.applied = seq;
+    repl.changes++;
+    if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return 0;
+}
+
+/*
+ * Loads the leader's snapshot from in, replacing whatever an earlier
+ * connection loaded, and applies changes until the stream ends.
+ */
+static void repl_sync(FILE *in) {
+    char line[3 * BUFLEN];
+    unsigned long long from;
+    int keys;
+    int err;
+
+    if (fgets(line, sizeof(line), in) == 0) return;
+    if (sscanf(line, "snapshot %llu", &from) != 1) {
+        fprintf(stderr, "replication: leader answered %s", line);
+        return;
+    }
+    // a query would see some of the old keys and some of the new ones
+    __atomic_store_n(&repl.ready, 0, __ATOMIC_RELEASE);
+    if (repl.snapshots > 0 && db_clear() < 0) {
+        fprintf(stderr, "replication: could not clear the database\n");
+        return;
+    }
+    if ((keys = repl_load(in)) < 0) {
+        fprintf(stderr, "replication: could not load the snapshot\n");
+        return;
+    }
+    if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    repl.snapshots++;
+    repl.streaming = 1;
+    repl.applied = from - 1;
+    repl.changes = 0;
+    if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    __atomic_store_n(&repl.ready, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "replication: loaded %d keys from %s:%s at change %llu\n",
+            keys, repl.host, repl.port, from);
+
+    // "subscribed <from>", then the changes
+    while (fgets(line, sizeof(line), in) != 0) {
+        if (strncmp(line, "subscribed", 10) == 0) continue;
+        if (strncmp(line, "gap", 3) == 0) {
+            fprintf(stderr, "replication: fell behind the leader\n");
+            break;
+        }
+        if (repl_apply(in, line) < 0) {
+            fprintf(stderr, "replication: bad change %s", line);
+            break;
+        }
+    }
+    fprintf(stderr, "replication: lost the leader at change %" PRIu64 "\n",
+            repl.applied);
+}
+
+/* One connection to the leader. */
+static void repl_session(void) {
+    FILE *in;
+    int sock;
+    int go;
+    int err;
+
+    if ((sock = repl_connect()) < 0) return;
+    if ((in = fdopen(sock, "r")) == 0) {
+        perror("fdopen");
+        if (close(sock) < 0) perror("close");
+        return;
+    }
+    if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    // repl_close() shuts the connection down to stop us
+    go = !repl.stopping;
+    repl.fd = go ? sock : -1;
+    if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if (go && write(sock, "R\n", 2) == 2) repl_sync(in);
+
+    if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    repl.fd = -1;
+    repl.streaming = 0;
+    if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    fclose(in);
+}
+
+static void *repl_thread(void *arg) {
+    int err;
+    while (1) {
+        repl_session();
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REPL_RETRY_MS / 1000;
+        deadline.tv_nsec += (REPL_RETRY_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        err = 0;
+        while (!repl.stopping && err != ETIMEDOUT) {
+            err = pthread_cond_timedwait(&repl.cond, &repl.mutex, &deadline);
+            if (err != 0 && err != ETIMEDOUT) {
+                handle_error_en(err, "pthread_cond_timedwait");
+            }
+        }
+        int stopping = repl.stopping;
+        if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (stopping) break;
+    }
+    return arg;
+}
+
+int repl_follow(const char *leader) {
+    const char *colon = strrchr(leader, ':');
+    int err;
+    if (colon == 0 || colon == leader || colon[1] == '\0' ||
+        (size_t)(colon - leader) >= sizeof(repl.host) ||
+        strlen(colon + 1) >= sizeof(repl.port)) {
+        fprintf(stderr, "replication: expected <host>:<port>\n");
+        return -1;
+    }
+    memcpy(repl.host, leader, colon - leader);
+    repl.host[colon - leader] = '\0';
+    strcpy(repl.port, colon + 1);
+    repl_on = 1;
+    if ((err = pthread_create(&repl.thread, 0, repl_thread, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    return 0;
+}
+
+void repl_report(FILE *out) {
+    int err;
+    if (!repl_on) {
+        fprintf(out, "not following a leader\n");
+        return;
+    }
+    if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (!repl.streaming) {
+        fprintf(out, "replication: connecting to %s:%s\n", repl.host,
+                repl.port);
+    } else {
+        uint64_t behind = repl.leader_next > repl.applied + 1
+                              ? repl.leader_next - repl.applied - 1
+                              : 0;
+        fprintf(out,
+                "replication: following %s:%s, applied change %" PRIu64
+                " (%" PRIu64 " since snapshot %d), %" PRIu64
+                " behind the leader as of %lld ms ago, heartbeat delay "
+                "%lld ms\n",
+                repl.host, repl.port, repl.applied, repl.changes,
+                repl.snapshots, behind,
+                repl_now_ms(CLOCK_MONOTONIC) - repl.heard_ms, repl.delay_ms);
+    }
+    if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+void repl_close(void) {
+    int err;
+    if (!repl_on) return;
+    if ((err = pthread_mutex_lock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    repl.stopping = 1;
+    // wake the thread from a read on the connection or from its retry delay
+    if (repl.fd >= 0 && shutdown(repl.fd, SHUT_RDWR) < 0) perror("shutdown");
+    if ((err = pthread_cond_broadcast(&repl.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_broadcast");
+    }
+    if ((err = pthread_mutex_unlock(&repl.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_join(repl.thread, 0)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    repl_on = 0;
+}
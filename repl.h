@@ -0,0 +1,56 @@
+#ifndef REPL_H_
+#define REPL_H_
+
+#include <stdio.h>
+
+/*
+ * Asynchronous leader-follower replication. A follower connects to the
+ * leader's client port and sends "R". The leader, which must keep a change
+ * ring (see cdc.h), notes the next sequence number, sends a snapshot in
+ * db_dump() format, and then streams every change from that sequence number on with
+ * heartbeats. Changes made while the snapshot was taken are in both, which
+ * is harmless: replaying a key's changes in order ends in the same state
+ * whether or not the snapshot already had some of them.
+ */
+
+/*
+ * Serves a follower's "R" on the leader: writes "snapshot <seq>", then the
+ * snapshot in chunks of a few thousand keys, each as "<length>", its bytes
+ * and a newline, ending with "0", then the change stream from seq (see
+ * cdc_stream()). Reports on stderr when the changes made while the snapshot
+ * was sent took up more than half the ring. Returns 0 when the follower went away and -1 if the
+ * connection failed.
+ */
+int repl_serve(FILE *cxstr);
+
+/*
+ * Starts a thread that follows the leader at host:port, loading its snapshot
+ * and applying its changes. When the connection is lost, or the follower
+ * falls behind the leader's ring, the thread reconnects every second and
+ * replaces the database with a new snapshot. Returns 0 on success and -1 on
+ * a malformed address.
+ */
+int repl_follow(const char *leader);
+
+/* Nonzero if this server is a follower, which refuses changes from clients. */
+int repl_following(void);
+
+/*
+ * Nonzero once a follower holds a whole snapshot. It is cleared while a new
+ * snapshot replaces the database after a reconnect, when the keys are a mix
+ * of the old and the new ones and queries must wait; in between the follower
+ * serves the keys it had, like any lagging follower.
+ */
+int repl_ready(void);
+
+/*
+ * Writes the replication state and lag to out: the last change applied, how
+ * many changes the leader is ahead by as of its last heartbeat, how long ago
+ * that was, and how long the heartbeat took to arrive.
+ */
+void repl_report(FILE *out);
+
+/* Stops following. */
+void repl_close(void);
+
+#endif  // REPL_H_
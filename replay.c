@@ -0,0 +1,490 @@
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "./capture.h"
+#include "./comm.h"
+
+/*
+ * Replays a capture taken with the server's -x option (see capture.h)
+ * against a server. By default each captured connection is replayed on a
+ * connection of its own, opened when it sent its first command, and each
+ * command is sent when it arrived in the capture, scaled by -s, so the
+ * server sees the same mix, concurrency and pauses as it did in production.
+ * The connections are handed out in the order of their first commands to a
+ * pool of -c threads (TIMED_WORKERS by default), so a capture of many short
+ * connections does not need a thread for each; one that had more open at
+ * once than there are threads starts some late, which shows in how far the
+ * replay fell behind. With -f the timing is ignored: -c workers each take
+ * the next captured connection and send its commands back to back, -p at a
+ * time without waiting for the replies in between, until every connection
+ * has been replayed. Commands of
+ * one connection are always sent in order on one connection, so named
+ * databases and the like still apply. Streaming commands (S, W and R) are
+ * left out, since they would never finish. It reports the commands per
+ * second and the latency from sending each command to its reply.
+ */
+
+#define BUFSIZE 1024
+#define WORKERS 16
+// the threads of a timed replay, the most connections it keeps open at once
+#define TIMED_WORKERS 256
+// the most commands in flight on a connection with -p
+#define MAX_DEPTH 1024
+
+typedef struct command {
+    uint64_t at_us;  // since the start of the capture
+    const char *bytes;
+    size_t len;
+} command_t;
+
+typedef struct connection {
+    command_t *commands;
+    size_t n;
+    size_t size;
+    uint64_t closed_us;  // when it hung up, or 0 if still open at the end
+} connection_t;
+
+typedef struct worker {
+    pthread_t thread;
+    uint64_t *latency_ns;
+    size_t n;
+    size_t size;
+    uint64_t late_us;  // the furthest behind the capture's timing it fell
+    size_t failed;     // connections that could not be replayed
+} worker_t;
+
+static struct {
+    const char *server;
+    const char *port;
+    connection_t *connections;
+    size_t nconnections;
+    size_t skipped;
+    int fast;
+    int depth;
+    double speed;
+    struct timespec start;
+    // the connections in the order of their first commands, and the next
+    // one for a worker to take
+    size_t *order;
+    size_t next;
+} replay = {.depth = 1, .speed = 1.0};
+
+/*
+ * Helper that opens a TCP socket representing the server.
+ * Returns the file descriptor on success, -1 on failure.
+ */
+static int get_socket(const char *server, const char *port) {
+    int sock = -1;
+    int one = 1;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    struct addrinfo *res;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) break;
+        close(sock);
+    }
+    freeaddrinfo(result);
+    if (res == NULL) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", server);
+        return -1;
+    }
+    // commands go out as soon as they are written, not after the last reply
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/* Reads an unsigned LEB128 varint at *p, before end. Returns -1 if cut off. */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+                      uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return 0;
+    }
+    return -1;
+}
+
+/*
+ * Reads the capture at path into memory and sorts its commands by
+ * connection. Returns the number of commands, or -1 if it is not a capture.
+ */
+static long load_capture(const char *path) {
+    const unsigned char *p, *end;
+    unsigned char *data;
+    uint64_t id, delay, len, at = 0;
+    size_t size, magic = strlen(CAPTURE_MAGIC);
+    long count = 0;
+    FILE *file;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    // the commands point into it, so it is kept until the end
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    if ((data = malloc(size + 1)) == NULL ||
+        fread(data, 1, size, file) != size) {
+        perror(path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    if (size < magic || memcmp(data, CAPTURE_MAGIC, magic) != 0) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        return -1;
+    }
+    end = data + size;
+    for (p = data + magic; p < end;) {
+        if (get_varint(&p, end, &id) < 0 || get_varint(&p, end, &delay) < 0 ||
+            get_varint(&p, end, &len) < 0 || id == 0 ||
+            len > (uint64_t)(end - p)) {
+            // a capture cut short, say by a crash, is replayed up to there
+            fprintf(stderr,
+                    "%s is truncated, replaying the %ld commands "
+                    "before\n",
+                    path, count);
+            break;
+        }
+        // the replay starts with the first command, not when capturing did
+        if (count > 0 || replay.nconnections > 0) at += delay;
+        // connections are numbered densely from 1
+        if (id > replay.nconnections) {
+            connection_t *grown =
+                realloc(replay.connections, id * sizeof(connection_t));
+            if (grown == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            memset(grown + replay.nconnections, 0,
+                   (id - replay.nconnections) * sizeof(connection_t));
+            replay.connections = grown;
+            replay.nconnections = id;
+        }
+        connection_t *c = &replay.connections[id - 1];
+        if (len == 0) {
+            c->closed_us = at;
+        } else if (strchr("SWR", p[0]) != NULL) {
+            replay.skipped++;
+        } else {
+            if (c->n == c->size) {
+                size_t grow = c->size ? 2 * c->size : 16;
+                command_t *grown =
+                    realloc(c->commands, grow * sizeof(command_t));
+                if (grown == NULL) {
+                    perror("realloc");
+                    return -1;
+                }
+                c->commands = grown;
+                c->size = grow;
+            }
+            c->commands[c->n++] = (command_t){at, (const char *)p, len};
+            count++;
+        }
+        p += len;
+    }
+    return count;
+}
+
+/* Sleeps until us after the start of the replay, scaled by -s. */
+static void sleep_until(uint64_t us) {
+    struct timespec when = replay.start;
+    uint64_t ns = (uint64_t)(us / replay.speed * 1000);
+    when.tv_sec += ns / 1000000000;
+    when.tv_nsec += ns % 1000000000;
+    if (when.tv_nsec >= 1000000000) {
+        when.tv_sec++;
+        when.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) ==
+           EINTR) {
+    }
+}
+
+static uint64_t since_start_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - replay.start.tv_sec) * 1000000000LL + now.tv_nsec -
+            replay.start.tv_nsec) /
+           1000;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Skips n bytes of the connection. Returns -1 if it closed first. */
+static int skip_bytes(FILE *in, size_t n) {
+    char buf[BUFSIZE];
+    while (n > 0) {
+        size_t chunk = n < sizeof(buf) ? n : sizeof(buf);
+        if (fread(buf, 1, chunk, in) != chunk) return -1;
+        n -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * Reads the reply to command, which is a single line except after Q, V and
+ * K (see client.c). Returns -1 if the connection closed.
+ */
+static int read_reply(FILE *in, const command_t *command) {
+    char line[BUFSIZE];
+    if (fgets(line, sizeof(line), in) == NULL) return -1;
+    if (line[0] < '0' || line[0] > '9') return 0;
+    // a value, and its newline
+    if (command->bytes[0] == 'Q') return skip_bytes(in, atol(line) + 1);
+    // or a count of keys, one per line
+    if (command->bytes[0] == 'V' || command->bytes[0] == 'K') {
+        for (long n = atol(line); n > 0; n--) {
+            if (fgets(line, sizeof(line), in) == NULL) return -1;
+        }
+    }
+    return 0;
+}
+
+/* Writes all len bytes. Returns -1 if the connection failed. */
+static int write_all(int fd, const char *bytes, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, bytes, len);
+        if (n < 0) return -1;
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void record_latency(worker_t *w, uint64_t ns) {
+    if (w->n == w->size) {
+        size_t grow = w->size ? 2 * w->size : 1024;
+        uint64_t *grown = realloc(w->latency_ns, grow * sizeof(uint64_t));
+        if (grown == NULL) return;
+        w->latency_ns = grown;
+        w->size = grow;
+    }
+    w->latency_ns[w->n++] = ns;
+}
+
+/*
+ * Replays connection c on a new connection to the server: at the captured
+ * times if timed, otherwise as fast as the replies allow with up to
+ * replay.depth commands in flight. Returns -1 if the connection failed.
+ */
+static int replay_connection(worker_t *w, connection_t *c, int timed) {
+    uint64_t sent_ns[MAX_DEPTH];
+    size_t sent = 0, replied = 0;
+    int depth = timed ? 1 : replay.depth;
+    int sock, ok = 1;
+    FILE *in;
+
+    if (c->n == 0) return 0;
+    if (timed) sleep_until(c->commands[0].at_us);
+    if ((sock = get_socket(replay.server, replay.port)) < 0) return -1;
+    if ((in = fdopen(sock, "r")) == NULL) {
+        close(sock);
+        return -1;
+    }
+    while (ok && replied < c->n) {
+        // fill the pipeline, then wait for the oldest reply
+        while (ok && sent < c->n && sent - replied < (size_t)depth) {
+            command_t *command = &c->commands[sent];
+            if (timed) {
+                uint64_t due = command->at_us / replay.speed;
+                uint64_t now = since_start_us();
+                if (now < due) {
+                    sleep_until(command->at_us);
+                } else if (now - due > w->late_us) {
+                    w->late_us = now - due;
+                }
+            }
+            sent_ns[sent % MAX_DEPTH] = now_ns();
+            ok = write_all(sock, command->bytes, command->len) == 0;
+            sent++;
+        }
+        if (!ok || read_reply(in, &c->commands[replied]) < 0) break;
+        record_latency(w, now_ns() - sent_ns[replied % MAX_DEPTH]);
+        replied++;
+    }
+    // and stay connected for as long as the client did
+    if (timed && replied == c->n && c->closed_us > 0) {
+        sleep_until(c->closed_us);
+    }
+    fclose(in);
+    return replied == c->n ? 0 : -1;
+}
+
+/*
+ * A worker replays connection after connection, the earliest to start
+ * first, until none are left: at their captured times unless fast.
+ */
+static void *run_worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&replay.next, 1, __ATOMIC_RELAXED)) <
+           replay.nconnections) {
+        connection_t *c = &replay.connections[replay.order[i]];
+        if (replay_connection(w, c, !replay.fast) < 0) w->failed++;
+    }
+    return NULL;
+}
+
+/* Orders connections by their first command; those with none go last. */
+static int compare_first(const void *a, const void *b) {
+    const connection_t *x = &replay.connections[*(const size_t *)a];
+    const connection_t *y = &replay.connections[*(const size_t *)b];
+    uint64_t xt = x->n > 0 ? x->commands[0].at_us : UINT64_MAX;
+    uint64_t yt = y->n > 0 ? y->commands[0].at_us : UINT64_MAX;
+    if (xt != yt) return xt < yt ? -1 : 1;
+    // the capture numbers them in that order, which breaks ties
+    return x < y ? -1 : x > y;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Prints the throughput and latency over all workers. */
+static void report(worker_t *workers, int nworkers, double seconds) {
+    uint64_t *all, late_us = 0, sum = 0;
+    size_t n = 0, failed = 0;
+
+    for (int i = 0; i < nworkers; i++) {
+        n += workers[i].n;
+        failed += workers[i].failed;
+        if (workers[i].late_us > late_us) late_us = workers[i].late_us;
+    }
+    printf(
+        "replayed %zu commands of %zu connections in %.3f s, %.0f "
+        "commands/s\n",
+        n, replay.nconnections, seconds, n / seconds);
+    if (replay.skipped > 0) {
+        printf("left out %zu streaming commands\n", replay.skipped);
+    }
+    if (failed > 0) printf("%zu connections failed\n", failed);
+    if (!replay.fast) {
+        printf("fell behind the capture's timing by up to %.3f ms\n",
+               late_us / 1e3);
+    }
+    if (n == 0 || (all = malloc(n * sizeof(uint64_t))) == NULL) return;
+    n = 0;
+    for (int i = 0; i < nworkers; i++) {
+        memcpy(all + n, workers[i].latency_ns, workers[i].n * sizeof(uint64_t));
+        n += workers[i].n;
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+    for (size_t i = 0; i < n; i++) sum += all[i];
+    printf(
+        "latency in us: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+        "p99.9 %.1f, max %.1f\n",
+        sum / 1e3 / n, all[n / 2] / 1e3, all[n * 9 / 10] / 1e3,
+        all[n * 99 / 100] / 1e3, all[n * 999 / 1000] / 1e3, all[n - 1] / 1e3);
+    free(all);
+}
+
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-f] [-c <connections>] [-p <pipeline depth>] "
+            "[-s <speed>] <servername> <port> <capture>\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    int nworkers = 0;
+    worker_t *workers = NULL;
+    struct timespec end;
+    long count;
+    int opt;
+    int err;
+
+    while ((opt = getopt(argc, argv, "fc:p:s:")) != -1) {
+        switch (opt) {
+            case 'f':
+                replay.fast = 1;
+                break;
+            case 'c':
+                if ((nworkers = atoi(optarg)) < 1) nworkers = -1;
+                break;
+            case 'p':
+                replay.depth = atoi(optarg);
+                break;
+            case 's':
+                replay.speed = atof(optarg);
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 3 || nworkers < 0 || replay.depth < 1 ||
+        replay.depth > MAX_DEPTH || replay.speed <= 0) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    replay.server = argv[optind];
+    replay.port = argv[optind + 1];
+    if ((count = load_capture(argv[optind + 2])) < 0) return 1;
+    if (nworkers == 0) nworkers = replay.fast ? WORKERS : TIMED_WORKERS;
+    // no more threads than there are connections to replay
+    if ((size_t)nworkers > replay.nconnections) {
+        nworkers = replay.nconnections;
+    }
+    printf("replaying %ld commands of %zu connections %s with %d threads\n",
+           count, replay.nconnections,
+           replay.fast ? "as fast as possible" : "at their captured times",
+           nworkers);
+    if ((replay.order = malloc((replay.nconnections + 1) * sizeof(size_t))) ==
+            NULL ||
+        (nworkers > 0 &&
+         (workers = calloc(nworkers, sizeof(worker_t))) == NULL)) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < replay.nconnections; i++) replay.order[i] = i;
+    qsort(replay.order, replay.nconnections, sizeof(size_t), compare_first);
+
+    clock_gettime(CLOCK_MONOTONIC, &replay.start);
+    for (int i = 0; i < nworkers; i++) {
+        if ((err = pthread_create(&workers[i].thread, NULL, run_worker,
+                                  &workers[i])) != 0) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+    for (int i = 0; i < nworkers; i++) {
+        if ((err = pthread_join(workers[i].thread, NULL)) != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (nworkers > 0) {
+        report(workers, nworkers,
+               (end.tv_sec - replay.start.tv_sec) +
+                   (end.tv_nsec - replay.start.tv_nsec) / 1e9);
+    }
+    return 0;
+}
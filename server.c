@@ -6,13 +6,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include "./capture.h"
+#include "./cdc.h"
+#include "./ckpt.h"
 #include "./comm.h"
 #include "./db.h"
+#include "./handoff.h"
+#include "./hot.h"
+#include "./lsm.h"
+#include "./metrics.h"
+#include "./perfctr.h"
+#include "./repl.h"
+#include "./slowlog.h"
+#include "./stats.h"
+#include "./trace.h"
+#include "./vindex.h"
+#include "./wal.h"
+#include "./watch.h"
+
+#define DRAIN_DEADLINE_MS 5000
+#define ARENA_SIZE_MB 1024
+#define INTERN_BUCKETS (1 << 16)
+// keys held in memory before the memtable is flushed to a run file
+#define LSM_MEMTABLE_KEYS (1 << 16)
+// how often values not read since the last sweep are evicted to disk
+#define TIER_INTERVAL_MS 10000
+// how often changed regions are checkpointed; 0 for only on 'c' and exit
+#define CKPT_INTERVAL_MS 60000
+// the most keys one 'K' command samples
+#define MAX_SAMPLE 100000
 
 /*
  * Use the variables in this struct to synchronize your main thread with client
@@ -22,17 +50,23 @@
 typedef struct server_control {
     pthread_mutex_t server_mutex;
     pthread_cond_t server_cond;
-    int num_client_threads;
+    // set while drain_clients() waits for the client threads, which signal
+    // server_cond as they exit; the threads are counted in the statistics
+    // registry (STATS_CONNECTIONS_*), so starting one takes no shared lock
+    int draining;
 } server_control_t;
 
 /*
  * Controls when the clients in the client thread list should be stopped and
- * let go.
+ * let go. While draining is set no client starts a new command; threads
+ * finish the command they are running and then exit on their own.
  */
 typedef struct client_control {
     pthread_mutex_t go_mutex;
     pthread_cond_t go;
     int stopped;
+    int draining;
+    int running;  // clients currently inside interpret_command()
 } client_control_t;
 
 /*
@@ -61,8 +95,13 @@ server_control_t server = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
                            0};
 
 client_control_t client_control = {PTHREAD_MUTEX_INITIALIZER,
-                                   PTHREAD_COND_INITIALIZER, 0};
+                                   PTHREAD_COND_INITIALIZER, 0, 0, 0};
 int server_active = 0;
+// how long a drain waits for in-flight commands before forcing connections
+// closed, settable with -d
+long drain_deadline_ms = DRAIN_DEADLINE_MS;
+// the local port metrics are served on, set with -m; -1 for none
+int metrics_port = -1;
 client_t *thread_list_head = NULL;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -78,26 +117,80 @@ void clean_up_pthread_mutex(void *arg) {
     // calls pthread_mutex_unlock on the given mutex in arg
     pthread_mutex_unlock((pthread_mutex_t *)arg);
 }
-// Called by client threads to wait until progress is permitted
-void client_control_wait() {
+// Called by client threads to wait until progress is permitted. Returns 0 if
+// the client may run its next command, or -1 if the server is draining.
+int client_control_wait() {
     // error variable
     int err;
+    int draining;
     // lock client control mutex
     if ((err = pthread_mutex_lock(&client_control.go_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_lock");
     }
     // push clean up thread mutex handler
     pthread_cleanup_push(&clean_up_pthread_mutex, &client_control.go_mutex);
-    // wait for client control stopped to == 1
-    while (client_control.stopped == 1) {
+    // wait for client control stopped to == 1, unless a drain lets us go
+    while (client_control.stopped == 1 && client_control.draining == 0) {
         // waits for the condition variable to change
         if ((err = pthread_cond_wait(&client_control.go,
                                      &client_control.go_mutex)) != 0) {
             handle_error_en(err, "pthread_cond_wait");
         }
     }
+    draining = client_control.draining;
+    // count ourselves as running so client_control_quiesce() can wait for us
+    if (!draining) client_control.running++;
     // pop the cleanup handler
     pthread_cleanup_pop(1);
+    return draining ? -1 : 0;
+}
+
+// Called by client threads when the command started after
+// client_control_wait() has finished
+void client_control_done() {
+    int err;
+    if ((err = pthread_mutex_lock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    client_control.running--;
+    // the main thread may be waiting in client_control_quiesce()
+    if (client_control.running == 0 && client_control.stopped == 1) {
+        if ((err = pthread_cond_broadcast(&client_control.go)) != 0) {
+            handle_error_en(err, "pthread_cond_broadcast");
+        }
+    }
+    if ((err = pthread_mutex_unlock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// Polled by interpret_command() between the lines of an 'f' command
+int client_control_draining() {
+    int err;
+    int draining;
+    if ((err = pthread_mutex_lock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    draining = client_control.draining;
+    if ((err = pthread_mutex_unlock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return draining;
+}
+
+// Sets or clears the draining flag and wakes any stopped clients
+void client_control_drain(int draining) {
+    int err;
+    if ((err = pthread_mutex_lock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    client_control.draining = draining;
+    if ((err = pthread_cond_broadcast(&client_control.go)) != 0) {
+        handle_error_en(err, "pthread_cond_broadcast");
+    }
+    if ((err = pthread_mutex_unlock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
 }
 
 // Called by main thread to stop client threads
@@ -116,6 +209,25 @@ void client_control_stop() {
     }
 }
 
+// Called by main thread to stop client threads and wait until none of them is
+// in the middle of a command, after which the database cannot change
+void client_control_quiesce() {
+    int err;
+    client_control_stop();
+    if ((err = pthread_mutex_lock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    while (client_control.running > 0) {
+        if ((err = pthread_cond_wait(&client_control.go,
+                                     &client_control.go_mutex)) != 0) {
+            handle_error_en(err, "pthread_cond_wait");
+        }
+    }
+    if ((err = pthread_mutex_unlock(&client_control.go_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
 // Called by main thread to resume client threads
 void client_control_release() {
     // error variable
@@ -171,6 +283,187 @@ void client_destructor(client_t *client) {
     client = NULL;
 }
 
+/*
+ * Reads and throws away the payload of an 'A' command that will not be run,
+ * so that its bytes are not taken for commands. Returns -1 if the connection
+ * failed.
+ */
+int discard_payload(FILE *cxstr, char *command) {
+    char name[BUFLEN];
+    char chunk[BUFSIZ];
+    size_t len;
+    if (sscanf(&command[1], "%255s %zu", name, &len) < 2) return 0;
+    // the trailing newline is part of the payload here
+    len++;
+    while (len > 0) {
+        size_t n = len < sizeof(chunk) ? len : sizeof(chunk);
+        if (fread(chunk, 1, n, cxstr) != n) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Runs the commands that need the connection itself rather than a response
+ * buffer:
+ *   A <key> <length>   followed by length bytes and a newline, adds the key
+ *   Q <key>            replies "<length>", then the value and a newline
+ *   S [<seq>]          subscribes to the changes from seq on (see cdc.h)
+ *   W <pattern>...     watches keys, or prefixes ending in '*' (see watch.h)
+ *   R                  sends a snapshot and then the changes to a follower
+ *   V <value>          replies "<count>" and the keys holding value, one per
+ *                      line (see vindex.h)
+ *   K <k>              replies "<count>" and k keys sampled uniformly at
+ *                      random, one per line, with -K (see db_sample())
+ * Returns 1 if the command was one of these, 0 if it should go to
+ * interpret_command(), 2 if the connection should become a subscription (see
+ * serve_subscription()), and -1 if the connection failed.
+ */
+int serve_stream_command(client_t *client, char *command, char *response) {
+    char name[BUFLEN];
+    size_t len;
+    blob_t *blob;
+    int ret;
+
+    switch (command[0]) {
+        case 'A':
+            if (sscanf(&command[1], "%255s %zu", name, &len) < 2) {
+                snprintf(response, BUFLEN, "ill-formed command");
+                return 1;
+            }
+            if ((blob = db_blob_alloc(len)) == NULL) {
+                // keep the stream in step even though we refuse the value
+                snprintf(response, BUFLEN, "value too large");
+                return discard_payload(client->cxstr, command) < 0 ? -1 : 1;
+            }
+            if (comm_recv_payload(client->cxstr, blob->data, len) < 0) {
+                db_blob_put(blob);
+                return -1;
+            }
+            if (capture_enabled()) capture_command(command, blob->data, len);
+            if ((ret = db_add_blob(name, blob)) > 0) {
+                snprintf(response, BUFLEN, "added");
+            } else {
+                db_blob_put(blob);
+                snprintf(response, BUFLEN,
+                         ret < 0 ? "out of memory" : "already in database");
+            }
+            return 1;
+
+        case 'Q':
+            if (sscanf(&command[1], "%255s", name) < 1) {
+                snprintf(response, BUFLEN, "ill-formed command");
+                return 1;
+            }
+            if ((blob = db_query_blob(name)) == NULL) {
+                snprintf(response, BUFLEN, "not found");
+                return 1;
+            }
+            ret = comm_send_payload(client->cxstr, blob->data, blob->len);
+            db_blob_put(blob);
+            return ret < 0 ? -1 : 1;
+
+        case 'V': {
+            char *keys;
+            size_t klen;
+            long count;
+            if (sscanf(&command[1], "%255s", name) < 1) {
+                snprintf(response, BUFLEN, "ill-formed command");
+                return 1;
+            }
+            if (!vindex_enabled()) {
+                snprintf(response, BUFLEN, "value index not enabled");
+                return 1;
+            }
+            if ((count = vindex_lookup(name, &keys, &klen)) <= 0) {
+                snprintf(response, BUFLEN,
+                         count < 0 ? "out of memory" : "not found");
+                return 1;
+            }
+            char header[32];
+            struct iovec iov[2] = {
+                {header, snprintf(header, sizeof(header), "%ld\n", count)},
+                {keys, klen}};
+            ret = comm_writev(client->cxstr, iov, 2);
+            free(keys);
+            return ret < 0 ? -1 : 1;
+        }
+
+        case 'K': {
+            // a uniform sample of keys, with replacement
+            char *keys;
+            size_t klen;
+            long count;
+            long k;
+            if (sscanf(&command[1], "%ld", &k) < 1 || k < 1 || k > MAX_SAMPLE) {
+                snprintf(response, BUFLEN, "ill-formed command");
+                return 1;
+            }
+            if (lsm_enabled()) {
+                snprintf(response, BUFLEN, "not supported in LSM mode");
+                return 1;
+            }
+            if (!db_sampling()) {
+                snprintf(response, BUFLEN, "sampling not enabled (-K)");
+                return 1;
+            }
+            if ((count = db_sample(k, &keys, &klen)) <= 0) {
+                snprintf(response, BUFLEN,
+                         count < 0 ? "out of memory" : "database empty");
+                return 1;
+            }
+            char header[32];
+            struct iovec iov[2] = {
+                {header, snprintf(header, sizeof(header), "%ld\n", count)},
+                {keys, klen}};
+            ret = comm_writev(client->cxstr, iov, 2);
+            free(keys);
+            return ret < 0 ? -1 : 1;
+        }
+
+        case 'S':
+            // the connection turns into a change stream, see run_client()
+            if (!cdc_enabled()) {
+                snprintf(response, BUFLEN, "change capture not enabled");
+                return 1;
+            }
+            return 2;
+
+        case 'R':
+            return 2;
+
+        case 'W':
+            if (sscanf(&command[1], "%255s", name) < 1) {
+                snprintf(response, BUFLEN, "ill-formed command");
+                return 1;
+            }
+            return 2;
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Turns the connection into a stream of changes ('S'), of notifications
+ * about watched keys ('W'), or of a snapshot and changes for a follower ('R')
+ * until the client hangs up. A subscriber reads the
+ * database's changes, not the database, so it runs outside
+ * client_control_wait() and does not hold up client_control_quiesce(); it
+ * leaves once drain_clients() shuts down its read side.
+ */
+void serve_subscription(client_t *client, char *command) {
+    unsigned long long from = 0;
+    if (command[0] == 'S') {
+        sscanf(&command[1], "%llu", &from);
+        cdc_stream(client->cxstr, from, 0);
+    } else if (command[0] == 'R') {
+        repl_serve(client->cxstr);
+    } else {
+        watch_stream(client->cxstr, &command[1]);
+    }
+}
+
 // Code executed by a client thread
 void *run_client(void *arg) {
     // cast the input
@@ -207,16 +500,8 @@ void *run_client(void *arg) {
         }
         // push thread cleanup if thread has been canceled
         pthread_cleanup_push(thread_cleanup, client);
-        // locks the server mutex
-        if ((err = pthread_mutex_lock(&server.server_mutex)) != 0) {
-            handle_error_en(err, "pthread_mutex_lock");
-        }
-        // increment the number of client thread using the server
-        server.num_client_threads++;
-        // unlock the server mutex
-        if ((err = pthread_mutex_unlock(&server.server_mutex)) != 0) {
-            handle_error_en(err, "pthread_mutex_unlock");
-        }
+        // counted while server_active holds, so a drain waits for us
+        stats_add(STATS_CONNECTIONS_OPENED, 1);
         // unlock the thread_list_mutex
         if ((err = pthread_mutex_unlock(&thread_list_mutex)) != 0) {
             handle_error_en(err, "pthread_mutex_unlock");
@@ -226,10 +511,83 @@ void *run_client(void *arg) {
         while (comm_serve(client->cxstr, response, command) == 0) {
             // memset the response buffer
             memset(response, 0, BUFLEN);
-            // wait on stopped database
-            client_control_wait();
-            // call interpret command
-            interpret_command(command, response, BUFLEN);
+            // wait on stopped database, and refuse new work while draining
+            if (client_control_wait() != 0) {
+                snprintf(response, BUFLEN, "server shutting down");
+                if (command[0] == 'A' &&
+                    discard_payload(client->cxstr, command) < 0) {
+                    break;
+                }
+                memset(command, 0, BUFLEN);
+                continue;
+            }
+            // time the command and its lock waits for the slow log and the
+            // metrics
+            struct timespec start, end;
+            size_t locks;
+            size_t depth;
+            uint64_t wait_ns;
+            int timed = slowlog_enabled() || metrics_enabled();
+            if (timed) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                db_lock_stats(&locks, &depth, &wait_ns);
+            }
+            TRACE1(command__start, command);
+            // an 'A' is captured with its value, once that has been read
+            if (capture_enabled() && command[0] != 'A') {
+                capture_command(command, NULL, 0);
+            }
+            if (perfctr_sampling()) perfctr_command_start();
+            // a follower only changes through its leader
+            int ret = 0;
+            if (repl_following() && command[0] != '\0' &&
+                strchr("adfAD", command[0]) != NULL) {
+                snprintf(response, BUFLEN, "read-only follower");
+                if (command[0] == 'A' &&
+                    discard_payload(client->cxstr, command) < 0) {
+                    ret = -1;
+                } else {
+                    ret = 1;
+                }
+            } else if (repl_following() && !repl_ready() &&
+                       command[0] != '\0' &&
+                       strchr("qQVK", command[0]) != NULL) {
+                // nor answers from a half loaded snapshot
+                snprintf(response, BUFLEN, "not ready");
+                ret = 1;
+            }
+            // call interpret command, unless the command needs the stream
+            if (ret == 0) ret = serve_stream_command(client, command, response);
+            if (ret == 0) {
+                interpret_command(command, response, BUFLEN);
+            }
+            // with -Y a change is on disk before the client hears of it,
+            // and one that could not be logged is not reported as done
+            if (wal_sync() < 0) {
+                snprintf(response, BUFLEN, "write-ahead log failed");
+            }
+            client_control_done();
+            if (perfctr_sampling()) perfctr_command_done(command[0]);
+            TRACE2(command__done, command, response);
+            if (timed && ret != 2) {
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                db_lock_stats(&locks, &depth, &wait_ns);
+                uint64_t total = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                                 end.tv_nsec - start.tv_nsec;
+                if (metrics_enabled()) {
+                    metrics_command(command[0], total, locks, wait_ns);
+                }
+                if (slowlog_enabled()) {
+                    slowlog_record(command, total, locks, depth, wait_ns);
+                }
+            }
+            if (ret == 2) {
+                serve_subscription(client, command);
+                break;
+            }
+            if (ret < 0) {
+                break;
+            }
             // memset the command buffer
             memset(command, 0, BUFLEN);
         }
@@ -239,41 +597,138 @@ void *run_client(void *arg) {
     return NULL;
 }
 
-void delete_all() {
+/*
+ * Calls shutdown() with the given mode on the socket of every client in the
+ * list. Shutting down the read side makes a client blocked in comm_serve() see
+ * EOF once it has sent the response to its current command, so it leaves its
+ * loop and runs thread_cleanup() itself. Returns the number of clients.
+ */
+int shutdown_all(int how) {
+    int err;
+    int count = 0;
+    // lock the thread list mutex
+    if ((err = pthread_mutex_lock(&thread_list_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    // loop through the thread list
+    for (client_t *cur = thread_list_head; cur != NULL; cur = cur->next) {
+        // ENOTCONN just means the peer already went away
+        if (shutdown(fileno(cur->cxstr), how) < 0 && errno != ENOTCONN) {
+            perror("shutdown");
+        }
+        count++;
+    }
+    // unlock the thread list mutex
+    if ((err = pthread_mutex_unlock(&thread_list_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return count;
+}
+
+/*
+ * Client threads still running: the connections opened less those closed,
+ * read in that order so that a thread exiting meanwhile is not counted as
+ * closed without having been counted as opened.
+ */
+static uint64_t open_connections(void) {
+    uint64_t closed = stats_sum(STATS_CONNECTIONS_CLOSED);
+    return stats_sum(STATS_CONNECTIONS_OPENED) - closed;
+}
+
+/*
+ * Cooperatively stops every client thread. New connections are refused, no
+ * client starts another command, and in-flight commands are allowed to finish
+ * and send their responses. If the clients have not all exited after
+ * drain_deadline_ms the remaining connections are shut down in both
+ * directions, which fails their next write. Client threads are never
+ * cancelled, so no thread can die while holding node locks in db.c.
+ */
+void drain_clients() {
     // variable for error
     int err;
+    struct timespec start, now, deadline;
+    int expired = 0;
+    int forced = 0;
     // lock the thread mutex
     if ((err = pthread_mutex_lock(&thread_list_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_lock");
     }
-    // change the server_active int boolean to 0 because we are getting rid of
-    // all clients
+    // change the server_active int boolean to 0 so that new clients are
+    // turned away while we drain
     server_active = 0;
     // unlock the thread_list_mutex
     if ((err = pthread_mutex_unlock(&thread_list_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_unlock");
     }
-    // variable
-    client_t *next;
-    // lock the thread list mutex
-    if ((err = pthread_mutex_lock(&thread_list_mutex)) != 0) {
+    // stop clients from starting new commands, and wake the stopped ones
+    client_control_drain(1);
+
+    // timed waits on server_cond use the realtime clock, the report uses
+    // the monotonic one
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_deadline_ms / 1000;
+    deadline.tv_nsec += (drain_deadline_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    // close the read side of every connection
+    int clients = shutdown_all(SHUT_RD);
+
+    // wait for the client threads to exit, up to the deadline
+    if ((err = pthread_mutex_lock(&server.server_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_lock");
     }
-    // set the variable cur to the thread_list_head
-    client_t *cur = thread_list_head;
-    // loop through the thread list
-    while (cur != NULL) {
-        next = cur->next;
-        // cancel all the threads
-        if ((err = pthread_cancel(cur->thread)) != 0) {
-            handle_error_en(err, "pthread_cancel: hello");
+    __atomic_store_n(&server.draining, 1, __ATOMIC_SEQ_CST);
+    // pairs with the fence in thread_cleanup(): either we see its close
+    // counted or it sees draining set and signals us
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (open_connections() != 0 && !expired) {
+        err = pthread_cond_timedwait(&server.server_cond, &server.server_mutex,
+                                     &deadline);
+        if (err == ETIMEDOUT) {
+            expired = 1;
+        } else if (err != 0) {
+            handle_error_en(err, "pthread_cond_timedwait");
         }
-        cur = next;
     }
-    // unlock the thread list mutex
-    if ((err = pthread_mutex_unlock(&thread_list_mutex)) != 0) {
+    if ((err = pthread_mutex_unlock(&server.server_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_unlock");
     }
+    if (expired) {
+        // past the deadline: fail the writes of the stragglers as well. They
+        // can only be inside a bounded database operation by now, so waiting
+        // for them without a deadline is safe.
+        forced = shutdown_all(SHUT_RDWR);
+        if ((err = pthread_mutex_lock(&server.server_mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        while (open_connections() != 0) {
+            if ((err = pthread_cond_wait(&server.server_cond,
+                                         &server.server_mutex)) != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+        }
+        if ((err = pthread_mutex_unlock(&server.server_mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+    }
+    __atomic_store_n(&server.draining, 0, __ATOMIC_SEQ_CST);
+    client_control_drain(0);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms =
+        (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6;
+    if (forced > 0) {
+        printf(
+            "drained %d clients in %.3f ms (%d forced closed after %ld ms)\n",
+            clients, ms, forced, drain_deadline_ms);
+    } else {
+        printf("drained %d clients in %.3f ms\n", clients, ms);
+    }
+    fflush(stdout);
 }
 
 // Cleanup routine for client threads, called on cancels and exit.
@@ -282,6 +737,7 @@ void thread_cleanup(void *arg) {
     client_t *client = (client_t *)arg;
     int err;
 
+    if (capture_enabled()) capture_disconnect();
     // lock the thread list mutex
     if ((err = pthread_mutex_lock(&thread_list_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_lock");
@@ -315,22 +771,20 @@ void thread_cleanup(void *arg) {
     if ((err = pthread_mutex_unlock(&thread_list_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_unlock");
     }
-    // lock the server mutex
-    if ((err = pthread_mutex_lock(&server.server_mutex)) != 0) {
-        handle_error_en(err, "pthread_mutex_lock");
-    }
-    // decrease the number of threads
-    server.num_client_threads--;
-    // if there are no more clients in the list
-    if (server.num_client_threads == 0) {
-        // broadcast the server condition variable
+    stats_add(STATS_CONNECTIONS_CLOSED, 1);
+    // only a drain waits for the count to reach 0, so only then is there
+    // anyone to wake
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&server.draining, __ATOMIC_SEQ_CST)) {
+        if ((err = pthread_mutex_lock(&server.server_mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
         if ((err = pthread_cond_broadcast(&server.server_cond)) != 0) {
             handle_error_en(err, "pthread_cond_broadcast");
         }
-    }
-    // lock the server mutex
-    if ((err = pthread_mutex_unlock(&server.server_mutex)) != 0) {
-        handle_error_en(err, "pthread_mutex_unlock");
+        if ((err = pthread_mutex_unlock(&server.server_mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
     }
     // destroy the client
     client_destructor(client);
@@ -357,13 +811,15 @@ void *monitor_signal(void *arg) {
         }
         // if the signal is SIGINT
         if (sig_num == SIGINT) {
-            // delete all clients
-            if ((err = printf("SIGINT recieved, cancelling all clients\n")) <
-                0) {
+            // drain all clients
+            if ((err = printf("SIGINT recieved, draining all clients\n")) < 0) {
                 fprintf(stderr, "printf failed");
                 exit(1);
             }
-            delete_all();
+            // a drain holds server mutexes across its waits, so it must not
+            // be interrupted by sig_handler_destructor()
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            drain_clients();
             // lock the thread list mutex
             if ((err = pthread_mutex_lock(&thread_list_mutex)) != 0) {
                 handle_error_en(err, "pthread_mutex_lock");
@@ -374,6 +830,7 @@ void *monitor_signal(void *arg) {
             if ((err = pthread_mutex_unlock(&thread_list_mutex)) != 0) {
                 handle_error_en(err, "pthread_mutex_unlock");
             }
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
         }
     }
 
@@ -431,15 +888,212 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
     sighandler = NULL;
 }
 
-// The arguments to the server should be the port number.
+// Cancels and joins the listener thread so no more connections are accepted.
+// The listening socket itself stays open.
+void stop_listener(pthread_t listen) {
+    int err;
+    if ((err = pthread_cancel(listen)) != 0) {
+        handle_error_en(err, "pthread_cancel hi");
+        exit(1);
+    }
+    if ((err = pthread_join(listen, NULL)) != 0) {
+        handle_error_en(err, "pthread_join");
+        exit(1);
+    }
+}
+
+// Tears the server down once the listener has been stopped
+void server_shutdown(sig_handler_t *sig_handle) {
+    int err;
+    // destroy the sighandler, which waits out a SIGINT drain that is
+    // already running
+    sig_handler_destructor(sig_handle);
+    // drain all clients; this returns once every client thread has exited
+    drain_clients();
+    // nothing changes the database after this
+    repl_close();
+    // the last checkpoint sees every change
+    if (ckpt_enabled()) ckpt_close(1);
+    // the ring holds references to blobs in the database
+    if (cdc_enabled()) cdc_close();
+    vindex_close();
+    metrics_close();
+    // every client has hung up, so the capture is complete
+    if (capture_enabled()) capture_close(stdout);
+    // call db_cleanup
+    db_cleanup();
+    // every change has been logged by now
+    wal_close();
+    if ((err = printf("exiting database\n")) < 0) {
+        fprintf(stderr, "printf failed");
+        exit(1);
+    }
+}
+
+/*
+ * Hands the listening socket and the database to a new server process started
+ * with -u path. Clients are stopped and in-flight commands finish before the
+ * database is sent, so the new server starts with exactly our contents. While
+ * the handoff runs, connection attempts wait in the listen backlog, which the
+ * new process then serves. Returns -1 (and resumes serving) if it failed.
+ */
+int server_handoff(const char *path, int timeout_ms, pthread_t *listen) {
+    printf("handing off to new server at %s\n", path);
+    fflush(stdout);
+    stop_listener(*listen);
+    client_control_quiesce();
+    // the new server takes over the checkpoint directory too
+    if (ckpt_enabled()) ckpt_suspend(1);
+    // and the metrics port
+    metrics_close();
+    if (handoff_send(path, comm_listen_fd(), db_dump, timeout_ms) < 0) {
+        fprintf(stderr, "handoff failed, resuming\n");
+        if (ckpt_enabled()) ckpt_suspend(0);
+        if (metrics_port >= 0 && metrics_open(metrics_port) < 0) {
+            fprintf(stderr, "could not serve metrics again\n");
+        }
+        *listen = start_listener_fd(comm_listen_fd(), client_constructor);
+        client_control_release();
+        return -1;
+    }
+    printf("handoff complete\n");
+    return 0;
+}
+
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s <port> [-d <drain deadline ms>] "
+            "[-u <handoff socket>] [-s <shared db file>] [-H] "
+            "[-a <arena MB>] [-i] [-l <run dir>] [-L <memtable keys>] "
+            "[-t <value log>] [-T <sweep ms>] [-w <write-ahead log>] "
+            "[-W <replay threads>] [-Y] [-c <checkpoint dir>] "
+            "[-C <checkpoint ms>] [-R <change ring entries>] "
+            "[-F <leader host:port>] [-V] [-k] [-K] [-S <slow command us>] "
+            "[-m <metrics port>] [-P <commands per sample>] "
+            "[-x <capture file>]\n",
+            cmd);
+}
+
+// The arguments to the server should be the port number, followed by options.
 int main(int argc, char *argv[]) {
     // variables
     int err;
+    int opt;
     char buf[BUFLEN];
     char *tokens[BUFLEN];
     char *token;
     int i = 0;
     ssize_t response;
+    char *handoff_path = NULL;
+    char *shared_path = NULL;
+    int hugepages = 0;
+    int interning = 0;
+    size_t arena_mb = ARENA_SIZE_MB;
+    char *lsm_dir = NULL;
+    size_t memtable_keys = LSM_MEMTABLE_KEYS;
+    char *tier_path = NULL;
+    long tier_interval_ms = TIER_INTERVAL_MS;
+    char *wal_path = NULL;
+    int replay_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *ckpt_dir = NULL;
+    long ckpt_interval_ms = CKPT_INTERVAL_MS;
+    off_t wal_from = 0;
+    size_t cdc_entries = 0;
+    char *leader = NULL;
+    int value_index = 0;
+    int wal_sync_on = 0;
+    int hot_keys = 0;
+    int sampling = 0;
+    long slow_us = -1;
+    int perf_every = 0;
+    char *capture_path = NULL;
+
+    if (argc < 2) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    // the port comes first, options follow it
+    optind = 2;
+    while ((opt = getopt(argc, argv,
+                         "d:u:s:Ha:il:L:t:T:w:W:Yc:C:R:F:VkKS:m:P:x:")) != -1) {
+        switch (opt) {
+            case 'd':
+                drain_deadline_ms = atol(optarg);
+                break;
+            case 'u':
+                handoff_path = optarg;
+                break;
+            case 's':
+                shared_path = optarg;
+                break;
+            case 'H':
+                hugepages = 1;
+                break;
+            case 'i':
+                interning = 1;
+                break;
+            case 'a':
+                arena_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                lsm_dir = optarg;
+                break;
+            case 'L':
+                memtable_keys = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                tier_path = optarg;
+                break;
+            case 'T':
+                tier_interval_ms = atol(optarg);
+                break;
+            case 'w':
+                wal_path = optarg;
+                break;
+            case 'W':
+                replay_threads = atoi(optarg);
+                break;
+            case 'Y':
+                wal_sync_on = 1;
+                break;
+            case 'c':
+                ckpt_dir = optarg;
+                break;
+            case 'C':
+                ckpt_interval_ms = atol(optarg);
+                break;
+            case 'R':
+                cdc_entries = strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                leader = optarg;
+                break;
+            case 'V':
+                value_index = 1;
+                break;
+            case 'k':
+                hot_keys = 1;
+                break;
+            case 'K':
+                sampling = 1;
+                break;
+            case 'S':
+                slow_us = atol(optarg);
+                break;
+            case 'm':
+                metrics_port = atoi(optarg);
+                break;
+            case 'P':
+                perf_every = atoi(optarg);
+                break;
+            case 'x':
+                capture_path = optarg;
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
 
     if ((err = pthread_mutex_lock(&thread_list_mutex)) != 0) {
         handle_error_en(err, "pthread_mutex_lock");
@@ -451,10 +1105,181 @@ int main(int argc, char *argv[]) {
     }
     // ignore SIGPIPE
     signal(SIGPIPE, SIG_IGN);
+    // client threads poll this while running 'f' commands
+    db_set_interrupt(client_control_draining);
     // sighandler
     sig_handler_t *sig_handle = sig_handler_constructor();
-    // call start_listener
-    pthread_t listen = start_listener(atoi(argv[1]), client_constructor);
+    if (shared_path != NULL) {
+        // keep the tree in a shared arena that survives restarts
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if ((err = db_attach(shared_path, arena_mb << 20)) < 0) {
+            fprintf(stderr, "could not attach shared database %s\n",
+                    shared_path);
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (err == 1) {
+            printf("reattached database in %s in %.3f ms\n", shared_path,
+                   (end.tv_sec - start.tv_sec) * 1e3 +
+                       (end.tv_nsec - start.tv_nsec) / 1e6);
+        }
+    } else if (hugepages) {
+        // allocate the tree from huge pages to cut TLB misses
+        if ((err = db_use_hugepages(arena_mb << 20)) < 0) {
+            fprintf(stderr, "could not set up the huge page arena\n");
+            exit(1);
+        }
+        printf("allocating nodes from %s\n",
+               err ? "hugetlb pages" : "transparent huge pages");
+    }
+    if (interning && db_use_interning(INTERN_BUCKETS) < 0) {
+        fprintf(stderr, "could not enable string interning\n");
+        exit(1);
+    }
+    // after a reattach, whose sizes it counts, and before anything is loaded
+    if (sampling) {
+        if (db_use_sampling() < 0) {
+            fprintf(stderr, "could not count subtree sizes\n");
+            exit(1);
+        }
+        printf("keeping subtree sizes, sample keys with K\n");
+    }
+    if (lsm_dir != NULL) {
+        // keep the tree as a memtable over sorted run files in lsm_dir
+        if (db_use_lsm(lsm_dir, memtable_keys) < 0) {
+            fprintf(stderr, "could not open run directory %s\n", lsm_dir);
+            exit(1);
+        }
+        printf("storing runs in %s, flushing every %zu keys\n", lsm_dir,
+               memtable_keys);
+    }
+    if (tier_path != NULL) {
+        // keep only hot values in memory, the rest in a log on disk
+        if (db_use_tiering(tier_path, tier_interval_ms) < 0) {
+            fprintf(stderr, "could not open value log %s\n", tier_path);
+            exit(1);
+        }
+        printf("evicting values not read for %ld ms to %s\n", tier_interval_ms,
+               tier_path);
+    }
+    if ((wal_path != NULL || ckpt_dir != NULL) &&
+        (shared_path != NULL || lsm_dir != NULL)) {
+        // those keep the database across restarts already
+        fprintf(stderr, "-w and -c cannot be combined with -s or -l\n");
+        exit(1);
+    }
+    if (leader != NULL &&
+        (shared_path != NULL || lsm_dir != NULL || wal_path != NULL ||
+         ckpt_dir != NULL || handoff_path != NULL)) {
+        // a follower's database always comes from its leader
+        fprintf(stderr, "-F cannot be combined with -s, -l, -w, -c or -u\n");
+        exit(1);
+    }
+    if (value_index) {
+        if (shared_path != NULL || lsm_dir != NULL) {
+            // the keys already stored there would not be indexed
+            fprintf(stderr, "-V cannot be combined with -s or -l\n");
+            exit(1);
+        }
+        // before anything is loaded, so that every key is indexed
+        if (vindex_open() < 0) {
+            fprintf(stderr, "could not set up the value index\n");
+            exit(1);
+        }
+        printf("indexing keys by value\n");
+    }
+    // the log is replayed on top of the checkpoint, from where it left off
+    if (ckpt_dir != NULL && ckpt_open(ckpt_dir, handoff_path == NULL,
+                                      ckpt_interval_ms, &wal_from) < 0) {
+        fprintf(stderr, "could not open checkpoint %s\n", ckpt_dir);
+        exit(1);
+    }
+    int lfd = -1;
+    if (handoff_path != NULL) {
+        // take over the listening socket and database of a running server
+        int keys;
+        if ((keys = handoff_recv(handoff_path, &lfd, db_load)) < 0) {
+            fprintf(stderr, "handoff from %s failed\n", handoff_path);
+            exit(1);
+        }
+        printf("took over %d keys from %s\n", keys, handoff_path);
+    }
+    // after a handoff the log already holds what the dump brought over
+    if (wal_path != NULL && wal_open(wal_path, handoff_path == NULL, wal_from,
+                                     replay_threads, wal_sync_on) < 0) {
+        fprintf(stderr, "could not recover from %s\n", wal_path);
+        exit(1);
+    }
+    if (watch_open() < 0) {
+        fprintf(stderr, "could not set up key watches\n");
+        exit(1);
+    }
+    // subscribers see the changes made from here on
+    if (cdc_entries > 0) {
+        if (cdc_open(cdc_entries) < 0) {
+            fprintf(stderr, "could not set up change capture\n");
+            exit(1);
+        }
+        printf("keeping the last %zu changes for subscribers\n", cdc_entries);
+    }
+    // the observers above see the leader's changes too, so followers can be
+    // chained
+    if (leader != NULL) {
+        if (repl_follow(leader) < 0) exit(1);
+        printf("following %s, refusing changes from clients\n", leader);
+    }
+    // named databases are only kept in memory, so a server that must not
+    // lose changes keeps to the default one
+    if (wal_path != NULL || ckpt_dir != NULL || cdc_entries > 0 ||
+        leader != NULL || value_index) {
+        db_default_only();
+    }
+    // only what clients (and the leader) do counts, not what was loaded
+    if (hot_keys) {
+        hot_open();
+        printf("tracking hot keys, report them with h\n");
+    }
+    if (slow_us >= 0) {
+        slowlog_open(slow_us);
+        printf("logging commands taking %ld us or more, list them with l\n",
+               slow_us);
+    }
+    if (perf_every > 0) {
+        if (perfctr_sample_open(perf_every) < 0) {
+            fprintf(stderr,
+                    "no hardware performance counters (is "
+                    "/proc/sys/kernel/perf_event_paranoid above 2?)\n");
+            exit(1);
+        }
+        printf(
+            "counting cycles and misses of 1 in %d commands, report "
+            "them with e\n",
+            perf_every);
+    }
+    if (metrics_port >= 0) {
+        if (metrics_open(metrics_port) < 0) {
+            fprintf(stderr, "could not serve metrics on port %d\n",
+                    metrics_port);
+            exit(1);
+        }
+        printf("serving metrics on http://127.0.0.1:%d/metrics\n",
+               metrics_port);
+    }
+    if (capture_path != NULL) {
+        if (capture_open(capture_path) < 0) {
+            perror(capture_path);
+            exit(1);
+        }
+        printf("capturing client commands to %s, stop with x\n", capture_path);
+    }
+    pthread_t listen;
+    if (lfd >= 0) {
+        listen = start_listener_fd(lfd, client_constructor);
+    } else {
+        // call start_listener
+        listen = start_listener(atoi(argv[1]), client_constructor);
+    }
 
     char *s;
     // loop command line until EOF
@@ -502,42 +1327,77 @@ int main(int argc, char *argv[]) {
                         fprintf(stderr, "db_print error");
                     }
                 }
+                // if the command is a c, take a checkpoint
+                else if (strcmp(tokens[0], "c") == 0) {
+                    if (!ckpt_enabled()) {
+                        fprintf(stderr, "no checkpoint directory (-c)\n");
+                    } else if (ckpt_take() < 0) {
+                        fprintf(stderr, "checkpoint failed\n");
+                    }
+                }
+                // if the command is an r, report replication lag
+                else if (strcmp(tokens[0], "r") == 0) {
+                    repl_report(stdout);
+                }
+                // if the command is an h, report the hottest keys
+                else if (strcmp(tokens[0], "h") == 0) {
+                    hot_report(stdout,
+                               tokens[1] != NULL ? atoi(tokens[1]) : 10);
+                }
+                // if the command is an l, list the slowest recent commands
+                else if (strcmp(tokens[0], "l") == 0) {
+                    slowlog_report(stdout,
+                                   tokens[1] != NULL ? atoi(tokens[1]) : 20);
+                }
+                // if the command is an e, report the hardware counters
+                else if (strcmp(tokens[0], "e") == 0) {
+                    perfctr_report(stdout);
+                }
+                // if the command is a t, print the totals of the counters
+                else if (strcmp(tokens[0], "t") == 0) {
+                    stats_report(stdout);
+                }
+                // if the command is an x, start or stop capturing
+                else if (strcmp(tokens[0], "x") == 0) {
+                    if (tokens[1] == NULL) {
+                        capture_close(stdout);
+                    } else if (capture_open(tokens[1]) < 0) {
+                        perror(tokens[1]);
+                    } else {
+                        printf("capturing client commands to %s\n", tokens[1]);
+                    }
+                }
+                // if the command is a u, hand off to a new server
+                else if (strcmp(tokens[0], "u") == 0) {
+                    int timeout_ms = HANDOFF_TIMEOUT_MS;
+                    if (tokens[1] != NULL && tokens[2] != NULL) {
+                        timeout_ms = atoi(tokens[2]);
+                    }
+                    if (tokens[1] == NULL || timeout_ms <= 0) {
+                        fprintf(stderr,
+                                "usage: u <handoff socket> [<wait ms>]\n");
+                    } else if (lsm_dir != NULL) {
+                        // the run files cannot be shared by two servers
+                        fprintf(stderr, "cannot hand off in LSM mode\n");
+                    } else if (repl_following()) {
+                        // the new server would not follow the leader
+                        fprintf(stderr, "cannot hand off a follower\n");
+                    } else if (db_named_count() > 0) {
+                        // db_dump() only streams the default database
+                        fprintf(stderr, "cannot hand off named databases\n");
+                    } else if (server_handoff(tokens[1], timeout_ms, &listen) ==
+                               0) {
+                        server_shutdown(sig_handle);
+                        return 0;
+                    }
+                }
             }
         }
         // if response is 0 that means EOF has happened and return
         if (response == 0) {
-            // delete all clients
-            delete_all();
-            // lock the server mutex
-            if ((err = pthread_mutex_lock(&server.server_mutex)) != 0) {
-                handle_error_en(err, "pthread_mutex_lock");
-            }
-            // push a clean up handler to clean up the mutex
-            pthread_cleanup_push(clean_up_pthread_mutex, &server.server_mutex);
-            // wait for the number of threads to be 0
-            while (server.num_client_threads != 0) {
-                pthread_cond_wait(&server.server_cond, &server.server_mutex);
-            }
-            // cleanup pop
-            pthread_cleanup_pop(1);
-            // destroy the sighandler
-            sig_handler_destructor(sig_handle);
-            // call db_cleanup
-            db_cleanup();
-            // cancel the lisenter thread
-            if ((err = pthread_cancel(listen)) != 0) {
-                handle_error_en(err, "pthread_cancel hi");
-                exit(1);
-            }
-            // join the listener thread
-            if ((err = pthread_join(listen, NULL)) != 0) {
-                handle_error_en(err, "pthread_join");
-                exit(1);
-            }
-            if ((err = printf("exiting database\n")) < 0) {
-                fprintf(stderr, "printf failed");
-                exit(1);
-            }
+            // stop accepting first, then tear everything down
+            stop_listener(listen);
+            server_shutdown(sig_handle);
             return 0;
         }
     }
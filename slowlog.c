@@ -0,0 +1,89 @@
+#include "./slowlog.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+
+/* The slow command log, a ring under a mutex that only slow commands take */
+
+// the part of a command that is kept
+#define SLOWLOG_COMMAND 64
+
+typedef struct slow_entry {
+    struct timespec when;
+    uint64_t total_ns;
+    uint64_t wait_ns;
+    size_t locks;
+    size_t depth;
+    char command[SLOWLOG_COMMAND];
+} slow_entry_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    slow_entry_t ring[SLOWLOG_ENTRIES];
+    uint64_t next;  // entries ever logged
+    uint64_t threshold_ns;
+    int on;
+} slowlog = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+void slowlog_open(long threshold_us) {
+    slowlog.threshold_ns = threshold_us * 1000ULL;
+    slowlog.on = 1;
+}
+
+int slowlog_enabled(void) { return slowlog.on; }
+
+void slowlog_record(const char *command, uint64_t total_ns, size_t locks,
+                    size_t depth, uint64_t wait_ns) {
+    int err;
+    if (total_ns < slowlog.threshold_ns) return;
+    if ((err = pthread_mutex_lock(&slowlog.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    slow_entry_t *entry = &slowlog.ring[slowlog.next++ % SLOWLOG_ENTRIES];
+    clock_gettime(CLOCK_REALTIME, &entry->when);
+    entry->total_ns = total_ns;
+    entry->wait_ns = wait_ns;
+    entry->locks = locks;
+    entry->depth = depth;
+    // the command without its newline
+    snprintf(entry->command, sizeof(entry->command), "%.*s",
+             (int)strcspn(command, "\n"), command);
+    if ((err = pthread_mutex_unlock(&slowlog.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+void slowlog_report(FILE *out, int n) {
+    char stamp[32];
+    struct tm tm;
+    int err;
+
+    if (!slowlog.on) {
+        fprintf(out, "slow command log not enabled\n");
+        return;
+    }
+    if ((err = pthread_mutex_lock(&slowlog.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    fprintf(out, "%llu commands took %llu us or more\n",
+            (unsigned long long)slowlog.next,
+            (unsigned long long)slowlog.threshold_ns / 1000);
+    for (uint64_t i = slowlog.next;
+         i > 0 && slowlog.next - i < SLOWLOG_ENTRIES && n-- > 0; i--) {
+        slow_entry_t *entry = &slowlog.ring[(i - 1) % SLOWLOG_ENTRIES];
+        localtime_r(&entry->when.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+        fprintf(out,
+                "%s.%06ld %8.3f ms, %8.3f ms waiting for locks, %zu locks, "
+                "depth %zu: %s\n",
+                stamp, entry->when.tv_nsec / 1000, entry->total_ns / 1e6,
+                entry->wait_ns / 1e6, entry->locks, entry->depth,
+                entry->command);
+    }
+    if ((err = pthread_mutex_unlock(&slowlog.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef SLOWLOG_H_
+#define SLOWLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A log of the last SLOWLOG_ENTRIES client commands that took longer than a
+ * threshold, each with when it finished, how long it took, how many node
+ * locks it took, the depth its deepest search reached in the tree and how
+ * long it spent waiting for locks that other threads held.
+ */
+
+#define SLOWLOG_ENTRIES 128
+
+/* Logs the commands taking threshold_us or longer from now on. */
+void slowlog_open(long threshold_us);
+
+/* Nonzero once slowlog_open() has been called. */
+int slowlog_enabled(void);
+
+/*
+ * Logs command if total_ns reaches the threshold; locks, depth and wait_ns
+ * are as reported by db_lock_stats() for the command.
+ */
+void slowlog_record(const char *command, uint64_t total_ns, size_t locks,
+                    size_t depth, uint64_t wait_ns);
+
+/* Writes the n most recent entries to out, newest first. */
+void slowlog_report(FILE *out, int n);
+
+#endif  // SLOWLOG_H_
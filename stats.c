@@ -0,0 +1,199 @@
+#include "./stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+
+/* Per-thread blocks of counter chunks, summed under a mutex when read */
+
+typedef struct stats_block {
+    // written only by the owner, with release stores, as it allocates them
+    uint64_t *chunks[STATS_CHUNKS];
+    int owned;  // a thread is counting in it; guarded by stats.mutex
+    struct stats_block *next;
+} stats_block_t;
+
+/* A registered group of counters, for reports */
+typedef struct stats_entry {
+    int id;
+    int n;
+    struct stats_entry *next;
+    char name[];
+} stats_entry_t;
+
+static const char *fixed_names[STATS_NFIXED] = {
+    "db.default.queries", "db.default.adds", "db.default.removes",
+    "connections.opened", "connections.closed"};
+
+static struct {
+    // guards the lists, who owns which block, and the ids handed out
+    pthread_mutex_t mutex;
+    stats_block_t *blocks;
+    stats_entry_t *entries;  // in the order they were registered
+    stats_entry_t **tail;
+    int nentries;
+    int next_id;
+    pthread_once_t once;
+    pthread_key_t key;  // releases a thread's block when it exits
+} stats = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+           .tail = &stats.entries,
+           .next_id = STATS_NFIXED,
+           .once = PTHREAD_ONCE_INIT};
+
+static __thread stats_block_t *mine = 0;
+
+static void stats_lock(void) {
+    int err;
+    if ((err = pthread_mutex_lock(&stats.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void stats_unlock(void) {
+    int err;
+    if ((err = pthread_mutex_unlock(&stats.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+/* Leaves an exiting thread's block to the next thread that counts. */
+static void stats_release(void *block) {
+    stats_lock();
+    ((stats_block_t *)block)->owned = 0;
+    stats_unlock();
+}
+
+static void stats_init(void) {
+    int err;
+    if ((err = pthread_key_create(&stats.key, stats_release)) != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+/* Returns the calling thread's block, or 0 if out of memory. */
+static stats_block_t *stats_mine(void) {
+    stats_block_t *b;
+    int err;
+    if ((err = pthread_once(&stats.once, stats_init)) != 0) {
+        handle_error_en(err, "pthread_once");
+    }
+    stats_lock();
+    b = stats.blocks;
+    while (b != 0 && b->owned) b = b->next;
+    if (b == 0 && (b = calloc(1, sizeof(stats_block_t))) != 0) {
+        b->next = stats.blocks;
+        stats.blocks = b;
+    }
+    if (b != 0) b->owned = 1;
+    stats_unlock();
+    if (b != 0 && (err = pthread_setspecific(stats.key, b)) != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    return mine = b;
+}
+
+/* Allocates chunk c of the calling thread's block, or returns 0. */
+static uint64_t *stats_chunk(stats_block_t *b, int c) {
+    void *chunk;
+    if (posix_memalign(&chunk, 64, STATS_CHUNK * sizeof(uint64_t)) != 0) {
+        return 0;
+    }
+    memset(chunk, 0, STATS_CHUNK * sizeof(uint64_t));
+    // readers see the zeroes before the pointer
+    __atomic_store_n(&b->chunks[c], chunk, __ATOMIC_RELEASE);
+    return chunk;
+}
+
+int stats_register(const char *name, int n) {
+    stats_entry_t *entry;
+    int id = -1;
+    if (n < 1 || (entry = malloc(sizeof(*entry) + strlen(name) + 1)) == 0) {
+        return -1;
+    }
+    stats_lock();
+    if (stats.next_id + n <= STATS_MAX) {
+        id = entry->id = stats.next_id;
+        entry->n = n;
+        strcpy(entry->name, name);
+        entry->next = 0;
+        *stats.tail = entry;
+        stats.tail = &entry->next;
+        stats.nentries++;
+        stats.next_id += n;
+    }
+    stats_unlock();
+    if (id < 0) free(entry);
+    return id;
+}
+
+void stats_add(int id, uint64_t n) {
+    stats_block_t *b = mine;
+    uint64_t *counter;
+    if (id < 0) return;
+    if (b == 0 && (b = stats_mine()) == 0) return;
+    // only the owner writes the chunk pointers, so it reads them plainly
+    if ((counter = b->chunks[id / STATS_CHUNK]) == 0 &&
+        (counter = stats_chunk(b, id / STATS_CHUNK)) == 0) {
+        return;
+    }
+    counter += id % STATS_CHUNK;
+    // and nobody else writes the counter, so a load and a store suffice
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+void stats_sums(int id, int n, uint64_t *sums) {
+    memset(sums, 0, n * sizeof(uint64_t));
+    stats_lock();
+    for (stats_block_t *b = stats.blocks; b != 0; b = b->next) {
+        for (int i = 0; i < n; i++) {
+            uint64_t *chunk = __atomic_load_n(
+                &b->chunks[(id + i) / STATS_CHUNK], __ATOMIC_ACQUIRE);
+            if (chunk != 0) {
+                sums[i] += __atomic_load_n(&chunk[(id + i) % STATS_CHUNK],
+                                           __ATOMIC_RELAXED);
+            }
+        }
+    }
+    stats_unlock();
+}
+
+uint64_t stats_sum(int id) {
+    uint64_t sum = 0;
+    if (id >= 0) stats_sums(id, 1, &sum);
+    return sum;
+}
+
+void stats_report(FILE *out) {
+    uint64_t sums[STATS_NFIXED];
+    stats_entry_t *entry;
+    int count;
+
+    stats_sums(0, STATS_NFIXED, sums);
+    for (int i = 0; i < STATS_NFIXED; i++) {
+        fprintf(out, "%s %llu\n", fixed_names[i], (unsigned long long)sums[i]);
+    }
+    // entries are only ever appended, so the first count of them stay put
+    stats_lock();
+    entry = stats.entries;
+    count = stats.nentries;
+    stats_unlock();
+    for (; count > 0; count--, entry = entry->next) {
+        uint64_t *group;
+        if ((group = malloc(entry->n * sizeof(uint64_t))) == 0) {
+            fprintf(out, "%s: out of memory\n", entry->name);
+            continue;
+        }
+        stats_sums(entry->id, entry->n, group);
+        if (entry->n == 1) {
+            fprintf(out, "%s %llu\n", entry->name,
+                    (unsigned long long)group[0]);
+        }
+        for (int i = 0; entry->n > 1 && i < entry->n; i++) {
+            if (group[i] == 0) continue;
+            fprintf(out, "%s[%d] %llu\n", entry->name, i,
+                    (unsigned long long)group[i]);
+        }
+        free(group);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A registry of statistics counters kept per thread. Every thread counts in
+ * its own block, in chunks of STATS_CHUNK counters aligned to cache lines
+ * that it allocates as it first counts in them, so adding to a counter is a
+ * thread-local load and a relaxed store, never an atomic read-modify-write,
+ * and no two threads ever write the same cache line however many cores
+ * there are. Reading a counter sums it over every block with relaxed loads,
+ * under a mutex that counting never takes. A thread that exits leaves its
+ * block, counts and all, to the next thread, so counters never go down.
+ */
+
+/* Counters every server has; their ids are fixed. */
+enum stats_fixed {
+    STATS_QUERIES,  // of the default database; named ones register theirs
+    STATS_ADDS,
+    STATS_REMOVES,
+    STATS_CONNECTIONS_OPENED,
+    STATS_CONNECTIONS_CLOSED,
+    STATS_NFIXED
+};
+
+#define STATS_CHUNK 64
+#define STATS_CHUNKS 256
+// the most counters there can be
+#define STATS_MAX (STATS_CHUNK * STATS_CHUNKS)
+
+/*
+ * Registers n consecutive counters, starting at 0, under name, which is
+ * copied. Returns the id of the first, or -1 if there is no room left.
+ */
+int stats_register(const char *name, int n);
+
+/* Adds n to counter id for the calling thread. An id of -1 is ignored. */
+void stats_add(int id, uint64_t n);
+
+/* The total of counter id over all threads. */
+uint64_t stats_sum(int id);
+
+/* Stores the totals of the n counters from id on in sums. */
+void stats_sums(int id, int n, uint64_t *sums);
+
+/*
+ * Writes every counter to out as "name total", or "name[i] total" for the
+ * counters of a group, leaving out those of a group that are 0.
+ */
+void stats_report(FILE *out);
+
+#endif  // STATS_H_
@@ -0,0 +1,102 @@
+#!/bin/bash
+
+# Helpers for the scripted checks in tests/, sourced by each of them. A check
+# starts servers whose console is a fifo, so it can type console commands and
+# end a server by closing it, drives them with ./client scripts, and compares
+# what comes back with what it expected. Run from the repository root after
+# make, or through "make test".
+
+TMP=$(mktemp -d /tmp/dbtest.XXXXXX)
+FAILED=0
+declare -A SERVER_PID SERVER_FD SERVER_LOG
+
+cleanup() {
+    for name in "${!SERVER_PID[@]}"; do
+        kill "${SERVER_PID[$name]}" 2>/dev/null
+    done
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# wait_for <file> <pattern> [<pid>]: waits up to 10 seconds for a line
+# matching pattern in file; returns 1 if none came or the process exited.
+wait_for() {
+    local file=$1 pattern=$2 pid=$3
+    for _ in $(seq 100); do
+        grep -q -- "$pattern" "$file" 2>/dev/null && return 0
+        [ -n "$pid" ] && ! kill -0 "$pid" 2>/dev/null && return 1
+        sleep 0.1
+    done
+    return 1
+}
+
+# start_server <name> <port> <server options...>: starts ./server on port
+# with its output in $TMP/<name>.log and waits until it serves. <port> may
+# be "-" for a free one, which is left in PORT.
+start_server() {
+    local name=$1 port=$2 fd
+    shift 2
+    for _ in 1 2 3 4 5; do
+        [ "$port" = - ] && PORT=$((20000 + RANDOM % 20000)) || PORT=$port
+        SERVER_LOG[$name]=$TMP/$name.log
+        rm -f "$TMP/$name.fifo"
+        mkfifo "$TMP/$name.fifo"
+        ./server "$PORT" "$@" <"$TMP/$name.fifo" >"${SERVER_LOG[$name]}" 2>&1 &
+        SERVER_PID[$name]=$!
+        exec {fd}>"$TMP/$name.fifo"
+        SERVER_FD[$name]=$fd
+        # "on port", or "on inherited socket" after a handoff
+        if wait_for "${SERVER_LOG[$name]}" "listening on" \
+            "${SERVER_PID[$name]}"; then
+            return 0
+        fi
+        stop_server "$name"
+        # only a port of our choosing is worth another try
+        [ "$port" = - ] || break
+    done
+    echo "$name: server did not start:"
+    cat "${SERVER_LOG[$name]}"
+    exit 1
+}
+
+# console <name> <command>: types a command at the server's console.
+console() {
+    echo "$2" >&"${SERVER_FD[$1]}"
+}
+
+# stop_server <name>: closes the console, which makes the server shut down
+# (taking its last checkpoint or flush), and waits for it to exit.
+stop_server() {
+    local fd=${SERVER_FD[$1]}
+    exec {fd}>&-
+    wait "${SERVER_PID[$1]}" 2>/dev/null
+    unset "SERVER_PID[$1]"
+}
+
+# kill_server <name>: kills the server outright, as a crash would.
+kill_server() {
+    kill -9 "${SERVER_PID[$1]}"
+    stop_server "$1"
+}
+
+# client <port>: runs the client script on standard input against the
+# server and prints its responses.
+client() {
+    timeout 30 ./client localhost "$1" | grep -v '^Client terminated cleanly'
+}
+
+# check <description> <expected> <actual>: reports whether they match.
+check() {
+    if [ "$2" == "$3" ]; then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1"
+        diff <(echo "$2") <(echo "$3") | sed 's/^/    /'
+        FAILED=1
+    fi
+}
+
+# finish: the exit status of the check.
+finish() {
+    exit $FAILED
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# With -x the server captures its client traffic; "x" on the console stops
+# the capture and reports its size, and ./replay re-issues it, timed or with
+# -f, so another server ends with the same keys.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db - -x $TMP/capture
+(for i in $(seq 1 50); do echo "a k$i v$i"; done
+    for i in $(seq 1 2 50); do echo "d k$i"; done) | client $PORT >/dev/null
+client $PORT >/dev/null <<'END'
+n other
+a o1 x
+A big 5
+hello
+n
+q k2
+END
+console db "x"
+echo "a after x" | client $PORT >/dev/null
+stop_server db
+check "capture reported" "captured 84 records of 2 connections" \
+    "$(grep -o '^captured [0-9]* records of [0-9]* connections' $TMP/db.log)"
+
+for mode in timed fast; do
+    start_server $mode -
+    [ $mode == fast ] && flags=-f || flags=
+    ./replay $flags localhost $PORT $TMP/capture >$TMP/$mode.out 2>&1
+    check "$mode replay ran" "replaying 82 commands of 2 connections" \
+        "$(grep -o '^replaying [0-9]* commands of [0-9]* connections' \
+            $TMP/$mode.out)"
+    check "$mode replay keys" "v2
+not found
+not found" "$(printf 'q k2\nq k1\nq after\n' | client $PORT)"
+    check "$mode replay named database" "hello" \
+        "$(printf 'n other\nQ big\n' | client $PORT | tail -1)"
+    stop_server $mode
+done
+
+finish
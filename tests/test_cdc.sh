@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# With -R a client that sends "S <seq>" gets the changes from <seq> on,
+# those already made from the ring and the rest as they happen, including
+# large values and range deletes; one asking for changes the ring no longer
+# holds gets "gap".
+
+. "$(dirname "$0")/lib.sh"
+
+# subscribe <seq> <file>: subscribes in the background, leaving the stream in
+# file and the client's pid in SUBSCRIBER.
+subscribe() {
+    echo "S $1" | timeout 30 ./client localhost $PORT >$2 2>/dev/null &
+    SUBSCRIBER=$!
+    wait_for $2 subscribed
+}
+
+start_server db - -R 8
+for i in 1 2 3 4 5; do echo "a k$i v$i"; done | client $PORT >/dev/null
+subscribe 3 $TMP/stream
+client $PORT >/dev/null <<'EOF'
+d k1
+A big 10
+0123456789
+D k2 k3
+EOF
+wait_for $TMP/stream "^8 "
+kill $SUBSCRIBER
+check "changes resumed from 3" "subscribed 3
+3 a k3 v3
+4 a k4 v4
+5 a k5 v5
+6 d k1
+7 A big 10
+0123456789
+8 D k2 k3" "$(cat $TMP/stream)"
+
+# a resume from where the last one left off
+subscribe 9 $TMP/next
+echo "a k6 v6" | client $PORT >/dev/null
+wait_for $TMP/next "^9 "
+kill $SUBSCRIBER
+check "changes resumed from 9" "subscribed 9
+9 a k6 v6" "$(cat $TMP/next)"
+
+# 1 and 2 were overwritten by 9 and 10 in a ring of 8
+echo "a k7 v7" | client $PORT >/dev/null
+check "overwritten changes reported" "gap 3" \
+    "$(echo "S 1" | client $PORT 2>/dev/null)"
+stop_server db
+
+finish
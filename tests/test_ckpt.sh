@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# With -c the keys are written to region files of a few thousand keys each; a
+# checkpoint rewrites only the regions whose keys changed, and a restart, or
+# a restart after a kill -9 with -w, loads the keys back.
+
+. "$(dirname "$0")/lib.sh"
+
+long=$(head -c 3000 /dev/zero | tr '\0' c)
+
+load() {
+    for i in $(seq 10000 19999); do echo "a k$i v$i"; done
+    printf 'A big 3000\n%s\n' "$long"
+}
+
+# every hundredth key, and the large value
+queries() {
+    for i in $(seq 10000 100 19999); do echo "q k$i"; done
+    echo "Q big"
+}
+
+expected() {
+    for i in $(seq 10000 100 19999); do
+        if [ $i -ge 12000 ] && [ $i -le 12999 ]; then
+            echo "not found"
+        elif [ $i == 15000 ]; then
+            echo "changed"
+        else
+            echo "v$i"
+        fi
+    done
+    printf '3000\n%s\n' "$long"
+}
+
+start_server db - -c $TMP/ckpt -C 600000
+load | client $PORT >/dev/null
+console db c
+wait_for $TMP/db.log "checkpoint 1:"
+check "keys split into regions" \
+    "checkpoint 1: rewrote 1 dirty of 1 regions into 2 (10001 keys)" \
+    "$(grep -o 'checkpoint 1: .* keys)' $TMP/db.log)"
+# a change in the first region, which is split as it holds 8192 keys
+printf 'd k15000\na k15000 changed\n' | client $PORT >/dev/null
+console db c
+wait_for $TMP/db.log "checkpoint 2:"
+check "one region rewritten" \
+    "checkpoint 2: rewrote 1 dirty of 2 regions into 2 (8192 keys)" \
+    "$(grep -o 'checkpoint 2: .* keys)' $TMP/db.log)"
+echo "D k12000 k12999" | client $PORT >/dev/null
+stop_server db
+check "range delete checkpointed" 1 \
+    "$(grep -c 'checkpoint 3: rewrote 1 dirty of 3 regions into 1' $TMP/db.log)"
+# three regions and the manifest
+check "superseded files removed" 4 "$(ls $TMP/ckpt | wc -l)"
+
+start_server db - -c $TMP/ckpt
+check "checkpoint loaded" "$(expected)" "$(queries | client $PORT)"
+stop_server db
+check "keys loaded" 1 \
+    "$(grep -c 'loaded 9001 keys from checkpoint 3' $TMP/db.log)"
+
+# a crash: what the checkpoint does not hold is in the log
+start_server db - -c $TMP/ckpt -w $TMP/wal
+printf 'a after1 x\nd k19900\n' | client $PORT >/dev/null
+console db c
+wait_for $TMP/db.log "checkpoint 4:"
+printf 'a after2 y\nd k10000\n' | client $PORT >/dev/null
+kill_server db
+start_server db - -c $TMP/ckpt -w $TMP/wal
+check "checkpoint and log replayed" "x
+y
+not found
+not found
+v10100" "$(printf 'q after1\nq after2\nq k19900\nq k10000\nq k10100\n' |
+    client $PORT)"
+stop_server db
+
+finish
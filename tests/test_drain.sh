@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# SIGINT drains the connected clients, waiting until every connection opened
+# has closed, and the server then serves new ones; a drain with nobody
+# connected ends at once.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db -
+# two connections stay open, each after a command of its own
+for c in 1 2; do
+    mkfifo $TMP/hold.$c
+    ./client localhost $PORT <$TMP/hold.$c >/dev/null 2>&1 &
+    pids="$pids $!"
+    exec {fd}>$TMP/hold.$c
+    fds="$fds $fd"
+    echo "a k$c v$c" >&$fd
+done
+for _ in $(seq 50); do
+    [ "$(printf 'q k1\nq k2\n' | client $PORT | tr '\n' ' ')" == "v1 v2 " ] &&
+        break
+    sleep 0.1
+done
+kill -INT ${SERVER_PID[db]}
+wait_for $TMP/db.log "^drained 2 clients" ${SERVER_PID[db]}
+check "held connections drained" "drained 2 clients" \
+    "$(grep -o '^drained [0-9]* clients' $TMP/db.log)"
+check "none forced closed" 0 "$(grep -c 'forced closed' $TMP/db.log)"
+for fd in $fds; do
+    exec {fd}>&-
+done
+wait $pids
+check "serving after the drain" "v2" "$(echo "q k2" | client $PORT)"
+kill -INT ${SERVER_PID[db]}
+wait_for $TMP/db.log "^drained 0 clients" ${SERVER_PID[db]}
+check "empty drain" "drained 0 clients" \
+    "$(grep -o '^drained 0 clients' $TMP/db.log)"
+stop_server db
+
+finish
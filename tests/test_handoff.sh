@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# "u" hands the listening socket and the database to a new server started
+# with -u, which serves the same port with the same keys, including large
+# values; the old server keeps serving if the new one never confirms that it
+# loaded the database, and a server in LSM mode refuses to hand off.
+
+. "$(dirname "$0")/lib.sh"
+
+long=$(head -c 5000 /dev/zero | tr '\0' z)
+
+start_server old -
+port=$PORT
+client $port >/dev/null <<EOF
+a k1 v1
+a k2 v2
+a k3 v3
+A big 5000
+$long
+d k2
+EOF
+console old "u $TMP/handoff.sock 10000"
+wait_for $TMP/old.log "handing off" || check "handoff started" yes no
+start_server new $port -u $TMP/handoff.sock
+stop_server old
+check "old server handed off" "handoff complete" \
+    "$(grep -o 'handoff complete' $TMP/old.log)"
+after=$(client $port <<'EOF'
+q k1
+q k2
+q k3
+Q big
+a k4 v4
+q k4
+EOF
+)
+check "keys served after the handoff" "v1
+not found
+v3
+5000
+$long
+added
+v4" "$after"
+stop_server new
+# its standard output is only flushed on exit
+check "new server took over" "took over 3 keys from $TMP/handoff.sock" \
+    "$(grep 'took over' $TMP/new.log)"
+
+# a new server that takes the dump and dies before it has loaded it
+start_server old -
+echo "a k1 v1" | client $PORT >/dev/null
+console old "u $TMP/lost.sock 5000"
+wait_for $TMP/old.log "waiting"
+python3 - $TMP/lost.sock <<'END'
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+socket.recv_fds(s, 1, 2)
+while s.recv(65536):
+    pass
+END
+wait_for $TMP/old.log "resuming"
+check "old server resumes without a confirmed load" "v1" \
+    "$(echo "q k1" | client $PORT)"
+stop_server old
+
+start_server lsm - -l $TMP/runs
+console lsm "u $TMP/lsm.sock 1000"
+wait_for $TMP/lsm.log "cannot hand off"
+check "refused in LSM mode" "cannot hand off in LSM mode" \
+    "$(grep 'cannot hand off' $TMP/lsm.log)"
+stop_server lsm
+
+finish
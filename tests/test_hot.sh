@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# With -k, "h <n>" reports the n most accessed keys since the last report,
+# over the accesses of several connections, and starts a new window.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db - -k
+# hot1 200 times, hot2 100 times, hot3 50 times, and 300 keys once each,
+# spread over three connections
+for c in 1 2 3; do
+    (for i in $(seq 1 100); do
+        [ $c == 1 ] && echo "q hot1"
+        [ $c == 2 ] && echo "a hot1 x" && echo "q hot2"
+        [ $c == 3 ] && [ $((i % 2)) == 0 ] && echo "q hot3"
+        echo "q cold$c.$i"
+    done) | client $PORT >/dev/null &
+    pids="$pids $!"
+done
+wait $pids
+console db "h 3"
+echo "q later" | client $PORT >/dev/null
+console db "h 1"
+stop_server db
+check "hottest keys" "650 accesses since the last report
+hot1
+hot2
+hot3" "$(grep -A3 '^650 accesses' $TMP/db.log | awk 'NR == 1 { print; next }
+    { print $2 }')"
+check "counts exact when nothing collides" " 1 hot1 200 (30.8%)" \
+    "$(grep ' hot1 ' $TMP/db.log)"
+check "new window" "1 accesses since the last report
+ 1 later 1 (100.0%)" "$(grep -A1 '^1 accesses' $TMP/db.log)"
+
+finish
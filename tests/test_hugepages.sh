@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# With -H nodes come from a huge page arena (or transparent huge pages when
+# none are reserved) whose blocks are cached per thread: keys added, removed
+# and added again by several clients at once are all found.
+
+. "$(dirname "$0")/lib.sh"
+
+# keys <first> <last> <command>: a command on each of those keys
+keys() {
+    for i in $(seq $1 $2); do echo "$3 k$i${4:+ v$i}"; done
+}
+
+start_server db - -H -a 64
+pids=
+for part in 0 1 2 3; do
+    first=$((part * 500 + 1))
+    last=$((first + 499))
+    (keys $first $last a v; keys $first $last d; keys $first $((first + 249)) a v) |
+        client $PORT >/dev/null &
+    pids="$pids $!"
+done
+wait $pids
+expected=$(for i in $(seq 1 2000); do
+    [ $(((i - 1) % 500)) -lt 250 ] && echo "v$i" || echo "not found"
+done)
+check "keys in the huge page arena" "$expected" "$(keys 1 2000 q | client $PORT)"
+stop_server db
+check "huge pages used" 1 "$(grep -c 'huge pages' $TMP/db.log)"
+
+finish
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# With -i equal keys and values share one reference counted copy: removing
+# one user of a string leaves it intact for the others, and a string that
+# was freed can be interned again.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db - -i
+out=$(client $PORT <<'EOF2'
+a apple apple
+a pear apple
+a plum apple
+d apple
+q pear
+q plum
+d pear
+d plum
+q plum
+a apple fig
+a fig apple
+q apple
+q fig
+EOF2
+)
+check "shared strings" "added
+added
+added
+removed
+apple
+apple
+removed
+removed
+not found
+added
+added
+fig
+apple" "$out"
+stop_server db
+
+finish
@@ -0,0 +1,93 @@
+#!/bin/bash
+
+# With a memtable of four keys, most keys are flushed to run files (and the
+# runs merged) as they are added; queries find them there, deletes shadow
+# them, and a restart with the same directory sees the same keys.
+
+. "$(dirname "$0")/lib.sh"
+
+long=$(head -c 1000 /dev/zero | tr '\0' y)
+
+# k01 .. k40 and a large value
+load() {
+    for i in $(seq -w 1 40); do echo "a k$i v$i"; done
+    printf 'A big 1000\n%s\n' "$long"
+}
+
+queries() {
+    for i in $(seq -w 1 40); do echo "q k$i"; done
+    echo "Q big"
+}
+
+# what queries() gets after the changes below: every seventh key removed,
+# k02 removed and added back
+expected() {
+    for i in $(seq -w 1 40); do
+        if [ "$i" == 02 ]; then
+            echo "again"
+        elif [ $((10#$i % 7)) == 0 ]; then
+            echo "not found"
+        else
+            echo "v$i"
+        fi
+    done
+    printf '1000\n%s\n' "$long"
+}
+
+start_server db - -l $TMP/runs -L 4
+load | client $PORT >/dev/null
+check "flushed keys found" "v01
+v02
+v39" "$(printf 'q k01\nq k02\nq k39\n' | client $PORT)"
+changes=$(client $PORT <<'EOF'
+a k01 other
+d k02
+a k02 again
+d k07
+d k14
+d k21
+d k28
+d k35
+d k07
+D k01 k40
+EOF
+)
+check "changes to flushed keys" "already in database
+removed
+added
+removed
+removed
+removed
+removed
+removed
+not in database
+not supported in LSM mode" "$changes"
+check "queries through the runs" "$(expected)" "$(queries | client $PORT)"
+stop_server db
+check "run files written" yes "$([ "$(ls $TMP/runs | wc -l)" -gt 1 ] && echo yes)"
+
+start_server db - -l $TMP/runs -L 4
+check "runs read after a restart" "$(expected)" "$(queries | client $PORT)"
+stop_server db
+
+# many flushes: merges of runs of one size keep the number of runs small,
+# and every key and tombstone survives them
+start_server db - -l $TMP/many -L 8
+(for i in $(seq 1000 1999); do echo "a m$i v$i"; done
+    for i in $(seq 1000 3 1999); do echo "d m$i"; done) | client $PORT >/dev/null
+many() {
+    for i in $(seq 1000 1999); do
+        [ $(((i - 1000) % 3)) == 0 ] && echo "not found" || echo "v$i"
+    done
+}
+check "keys through merged runs" "$(many)" \
+    "$(for i in $(seq 1000 1999); do echo "q m$i"; done | client $PORT)"
+stop_server db
+runs=$(ls $TMP/many | grep -c 'run-')
+check "runs merged" yes "$([ $runs -ge 1 ] && [ $runs -le 16 ] && echo yes)"
+start_server db - -l $TMP/many -L 8
+check "merged runs read after a restart" "$(many)" \
+    "$(for i in $(seq 1000 1999); do echo "q m$i"; done | client $PORT)"
+stop_server db
+
+finish
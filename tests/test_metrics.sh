@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# With -m, GET /metrics on the loopback port reports the commands served by
+# type, the connections opened and open, and with -K the keys stored.
+
+. "$(dirname "$0")/lib.sh"
+
+mport=$((20000 + RANDOM % 20000))
+start_server db - -m $mport -K
+(for i in $(seq 1 30); do echo "a k$i v$i"; done
+    for i in $(seq 1 10); do echo "q k$i"; done
+    echo "d k1") | client $PORT >/dev/null
+# one connection stays open while the metrics are read
+mkfifo $TMP/hold
+./client localhost $PORT <$TMP/hold >/dev/null 2>&1 &
+holder=$!
+exec {hold}>$TMP/hold
+echo "q k2" >&$hold
+metric() {
+    grep "^$1 " $TMP/metrics | awk '{ print $2 }'
+}
+# until its query has been counted
+for _ in $(seq 50); do
+    curl -s http://127.0.0.1:$mport/metrics >$TMP/metrics
+    [ "$(metric 'db_command_duration_seconds_count{command="q"}')" == 11 ] &&
+        break
+    sleep 0.1
+done
+check "adds counted" 30 \
+    "$(metric 'db_command_duration_seconds_count{command="a"}')"
+check "queries counted" 11 \
+    "$(metric 'db_command_duration_seconds_count{command="q"}')"
+check "connections opened" 2 "$(metric db_connections_opened_total)"
+check "connections open" 1 "$(metric db_connections)"
+check "keys" 29 "$(metric db_keys)"
+exec {hold}>&-
+wait $holder
+check "not found elsewhere" 404 \
+    "$(curl -s -o /dev/null -w '%{http_code}' http://127.0.0.1:$mport/other)"
+stop_server db
+
+finish
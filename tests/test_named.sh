@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# "n <name>" switches a connection to a separate named database, "n" back to
+# the default one; the same key lives apart in each, a new connection starts
+# in the default one, and named databases are refused where they would be
+# lost (here with -w).
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db -
+client $PORT >$TMP/answers <<'EOF'
+a k1 default
+n t1
+a k1 one
+q k1
+n t2
+q k1
+a k2 two
+n
+q k1
+q k2
+n t1
+q k1
+d k1
+q k1
+EOF
+check "keys kept apart" "added
+using t1: 0 queries, 0 adds, 0 removes
+added
+one
+using t2: 0 queries, 0 adds, 0 removes
+not found
+added
+using default: 0 queries, 1 adds, 0 removes
+default
+not found
+using t1: 1 queries, 1 adds, 0 removes
+one
+removed
+not found" "$(cat $TMP/answers)"
+check "default key kept" "default" "$(echo "q k1" | client $PORT)"
+check "named key kept" "two" \
+    "$(printf "n t2\nq k2\n" | client $PORT | tail -1)"
+stop_server db
+
+start_server db - -w $TMP/wal
+check "refused with a log" "only the default database" \
+    "$(echo "n t1" | client $PORT)"
+stop_server db
+
+finish
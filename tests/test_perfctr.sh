@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# With -P 2 one command in two is measured with the hardware counters, and
+# "e" reports them per command type; where the counters cannot be opened
+# (in most virtual machines, or with perf_event_paranoid above 2) the server
+# says so and does not start.
+
+. "$(dirname "$0")/lib.sh"
+
+if ! ./server 0 -P 2 </dev/null >$TMP/probe.log 2>&1 &&
+    grep -q 'no hardware performance counters' $TMP/probe.log; then
+    echo "skipped: no hardware performance counters"
+    finish
+fi
+
+start_server db - -P 2
+(for i in $(seq 1 100); do echo "a k$i v$i"; done
+    for i in $(seq 1 100); do echo "q k$i"; done) | client $PORT >/dev/null
+console db e
+stop_server db
+# about half of each type
+check "commands measured" "a yes
+q yes" "$(awk '$1 == "a" || $1 == "q" {
+    print $1, ($2 >= 40 && $2 <= 60 ? "yes" : "no") }' $TMP/db.log)"
+
+finish
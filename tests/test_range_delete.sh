@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# D removes exactly the keys in its inclusive range, and a restart gets the
+# same database back by replaying the write-ahead log, alone and on top of a
+# checkpoint.
+
+. "$(dirname "$0")/lib.sh"
+
+# k01 .. k20 with values v01 .. v20
+load() {
+    for i in $(seq -w 1 20); do echo "a k$i v$i"; done
+}
+
+# q of every key, so the database can be compared as a whole
+queries() {
+    for i in $(seq -w 1 20); do echo "q k$i"; done
+}
+
+# what queries() gets after changes(): k05 .. k12 are gone except k07,
+# which is added back, and k15 is removed
+expected() {
+    for i in $(seq -w 1 20); do
+        if [ "$i" == 07 ]; then
+            echo "again"
+        elif [[ ("$i" > 04 && "$i" < 13) || "$i" == 15 ]]; then
+            echo "not found"
+        else
+            echo "v$i"
+        fi
+    done
+}
+
+changes() {
+    client $1 <<'EOF'
+D k05 k12
+D k05 k12
+D x y
+a k07 again
+d k15
+EOF
+}
+
+start_server db - -w $TMP/wal
+load | client $PORT >/dev/null
+check "range delete" "range removed
+none in range
+none in range
+added
+removed" "$(changes $PORT)"
+check "after range delete" "$(expected)" "$(queries | client $PORT)"
+stop_server db
+
+start_server db - -w $TMP/wal -W 4
+check "log replayed" "$(expected)" "$(queries | client $PORT)"
+stop_server db
+
+# the checkpoint taken on exit holds the range delete, the log what follows
+start_server db - -w $TMP/wal2 -c $TMP/ckpt
+load | client $PORT >/dev/null
+changes $PORT >/dev/null
+stop_server db
+start_server db - -w $TMP/wal2 -c $TMP/ckpt
+check "checkpoint loaded" "$(expected)" "$(queries | client $PORT)"
+# a crash leaves the range delete in the log only
+echo "D k01 k03" | client $PORT >/dev/null
+kill_server db
+start_server db - -w $TMP/wal2 -c $TMP/ckpt
+check "checkpoint and log replayed" "$(expected | sed '1,3s/.*/not found/')" \
+    "$(queries | client $PORT)"
+stop_server db
+
+finish
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# A follower (-F) answers "not ready" until it has a snapshot, then loads the
+# leader's snapshot, which spans several chunks, catches up with the changes
+# made since, refuses changes from clients, and replaces its keys with a new
+# snapshot when it reconnects to a new leader.
+
+. "$(dirname "$0")/lib.sh"
+
+long=$(head -c 2000 /dev/zero | tr '\0' r)
+
+# k10000 .. k19999, every hundredth one queried
+queries() {
+    for i in $(seq 10000 100 19999); do echo "q k$i"; done
+    echo "Q big"
+}
+
+# waits up to 10 seconds until the follower answers q <key> with <value>
+wait_value() {
+    for _ in $(seq 100); do
+        [ "$(echo "q $1" | client $FOLLOWER)" == "$2" ] && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# a leader without a change ring (-R) never sends a snapshot
+start_server lost -
+port=$PORT
+start_server follower - -F localhost:$port
+check "not ready before a snapshot" "not ready" \
+    "$(echo "q k10000" | client $PORT)"
+stop_server follower
+stop_server lost
+
+start_server leader - -R 100000
+port=$PORT
+(for i in $(seq 10000 19999); do echo "a k$i v$i"; done
+    printf 'A big 2000\n%s\n' "$long") | client $port >/dev/null
+start_server follower - -F localhost:$port
+FOLLOWER=$PORT
+wait_value k19900 v19900
+check "snapshot loaded" "$(queries | client $port)" \
+    "$(queries | client $FOLLOWER)"
+
+client $port >/dev/null <<'EOF'
+d k10000
+a k10000 changed
+D k10100 k10199
+a last done
+EOF
+wait_value last done
+check "changes followed" "changed
+not found
+v10200" "$(printf 'q k10000\nq k10100\nq k10200\n' | client $FOLLOWER)"
+check "changes refused" "read-only follower" \
+    "$(echo "a other x" | client $FOLLOWER)"
+
+# a leader handing off drops its followers: the follower starts over from
+# the new leader's snapshot
+console leader "u $TMP/handoff.sock 10000"
+wait_for $TMP/leader.log "handing off"
+start_server new $port -u $TMP/handoff.sock -R 100000
+stop_server leader
+echo "d k10000" | client $port >/dev/null
+wait_value k10000 "not found"
+check "snapshot replaced" "$(queries | client $port)" \
+    "$(queries | client $FOLLOWER)"
+stop_server new
+stop_server follower
+check "snapshots loaded" 2 \
+    "$(grep -c "replication: loaded" $TMP/follower.log)"
+
+finish
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# With -K, "K <k>" samples k keys, all of them present, including after
+# removes and range deletes, and about uniformly, also from a reattached
+# shared tree; without -K it is refused.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db - -K
+(for i in $(seq 100 299); do echo "a k$i v$i"; done
+    for i in $(seq 100 2 199); do echo "d k$i"; done
+    echo "D k200 k249"
+    echo "d absent"
+    echo "a k101 again") | client $PORT >/dev/null
+echo "K 3000" | client $PORT >$TMP/sample
+check "sample size" 3000 "$(head -1 $TMP/sample)"
+# k101 .. k199 odd and k250 .. k299 are left: 100 keys
+check "only present keys" 100 "$(tail -n +2 $TMP/sample | sort -u |
+    grep -c -E '^k(1[0-9][13579]|2[5-9][0-9])$')"
+check "every key sampled" 100 "$(tail -n +2 $TMP/sample | sort -u | wc -l)"
+# each key is expected 30 times
+check "about uniform" yes "$(tail -n +2 $TMP/sample | sort | uniq -c |
+    awk '$1 < 5 || $1 > 80 { bad = 1 } END { print bad ? "no" : "yes" }')"
+stop_server db
+
+start_server db -
+echo "a k1 v1" | client $PORT >/dev/null
+check "refused without -K" "sampling not enabled (-K)" \
+    "$(echo "K 10" | client $PORT)"
+stop_server db
+
+# a shared tree changed without -K has its sizes counted when reattached
+start_server db - -s $TMP/shared
+for i in $(seq 10 59); do echo "a k$i v$i"; done | client $PORT >/dev/null
+stop_server db
+start_server db - -s $TMP/shared -K
+check "sizes counted on reattach" "2000 50" "$(echo "K 2000" | client $PORT |
+    awk 'NR == 1 { n = $1 } NR > 1 { seen[$1] } END {
+        print n, length(seen) }')"
+stop_server db
+
+finish
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# With -s the tree lives in a file-backed arena: a server that exits cleanly
+# leaves it for the next one to reattach, large values included, and one
+# that is killed leaves it stale, so the next server starts empty.
+
+. "$(dirname "$0")/lib.sh"
+
+long=$(head -c 2000 /dev/zero | tr '\0' s)
+
+start_server db - -s $TMP/arena -a 64
+client $PORT >/dev/null <<EOF2
+a k1 v1
+a k2 v2
+a k3 v3
+d k2
+A big 2000
+$long
+EOF2
+stop_server db
+
+start_server db - -s $TMP/arena -a 64
+check "tree reattached" "v1
+not found
+v3
+2000
+$long" "$(printf 'q k1\nq k2\nq k3\nQ big\n' | client $PORT)"
+check "reattached tree takes changes" "removed
+added
+v4" "$(printf 'd k1\na k4 v4\nq k4\n' | client $PORT)"
+kill_server db
+
+start_server db - -s $TMP/arena -a 64
+check "stale arena discarded" "not found" "$(echo "q k3" | client $PORT)"
+stop_server db
+check "stale arena reported" 1 "$(grep -c 'stale' $TMP/db.log)"
+
+finish
@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# With -S 0 every command is logged, and "l <n>" lists the last n with the
+# locks they took and the depth they reached: keys added in order make the
+# tree a list, so the last one is found as deep as there are keys.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db - -S 0
+(for i in $(seq 100 149); do echo "a k$i v$i"; done
+    echo "q k149"
+    echo "q k100") | client $PORT >/dev/null
+# the last entry is the end of input the client sends when it is done
+console db "l 3"
+stop_server db
+check "commands logged" "53 commands took 0 us or more" \
+    "$(grep 'commands took' $TMP/db.log)"
+check "depth of each" "depth 1: q k100
+depth 50: q k149" "$(grep -o 'depth .*: q .*' $TMP/db.log)"
+
+finish
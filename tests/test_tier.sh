@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# With -t values that go unread are evicted to the value log and served from
+# it, large ones included; a key read between sweeps is loaded back, and
+# removed and re-added keys get their new values.
+
+. "$(dirname "$0")/lib.sh"
+
+long=$(head -c 3000 /dev/zero | tr '\0' b)
+
+queries() {
+    for i in $(seq 1 100); do echo "q k$i"; done
+    echo "Q big"
+}
+
+expected() {
+    for i in $(seq 1 100); do
+        [ $i == 7 ] && echo "new7" || echo "value$i"
+    done
+    printf '3000\n%s\n' "$long"
+}
+
+start_server db - -t $TMP/vlog -T 100
+(for i in $(seq 1 100); do echo "a k$i value$i"; done
+    printf 'A big 3000\n%s\n' "$long") | client $PORT >/dev/null
+wait_for $TMP/db.log "evicted 101 values"
+check "evicted values served from the log" "$(expected | sed 's/new7/value7/')" \
+    "$(queries | client $PORT)"
+wait_for $TMP/db.log "loaded 101"
+check "read values loaded back" 1 "$(grep -c 'loaded 101' $TMP/db.log)"
+# and evicted again, unread
+for _ in $(seq 100); do
+    [ $(grep -c 'evicted 101' $TMP/db.log) -ge 2 ] && break
+    sleep 0.1
+done
+check "evicted key replaced" "removed
+added" "$(printf 'd k7\na k7 new7\n' | client $PORT)"
+check "values after the replacement" "$(expected)" "$(queries | client $PORT)"
+stop_server db
+
+finish
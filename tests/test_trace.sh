@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Built with <sys/sdt.h>, the server carries a USDT probe under the provider
+# "db" for each tracepoint in trace.h; without it there are none to check.
+
+. "$(dirname "$0")/lib.sh"
+
+if ! readelf -n ./server | grep -q 'Provider: db'; then
+    echo "skipped: built without <sys/sdt.h>"
+    finish
+fi
+check "probes" "command__done
+command__start
+connection__accept
+connection__close
+lock__acquire
+lock__release
+lock__wait
+node__alloc
+node__free" "$(readelf -n ./server | awk '/Name:/ { print $2 }' | sort -u)"
+
+finish
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# a and q with values that fit on a command line, A with values that do not,
+# and q refusing, and Q returning, values too long for a reply line.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db -
+
+small=$(client $PORT <<'EOF'
+a alpha one
+q alpha
+a alpha two
+A beta 11
+hello world
+q beta
+Q beta
+Q alpha
+d alpha
+q alpha
+Q alpha
+EOF
+)
+check "small values" "added
+one
+already in database
+added
+hello world
+11
+hello world
+3
+one
+removed
+not found
+not found" "$small"
+
+long300=$(head -c 300 /dev/zero | tr '\0' x)
+long100k=$(head -c 100000 /dev/urandom | base64 -w 0 | head -c 100000)
+large=$(client $PORT <<EOF
+A gamma 300
+$long300
+A delta 100000
+$long100k
+q gamma
+Q gamma
+Q delta
+d gamma
+Q gamma
+q delta
+EOF
+)
+check "large values" "added
+added
+value too large, use Q
+300
+$long300
+100000
+$long100k
+removed
+not found
+value too large, use Q" "$large"
+
+stop_server db
+finish
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# With -V, "V <value>" lists the keys holding value in order, following adds,
+# removes and range deletes; large values are not indexed.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db - -V
+client $PORT >/dev/null <<'EOF'
+a k3 red
+a k1 red
+a k2 blue
+a k4 red
+a k5 red
+A big 3
+red
+EOF
+check "keys by value" "4
+k1
+k3
+k4
+k5
+1
+k2
+not found" "$(printf 'V red\nV blue\nV green\n' | client $PORT)"
+client $PORT >/dev/null <<'EOF'
+d k3
+d k2
+a k2 red
+D k4 k5
+EOF
+check "index follows changes" "2
+k1
+k2
+not found" "$(printf 'V red\nV blue\n' | client $PORT)"
+stop_server db
+
+finish
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# With -w every change is logged, and a server started with the same log
+# replays it, on one thread or many, after a clean exit or a kill -9 (with
+# group commit, -Y); a torn record at the end of the log is cut off, and a
+# change that cannot be logged is reported to the client.
+
+. "$(dirname "$0")/lib.sh"
+
+long=$(head -c 4000 /dev/zero | tr '\0' w)
+
+# the same key changes many times, so the replay order per key matters
+changes() {
+    for i in $(seq 1 200); do echo "a k$i v$i"; done
+    for i in $(seq 1 2 200); do echo "d k$i"; echo "a k$i again$i"; done
+    for i in $(seq 1 5 200); do echo "d k$i"; done
+    printf 'A big 4000\n%s\n' "$long"
+}
+
+queries() {
+    for i in $(seq 1 200); do echo "q k$i"; done
+    echo "Q big"
+}
+
+expected() {
+    for i in $(seq 1 200); do
+        if [ $(((i - 1) % 5)) == 0 ]; then
+            echo "not found"
+        elif [ $((i % 2)) == 1 ]; then
+            echo "again$i"
+        else
+            echo "v$i"
+        fi
+    done
+    printf '4000\n%s\n' "$long"
+}
+
+start_server db - -w $TMP/wal -Y
+changes | client $PORT >/dev/null
+check "changes logged" "$(expected)" "$(queries | client $PORT)"
+kill_server db
+
+for threads in 1 8; do
+    start_server db - -w $TMP/wal -W $threads
+    check "log replayed on $threads threads" "$(expected)" \
+        "$(queries | client $PORT)"
+    stop_server db
+    check "records replayed on $threads threads" 1 \
+        "$(grep -c "replayed 441 records .* on $threads threads" $TMP/db.log)"
+done
+
+printf 'a torn' >>$TMP/wal
+start_server db - -w $TMP/wal
+check "torn record cut off" "$(expected)
+added" "$( (queries; echo "a torn whole") | client $PORT)"
+stop_server db
+check "torn record reported" 1 "$(grep -c 'torn record' $TMP/db.log)"
+start_server db - -w $TMP/wal
+check "log appended after the cut" "whole" "$(echo "q torn" | client $PORT)"
+stop_server db
+
+# a log that cannot grow past 8 KB: the adds that could not be logged are
+# reported, and a restart replays exactly the others
+value=$(head -c 200 /dev/zero | tr '\0' v)
+(
+    trap '' XFSZ
+    ulimit -f 8
+    start_server db - -w $TMP/full
+    for i in $(seq 1 60); do echo "a k$i $value"; done | client $PORT \
+        >$TMP/answers
+    stop_server db
+)
+check "unlogged adds reported" "added
+write-ahead log failed" "$(uniq $TMP/answers)"
+start_server db - -w $TMP/full
+check "logged adds replayed" "$(sed "s/^added$/$value/;
+    s/^write-ahead log failed$/not found/" $TMP/answers)" \
+    "$(for i in $(seq 1 60); do echo "q k$i"; done | client $PORT)"
+stop_server db
+
+finish
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# "W" watches keys and prefixes: the watcher hears of adds and removes of the
+# keys it matches, and of range deletes covering them, and of nothing else.
+
+. "$(dirname "$0")/lib.sh"
+
+start_server db -
+echo "W k1 user:*" | timeout 30 ./client localhost $PORT >$TMP/watch \
+    2>/dev/null &
+watcher=$!
+wait_for $TMP/watch watching
+client $PORT >/dev/null <<'EOF'
+a k1 v1
+a k2 v2
+a user:ann x
+a users y
+d k1
+d k2
+a user:bob z
+D user:a user:c
+a last done
+d user:zed
+EOF
+wait_for $TMP/watch "range"
+kill $watcher
+check "watched changes" "watching 2
+added k1
+added user:ann
+removed k1
+added user:bob
+removed range user:a user:c" "$(cat $TMP/watch)"
+stop_server db
+
+finish
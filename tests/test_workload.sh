@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# ./workload writes the same script for the same seed, loads keys in sorted
+# order with -i sequential, splits the keys of the load over -j slices, and
+# its operations only touch loaded keys, so every one of them succeeds.
+
+. "$(dirname "$0")/lib.sh"
+
+check "same seed, same script" yes \
+    "$(cmp -s <(./workload -n 100 -o 100) <(./workload -n 100 -o 100) &&
+        echo yes || echo no)"
+check "another seed, another script" no \
+    "$(cmp -s <(./workload -n 100 -o 100) <(./workload -n 100 -o 100 -s 2) &&
+        echo yes || echo no)"
+./workload -n 200 -o 0 -i sequential | awk '{ print $2 }' >$TMP/keys
+check "sequential load sorted" yes \
+    "$(sort -c $TMP/keys 2>/dev/null && echo yes || echo no)"
+check "slices make up the load" \
+    "$(./workload -n 200 -o 0 | awk '{ print $2 }' | sort)" \
+    "$(for j in 0 1 2; do ./workload -n 200 -o 0 -j $j/3; done |
+        awk '{ print $2 }' | sort)"
+
+start_server db -
+./workload -n 1000 -o 5000 -r 50 -d 0 -v 8:3000 | client $PORT >$TMP/answers
+check "every load and write succeeds" 0 \
+    "$(grep -c -E '^(not found|already in database|out of memory)$' \
+        $TMP/answers)"
+check "writes overwrite loaded keys" "$((1000 + 2 * $(./workload -n 1000 \
+    -o 5000 -r 50 -d 0 -v 8:3000 | grep -c '^d ')))" \
+    "$(grep -c -E '^(added|removed)$' $TMP/answers)"
+stop_server db
+
+finish
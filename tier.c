@@ -0,0 +1,223 @@
+#include "./tier.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+
+/* The on-disk value log and the thread that moves values to and from it */
+
+// values are stored in slots of a power of two bytes, at least this many,
+// so a released slot can be reused by any later value of the same class
+#define TIER_MIN_SLOT 16
+#define TIER_CLASSES 48
+
+/* The offsets of released slots of one size, reused last in first out. */
+typedef struct slots {
+    int64_t *offs;
+    size_t n, cap;
+} slots_t;
+
+static struct tier {
+    int fd;
+    long interval_ms;
+    // guards everything below
+    pthread_mutex_t mutex;
+    int64_t end;    // where the next slot is appended
+    size_t values;  // values in the log still referenced by a node
+    size_t bytes;   // and their total size
+    slots_t free[TIER_CLASSES];
+    // wakes the sweeping thread early when stopping
+    pthread_cond_t cond;
+    int stopping;
+    pthread_t thread;
+} tier = {-1};
+
+static int tier_on = 0;
+
+int tier_enabled(void) { return tier_on; }
+
+/* The class of the slot that holds len bytes. */
+static int tier_class(size_t len) {
+    int cls = 0;
+    while (((size_t)TIER_MIN_SLOT << cls) < len) cls++;
+    return cls;
+}
+
+int64_t tier_spill(const char *data, size_t len) {
+    int err;
+    int64_t off;
+    size_t done = 0;
+    int cls = tier_class(len);
+    slots_t *slots = &tier.free[cls];
+
+    if ((err = pthread_mutex_lock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    // a released slot of the same size first, so the log only grows when
+    // more values are evicted than were loaded back or removed
+    off = slots->n > 0 ? slots->offs[slots->n - 1] : tier.end;
+    while (done < len) {
+        ssize_t wrote = pwrite(tier.fd, data + done, len - done, off + done);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) {
+            perror("pwrite");
+            off = -1;
+            break;
+        }
+        done += wrote;
+    }
+    if (off >= 0) {
+        if (slots->n > 0) {
+            slots->n--;
+        } else {
+            tier.end += (int64_t)TIER_MIN_SLOT << cls;
+        }
+        tier.values++;
+        tier.bytes += len;
+    }
+    if ((err = pthread_mutex_unlock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return off;
+}
+
+int tier_load(int64_t off, char *buf, size_t len) {
+    size_t done = 0;
+    // no lock: the caller's node lock keeps these bytes referenced, so the
+    // log cannot be truncated under us
+    while (done < len) {
+        ssize_t got = pread(tier.fd, buf + done, len - done, off + done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            perror("pread");
+            return -1;
+        }
+        done += got;
+    }
+    return 0;
+}
+
+void tier_release(int64_t off, size_t len) {
+    int err;
+    slots_t *slots = &tier.free[tier_class(len)];
+    if ((err = pthread_mutex_lock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    tier.values--;
+    tier.bytes -= len;
+    if (tier.values == 0) {
+        // nothing in the log is live any more, so reclaim all of it
+        if (ftruncate(tier.fd, 0) < 0) perror("ftruncate");
+        tier.end = 0;
+        for (int cls = 0; cls < TIER_CLASSES; cls++) tier.free[cls].n = 0;
+    } else {
+        if (slots->n == slots->cap) {
+            size_t cap = slots->cap > 0 ? 2 * slots->cap : 64;
+            int64_t *offs = realloc(slots->offs, cap * sizeof(int64_t));
+            if (offs != NULL) {
+                slots->offs = offs;
+                slots->cap = cap;
+            }
+        }
+        // out of memory, the slot is just never reused
+        if (slots->n < slots->cap) slots->offs[slots->n++] = off;
+    }
+    if ((err = pthread_mutex_unlock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+void tier_stats(size_t *values, size_t *bytes, size_t *log_bytes) {
+    int err;
+    if ((err = pthread_mutex_lock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    *values = tier.values;
+    *bytes = tier.bytes;
+    *log_bytes = tier.end;
+    if ((err = pthread_mutex_unlock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+static void *tier_thread(void *arg) {
+    int err;
+    size_t evicted, loaded, values, bytes, log_bytes;
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += tier.interval_ms / 1000;
+        deadline.tv_nsec += (tier.interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if ((err = pthread_mutex_lock(&tier.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        err = 0;
+        while (!tier.stopping && err != ETIMEDOUT) {
+            err = pthread_cond_timedwait(&tier.cond, &tier.mutex, &deadline);
+            if (err != 0 && err != ETIMEDOUT) {
+                handle_error_en(err, "pthread_cond_timedwait");
+            }
+        }
+        int stopping = tier.stopping;
+        if ((err = pthread_mutex_unlock(&tier.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (stopping) break;
+
+        db_tier_sweep(&evicted, &loaded);
+        if (evicted > 0 || loaded > 0) {
+            tier_stats(&values, &bytes, &log_bytes);
+            printf(
+                "tiering: evicted %zu values, loaded %zu; %zu (%zu bytes) "
+                "on disk in a %zu byte log\n",
+                evicted, loaded, values, bytes, log_bytes);
+            fflush(stdout);
+        }
+    }
+    return NULL;
+}
+
+int tier_open(const char *path, long interval_ms) {
+    int err;
+    if ((tier.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        perror(path);
+        return -1;
+    }
+    tier.interval_ms = interval_ms > 0 ? interval_ms : 1;
+    pthread_mutex_init(&tier.mutex, 0);
+    pthread_cond_init(&tier.cond, 0);
+    if ((err = pthread_create(&tier.thread, 0, tier_thread, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    tier_on = 1;
+    return 0;
+}
+
+void tier_close(void) {
+    int err;
+    if ((err = pthread_mutex_lock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    tier.stopping = 1;
+    if ((err = pthread_cond_signal(&tier.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    if ((err = pthread_mutex_unlock(&tier.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_join(tier.thread, NULL)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    // nodes freed after this point still hand their log space back
+    tier_on = 0;
+}
@@ -0,0 +1,59 @@
+#ifndef TIER_H_
+#define TIER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tiered storage for values. A background thread sweeps the tree every
+ * interval: values that were not read since the previous sweep are appended
+ * to a value log on disk and freed, leaving only the key and the value's log
+ * offset in memory, and values on disk that were read since the previous
+ * sweep are loaded back. Reads of a value on disk are served with pread().
+ *
+ * The log is a cache of the tree, not a copy of it: it is truncated when
+ * opened, and db_dump() reads evicted values back from it. Values are
+ * written to slots of a power of two bytes, and the slots of values that were
+ * loaded back or removed are reused by later evictions of the same class, so
+ * evicting and loading back the same values over and over does not grow it.
+ */
+
+/*
+ * Creates (or truncates) the value log at path and starts the sweeping
+ * thread, which runs db_tier_sweep() every interval_ms. Must be called before
+ * any keys are added. Returns 0 on success and -1 on failure.
+ */
+int tier_open(const char *path, long interval_ms);
+
+/* Nonzero once tier_open() has succeeded. */
+int tier_enabled(void);
+
+/*
+ * Writes len bytes to a free slot of the log, appending one if there is none,
+ * and returns their offset, or -1 if the write failed.
+ */
+int64_t tier_spill(const char *data, size_t len);
+
+/* Reads len bytes at off in the log into buf. Returns 0 or -1 on error. */
+int tier_load(int64_t off, char *buf, size_t len);
+
+/*
+ * Tells the log that the len bytes at off are no longer referenced, so their
+ * slot can be reused. Once nothing is referenced the log is truncated back to
+ * empty.
+ */
+void tier_release(int64_t off, size_t len);
+
+/*
+ * Reports the number of values on disk, their total size and the size of the
+ * log holding them.
+ */
+void tier_stats(size_t *values, size_t *bytes, size_t *log_bytes);
+
+/*
+ * Stops the sweeping thread. The log stays open, so nodes freed afterwards
+ * by db_cleanup() can still release their values.
+ */
+void tier_close(void);
+
+#endif  // TIER_H_
@@ -0,0 +1,47 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * Static tracepoints (USDT probes) under the provider "db", for perf probe,
+ * bpftrace or SystemTap, e.g.
+ *
+ *   bpftrace -e 'usdt:./server:db:lock__wait { @[arg1] = count(); }'
+ *
+ * A probe compiles to a single nop plus a note in the ELF file naming its
+ * location and arguments; a tracer attaching to it patches the nop, so an
+ * unused probe costs nothing and no rebuild is needed to use one. Built
+ * without <sys/sdt.h> (from systemtap-sdt-dev), or with -DDB_NO_TRACE, the
+ * probes compile to nothing at all.
+ *
+ * The probes and their arguments:
+ *   command__start   (char *command)
+ *   command__done    (char *command, char *response)
+ *   lock__acquire    (pthread_rwlock_t *lock, int write), before taking it
+ *   lock__wait       (pthread_rwlock_t *lock, int write, uint64 ns), when
+ *                    the lock was not free at once, after it was acquired
+ *   lock__release    (pthread_rwlock_t *lock)
+ *   node__alloc      (node_t *node, char *name)
+ *   node__free       (node_t *node)
+ *   connection__accept (int fd)
+ *   connection__close  (int fd)
+ */
+
+#if !defined(DB_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DB_TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef DB_TRACE_ENABLED
+#define TRACE1(name, a) DTRACE_PROBE1(db, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(db, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(db, name, a, b, c)
+#else
+// the arguments are not even evaluated
+#define TRACE1(name, a) ((void)0)
+#define TRACE2(name, a, b) ((void)0)
+#define TRACE3(name, a, b, c) ((void)0)
+#endif
+
+#endif  // TRACE_H_
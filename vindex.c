@@ -0,0 +1,457 @@
+// for twalk_r()
+#define _GNU_SOURCE
+#include "./vindex.h"
+#include <pthread.h>
+#include <search.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+#include "./db.h"
+
+/*
+ * The index as two sets of balanced trees (tsearch()), split into stripes by
+ * hash so that changes to unrelated keys and values rarely share a mutex:
+ * one maps each value to the tree of keys holding it, the other maps each key
+ * to its entry in the first, so a remove can find the value it drops.
+ *
+ * Hashing leaves no order to find the keys of a range delete by, so they are
+ * removed by a background thread that walks every stripe, rather than by the
+ * observer while the database waits. Until it is done, lookups leave out the
+ * keys that the pending range deletes removed: every change is numbered, and
+ * a key is hidden if it is in such a range and was added before it.
+ */
+
+#define VINDEX_STRIPES 64
+
+typedef struct vkeys {
+    char *value;
+    size_t count;
+    void *keys;  // tree of the keys' vpairs
+} vkeys_t;
+
+typedef struct vpair {
+    char *key;
+    vkeys_t *vk;   // lives in the value's stripe; it outlives this pair
+    uint64_t seq;  // of the change that added it
+} vpair_t;
+
+/* A range delete whose keys are still in the index */
+typedef struct vrange {
+    char *lo;
+    char *hi;
+    uint64_t seq;  // of the range delete
+    struct vrange *next;
+} vrange_t;
+
+static struct stripe {
+    pthread_mutex_t mutex;
+    void *by_value;  // vkeys_t, in the stripe of the value's hash
+    void *by_key;    // vpair_t, in the stripe of the key's hash
+} stripes[VINDEX_STRIPES];
+
+// the range deletes waiting for the thread, oldest first
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    vrange_t *head;
+    vrange_t **tail;
+    int pending;  // read without the mutex to skip checking lookups
+    int stop;
+    pthread_t thread;
+} ranges = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+            .cond = PTHREAD_COND_INITIALIZER,
+            .tail = &ranges.head};
+
+// numbers the changes, see vpair_t and vrange_t
+static uint64_t vindex_seq = 0;
+
+static int vindex_on = 0;
+
+int vindex_enabled(void) { return vindex_on; }
+
+static struct stripe *vindex_stripe(const char *str) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3ULL;
+    }
+    return &stripes[hash % VINDEX_STRIPES];
+}
+
+static int cmp_vkeys(const void *a, const void *b) {
+    return strcmp(((const vkeys_t *)a)->value, ((const vkeys_t *)b)->value);
+}
+
+static int cmp_vpair(const void *a, const void *b) {
+    return strcmp(((const vpair_t *)a)->key, ((const vpair_t *)b)->key);
+}
+
+static void vindex_lock(struct stripe *st) {
+    int err;
+    if ((err = pthread_mutex_lock(&st->mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void vindex_unlock(struct stripe *st) {
+    int err;
+    if ((err = pthread_mutex_unlock(&st->mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+/* Takes a pair that is no longer in by_key out of its value's keys. */
+static void vindex_drop(vpair_t *pair) {
+    vkeys_t *vk = pair->vk;
+    struct stripe *vs = vindex_stripe(vk->value);
+    vindex_lock(vs);
+    tdelete(pair, &vk->keys, cmp_vpair);
+    if (--vk->count == 0) {
+        tdelete(vk, &vs->by_value, cmp_vkeys);
+        free(vk->value);
+        free(vk);
+    }
+    vindex_unlock(vs);
+    free(pair->key);
+    free(pair);
+}
+
+/* Indexes key under value as of change seq. Returns -1 if out of memory. */
+static int vindex_add(const char *key, const char *value, uint64_t seq) {
+    struct stripe *vs = vindex_stripe(value);
+    struct stripe *ks = vindex_stripe(key);
+    vpair_t *pair;
+    vkeys_t probe = {(char *)value};
+    vkeys_t *vk;
+    void *found;
+
+    if ((pair = malloc(sizeof(vpair_t))) == 0) return -1;
+    if ((pair->key = strdup(key)) == 0) {
+        free(pair);
+        return -1;
+    }
+    pair->seq = seq;
+    vindex_lock(vs);
+    if ((found = tfind(&probe, &vs->by_value, cmp_vkeys)) != 0) {
+        vk = *(vkeys_t **)found;
+    } else if ((vk = calloc(1, sizeof(vkeys_t))) == 0 ||
+               (vk->value = strdup(value)) == 0 ||
+               tsearch(vk, &vs->by_value, cmp_vkeys) == 0) {
+        if (vk != 0) free(vk->value);
+        free(vk);
+        vk = 0;
+    }
+    if (vk != 0 && tsearch(pair, &vk->keys, cmp_vpair) == 0) {
+        // a value with no keys is never left in the tree
+        if (vk->count == 0) {
+            tdelete(vk, &vs->by_value, cmp_vkeys);
+            free(vk->value);
+            free(vk);
+        }
+        vk = 0;
+    }
+    if (vk != 0) vk->count++;
+    vindex_unlock(vs);
+
+    if (vk == 0) {
+        free(pair->key);
+        free(pair);
+        return -1;
+    }
+    pair->vk = vk;
+    vindex_lock(ks);
+    found = tsearch(pair, &ks->by_key, cmp_vpair);
+    vindex_unlock(ks);
+    if (found == 0) {
+        // without the pair a remove could not find the key again
+        vindex_drop(pair);
+        return -1;
+    }
+    return 0;
+}
+
+/* Removes key from the index if it was indexed before change before. */
+static void vindex_remove(const char *key, uint64_t before) {
+    struct stripe *ks = vindex_stripe(key);
+    vpair_t probe = {(char *)key};
+    vpair_t *pair = 0;
+    void *found;
+
+    vindex_lock(ks);
+    if ((found = tfind(&probe, &ks->by_key, cmp_vpair)) != 0 &&
+        (*(vpair_t **)found)->seq < before) {
+        pair = *(vpair_t **)found;
+        tdelete(pair, &ks->by_key, cmp_vpair);
+    }
+    vindex_unlock(ks);
+    if (pair != 0) vindex_drop(pair);
+}
+
+/* Whether a pending range delete removed the pair's key. */
+static int vindex_hidden(const vpair_t *pair) {
+    int hidden = 0;
+    int err;
+    if (__atomic_load_n(&ranges.pending, __ATOMIC_ACQUIRE) == 0) return 0;
+    if ((err = pthread_mutex_lock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    for (vrange_t *r = ranges.head; r != 0 && !hidden; r = r->next) {
+        hidden = pair->seq < r->seq && strcmp(pair->key, r->lo) >= 0 &&
+                 strcmp(pair->key, r->hi) <= 0;
+    }
+    if ((err = pthread_mutex_unlock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return hidden;
+}
+
+/* A range being removed, and the keys of by_key found in it */
+typedef struct vfound {
+    const vrange_t *range;
+    FILE *found;
+} vfound_t;
+
+static void vindex_collect_range(const void *nodep, VISIT which,
+                                 void *closure) {
+    const vpair_t *pair = *(const vpair_t **)nodep;
+    vfound_t *f = closure;
+    if ((which == postorder || which == leaf) && pair->seq < f->range->seq &&
+        strcmp(pair->key, f->range->lo) >= 0 &&
+        strcmp(pair->key, f->range->hi) <= 0) {
+        fprintf(f->found, "%s\n", pair->key);
+    }
+}
+
+/*
+ * Removes the keys of a range delete. The stripes are split by hash, so
+ * every by_key tree is walked; the keys are listed first because a tree
+ * cannot be changed while it is walked.
+ */
+static void vindex_remove_range(const vrange_t *range) {
+    vfound_t f = {range, 0};
+    char *keys = 0;
+    size_t len = 0;
+
+    if ((f.found = open_memstream(&keys, &len)) == 0) {
+        fprintf(stderr, "vindex: out of memory, stale keys are left\n");
+        return;
+    }
+    for (int i = 0; i < VINDEX_STRIPES; i++) {
+        vindex_lock(&stripes[i]);
+        twalk_r(stripes[i].by_key, vindex_collect_range, &f);
+        vindex_unlock(&stripes[i]);
+    }
+    if (fclose(f.found) != 0) {
+        fprintf(stderr, "vindex: out of memory, stale keys are left\n");
+    } else {
+        for (char *key = keys, *nl; (nl = strchr(key, '\n')) != 0;
+             key = nl + 1) {
+            *nl = '\0';
+            vindex_remove(key, range->seq);
+        }
+    }
+    free(keys);
+}
+
+static void vrange_free(vrange_t *range) {
+    free(range->lo);
+    free(range->hi);
+    free(range);
+}
+
+/* Removes the keys of the pending range deletes, oldest first. */
+static void *vindex_thread(void *arg) {
+    int err;
+    (void)arg;
+    if ((err = pthread_mutex_lock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    while (1) {
+        while (ranges.head == 0 && !ranges.stop) {
+            if ((err = pthread_cond_wait(&ranges.cond, &ranges.mutex)) != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+        }
+        if (ranges.stop) break;
+        // it stays on the list, hiding its keys, until they are gone
+        vrange_t *range = ranges.head;
+        if ((err = pthread_mutex_unlock(&ranges.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        vindex_remove_range(range);
+        if ((err = pthread_mutex_lock(&ranges.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        if ((ranges.head = range->next) == 0) ranges.tail = &ranges.head;
+        __atomic_sub_fetch(&ranges.pending, 1, __ATOMIC_RELEASE);
+        vrange_free(range);
+    }
+    if ((err = pthread_mutex_unlock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return 0;
+}
+
+/* Queues a range delete for the thread. Returns -1 if out of memory. */
+static int vindex_queue_range(const char *lo, const char *hi, uint64_t seq) {
+    vrange_t *range = calloc(1, sizeof(vrange_t));
+    int err;
+    if (range == 0 || (range->lo = strdup(lo)) == 0 ||
+        (range->hi = strdup(hi)) == 0) {
+        if (range != 0) vrange_free(range);
+        return -1;
+    }
+    range->seq = seq;
+    if ((err = pthread_mutex_lock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    *ranges.tail = range;
+    ranges.tail = &range->next;
+    __atomic_add_fetch(&ranges.pending, 1, __ATOMIC_RELEASE);
+    if ((err = pthread_cond_signal(&ranges.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    if ((err = pthread_mutex_unlock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return 0;
+}
+
+/*
+ * The observer registered with db_observe(). Large values are left out, and
+ * so are the keys of named databases, which observers never see.
+ */
+static void vindex_change(const db_change_t *change, void *arg) {
+    uint64_t seq = __atomic_add_fetch(&vindex_seq, 1, __ATOMIC_RELAXED);
+    (void)arg;
+    if (change->op == db_op_remove) {
+        vindex_remove(change->name, seq);
+    } else if (change->op == db_op_remove_range) {
+        if (vindex_queue_range(change->name, change->value, seq) < 0) {
+            fprintf(stderr, "vindex: out of memory, stale keys are left\n");
+        }
+    } else {
+        // a key that a pending range delete removed is still in the index
+        if (__atomic_load_n(&ranges.pending, __ATOMIC_ACQUIRE) > 0) {
+            vindex_remove(change->name, seq);
+        }
+        if (!change->large &&
+            vindex_add(change->name, change->value, seq) < 0) {
+            fprintf(stderr, "vindex: out of memory, %s is not indexed\n",
+                    change->name);
+        }
+    }
+}
+
+int vindex_open(void) {
+    int err;
+    for (int i = 0; i < VINDEX_STRIPES; i++) {
+        if ((err = pthread_mutex_init(&stripes[i].mutex, 0)) != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+    if (db_observe(vindex_change, 0) < 0) {
+        fprintf(stderr, "vindex: too many observers\n");
+        return -1;
+    }
+    if ((err = pthread_create(&ranges.thread, 0, vindex_thread, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    vindex_on = 1;
+    return 0;
+}
+
+/* The keys of a value being looked up, and how many */
+typedef struct vlookup {
+    FILE *out;
+    long count;
+} vlookup_t;
+
+/* Appends each key still in the database to the lookup's memory stream. */
+static void vindex_collect(const void *nodep, VISIT which, void *closure) {
+    const vpair_t *pair = *(const vpair_t **)nodep;
+    vlookup_t *l = closure;
+    if ((which == postorder || which == leaf) && !vindex_hidden(pair)) {
+        fprintf(l->out, "%s\n", pair->key);
+        l->count++;
+    }
+}
+
+long vindex_lookup(const char *value, char **keys, size_t *len) {
+    struct stripe *vs = vindex_stripe(value);
+    vkeys_t probe = {(char *)value};
+    void *found;
+    long count = 0;
+    vlookup_t l = {0, 0};
+
+    *keys = 0;
+    *len = 0;
+    vindex_lock(vs);
+    if ((found = tfind(&probe, &vs->by_value, cmp_vkeys)) != 0) {
+        vkeys_t *vk = *(vkeys_t **)found;
+        // copy the keys out so they are written without the mutex
+        if ((l.out = open_memstream(keys, len)) == 0) {
+            count = -1;
+        } else {
+            twalk_r(vk->keys, vindex_collect, &l);
+            count = fclose(l.out) == 0 ? l.count : -1;
+        }
+    }
+    vindex_unlock(vs);
+    if (count < 0) {
+        free(*keys);
+        *keys = 0;
+    }
+    return count;
+}
+
+/* tdestroy() callbacks: the pairs in a value's keys belong to by_key */
+static void vindex_free_nothing(void *node) { (void)node; }
+
+static void vindex_free_vkeys(void *node) {
+    vkeys_t *vk = node;
+    tdestroy(vk->keys, vindex_free_nothing);
+    free(vk->value);
+    free(vk);
+}
+
+static void vindex_free_pair(void *node) {
+    vpair_t *pair = node;
+    free(pair->key);
+    free(pair);
+}
+
+void vindex_close(void) {
+    int err;
+    if (!vindex_on) return;
+    if ((err = pthread_mutex_lock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    ranges.stop = 1;
+    if ((err = pthread_cond_signal(&ranges.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    if ((err = pthread_mutex_unlock(&ranges.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_join(ranges.thread, 0)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    // the keys of any range deletes still pending go with the rest
+    while (ranges.head != 0) {
+        vrange_t *range = ranges.head;
+        ranges.head = range->next;
+        vrange_free(range);
+    }
+    ranges.tail = &ranges.head;
+    ranges.pending = 0;
+    ranges.stop = 0;
+    for (int i = 0; i < VINDEX_STRIPES; i++) {
+        tdestroy(stripes[i].by_value, vindex_free_vkeys);
+        tdestroy(stripes[i].by_key, vindex_free_pair);
+        stripes[i].by_value = stripes[i].by_key = 0;
+    }
+    vindex_on = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef VINDEX_H_
+#define VINDEX_H_
+
+#include <stddef.h>
+
+/*
+ * A secondary index from values to the keys holding them. It is kept up to
+ * date by an observer (see db_observe()) that runs while the changed key's
+ * parent is still write locked, so no reader can see a change in the tree
+ * before it is in the index. Values too large for a command line are not
+ * indexed.
+ */
+
+/*
+ * Registers the observer that maintains the index. Must be called before any
+ * keys are added, so that every key is indexed. Returns 0 on success and -1
+ * on failure.
+ */
+int vindex_open(void);
+
+/* Nonzero once vindex_open() has succeeded. */
+int vindex_enabled(void);
+
+/*
+ * Looks up the keys holding value. Returns how many there are and, if any,
+ * stores them in key order in a malloc()ed buffer in *keys, one per line,
+ * with its length in *len. Returns -1 if out of memory.
+ */
+long vindex_lookup(const char *value, char **keys, size_t *len);
+
+/* Frees the index. */
+void vindex_close(void);
+
+#endif  // VINDEX_H_
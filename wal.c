@@ -0,0 +1,452 @@
+// for fallocate()
+#define _GNU_SOURCE
+#include "./wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+
+/* Write-ahead logging and parallel replay */
+
+#define WAL_MAXLEN 256
+
+static FILE *wal_out = NULL;
+// serializes appends; taken inside the tree's node locks
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+// where the calling thread's last record ends, for wal_sync()
+static __thread off_t my_end = 0;
+// whether one of its records since then could not be written
+static __thread int my_failed = 0;
+
+/* Group commit: one fdatasync() at a time covers every record before it */
+static struct {
+    int on;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int syncing;     // a thread is in fdatasync()
+    off_t synced;    // the log is on disk up to here
+    off_t released;  // and freed before here by wal_release()
+    off_t lost;      // a failed fdatasync() covered the log up to here
+} wal_sync_state = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/*
+ * One parsed record, pointing into the log: its words are not terminated,
+ * so they are copied out when the record is applied.
+ */
+typedef struct record {
+    char op;
+    unsigned char name_len;
+    unsigned char value_len;
+    int part;  // the partition of the key, which counts the record
+    const char *name;
+    const char *value;  // of an 'a', the upper bound of a 'D', or an 'A's bytes
+    size_t len;         // of an 'A's value
+} record_t;
+
+/* One replay thread's share of the log: the records it applies, in order. */
+typedef struct replay {
+    record_t *recs;
+    size_t nrecs, cap;
+    int part;
+    int nparts;
+    size_t applied;
+    int failed;
+} replay_t;
+
+static uint64_t wal_hash(const char *key, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Finds the space-delimited word at *p (before end). */
+static int wal_word(const char **p, const char *end, const char **word,
+                    unsigned char *word_len) {
+    const char *start = *p;
+    while (*p < end && **p != ' ') (*p)++;
+    size_t len = *p - start;
+    if (len == 0 || len >= WAL_MAXLEN) return -1;
+    *word = start;
+    *word_len = len;
+    if (*p < end) (*p)++;  // the space
+    return 0;
+}
+
+/* Copies a word of the log out into buf, terminated. */
+static char *wal_copy(char *buf, const char *word, size_t len) {
+    memcpy(buf, word, len);
+    buf[len] = '\0';
+    return buf;
+}
+
+/*
+ * Parses the record at *p (before end) into rec and moves *p past it.
+ * Returns 1, 0 if the record is torn, or -1 if it is malformed.
+ */
+static int wal_parse(const char **p, const char *end, record_t *rec) {
+    const char *nl = memchr(*p, '\n', end - *p);
+    if (nl == NULL) return 0;
+    const char *q = *p + 2;
+    rec->op = (*p)[0];
+    if (nl - *p < 3 || (*p)[1] != ' ' ||
+        wal_word(&q, nl, &rec->name, &rec->name_len) < 0) {
+        return -1;
+    }
+    if (rec->op == 'a' || rec->op == 'D') {
+        if (wal_word(&q, nl, &rec->value, &rec->value_len) < 0) return -1;
+    } else if (rec->op == 'A') {
+        char length[WAL_MAXLEN];
+        if (wal_word(&q, nl, &rec->value, &rec->value_len) < 0) return -1;
+        rec->len =
+            strtoul(wal_copy(length, rec->value, rec->value_len), NULL, 10);
+        if ((size_t)(end - nl - 1) < rec->len + 1) return 0;  // torn payload
+        if (nl[1 + rec->len] != '\n') return -1;
+        rec->value = nl + 1;
+        nl += rec->len + 1;
+    } else if (rec->op != 'd') {
+        return -1;
+    }
+    *p = nl + 1;
+    return 1;
+}
+
+/* Whether the partition r replays the changes to name; for db_remove_each() */
+static int replay_owns(const char *name, void *r) {
+    const replay_t *part = (const replay_t *)r;
+    return wal_hash(name, strlen(name)) % part->nparts == part->part;
+}
+
+/* Adds rec to the partition's list; returns -1 if out of memory. */
+static int replay_push(replay_t *r, const record_t *rec) {
+    if (r->nrecs == r->cap) {
+        size_t cap = r->cap > 0 ? 2 * r->cap : 1024;
+        record_t *recs = realloc(r->recs, cap * sizeof(record_t));
+        if (recs == NULL) return -1;
+        r->recs = recs;
+        r->cap = cap;
+    }
+    r->recs[r->nrecs++] = *rec;
+    return 0;
+}
+
+static void *replay_thread(void *arg) {
+    replay_t *r = (replay_t *)arg;
+    char name[WAL_MAXLEN];
+    char value[WAL_MAXLEN];
+
+    for (size_t i = 0; i < r->nrecs; i++) {
+        const record_t *rec = &r->recs[i];
+        int ret = 1;
+        wal_copy(name, rec->name, rec->name_len);
+        if (rec->op == 'a') {
+            ret = db_add(name, wal_copy(value, rec->value, rec->value_len));
+        } else if (rec->op == 'd') {
+            ret = db_remove(name);
+        } else if (rec->op == 'D') {
+            // every partition removes the keys of the range that it owns,
+            // and the record is counted in the partition of its first key
+            ret = db_remove_each(name,
+                                 wal_copy(value, rec->value, rec->value_len),
+                                 replay_owns, r);
+        } else {
+            blob_t *blob = db_blob_alloc(rec->len);
+            if (blob == NULL) {
+                ret = -1;
+            } else {
+                memcpy(blob->data, rec->value, rec->len);
+                if ((ret = db_add_blob(name, blob)) <= 0) {
+                    db_blob_put(blob);
+                }
+            }
+        }
+        if (ret < 0) {
+            // out of memory; the rest of the partition cannot be trusted
+            r->failed = 1;
+            break;
+        }
+        if (rec->part == r->part) r->applied++;
+    }
+    return NULL;
+}
+
+/*
+ * Replays the log in fd from offset from with nthreads threads: the log is
+ * parsed once, here, and each record is handed to the thread of its key's
+ * partition (a range to all of them). Returns the length of the log up to
+ * its last complete record.
+ */
+static ssize_t wal_replay(const char *path, int fd, off_t from, int nthreads) {
+    struct stat st;
+    struct timespec start, finish;
+    size_t applied = 0;
+    int err;
+
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    if (from > st.st_size) {
+        fprintf(stderr, "%s: shorter than the checkpoint expects\n", path);
+        from = st.st_size;
+    }
+    if (from == st.st_size) return from;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const char *log = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise((void *)log, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    if (log[from] == '\0') {
+        // the start of the log was released after a checkpoint (wal_release())
+        fprintf(stderr,
+                "%s: the log before offset %lld was released, "
+                "replay it from its checkpoint\n",
+                path, (long long)from);
+        munmap((void *)log, st.st_size);
+        return -1;
+    }
+
+    replay_t parts[nthreads];
+    memset(parts, 0, sizeof(parts));
+    for (int i = 0; i < nthreads; i++) {
+        parts[i].part = i;
+        parts[i].nparts = nthreads;
+    }
+    const char *p = log + from;
+    const char *end = log + st.st_size;
+    record_t rec;
+    int malformed = 0, failed = 0;
+    while (p < end && !failed) {
+        const char *at = p;
+        int ret = wal_parse(&p, end, &rec);
+        if (ret <= 0) {
+            malformed = failed = ret < 0;
+            p = at;
+            break;
+        }
+        rec.part = wal_hash(rec.name, rec.name_len) % nthreads;
+        for (int i = 0; i < nthreads; i++) {
+            if ((i == rec.part || rec.op == 'D') &&
+                replay_push(&parts[i], &rec) < 0) {
+                failed = 1;
+            }
+        }
+    }
+    size_t valid = p - (log + from);
+
+    // then the partitions are applied concurrently, unless that failed
+    pthread_t tids[nthreads];
+    int started = failed ? 0 : nthreads;
+    for (int i = 0; i < started; i++) {
+        if ((err = pthread_create(&tids[i], 0, replay_thread, &parts[i]))) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        if ((err = pthread_join(tids[i], NULL)) != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+        applied += parts[i].applied;
+        failed |= parts[i].failed;
+    }
+    for (int i = 0; i < nthreads; i++) free(parts[i].recs);
+    munmap((void *)log, st.st_size);
+    if (malformed) {
+        fprintf(stderr, "%s: malformed record at offset %zu\n", path,
+                from + valid);
+        return -1;
+    } else if (failed) {
+        fprintf(stderr, "%s: out of memory replaying\n", path);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double ms = (finish.tv_sec - start.tv_sec) * 1e3 +
+                (finish.tv_nsec - start.tv_nsec) / 1e6;
+    printf(
+        "replayed %zu records from %s in %.1f ms on %d threads "
+        "(%.0f records/s)\n",
+        applied, path, ms, nthreads, ms > 0 ? applied / ms * 1e3 : 0.0);
+    if (from + valid < (size_t)st.st_size) {
+        fprintf(stderr, "%s: dropping %zu bytes of a torn record\n", path,
+                (size_t)st.st_size - from - valid);
+    }
+    return from + valid;
+}
+
+/* Appends a change to the log; registered with db_observe(). */
+static void wal_append(const db_change_t *change, void *arg) {
+    int err;
+    int ret;
+    if ((err = pthread_mutex_lock(&wal_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (change->op == db_op_remove) {
+        ret = fprintf(wal_out, "d %s\n", change->name);
+    } else if (change->op == db_op_remove_range) {
+        ret = fprintf(wal_out, "D %s %s\n", change->name, change->value);
+    } else if (change->large) {
+        ret = fprintf(wal_out, "A %s %zu\n", change->name, change->len);
+        if (ret >= 0 &&
+            (fwrite(change->value, 1, change->len, wal_out) != change->len ||
+             fputc('\n', wal_out) == EOF)) {
+            ret = -1;
+        }
+    } else {
+        ret = fprintf(wal_out, "a %s %s\n", change->name, change->value);
+    }
+    // hand every record to the kernel before the client hears of it, and
+    // tell it, through wal_sync(), if that failed
+    if (ret < 0 || fflush(wal_out) == EOF) {
+        perror("write-ahead log");
+        my_failed = 1;
+    } else if (wal_sync_state.on) {
+        my_end = ftello(wal_out);
+    }
+    if ((err = pthread_mutex_unlock(&wal_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+int wal_open(const char *path, int replay, off_t from, int nthreads, int sync) {
+    int fd;
+    ssize_t valid = 0;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        perror(path);
+        return -1;
+    }
+    if (replay) {
+        if ((valid = wal_replay(path, fd, from, nthreads > 0 ? nthreads : 1)) <
+            0) {
+            close(fd);
+            return -1;
+        }
+        if (ftruncate(fd, valid) < 0) {
+            perror("ftruncate");
+            close(fd);
+            return -1;
+        }
+    }
+    if (lseek(fd, 0, SEEK_END) < 0 || (wal_out = fdopen(fd, "a")) == NULL) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (db_observe(wal_append, NULL) < 0) {
+        fclose(wal_out);
+        wal_out = NULL;
+        return -1;
+    }
+    wal_sync_state.on = sync;
+    return 0;
+}
+
+int wal_sync(void) {
+    int err;
+    int failed = my_failed;
+    off_t want = my_end;
+    my_failed = 0;
+    if (want == 0) return failed ? -1 : 0;
+    my_end = 0;
+    if ((err = pthread_mutex_lock(&wal_sync_state.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    while (wal_sync_state.synced < want) {
+        if (wal_sync_state.syncing) {
+            // the sync under way may cover this record too
+            if ((err = pthread_cond_wait(&wal_sync_state.cond,
+                                         &wal_sync_state.mutex)) != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+            continue;
+        }
+        // lead a sync of everything logged so far, for whoever is waiting
+        wal_sync_state.syncing = 1;
+        if ((err = pthread_mutex_unlock(&wal_sync_state.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        off_t upto = wal_offset();
+        int ret = fdatasync(fileno(wal_out));
+        if (ret < 0) perror("write-ahead log");
+        if ((err = pthread_mutex_lock(&wal_sync_state.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        wal_sync_state.syncing = 0;
+        // on failure the records it covered may never reach the disk, and
+        // their clients are told so
+        if (upto > wal_sync_state.synced) wal_sync_state.synced = upto;
+        if (ret < 0 && want > wal_sync_state.synced) {
+            wal_sync_state.synced = want;
+        }
+        if (ret < 0 && wal_sync_state.synced > wal_sync_state.lost) {
+            wal_sync_state.lost = wal_sync_state.synced;
+        }
+        if ((err = pthread_cond_broadcast(&wal_sync_state.cond)) != 0) {
+            handle_error_en(err, "pthread_cond_broadcast");
+        }
+    }
+    failed |= want <= wal_sync_state.lost;
+    if ((err = pthread_mutex_unlock(&wal_sync_state.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return failed ? -1 : 0;
+}
+
+void wal_release(off_t upto) {
+    int err;
+    off_t from;
+    if (wal_out == NULL) return;
+    if ((err = pthread_mutex_lock(&wal_sync_state.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    from = wal_sync_state.released;
+    if (upto > from) wal_sync_state.released = upto;
+    if ((err = pthread_mutex_unlock(&wal_sync_state.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    // a hole keeps every offset, and so every checkpoint's, as it was
+    if (upto > from &&
+        fallocate(fileno(wal_out), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  from, upto - from) < 0) {
+        perror("write-ahead log: releasing checkpointed records");
+    }
+}
+
+off_t wal_offset(void) {
+    int err;
+    off_t off = 0;
+    if (wal_out == NULL) return 0;
+    if ((err = pthread_mutex_lock(&wal_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    off = ftello(wal_out);
+    if ((err = pthread_mutex_unlock(&wal_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return off;
+}
+
+void wal_close(void) {
+    if (wal_out != NULL && wal_sync_state.on &&
+        fdatasync(fileno(wal_out)) < 0) {
+        perror("write-ahead log");
+    }
+    if (wal_out != NULL && fclose(wal_out) == EOF) perror("write-ahead log");
+    wal_out = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <sys/types.h>
+
+/*
+ * A write-ahead log of every add and remove, in the same text format as the
+ * client commands: "a name value", "d name", "D lo hi" for a range, and
+ * "A name length" followed by the value's bytes and a newline. A server
+ * started with the same log replays it to rebuild the database.
+ *
+ * Replay parses the log once and hands every parsed record to the thread of
+ * the partition its key hashes to (a range goes to all of them), so the changes
+ * to any one key are applied in log order while different keys are applied
+ * concurrently.
+ *
+ * Records are handed to the kernel before the client is answered. With sync
+ * set they are also on disk by then: wal_sync() waits for an fdatasync()
+ * that covers the caller's records, shared by all the clients waiting at the
+ * same time (group commit). Once a checkpoint covers the start of the log,
+ * wal_release() frees its disk space.
+ */
+
+/*
+ * Replays the log at path (if it exists) from offset from with nthreads
+ * threads, reporting the records applied and the throughput, then opens it
+ * for appending and registers the observer that logs every change from then
+ * on. from is 0, or the offset recorded by a checkpoint the database was
+ * loaded from (see ckpt.h). A torn record at the end, left by a crash, is cut
+ * off. With replay unset the log is only opened for appending, for a server
+ * whose database came from a handoff. Returns 0 on success and -1 on failure.
+ */
+int wal_open(const char *path, int replay, off_t from, int nthreads, int sync);
+
+/*
+ * Waits until every change the calling thread logged is on disk, when
+ * wal_open() was asked to sync. Called outside the tree's locks, before the
+ * client is answered. Returns -1 if one of those changes could not be
+ * written to the log (or synced) since the last call, and 0 otherwise.
+ */
+int wal_sync(void);
+
+/*
+ * Frees the disk space of the log before offset upto, which a durable
+ * checkpoint covers, by punching a hole in it. Offsets do not change, but
+ * the log can then only be replayed from that checkpoint.
+ */
+void wal_release(off_t upto);
+
+/*
+ * Returns the offset at which the next record will be written, or 0 if there
+ * is no log. Every change that completed before the call is logged before it.
+ */
+off_t wal_offset(void);
+
+/* Flushes (and with sync, syncs) and closes the log. */
+void wal_close(void);
+
+#endif  // WAL_H_
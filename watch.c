@@ -0,0 +1,328 @@
+#include "./watch.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+#include "./db.h"
+
+/* The registered watches, indexed by key and prefix, and their observer */
+
+// the longest notification: "removed range <lo> <hi>\n"
+#define WATCH_LINE_MAX (2 * BUFLEN + 16)
+// how long an idle watcher sleeps before checking its connection
+#define WATCH_POLL_MS 200
+// buckets in each of the two pattern tables
+#define WATCH_BUCKETS 4096
+// FNV-1a's offset basis, the hash of the empty prefix
+#define WATCH_HASH_START 0xcbf29ce484222325ULL
+
+typedef struct pattern {
+    char text[BUFLEN];
+    size_t len;
+    int prefix;  // match keys starting with text rather than equal to it
+    uint64_t hash;
+    struct watcher *watcher;
+    struct pattern *next;  // in its bucket
+} pattern_t;
+
+typedef struct watcher {
+    pattern_t patterns[WATCH_MAX_PATTERNS];
+    int npatterns;
+    // guards the queue
+    pthread_mutex_t mutex;
+    // the queued notifications
+    char lines[WATCH_QUEUE][WATCH_LINE_MAX];
+    size_t lens[WATCH_QUEUE];
+    int first;
+    int count;
+    int overflow;  // notifications were dropped since the last write
+    pthread_cond_t cond;
+    struct watcher *prev;
+    struct watcher *next;
+} watcher_t;
+
+static struct watch {
+    // guards the list and the tables; changes only read them
+    pthread_rwlock_t rwlock;
+    watcher_t *head;
+    // key patterns by the hash of their key, prefix patterns by the hash of
+    // their prefix
+    pattern_t *keys[WATCH_BUCKETS];
+    pattern_t *prefixes[WATCH_BUCKETS];
+    // the prefix patterns of each length, so only those lengths are probed
+    int prefix_lens[BUFLEN];
+    int nwatchers;  // read without the lock to skip changes nobody watches
+} watch = {.rwlock = PTHREAD_RWLOCK_INITIALIZER};
+
+/* 64 bit FNV-1a, continued from hash over len more bytes. */
+static inline uint64_t watch_hash(uint64_t hash, const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Whether a range delete can cover keys that one of w's patterns matches. */
+static int watch_in_range(const watcher_t *w, const db_change_t *change) {
+    const char *name = change->name;
+    for (int i = 0; i < w->npatterns; i++) {
+        const pattern_t *p = &w->patterns[i];
+        // the keys with a prefix run from the prefix itself up to where the
+        // first len bytes grow past it
+        if ((p->prefix ? strncmp(name, p->text, p->len) <= 0
+                       : strcmp(name, p->text) <= 0) &&
+            strcmp(p->text, change->value) <= 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether p is the first of its watcher's patterns to match name, so that a
+ * key matching several of them is sent once.
+ */
+static int watch_first(const pattern_t *p, const char *name) {
+    for (const pattern_t *q = p->watcher->patterns; q < p; q++) {
+        if (q->prefix ? strncmp(name, q->text, q->len) == 0
+                      : strcmp(name, q->text) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Queues the line of len bytes for w. */
+static void watch_queue(watcher_t *w, const char *line, size_t len) {
+    int err;
+    if ((err = pthread_mutex_lock(&w->mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (w->count == WATCH_QUEUE) {
+        w->overflow = 1;
+    } else {
+        int slot = (w->first + w->count++) % WATCH_QUEUE;
+        memcpy(w->lines[slot], line, len);
+        w->lens[slot] = len;
+        if ((err = pthread_cond_signal(&w->cond)) != 0) {
+            handle_error_en(err, "pthread_cond_signal");
+        }
+    }
+    if ((err = pthread_mutex_unlock(&w->mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+/*
+ * The observer registered with db_observe(). It runs under the changed key's
+ * parent lock, so it only looks the key up in the tables, which costs one
+ * probe for the key and one per prefix length that is watched, and copies
+ * the notification into each matching watcher's queue; the watcher's own
+ * thread writes it out. Only a range delete, which is rare, checks every
+ * watcher.
+ */
+static void watch_notify(const db_change_t *change, void *arg) {
+    char line[WATCH_LINE_MAX];
+    size_t len;
+    int err;
+    (void)arg;
+    if (__atomic_load_n(&watch.nwatchers, __ATOMIC_ACQUIRE) == 0) return;
+
+    if (change->op == db_op_remove_range) {
+        len = snprintf(line, sizeof(line), "removed range %s %s\n",
+                       change->name, change->value);
+    } else {
+        len = snprintf(line, sizeof(line), "%s %s\n",
+                       change->op == db_op_remove ? "removed" : "added",
+                       change->name);
+    }
+    if (len >= sizeof(line)) len = sizeof(line) - 1;
+    if ((err = pthread_rwlock_rdlock(&watch.rwlock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    if (change->op == db_op_remove_range) {
+        for (watcher_t *w = watch.head; w != 0; w = w->next) {
+            if (watch_in_range(w, change)) watch_queue(w, line, len);
+        }
+    } else {
+        const char *name = change->name;
+        size_t nlen = strlen(name);
+        uint64_t hash = WATCH_HASH_START;
+        // the hash of each prefix of the key on the way to the whole key
+        for (size_t plen = 0; plen <= nlen; plen++) {
+            if (plen > 0) hash = watch_hash(hash, name + plen - 1, 1);
+            if (plen >= BUFLEN || watch.prefix_lens[plen] == 0) continue;
+            for (pattern_t *p = watch.prefixes[hash % WATCH_BUCKETS]; p != 0;
+                 p = p->next) {
+                if (p->hash == hash && p->len == plen &&
+                    memcmp(p->text, name, plen) == 0 && watch_first(p, name)) {
+                    watch_queue(p->watcher, line, len);
+                }
+            }
+        }
+        for (pattern_t *p = watch.keys[hash % WATCH_BUCKETS]; p != 0;
+             p = p->next) {
+            if (p->hash == hash && strcmp(p->text, name) == 0 &&
+                watch_first(p, name)) {
+                watch_queue(p->watcher, line, len);
+            }
+        }
+    }
+    if ((err = pthread_rwlock_unlock(&watch.rwlock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+int watch_open(void) {
+    if (db_observe(watch_notify, 0) < 0) {
+        fprintf(stderr, "watch: too many observers\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Parses patterns into w. Returns the number of patterns, or -1. */
+static int watch_parse(watcher_t *w, const char *patterns) {
+    char text[BUFLEN];
+    int used;
+    w->npatterns = 0;
+    while (sscanf(patterns, "%255s%n", text, &used) == 1) {
+        if (w->npatterns == WATCH_MAX_PATTERNS) return -1;
+        pattern_t *p = &w->patterns[w->npatterns++];
+        p->len = strlen(text);
+        p->prefix = text[p->len - 1] == '*';
+        if (p->prefix) text[--p->len] = '\0';
+        memcpy(p->text, text, p->len + 1);
+        p->hash = watch_hash(WATCH_HASH_START, p->text, p->len);
+        p->watcher = w;
+        patterns += used;
+    }
+    return w->npatterns > 0 ? w->npatterns : -1;
+}
+
+static void watch_link(watcher_t *w, int add) {
+    int err;
+    if ((err = pthread_rwlock_wrlock(&watch.rwlock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+    for (int i = 0; i < w->npatterns; i++) {
+        pattern_t *p = &w->patterns[i];
+        pattern_t **bucket =
+            &(p->prefix ? watch.prefixes : watch.keys)[p->hash % WATCH_BUCKETS];
+        if (add) {
+            p->next = *bucket;
+            *bucket = p;
+        } else {
+            while (*bucket != p) bucket = &(*bucket)->next;
+            *bucket = p->next;
+        }
+        if (p->prefix) watch.prefix_lens[p->len] += add ? 1 : -1;
+    }
+    if (add) {
+        w->next = watch.head;
+        if (watch.head != 0) watch.head->prev = w;
+        watch.head = w;
+        __atomic_add_fetch(&watch.nwatchers, 1, __ATOMIC_RELEASE);
+    } else {
+        if (w->prev != 0) w->prev->next = w->next;
+        if (w->next != 0) w->next->prev = w->prev;
+        if (watch.head == w) watch.head = w->next;
+        __atomic_sub_fetch(&watch.nwatchers, 1, __ATOMIC_RELEASE);
+    }
+    if ((err = pthread_rwlock_unlock(&watch.rwlock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+int watch_stream(FILE *cxstr, const char *patterns) {
+    // notifications are copied out of the queue so the write happens without
+    // the mutex
+    static char overflow[] = "overflow\n";
+    char *lines;
+    struct iovec iov[WATCH_QUEUE + 1];
+    char header[32];
+    watcher_t *w;
+    int err;
+    int ret = 0;
+
+    if ((w = calloc(1, sizeof(watcher_t))) == 0 ||
+        (lines = malloc(WATCH_QUEUE * WATCH_LINE_MAX)) == 0) {
+        perror("malloc");
+        free(w);
+        return -1;
+    }
+    if (watch_parse(w, patterns) < 0) {
+        struct iovec bad = {"ill-formed command\n", 19};
+        ret = comm_writev(cxstr, &bad, 1);
+        free(lines);
+        free(w);
+        return ret;
+    }
+    if ((err = pthread_mutex_init(&w->mutex, 0)) != 0) {
+        handle_error_en(err, "pthread_mutex_init");
+    }
+    if ((err = pthread_cond_init(&w->cond, 0)) != 0) {
+        handle_error_en(err, "pthread_cond_init");
+    }
+    watch_link(w, 1);
+    iov[0].iov_base = header;
+    iov[0].iov_len =
+        snprintf(header, sizeof(header), "watching %d\n", w->npatterns);
+    ret = comm_writev(cxstr, iov, 1);
+
+    while (ret == 0 && !comm_peer_gone(cxstr)) {
+        struct timespec deadline;
+        int nvec = 0;
+        size_t used = 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WATCH_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if ((err = pthread_mutex_lock(&w->mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        err = 0;
+        while (w->count == 0 && !w->overflow && err != ETIMEDOUT) {
+            err = pthread_cond_timedwait(&w->cond, &w->mutex, &deadline);
+            if (err != 0 && err != ETIMEDOUT) {
+                handle_error_en(err, "pthread_cond_timedwait");
+            }
+        }
+        for (; w->count > 0; w->count--) {
+            size_t len = w->lens[w->first];
+            memcpy(lines + used, w->lines[w->first], len);
+            iov[nvec].iov_base = lines + used;
+            iov[nvec++].iov_len = len;
+            used += len;
+            w->first = (w->first + 1) % WATCH_QUEUE;
+        }
+        if (w->overflow) {
+            iov[nvec].iov_base = overflow;
+            iov[nvec++].iov_len = sizeof(overflow) - 1;
+            w->overflow = 0;
+        }
+        if ((err = pthread_mutex_unlock(&w->mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (nvec > 0) ret = comm_writev(cxstr, iov, nvec);
+    }
+
+    watch_link(w, 0);
+    if ((err = pthread_cond_destroy(&w->cond)) != 0) {
+        handle_error_en(err, "pthread_cond_destroy");
+    }
+    if ((err = pthread_mutex_destroy(&w->mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_destroy");
+    }
+    free(lines);
+    free(w);
+    return ret;
+}
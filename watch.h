@@ -0,0 +1,36 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdio.h>
+
+/*
+ * Key watches. A connection that watches keys is sent a line each time one of
+ * them is added or removed, instead of polling them with 'q'. A pattern is a
+ * key, or a prefix followed by '*'.
+ */
+
+/* The most patterns one connection can watch */
+#define WATCH_MAX_PATTERNS 16
+/* The notifications queued for a connection that is not keeping up */
+#define WATCH_QUEUE 256
+
+/*
+ * Registers the observer that matches changes against the watches. Must be
+ * called before clients are served. Returns 0 on success and -1 on failure.
+ */
+int watch_open(void);
+
+/*
+ * Watches the whitespace separated patterns in patterns and writes a
+ * notification to the connection for each change to a matching key until it
+ * is closed or shut down for reading. The first line is "watching <count>",
+ * or "ill-formed command" (and nothing else) if there are no patterns or too
+ * many. Then each change is sent as "added <key>" or "removed <key>", or
+ * "removed range <lo> <hi>" for a range delete that may cover some. A
+ * watcher that falls WATCH_QUEUE notifications behind gets "overflow" in
+ * place of the ones that did not fit, and should query its keys again.
+ * Returns 0 when the watcher went away and -1 if the connection failed.
+ */
+int watch_stream(FILE *cxstr, const char *patterns);
+
+#endif  // WATCH_H_
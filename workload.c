@@ -0,0 +1,337 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Generates client scripts of any size on standard output, to be saved or
+ * piped straight into "./client <server> <port>". It first adds -n keys in
+ * the chosen insertion order, then runs -o operations, a mix of queries,
+ * removes and writes in the given percentages, on keys drawn uniformly, from
+ * a Zipfian distribution or in sequence. The keys are loaded already, and
+ * an add of a key that is present fails, so a write replaces the value: it
+ * is a remove followed by an add of the same key, two commands, which keeps
+ * the writes on the same popular keys as the queries and the database at
+ * its loaded size. Nothing is kept in memory per key:
+ * key i is a pure function of i, and the random insertion order and the
+ * scattering of popular keys are bijections of the indexes, so 50 million
+ * keys cost no more memory than 50.
+ *
+ * Key i starts with i in base 26, as wide as the largest index needs, so
+ * keys sort in index order and a sequential insertion order really is
+ * sorted; the rest of it, up to a length between the -l bounds that is
+ * fixed by i, is filler. Values get a fresh length between the -v bounds
+ * for every add, and use A (with Q for queries) instead of a and q when a
+ * line could not hold them.
+ */
+
+#define KEYS 100000
+#define OPERATIONS 100000
+// the longest key and value an a command line holds (see interpret_command())
+#define MAXLEN 255
+#define LINELEN 255
+
+enum order { SEQUENTIAL, REVERSE, RANDOM };
+enum distribution { UNIFORM, ZIPF, SCAN };
+
+static const char *orders[] = {"sequential", "reverse", "random"};
+static const char *distributions[] = {"uniform", "zipf", "sequential"};
+
+static struct {
+    uint64_t keys;
+    int width;  // of the index part of every key
+    int key_min;
+    int key_max;
+    int value_min;
+    int value_max;
+    int long_values;  // so A and Q are used
+    uint64_t seed;
+    // the permutation of [0, keys) used to shuffle
+    int half_bits;
+    uint64_t half_mask;
+    // the Zipfian sampler's constants, see zipf_sample()
+    double exponent;
+    double h_x1;
+    double h_n;
+    double s;
+} gen;
+
+/* splitmix64: a good 64 bit mix of x, as a hash and to seed with. */
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* xorshift64* over *state, which must not be 0. */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/* A uniform double in [0, 1). */
+static double next_double(uint64_t *state) {
+    return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * A pseudo-random bijection of [0, gen.keys): a four round Feistel network
+ * over the smallest even number of bits that covers it, applied again to
+ * the few results that fall outside until one falls inside (cycle walking).
+ */
+static uint64_t permute(uint64_t i) {
+    do {
+        uint64_t left = i >> gen.half_bits, right = i & gen.half_mask;
+        for (int round = 0; round < 4; round++) {
+            uint64_t next =
+                left ^ (mix(right ^ (gen.seed + round)) & gen.half_mask);
+            left = right;
+            right = next;
+        }
+        i = (left << gen.half_bits) | right;
+    } while (i >= gen.keys);
+    return i;
+}
+
+/* Writes key i, with its terminating '\0', to buf; returns its length. */
+static int make_key(uint64_t i, char *buf) {
+    uint64_t h = mix(i ^ gen.seed);
+    int len = gen.key_min + h % (gen.key_max - gen.key_min + 1);
+    if (len < gen.width) len = gen.width;
+    for (int d = gen.width - 1; d >= 0; d--, i /= 26) buf[d] = 'a' + i % 26;
+    for (int d = gen.width; d < len; d++, h = mix(h)) buf[d] = 'a' + h % 26;
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * The Zipfian sampler is rejection-inversion (Hormann and Derflinger, 1996),
+ * which takes constant time and memory for any number of keys and any
+ * exponent above 0, unlike the usual method that sums a term per key up
+ * front and needs an exponent below 1. These are its h(), the integral H()
+ * of h, and the inverse of H, for the exponent in gen.
+ */
+static double helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x
+                          : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x
+                          : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+static double h(double x) { return exp(-gen.exponent * log(x)); }
+
+static double h_integral(double x) {
+    double log_x = log(x);
+    return helper2((1 - gen.exponent) * log_x) * log_x;
+}
+
+static double h_integral_inverse(double x) {
+    double t = x * (1 - gen.exponent);
+    if (t < -1) t = -1;
+    return exp(helper1(t) * x);
+}
+
+static void zipf_init(double exponent) {
+    gen.exponent = exponent;
+    gen.h_x1 = h_integral(1.5) - 1;
+    gen.h_n = h_integral(gen.keys + 0.5);
+    gen.s = 2 - h_integral_inverse(h_integral(2.5) - h(2));
+}
+
+/* A rank from 0, the most popular, to gen.keys - 1. */
+static uint64_t zipf_sample(uint64_t *state) {
+    while (1) {
+        double u = gen.h_n + next_double(state) * (gen.h_x1 - gen.h_n);
+        double x = h_integral_inverse(u);
+        uint64_t k = x + 0.5;
+        if (k < 1) k = 1;
+        if (k > gen.keys) k = gen.keys;
+        if (k - x <= gen.s || u >= h_integral(k + 0.5) - h(k)) return k - 1;
+    }
+}
+
+/* Writes an add of key with a value of random length. */
+static void put_add(const char *key, uint64_t *state) {
+    char value[MAXLEN + 1];
+    char *big = NULL;
+    int len = gen.value_min +
+              next_random(state) % (gen.value_max - gen.value_min + 1);
+    char *v = len <= MAXLEN ? value : (big = malloc(len + 1));
+
+    if (v == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < len; i++) v[i] = 'a' + next_random(state) % 26;
+    v[len] = '\0';
+    if (gen.long_values) {
+        printf("A %s %d\n%s\n", key, len, v);
+    } else {
+        printf("a %s %s\n", key, v);
+    }
+    free(big);
+}
+
+/* Parses "<min>" or "<min>:<max>" into its bounds; returns -1 if bad. */
+static int parse_range(const char *arg, int *min, int *max) {
+    int n = sscanf(arg, "%d:%d", min, max);
+    if (n == 1) *max = *min;
+    return n >= 1 && *min >= 1 && *max >= *min ? 0 : -1;
+}
+
+/* Returns the index of name in the n names, or -1. */
+static int lookup(const char *name, const char **names, int n) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-n <keys>] [-o <operations>] "
+            "[-i sequential|reverse|random] [-k uniform|zipf|sequential] "
+            "[-z <exponent>] [-r <query %%>] [-d <remove %%>] "
+            "[-l <key length>[:<max>]] [-v <value length>[:<max>]] [-L] "
+            "[-j <part>/<parts>] [-s <seed>]\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    long operations = OPERATIONS;
+    int order = RANDOM;
+    int distribution = ZIPF;
+    double exponent = 0.99;
+    int query_pct = 90;
+    int remove_pct = 0;
+    int load = 1;
+    long part = 0, parts = 1;
+    uint64_t state;
+    char key[MAXLEN + 1];
+    int opt;
+
+    gen.keys = KEYS;
+    gen.key_min = gen.key_max = 12;
+    gen.value_min = gen.value_max = 12;
+    gen.seed = 330;
+    while ((opt = getopt(argc, argv, "n:o:i:k:z:r:d:l:v:Lj:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                gen.keys = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                operations = atol(optarg);
+                break;
+            case 'i':
+                order = lookup(optarg, orders, 3);
+                break;
+            case 'k':
+                distribution = lookup(optarg, distributions, 3);
+                break;
+            case 'z':
+                exponent = atof(optarg);
+                break;
+            case 'r':
+                query_pct = atoi(optarg);
+                break;
+            case 'd':
+                remove_pct = atoi(optarg);
+                break;
+            case 'l':
+                if (parse_range(optarg, &gen.key_min, &gen.key_max) < 0 ||
+                    gen.key_max > MAXLEN) {
+                    gen.key_min = -1;
+                }
+                break;
+            case 'v':
+                if (parse_range(optarg, &gen.value_min, &gen.value_max) < 0) {
+                    gen.value_min = -1;
+                }
+                break;
+            case 'L':
+                load = 0;
+                break;
+            case 'j':
+                if (sscanf(optarg, "%ld/%ld", &part, &parts) != 2) parts = 0;
+                break;
+            case 's':
+                gen.seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+    if (gen.keys == 0 || operations < 0 || order < 0 || distribution < 0 ||
+        exponent <= 0 || query_pct < 0 || remove_pct < 0 ||
+        query_pct + remove_pct > 100 || gen.key_min < 0 || gen.value_min < 0 ||
+        parts < 1 || part < 0 || part >= parts || optind != argc) {
+        usage_error(argv[0]);
+        return 1;
+    }
+
+    // the index part of the keys, then the widest key with an a command
+    for (uint64_t n = gen.keys - 1; n > 0 || gen.width == 0; n /= 26) {
+        gen.width++;
+    }
+    if (gen.width > MAXLEN) {
+        fprintf(stderr, "keys cannot be longer than %d\n", MAXLEN);
+        return 1;
+    }
+    int key_len = gen.key_max > gen.width ? gen.key_max : gen.width;
+    gen.long_values = gen.value_max > MAXLEN ||
+                      (int)strlen("a  \n") + key_len + gen.value_max > LINELEN;
+    while (((uint64_t)1 << (2 * gen.half_bits)) < gen.keys) gen.half_bits++;
+    gen.half_mask = ((uint64_t)1 << gen.half_bits) - 1;
+    zipf_init(exponent);
+    // each part of a split workload draws its own operations
+    state = mix(gen.seed ^ mix(part)) | 1;
+    // scripts are written in large blocks, whatever stdout is
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+    // the load, split into parts by position so they can run in parallel
+    for (uint64_t i = part; load && i < gen.keys; i += parts) {
+        uint64_t index = order == SEQUENTIAL
+                             ? i
+                             : order == REVERSE ? gen.keys - 1 - i : permute(i);
+        make_key(index, key);
+        put_add(key, &state);
+    }
+    // the mix, each part starting its sequential scan at its own place
+    uint64_t scan = gen.keys / parts * part;
+    for (long op = 0; op < operations; op++) {
+        uint64_t index;
+        int kind = next_random(&state) % 100;
+        if (distribution == UNIFORM) {
+            index = next_random(&state) % gen.keys;
+        } else if (distribution == ZIPF) {
+            // popular keys are scattered over the tree, not its left edge
+            index = permute(zipf_sample(&state));
+        } else {
+            index = scan++ % gen.keys;
+        }
+        make_key(index, key);
+        if (kind < query_pct) {
+            printf("%c %s\n", gen.long_values ? 'Q' : 'q', key);
+        } else if (kind < query_pct + remove_pct) {
+            printf("d %s\n", key);
+        } else {
+            // an overwrite, see the top of the file
+            printf("d %s\n", key);
+            put_add(key, &state);
+        }
+    }
+    if (fflush(stdout) != 0) {
+        perror("stdout");
+        return 1;
+    }
+    return 0;
+}